@@ -1,5 +1,6 @@
 /* vim: ts=4 sw=4 et */
 #include "actions.h"
+#include "flow_cache.h"
 
 
 /*
@@ -8,7 +9,28 @@
 int
 action_drop(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
 {
+    flow_cache_record(core, pkt, FLOW_ACTION_DROP, data);
+
     core->stats->drop_nat_condition++;
-    rte_pktmbuf_free(pkt);
+    pkt_free(pkt, core);
     return -1;
 }
+
+/*
+ * Batched variant of action_drop, for the packets of pkts whose bit is set in
+ * mask. See ipv4.c/process_rules_burst().
+ */
+uint64_t
+action_drop_burst(struct rte_mbuf **pkts, uint64_t mask, struct core *core,
+                  void *data)
+{
+    struct rte_mbuf *pkt;
+
+    core->stats->drop_nat_condition += __builtin_popcountll(mask);
+    for (; mask; mask &= mask - 1) {
+        pkt = pkts[__builtin_ctzll(mask)];
+        flow_cache_record(core, pkt, FLOW_ACTION_DROP, data);
+        pkt_free(pkt, core);
+    }
+    return 0;
+}
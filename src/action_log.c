@@ -1,4 +1,5 @@
 /* vim: ts=4 sw=4 et */
+#include "flow_cache.h"
 #include "natasha.h"
 #include "network_headers.h"
 
@@ -10,6 +11,9 @@ action_print(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
     const int src_addr = rte_be_to_cpu_32(ipv4_hdr->src_addr);
     const int dst_addr = rte_be_to_cpu_32(ipv4_hdr->dst_addr);
 
+    // Packets must be printed even if their flow is cached.
+    flow_cache_record_abort(core);
+
     RTE_LOG(DEBUG, APP,
             "Port %i: packet on core %i from " IPv4_FMT " to " IPv4_FMT "\n",
             port, core->id, IPv4_FMTARGS(src_addr), IPv4_FMTARGS(dst_addr));
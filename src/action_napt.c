@@ -0,0 +1,234 @@
+/* vim: ts=4 sw=4 et */
+#include <stdio.h>
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_errno.h>
+#include <rte_lcore.h>
+#include <rte_ring.h>
+
+#include "natasha.h"
+#include "network_headers.h"
+#include "actions.h"
+#include "flow_cache.h"
+#include "napt.h"
+
+/*
+ * Action "nat napt;". See napt.h for the design of the session tables.
+ */
+
+// Cores, and index of each worker among the workers, set by napt_init().
+static struct core *napt_cores;
+static unsigned int napt_worker_index[RTE_MAX_LCORE];
+static unsigned int napt_workers[RTE_MAX_LCORE];
+static unsigned int napt_nb_workers;
+
+/*
+ * Create the handoff ring of each worker. Called before the workers are
+ * started.
+ */
+int
+napt_init(struct core *cores)
+{
+    char name[RTE_RING_NAMESIZE];
+    unsigned int core;
+
+    napt_cores = cores;
+    napt_nb_workers = 0;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        snprintf(name, sizeof(name), "napt_handoff_%u", core);
+        cores[core].napt = NULL;
+        cores[core].napt_ring = rte_ring_create(
+            name, NAPT_HANDOFF_RING_SIZE, rte_lcore_to_socket_id(core),
+            RING_F_SC_DEQ);
+        if (cores[core].napt_ring == NULL) {
+            RTE_LOG(ERR, APP, "Unable to create NAPT ring of core %u: %s\n",
+                    core, rte_strerror(rte_errno));
+            return -1;
+        }
+        napt_worker_index[core] = napt_nb_workers;
+        napt_workers[napt_nb_workers++] = core;
+    }
+    return 0;
+}
+
+/*
+ * Called by the worker when a new configuration is loaded. The sessions are
+ * kept if the NAPT configuration didn't change.
+ *
+ * @return
+ *  - -1 if the table can't be allocated. The NAPT is then disabled on this
+ *    core.
+ */
+int
+napt_reset(struct core *core, const struct napt_config *config)
+{
+    struct napt_table *table = core->napt;
+
+    if (table && memcmp(&table->config, config, sizeof(*config)) == 0) {
+        return 0;
+    }
+
+    napt_table_free(table);
+    core->napt = NULL;
+
+    if (config->nb_addresses == 0) {
+        return 0;
+    }
+
+    core->napt = napt_table_create(config, napt_worker_index[core->id],
+                                   napt_nb_workers,
+                                   rte_lcore_to_socket_id(core->id));
+    if (core->napt == NULL) {
+        RTE_LOG(ERR, APP, "Core %u: unable to create NAPT table\n", core->id);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Expire sessions, and dequeue at most n packets handed off to this worker by
+ * the others. Called by the worker once per iteration of its main loop.
+ *
+ * @return
+ *  - Number of packets stored in pkts, to process.
+ */
+unsigned int
+napt_poll(struct core *core, struct rte_mbuf **pkts, unsigned int n)
+{
+    struct napt_table *table = core->napt;
+
+    if (table) {
+        core->stats->napt_sessions_expired +=
+            napt_expire(table, rte_get_timer_cycles() / table->hz);
+    }
+    return rte_ring_sc_dequeue_burst(core->napt_ring, (void **)pkts, n, NULL);
+}
+
+/*
+ * Translate an incoming packet, destined to the pool. If its destination port
+ * belongs to another worker, the packet is handed off to it.
+ */
+static int
+napt_in(struct rte_mbuf *pkt, struct core *core, struct napt_table *table)
+{
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    struct napt_session *session;
+    enum napt_proto proto;
+    uint16_t *src_port;
+    uint16_t *dst_port;
+    uint16_t ext_port;
+    int owner;
+
+    if (nat_classify_ports(pkt, 1, &proto, &src_port, &dst_port) < 0) {
+        goto drop;
+    }
+
+    ext_port = rte_be_to_cpu_16(*dst_port);
+    owner = napt_port_owner(table, ext_port);
+    if (owner < 0) {
+        goto drop;
+    }
+
+    if ((unsigned int)owner != table->worker) {
+        if (rte_ring_mp_enqueue_burst(
+                napt_cores[napt_workers[owner]].napt_ring, (void **)&pkt, 1,
+                NULL) == 0) {
+            goto drop;
+        }
+        core->stats->napt_handoff++;
+        return -1;
+    }
+
+    session = napt_lookup_in(table, proto,
+                             rte_be_to_cpu_32(ipv4_hdr->dst_addr), ext_port);
+    if (session == NULL) {
+        goto drop;
+    }
+
+    napt_session_refresh(table, session);
+    nat_rewrite_port(pkt, proto, dst_port,
+                     rte_cpu_to_be_16(session->int_port));
+    nat_rewrite_address(pkt, &ipv4_hdr->dst_addr,
+                        rte_cpu_to_be_32(session->int_ip));
+    return 0;
+
+drop:
+    core->stats->drop_napt++;
+    pkt_free(pkt, core);
+    return -1;
+}
+
+/*
+ * Translate an outgoing packet, creating its session if needed.
+ */
+static int
+napt_out(struct rte_mbuf *pkt, struct core *core, struct napt_table *table)
+{
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    struct napt_session *session;
+    enum napt_proto proto;
+    uint16_t *src_port;
+    uint16_t *dst_port;
+    uint32_t int_ip;
+    uint16_t int_port;
+
+    if (nat_classify_ports(pkt, 0, &proto, &src_port, &dst_port) < 0) {
+        goto drop;
+    }
+
+    int_ip = rte_be_to_cpu_32(ipv4_hdr->src_addr);
+    int_port = rte_be_to_cpu_16(*src_port);
+
+    session = napt_lookup_out(table, proto, int_ip, int_port);
+    if (session == NULL) {
+        session = napt_session_create(table, proto, int_ip, int_port);
+        // No free session or port
+        if (session == NULL) {
+            goto drop;
+        }
+        core->stats->napt_sessions_created++;
+    }
+
+    napt_session_refresh(table, session);
+    nat_rewrite_port(pkt, proto, src_port,
+                     rte_cpu_to_be_16(session->ext_port));
+    nat_rewrite_address(pkt, &ipv4_hdr->src_addr,
+                        rte_cpu_to_be_32(session->ext_ip));
+    return 0;
+
+drop:
+    core->stats->drop_napt++;
+    pkt_free(pkt, core);
+    return -1;
+}
+
+/*
+ * Packets destined to the pool are translated back to their internal address
+ * and port, other packets are translated to a public address and port.
+ *
+ * Packets which can't be translated are dropped: fragments other than the
+ * first one, protocols other than TCP, UDP and ICMP echo, ICMP errors, and
+ * incoming packets without session.
+ */
+int
+action_napt(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
+{
+    struct napt_table *table = core->napt;
+
+    // The outcome depends on the sessions
+    flow_cache_record_abort(core);
+
+    if (unlikely(table == NULL)) {
+        core->stats->drop_napt++;
+        pkt_free(pkt, core);
+        return -1;
+    }
+
+    if (napt_pool_contains(&table->config,
+                           rte_be_to_cpu_32(ipv4_header(pkt)->dst_addr))) {
+        return napt_in(pkt, core, table);
+    }
+    return napt_out(pkt, core, table);
+}
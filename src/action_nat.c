@@ -1,57 +1,57 @@
 /* vim: ts=4 sw=4 et */
-#include <math.h>
-
 #include <rte_malloc.h>
 
 #include "natasha.h"
 #include "network_headers.h"
 #include "actions.h"
+#include "flow_cache.h"
+#include "nat_deterministic.h"
 
 /*
- * Search for ip in the NAT lookup table, and store the result in value.
- *
- * @return
- *  - -1 if ip is not in lookup_table.
+ * Search `ip` in `table` and rewrite `field` with the value. If `ip` is not
+ * found, drop `pkt`.
  */
 static int
-nat_lookup_ip(uint32_t ***lookup_table, uint32_t ip, uint32_t *value)
+lookup_and_rewrite(struct rte_mbuf *pkt, struct core *core,
+                   const struct nat_table *table, uint32_t ip, uint32_t *field)
 {
-    // first byte, second byte, last 2 bytes
-    const int fstb = (ip >> 24) & 0xff;
-    const int sndb = (ip >> 16) & 0xff;
-    const int l2b = (ip & 0xff00) | (ip & 0xff);
-
-    if (lookup_table == NULL ||
-        lookup_table[fstb] == NULL ||
-        lookup_table[fstb][sndb] == NULL ||
-        lookup_table[fstb][sndb][l2b] == 0)
-        return -1;
-
-    *value = lookup_table[fstb][sndb][l2b];
+    // If ip not found in table
+    if (nat_table_lookup(table, ip, field) < 0) {
+        pkt_free(pkt, core);
+        return -1; // Stop processing next rules
+    }
 
     return 0;
 }
 
 /*
- * Search `ip` in `lookup_table` and rewrite `field` with the value. If `ip` is
- * not found, drop `pkt`.
+ * Prefetch the NAT table entries of the source and destination addresses of
+ * pkt, so they are in cache when the rules are processed.
+ *
+ * Whether the source or the destination address will be rewritten is only
+ * known once the rules are processed, so both are prefetched. pkt must be an
+ * IPv4 packet, whose headers should have been prefetched by the caller.
  */
-static int
-lookup_and_rewrite(struct rte_mbuf *pkt, uint32_t ***lookup_table, uint32_t ip,
-                   uint32_t *field)
+void
+action_nat_prefetch(struct rte_mbuf *pkt, struct core *core)
 {
-    // If ip not found in lookup_table
-    if (nat_lookup_ip(lookup_table, ip, field) < 0) {
-        rte_pktmbuf_free(pkt);
-        return -1; // Stop processing next rules
+    struct nat_table *const *tables = core->app_config->nat_tables;
+    struct ipv4_hdr *ipv4_hdr;
+
+    if (tables[NAT_DIR_OUT] == NULL) {
+        return ;
     }
 
-    return 0;
+    ipv4_hdr = ipv4_header(pkt);
+    nat_table_prefetch(tables[NAT_DIR_OUT],
+                       rte_be_to_cpu_32(ipv4_hdr->src_addr));
+    nat_table_prefetch(tables[NAT_DIR_IN],
+                       rte_be_to_cpu_32(ipv4_hdr->dst_addr));
 }
 
 static int
 icmp_nat_handle(struct core *core, struct rte_mbuf *pkt,
-                int inner_ipv4_to_rewrite)
+                const struct nat_table *table, int inner_ipv4_to_rewrite)
 {
 
     struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
@@ -74,12 +74,11 @@ icmp_nat_handle(struct core *core, struct rte_mbuf *pkt,
     /* forged (with Scapy for instance). I don't think there are legitimate */
     /* cases where an ICMP error doesn't contain the IPv4 header of the packet */
     /* originating the error, but just in case I prefer not to drop anything. */
-    if (unlikely(rte_be_to_cpu_16(ipv4_hdr->total_length)
-                    - sizeof(struct ipv4_hdr) /* outer IPv4 header */
-                    - sizeof(struct icmp_hdr) /* ICMP error header */
-                    - sizeof(struct ipv4_hdr) /* inner IPv4 header */
-                    ) < 0)
-        return -1;
+    if (unlikely(rte_be_to_cpu_16(ipv4_hdr->total_length) <
+                 pkt->l3_len /* outer IPv4 header, with its options */
+                 + sizeof(struct icmp_hdr) /* ICMP error header */
+                 + sizeof(struct ipv4_hdr) /* inner IPv4 header */))
+        return 0;
 
     inner_ipv4_hdr = (struct ipv4_hdr *)((unsigned char *)icmp_hdr +
                                          sizeof(*icmp_hdr));
@@ -94,7 +93,8 @@ icmp_nat_handle(struct core *core, struct rte_mbuf *pkt,
 
     old_ipv4_address = *inner_ipv4_address;
     if (lookup_and_rewrite(pkt,
-                           core->app_config->nat_lookup,
+                           core,
+                           table,
                            rte_be_to_cpu_32(*inner_ipv4_address),
                            inner_ipv4_address) < 0) {
         core->stats->drop_no_rule++;
@@ -115,6 +115,136 @@ icmp_nat_handle(struct core *core, struct rte_mbuf *pkt,
 
     return 0;
 }
+/*
+ * Rewrite the port (or ICMP echo identifier) at *field to value, network
+ * order, and update the L4 checksum. Must be called before
+ * nat_rewrite_address(), which offloads the TCP and UDP checksums.
+ */
+void
+nat_rewrite_port(struct rte_mbuf *pkt, enum napt_proto proto,
+                 uint16_t *field, uint16_t value)
+{
+    uint16_t *cksum;
+
+    switch (proto) {
+    case NAPT_PROTO_TCP:
+        cksum = &tcp_header(pkt)->cksum;
+        break ;
+    case NAPT_PROTO_UDP:
+        cksum = &udp_header(pkt)->dgram_cksum;
+        // No checksum
+        if (*cksum == 0) {
+            cksum = NULL;
+        }
+        break ;
+    default:
+        cksum = &icmp_header(pkt)->icmp_cksum;
+        break ;
+    }
+
+    if (cksum) {
+        cksum_update(cksum, *field, value);
+    }
+    *field = value;
+}
+
+/*
+ * Protocol of pkt, and its source and destination ports, or the identifier of
+ * an ICMP echo request (outgoing) or reply (incoming) as both.
+ *
+ * @return
+ *  - -1 if pkt can't be translated.
+ */
+int
+nat_classify_ports(struct rte_mbuf *pkt, int incoming, enum napt_proto *proto,
+                   uint16_t **src_port, uint16_t **dst_port)
+{
+    struct icmp_hdr *icmp_hdr;
+
+    // The ports are only in the first fragment: pkt_l4_proto() is 0 for the
+    // others
+    switch (pkt_l4_proto(pkt)) {
+    case IPPROTO_TCP:
+        *proto = NAPT_PROTO_TCP;
+        *src_port = &tcp_header(pkt)->src_port;
+        *dst_port = &tcp_header(pkt)->dst_port;
+        return 0;
+
+    case IPPROTO_UDP:
+        *proto = NAPT_PROTO_UDP;
+        *src_port = &udp_header(pkt)->src_port;
+        *dst_port = &udp_header(pkt)->dst_port;
+        return 0;
+
+    case IPPROTO_ICMP:
+        icmp_hdr = icmp_header(pkt);
+        if (icmp_hdr->icmp_type !=
+            (incoming ? IP_ICMP_ECHO_REPLY : IP_ICMP_ECHO_REQUEST)) {
+            return -1;
+        }
+        *proto = NAPT_PROTO_ICMP;
+        *src_port = &icmp_hdr->icmp_ident;
+        *dst_port = &icmp_hdr->icmp_ident;
+        return 0;
+    }
+    return -1;
+}
+
+
+/*
+ * Set address, the source or destination address of pkt, to value, and update
+ * the IPv4 and TCP/UDP checksums. ICMP errors are not handled, see
+ * action_nat_rewrite_impl().
+ */
+void
+nat_rewrite_address(struct rte_mbuf *pkt, uint32_t *address, uint32_t value)
+{
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    uint32_t save_ipv4 = *address;
+
+    *address = value;
+
+    /* Update IP checksum using incremental update */
+    cksum_update(&ipv4_hdr->hdr_checksum, save_ipv4, *address);
+
+    /* Update L4 checksums on all packet a part from [2nd, n] fragment */
+    /* offload the checksum when possible */
+    switch (pkt_l4_proto(pkt)) {
+    case IPPROTO_TCP:
+    {
+        struct tcp_hdr *tcp_hdr = tcp_header(pkt);
+
+        /* Only the first fragment has a L4 protocol */
+        if (unlikely(pkt_is_fragment(pkt))) {
+            /* Compute TCP checksum using incremental update */
+            cksum_update(&tcp_hdr->cksum, save_ipv4, *address);
+        } else {
+            tcp_hdr->cksum = 0;
+            pkt->ol_flags |= PKT_TX_TCP_CKSUM;
+        }
+        break;
+    }
+    case IPPROTO_UDPLITE:
+    case IPPROTO_UDP:
+    {
+        struct udp_hdr *udp_hdr = udp_header(pkt);
+
+        if (unlikely(!udp_hdr->dgram_cksum))
+            break;
+        if (unlikely(pkt_is_fragment(pkt))) {
+            /* Compute UDP checksum using incremental update */
+            cksum_update(&udp_hdr->dgram_cksum, save_ipv4, *address);
+        } else {
+            udp_hdr->dgram_cksum = 0;
+            pkt->ol_flags |= PKT_TX_UDP_CKSUM;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
 /*
  * The actual rewrite function, to avoid duplicating the code twice to handle
  * the rewriting of the source and the destination addresses.
@@ -152,68 +282,46 @@ icmp_nat_handle(struct core *core, struct rte_mbuf *pkt,
  * address needs to be updated.
  * When rewriting the **destination** address, the inner packet's **source**
  * address needs to be updated.
+ *
+ * Both are looked up in the table of direction dir: the source address of an
+ * outgoing packet and the destination address of the inner packet are
+ * internal addresses.
  */
 static int
 action_nat_rewrite_impl(struct rte_mbuf *pkt, uint8_t port, struct core *core,
-                        uint32_t *address, int inner_ipv4_to_rewrite)
+                        enum nat_dir dir, uint32_t *address,
+                        int inner_ipv4_to_rewrite)
 {
+    const struct nat_table *table = core->app_config->nat_tables[dir];
     struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
-    uint32_t save_ipv4 = *address;
+    uint32_t value;
+    uint32_t slot;
 
     // Rewrite IPv4 source or destination address.
-    if (lookup_and_rewrite(pkt,
-                           core->app_config->nat_lookup,
-                           rte_be_to_cpu_32(*address),
-                           address) < 0) {
+    if (nat_table_lookup_slot(table, rte_be_to_cpu_32(*address), &value,
+                              &slot) < 0) {
     // If the `address`is not in lookup table, it's an error and we should stop
-    // processing rules for this packet (which has been freed by
-    // lookup_and_rewrite()).
+    // processing rules for this packet.
+        if (table && table->prefilter) {
+            if (nat_prefilter_contains(table, rte_be_to_cpu_32(*address))) {
+                core->stats->nat_prefilter_false_positive++;
+            } else {
+                core->stats->nat_prefilter_drop++;
+            }
+        }
+        pkt_free(pkt, core);
         core->stats->drop_no_rule++;
         return -1;
     }
 
-    /* Update IP checksum using incremental update */
-    cksum_update(&ipv4_hdr->hdr_checksum, save_ipv4, *address);
-
-    /* Update L4 checksums on all packet a part from [2nd, n] fragment */
-    /* offload the checksum when possible */
-    switch (NATA_IS_FRAG(ipv4_hdr) ? 0 : ipv4_hdr->next_proto_id) {
-    case IPPROTO_TCP:
-    {
-        struct tcp_hdr *tcp_hdr = tcp_header(pkt);
+    nat_table_count(table, core->id, slot,
+                    rte_be_to_cpu_16(ipv4_hdr->total_length));
+    flow_cache_record_slot(core, dir, slot);
+    nat_rewrite_address(pkt, address, value);
 
-        if (unlikely(NATA_IS_FIRST_FRAG(ipv4_hdr))) {
-            /* Compute TCP checksum using incremental update */
-            cksum_update(&tcp_hdr->cksum, save_ipv4, *address);
-        } else {
-            tcp_hdr->cksum = 0;
-            pkt->ol_flags |= PKT_TX_TCP_CKSUM;
-        }
-        break;
-    }
-    case IPPROTO_UDPLITE:
-    case IPPROTO_UDP:
-    {
-        struct udp_hdr *udp_hdr = udp_header(pkt);
-
-        if (unlikely(!udp_hdr->dgram_cksum))
-            break;
-        if (unlikely(NATA_IS_FIRST_FRAG(ipv4_hdr))) {
-            /* Compute UDP checksum using incremental update */
-            cksum_update(&udp_hdr->dgram_cksum, save_ipv4, *address);
-        } else {
-            udp_hdr->dgram_cksum = 0;
-            pkt->ol_flags |= PKT_TX_UDP_CKSUM;
-        }
-        break;
-    }
-    case IPPROTO_ICMP:
-    {
-        /* Handle inner Ipv4 header in ICMP error message */
-        return icmp_nat_handle(core, pkt, inner_ipv4_to_rewrite);
-    }
-    default:
-        break;
+    /* Handle inner Ipv4 header in ICMP error message */
+    if (pkt_l4_proto(pkt) == IPPROTO_ICMP) {
+        return icmp_nat_handle(core, pkt, table, inner_ipv4_to_rewrite);
     }
 
     return 0;
@@ -233,6 +341,7 @@ action_nat_rewrite(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *
             pkt,
             port,
             core,
+            NAT_DIR_OUT,
             &ipv4_hdr->src_addr,
             IPV4_DST_ADDR
         );
@@ -241,167 +350,111 @@ action_nat_rewrite(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *
         pkt,
         port,
         core,
+        NAT_DIR_IN,
         &ipv4_hdr->dst_addr,
         IPV4_SRC_ADDR
     );
 }
 
 /*
- * Set all the IP addresses stored in the NAT lookup table t to -1.
+ * Batched variant of action_nat_rewrite, for the packets of pkts whose bit is
+ * set in mask. Their NAT table entries were prefetched by
+ * action_nat_prefetch(). See ipv4.c/process_rules_burst().
+ *
+ * @return
+ *  - The mask of the packets rewritten. The others were dropped.
  */
-void
-nat_reset_lookup_table(uint32_t ***t)
+uint64_t
+action_nat_rewrite_burst(struct rte_mbuf **pkts, uint64_t mask,
+                         struct core *core, void *data)
 {
-    int i, j;
-
-    if (t) {
-        for (i = 0; i < lkp_fs; ++i) {
-            if (t[i]) {
-                for (j = 0; j < lkp_ss; ++j) {
-                    rte_free(t[i][j]);
-                }
-                rte_free(t[i]);
-            }
+    int rewrite_src = *(int *)data == IPV4_SRC_ADDR;
+    enum nat_dir dir = rewrite_src ? NAT_DIR_OUT : NAT_DIR_IN;
+    int inner_ipv4_to_rewrite = rewrite_src ? IPV4_DST_ADDR : IPV4_SRC_ADDR;
+    struct ipv4_hdr *ipv4_hdr;
+    struct rte_mbuf *pkt;
+    uint64_t rewritten = mask;
+    uint64_t tmp;
+    unsigned int i;
+
+    for (tmp = mask; tmp; tmp &= tmp - 1) {
+        i = __builtin_ctzll(tmp);
+        pkt = pkts[i];
+        ipv4_hdr = ipv4_header(pkt);
+
+        if (action_nat_rewrite_impl(
+                pkt, pkt->port, core, dir,
+                rewrite_src ? &ipv4_hdr->src_addr : &ipv4_hdr->dst_addr,
+                inner_ipv4_to_rewrite) < 0) {
+            rewritten &= ~(UINT64_C(1) << i);
         }
-        rte_free(t);
     }
-}
-
-static uint32_t ***
-add_rule_to_table(uint32_t ***t, uint32_t key, uint32_t value,
-                  unsigned int socket_id)
-{
-    // first byte, second byte, last 2 bytes
-    const int fstb = (key >> 24) & 0xff;
-    const int sndb = (key >> 16) & 0xff;
-    const int l2b = (key & 0xff00) | (key & 0xff);
-
-    if (t == NULL) {
-        t = rte_zmalloc_socket(NULL, lkp_fs * sizeof(*t), 0, socket_id);
-        if (t == NULL) {
-            return NULL;
-        }
-    }
-
-    if (t[fstb] == NULL) {
-        t[fstb] = rte_zmalloc_socket(NULL, lkp_ss * sizeof(**t), 0, socket_id);
-        if (t[fstb] == NULL) {
-            rte_free(t);
-            return NULL ;
-        }
-    }
-
-    if (t[fstb][sndb] == NULL) {
-        t[fstb][sndb] = rte_zmalloc_socket(NULL, lkp_ts * sizeof(***t), 0,
-                                           socket_id);
-        if (t[fstb][sndb] == NULL) {
-            rte_free(t[fstb]);
-            rte_free(t);
-            return NULL;
-        }
-
-        memset(t[fstb][sndb], 0, lkp_ts * sizeof(***t));
-    }
-
-    t[fstb][sndb][l2b] = value;
-    return t;
+    return rewritten;
 }
 
 /*
- * Store NAT rules in nat_lookup in network order.
- * @return
- *   - -1 on failure
+ * Deterministic NAT, see nat_deterministic.h. Packets destined to a public
+ * network of a mapping are translated back to their private address and
+ * port, packets from a private network are translated to their public
+ * address and port.
+ *
+ * Only the public address of an outgoing packet depends on the private
+ * address: outgoing fragments other than the first one are translated
+ * without their ports. Incoming fragments other than the first one, ICMP
+ * errors and packets from ports outside the private ports are dropped.
  */
 int
-add_rules_to_table(uint32_t ****nat_lookup, uint32_t int_ip, uint32_t ext_ip,
-                   unsigned int socket_id)
+action_nat_deterministic(struct rte_mbuf *pkt, uint8_t port,
+                         struct core *core, void *data)
 {
-    uint32_t ext_ip_formated = rte_cpu_to_be_32(ext_ip);
-    uint32_t int_ip_formated = rte_cpu_to_be_32(int_ip);
-
-    *nat_lookup = add_rule_to_table(*nat_lookup, int_ip,
-                                    ext_ip_formated, socket_id);
-    if (nat_lookup == NULL) {
-        return -1;
+    const struct nat_det *det = &core->app_config->nat_det;
+    const struct nat_det_mapping *m;
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    enum napt_proto proto;
+    uint16_t *src_port;
+    uint16_t *dst_port;
+    uint32_t new_ip;
+    uint16_t new_port;
+    uint32_t ip;
+
+    // The outcome depends on the ports
+    flow_cache_record_abort(core);
+
+    ip = rte_be_to_cpu_32(ipv4_hdr->dst_addr);
+    if ((m = nat_det_find_ext(det, ip)) != NULL) {
+        if (nat_classify_ports(pkt, 1, &proto, &src_port, &dst_port) < 0 ||
+            nat_det_in(m, ip, rte_be_to_cpu_16(*dst_port), &new_ip,
+                       &new_port) < 0) {
+            goto drop;
+        }
+        nat_rewrite_port(pkt, proto, dst_port, rte_cpu_to_be_16(new_port));
+        nat_rewrite_address(pkt, &ipv4_hdr->dst_addr,
+                            rte_cpu_to_be_32(new_ip));
+        return 0;
     }
 
-    *nat_lookup = add_rule_to_table(*nat_lookup, ext_ip,
-                                    int_ip_formated, socket_id);
-    if (nat_lookup == NULL) {
-        return -1;
+    ip = rte_be_to_cpu_32(ipv4_hdr->src_addr);
+    if ((m = nat_det_find_int(det, ip)) == NULL) {
+        goto drop;
     }
 
-    return 0;
-}
-
-static int
-nat_iter(uint32_t ***nat_lookup,
-         void (*func)(uint32_t from, uint32_t to, void *arg),
-         void *data)
-{
-    int i, j, k;
-    uint32_t from, to;
-    size_t n;
-
-    if (nat_lookup == NULL)
+    if (pkt_l4_proto(pkt) == 0) {
+        nat_rewrite_address(pkt, &ipv4_hdr->src_addr,
+                            rte_cpu_to_be_32(nat_det_ext_ip(m, ip)));
         return 0;
-
-    n = 0;
-    for (i = 0; i < lkp_fs; ++i) {
-        if (nat_lookup[i] == NULL) {
-            continue ;
-        }
-
-        for (j = 0; j < lkp_ss; ++j) {
-            if (nat_lookup[i][j] == NULL) {
-                continue ;
-            }
-
-            for (k = 0; k < lkp_ts; ++k) {
-                if (nat_lookup[i][j][k] == 0) {
-                    continue ;
-                }
-
-                if (func) {
-                    from = IPv4(i, j, (k >> 8) & 0xff, k & 0xff);
-                    to = nat_lookup[i][j][k];
-                    func(from, to, data);
-                }
-                ++n;
-            }
-        }
     }
-    // Since each rule is stored twice, one time for each direction, there are
-    // actually n / 2 NAT rules in nat_lookup.
-    return n / 2;
-}
-
-static void
-nat_dump_rule(uint32_t from, uint32_t to, void *arg)
-{
-    int out_fd = *(int *)arg;
 
-    dprintf(out_fd, IPv4_FMT " -> " IPv4_FMT "\n",
-            IPv4_FMTARGS(from), IPv4_FMTARGS(to));
-}
-
-/*
- * Display rules of the NAT lookup table.
- *
- * @return
- *  - Number of rules in nat_lookup.
- */
-int
-nat_dump_rules(int out_fd, uint32_t ***nat_lookup)
-{
-    size_t size;
-
-    size = nat_iter(nat_lookup, &nat_dump_rule, &out_fd);
-    return size;
-}
+    if (nat_classify_ports(pkt, 0, &proto, &src_port, &dst_port) < 0 ||
+        nat_det_out(m, ip, rte_be_to_cpu_16(*src_port), &new_ip,
+                    &new_port) < 0) {
+        goto drop;
+    }
+    nat_rewrite_port(pkt, proto, src_port, rte_cpu_to_be_16(new_port));
+    nat_rewrite_address(pkt, &ipv4_hdr->src_addr, rte_cpu_to_be_32(new_ip));
+    return 0;
 
-int
-nat_number_of_rules(uint32_t ***nat_lookup)
-{
-    return nat_iter(nat_lookup, NULL, NULL);
+drop:
+    core->stats->drop_no_rule++;
+    pkt_free(pkt, core);
+    return -1;
 }
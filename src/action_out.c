@@ -2,6 +2,7 @@
 #include "natasha.h"
 #include "network_headers.h"
 #include "actions.h"
+#include "flow_cache.h"
 
 
 /*
@@ -13,6 +14,8 @@ action_out(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
     struct out_packet *out = data;
     struct ether_hdr *eth_hdr = eth_header(pkt);
 
+    flow_cache_record(core, pkt, FLOW_ACTION_OUT, data);
+
     // setup ethernet header
     rte_eth_macaddr_get(port, &eth_hdr->s_addr);
     ether_addr_copy(&out->next_hop, &eth_hdr->d_addr);
@@ -24,6 +27,43 @@ action_out(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
     // Rewrite out vlan
     pkt->vlan_tci = out->vlan;
 
-    tx_send(pkt, out->port, &core->tx_queues[out->port], core->stats);
+    tx_send(pkt, out->port, core);
     return -1; // Stop processing rules
 }
+
+/*
+ * Batched variant of action_out, for the packets of pkts whose bit is set in
+ * mask. The MAC address of the input port is only read again when it differs
+ * from the previous packet, which only happens for packets handed off by
+ * "nat napt;". See ipv4.c/process_rules_burst().
+ */
+uint64_t
+action_out_burst(struct rte_mbuf **pkts, uint64_t mask, struct core *core,
+                 void *data)
+{
+    struct out_packet *out = data;
+    struct ether_addr port_addr;
+    struct ether_hdr *eth_hdr;
+    struct rte_mbuf *pkt;
+    int port = -1;
+
+    for (; mask; mask &= mask - 1) {
+        pkt = pkts[__builtin_ctzll(mask)];
+        eth_hdr = eth_header(pkt);
+
+        flow_cache_record(core, pkt, FLOW_ACTION_OUT, data);
+
+        if (unlikely(pkt->port != port)) {
+            port = pkt->port;
+            rte_eth_macaddr_get(port, &port_addr);
+        }
+        ether_addr_copy(&port_addr, &eth_hdr->s_addr);
+        ether_addr_copy(&out->next_hop, &eth_hdr->d_addr);
+
+        pkt->ol_flags |= PKT_TX_IPV4;
+        pkt->vlan_tci = out->vlan;
+
+        tx_send(pkt, out->port, core);
+    }
+    return 0;
+}
@@ -11,6 +11,8 @@
 
 int action_drop(struct rte_mbuf *pkt, uint8_t port, struct core *core,
                 void *data);
+uint64_t action_drop_burst(struct rte_mbuf **pkts, uint64_t mask,
+                           struct core *core, void *data);
 
 
 /**************
@@ -31,15 +33,21 @@ static const int IPV4_DST_ADDR = 1;
 
 int action_nat_rewrite(struct rte_mbuf *pkt, uint8_t port, struct core *core,
                        void *data);
+uint64_t action_nat_rewrite_burst(struct rte_mbuf **pkts, uint64_t mask,
+                                  struct core *core, void *data);
 
-void nat_reset_lookup_table(uint32_t ***nat_lookup);
+void action_nat_prefetch(struct rte_mbuf *pkt, struct core *core);
 
-int add_rules_to_table(uint32_t ****nat_lookup,
-                       uint32_t int_ip, uint32_t ext_ip,
-                       unsigned int socket_id);
+int action_nat_deterministic(struct rte_mbuf *pkt, uint8_t port,
+                             struct core *core, void *data);
 
-int nat_dump_rules(int out_fd, uint32_t ***nat_lookup);
-int nat_number_of_rules(uint32_t ***nat_lookup);
+void nat_rewrite_address(struct rte_mbuf *pkt, uint32_t *address,
+                         uint32_t value);
+void nat_rewrite_port(struct rte_mbuf *pkt, enum napt_proto proto,
+                      uint16_t *field, uint16_t value);
+int nat_classify_ports(struct rte_mbuf *pkt, int incoming,
+                       enum napt_proto *proto, uint16_t **src_port,
+                       uint16_t **dst_port);
 
 struct out_packet {
     uint8_t port;
@@ -48,11 +56,26 @@ struct out_packet {
 };
 
 
+/***************
+ * action napt *
+ ***************/
+
+int action_napt(struct rte_mbuf *pkt, uint8_t port, struct core *core,
+                void *data);
+
+int napt_init(struct core *cores);
+int napt_reset(struct core *core, const struct napt_config *config);
+unsigned int napt_poll(struct core *core, struct rte_mbuf **pkts,
+                       unsigned int n);
+
+
 /**************
  * action out *
  **************/
 
 int action_out(struct rte_mbuf *pkt, uint8_t port, struct core *core,
                void *data);
+uint64_t action_out_burst(struct rte_mbuf **pkts, uint64_t mask,
+                          struct core *core, void *data);
 
 #endif
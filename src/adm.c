@@ -195,6 +195,7 @@ handle_cmd_dpdk_stats(struct natasha_client *client, struct core *cores,
 
 void
 cpu_to_be_app_stats(struct natasha_app_stats *core) {
+    unsigned int i;
 
     core->drop_no_rule = rte_cpu_to_be_64(core->drop_no_rule);
     core->drop_nat_condition = rte_cpu_to_be_64(core->drop_nat_condition);
@@ -203,6 +204,25 @@ cpu_to_be_app_stats(struct natasha_app_stats *core) {
     core->drop_unknown_icmp = rte_cpu_to_be_64(core->drop_unknown_icmp);
     core->drop_unhandled_ethertype = rte_cpu_to_be_64(core->drop_unhandled_ethertype);
     core->drop_tx_notsent = rte_cpu_to_be_64(core->drop_tx_notsent);
+    core->flow_cache_hit = rte_cpu_to_be_64(core->flow_cache_hit);
+    core->flow_cache_miss = rte_cpu_to_be_64(core->flow_cache_miss);
+    core->napt_sessions_created =
+        rte_cpu_to_be_64(core->napt_sessions_created);
+    core->napt_sessions_expired =
+        rte_cpu_to_be_64(core->napt_sessions_expired);
+    core->napt_handoff = rte_cpu_to_be_64(core->napt_handoff);
+    core->drop_napt = rte_cpu_to_be_64(core->drop_napt);
+    core->rx_packets = rte_cpu_to_be_64(core->rx_packets);
+    core->nat_prefilter_drop = rte_cpu_to_be_64(core->nat_prefilter_drop);
+    core->nat_prefilter_false_positive =
+        rte_cpu_to_be_64(core->nat_prefilter_false_positive);
+    core->tx_retry = rte_cpu_to_be_64(core->tx_retry);
+    core->tx_retry_sent = rte_cpu_to_be_64(core->tx_retry_sent);
+    for (i = 0; i < NATASHA_TX_BATCH_BUCKETS; ++i) {
+        core->tx_batches[i] = rte_cpu_to_be_64(core->tx_batches[i]);
+    }
+    core->slowpath_handoff = rte_cpu_to_be_64(core->slowpath_handoff);
+    core->drop_slowpath = rte_cpu_to_be_64(core->drop_slowpath);
 
 }
 
@@ -254,6 +274,397 @@ handle_cmd_app_stats(struct natasha_client *client, struct core *cores,
     return 0;
 }
 
+static int
+handle_cmd_reload_stats(struct natasha_client *client, struct core *cores,
+                        uint8_t cmd_type)
+{
+    struct natasha_reload_stats stats;
+    struct natasha_cmd_reply reply;
+    size_t data_size;
+    int nb;
+
+    app_config_reload_stats(&stats);
+    stats.reloads = rte_cpu_to_be_64(stats.reloads);
+    stats.reload_failures = rte_cpu_to_be_64(stats.reload_failures);
+    stats.last_load_us = rte_cpu_to_be_64(stats.last_load_us);
+    stats.max_load_us = rte_cpu_to_be_64(stats.max_load_us);
+    stats.last_grace_us = rte_cpu_to_be_64(stats.last_grace_us);
+    stats.max_grace_us = rte_cpu_to_be_64(stats.max_grace_us);
+    stats.pending = rte_cpu_to_be_64(stats.pending);
+
+    data_size = sizeof(stats);
+
+    reply.type = cmd_type;
+    reply.status = NATASHA_REPLY_OK;
+    reply.data_size = rte_cpu_to_be_16(data_size);
+
+    nb = send(client->fd, &reply, sizeof(reply), 0);
+    if (nb != sizeof(reply)) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)sizeof(reply), nb);
+        return -1;
+    }
+
+    nb = send(client->fd, &stats, data_size, 0);
+    if (nb != data_size) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)data_size, nb);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+handle_cmd_slowpath_stats(struct natasha_client *client, struct core *cores,
+                          uint8_t cmd_type)
+{
+    struct natasha_slowpath_stats stats;
+    struct natasha_cmd_reply reply;
+    size_t data_size;
+    int nb;
+
+    slowpath_stats(&stats);
+    stats.arp_replies = rte_cpu_to_be_64(stats.arp_replies);
+    stats.icmp_echo_replies = rte_cpu_to_be_64(stats.icmp_echo_replies);
+    stats.drop_arp_rate = rte_cpu_to_be_64(stats.drop_arp_rate);
+    stats.drop_icmp_rate = rte_cpu_to_be_64(stats.drop_icmp_rate);
+    stats.drop_tx_notsent = rte_cpu_to_be_64(stats.drop_tx_notsent);
+
+    data_size = sizeof(stats);
+
+    reply.type = cmd_type;
+    reply.status = NATASHA_REPLY_OK;
+    reply.data_size = rte_cpu_to_be_16(data_size);
+
+    nb = send(client->fd, &reply, sizeof(reply), 0);
+    if (nb != sizeof(reply)) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)sizeof(reply), nb);
+        return -1;
+    }
+
+    nb = send(client->fd, &stats, data_size, 0);
+    if (nb != data_size) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)data_size, nb);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Read len bytes of the data following the type of the query of client: first
+ * what has already been read in client->buf, then from the socket.
+ */
+static int
+read_query_data(struct natasha_client *client, void *data, size_t len)
+{
+    struct timeval timeout;
+    fd_set readfds;
+    size_t nb_buf;
+    ssize_t nb;
+    char *p = data;
+
+    nb_buf = RTE_MIN(len, client->len - client->pos);
+    memcpy(p, client->buf + client->pos, nb_buf);
+    client->pos += nb_buf;
+    p += nb_buf;
+    len -= nb_buf;
+
+    while (len > 0) {
+        nb = read(client->fd, p, len);
+        if (nb > 0) {
+            p += nb;
+            len -= nb;
+            continue ;
+        }
+
+        if (nb == 0) {
+            RTE_LOG(ERR, APP, "%s: client disconnected\n", __func__);
+            return -1;
+        }
+
+        if (errno == EINTR) {
+            continue ;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            RTE_LOG(ERR, APP, "%s: client read error: %s\n", __func__,
+                    strerror(errno));
+            return -1;
+        }
+
+        /* Client socket is non blocking, wait for the rest of the query */
+        FD_ZERO(&readfds);
+        FD_SET(client->fd, &readfds);
+        memset(&timeout, 0, sizeof(timeout));
+        timeout.tv_sec = NATASHA_ADM_READ_TIMEOUT;
+
+        if (select(client->fd + 1, &readfds, NULL, NULL, &timeout) <= 0) {
+            RTE_LOG(ERR, APP, "%s: timeout while reading query\n", __func__);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Send the len bytes of data to client. The client socket is non blocking:
+ * partial sends are resumed once the socket is writable again, for at most
+ * NATASHA_ADM_READ_TIMEOUT seconds each.
+ */
+static int
+send_reply_data(struct natasha_client *client, const void *data, size_t len)
+{
+    struct timeval timeout;
+    fd_set writefds;
+    const char *p = data;
+    ssize_t nb;
+
+    while (len > 0) {
+        nb = send(client->fd, p, len, 0);
+        if (nb >= 0) {
+            p += nb;
+            len -= nb;
+            continue ;
+        }
+
+        if (errno == EINTR) {
+            continue ;
+        }
+
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            RTE_LOG(ERR, APP, "%s: client send error: %s\n", __func__,
+                    strerror(errno));
+            return -1;
+        }
+
+        /* Send buffer full, wait for the client to read the reply */
+        FD_ZERO(&writefds);
+        FD_SET(client->fd, &writefds);
+        memset(&timeout, 0, sizeof(timeout));
+        timeout.tv_sec = NATASHA_ADM_READ_TIMEOUT;
+
+        if (select(client->fd + 1, NULL, &writefds, NULL, &timeout) <= 0) {
+            RTE_LOG(ERR, APP, "%s: timeout while sending reply (0x%zx bytes "
+                    "left)\n", __func__, len);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+natasha_nat_op_to_update(uint8_t op, const struct natasha_nat_rule *rule,
+                         struct nat_update *update)
+{
+    switch (op) {
+    case NATASHA_NAT_ADD:
+        update->op = NAT_UPDATE_ADD;
+        break ;
+    case NATASHA_NAT_DEL:
+        update->op = NAT_UPDATE_DEL;
+        break ;
+    case NATASHA_NAT_REPLACE:
+        update->op = NAT_UPDATE_REPLACE;
+        break ;
+    default:
+        return -1;
+    }
+
+    update->rule.int_ip = rte_be_to_cpu_32(rule->int_ip);
+    update->rule.ext_ip = rte_be_to_cpu_32(rule->ext_ip);
+    return 0;
+}
+
+static int
+handle_cmd_nat_rule(struct natasha_client *client, struct core *cores,
+                    uint8_t cmd_type)
+{
+    struct natasha_nat_rule rule;
+    struct natasha_cmd_reply reply;
+    struct nat_update update;
+    uint8_t op;
+    int nb;
+
+    if (read_query_data(client, &rule, sizeof(rule)) < 0) {
+        return -1;
+    }
+
+    switch (cmd_type) {
+    case NATASHA_CMD_NAT_DEL:
+        op = NATASHA_NAT_DEL;
+        break ;
+    case NATASHA_CMD_NAT_REPLACE:
+        op = NATASHA_NAT_REPLACE;
+        break ;
+    case NATASHA_CMD_NAT_ADD:
+    default:
+        op = NATASHA_NAT_ADD;
+        break ;
+    }
+    natasha_nat_op_to_update(op, &rule, &update);
+
+    reply.type = cmd_type;
+    reply.status = app_config_nat_update(cores, &update, 1);
+    reply.data_size = 0;
+
+    nb = send(client->fd, &reply, sizeof(reply), 0);
+    if (nb != sizeof(reply)) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)sizeof(reply), nb);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+handle_cmd_nat_update(struct natasha_client *client, struct core *cores,
+                      uint8_t cmd_type)
+{
+    struct natasha_nat_update *queries = NULL;
+    struct nat_update *updates = NULL;
+    struct natasha_cmd_reply reply;
+    uint32_t nb_updates;
+    uint32_t i;
+    int nb;
+
+    if (read_query_data(client, &nb_updates, sizeof(nb_updates)) < 0) {
+        return -1;
+    }
+
+    nb_updates = rte_be_to_cpu_32(nb_updates);
+    if (nb_updates > NATASHA_MAX_NAT_UPDATES) {
+        RTE_LOG(ERR, APP, "%s: too many updates (%u)\n", __func__,
+                nb_updates);
+        return -1;
+    }
+
+    queries = malloc(nb_updates * sizeof(*queries) + 1);
+    updates = malloc(nb_updates * sizeof(*updates) + 1);
+    if (queries == NULL || updates == NULL) {
+        RTE_LOG(ERR, APP, "%s: unable to allocate %u updates\n", __func__,
+                nb_updates);
+        free(queries);
+        free(updates);
+        return -1;
+    }
+
+    if (read_query_data(client, queries,
+                        nb_updates * sizeof(*queries)) < 0) {
+        free(queries);
+        free(updates);
+        return -1;
+    }
+
+    reply.type = cmd_type;
+    reply.status = NATASHA_REPLY_OK;
+    reply.data_size = 0;
+
+    for (i = 0; i < nb_updates; ++i) {
+        if (natasha_nat_op_to_update(queries[i].op, &queries[i].rule,
+                                     &updates[i]) < 0) {
+            RTE_LOG(ERR, APP, "%s: unknown operation 0x%x\n", __func__,
+                    queries[i].op);
+            reply.status = -1;
+        }
+    }
+
+    if (reply.status == NATASHA_REPLY_OK) {
+        reply.status = app_config_nat_update(cores, updates, nb_updates);
+    }
+
+    free(queries);
+    free(updates);
+
+    nb = send(client->fd, &reply, sizeof(reply), 0);
+    if (nb != sizeof(reply)) {
+        RTE_LOG(ERR, APP, "%s: failed to send 0x%x bytes (sent 0x%x bytes)\n",
+                __func__, (uint32_t)sizeof(reply), nb);
+        return -1;
+    }
+
+    return 0;
+}
+
+struct nat_counters_reply {
+    struct natasha_nat_counter *entries;
+    uint32_t len;
+    uint32_t size;
+    int error;
+};
+
+static void
+append_nat_counter(uint32_t from, uint32_t to,
+                   const struct nat_counter *counter, void *arg)
+{
+    struct nat_counters_reply *reply = arg;
+    struct natasha_nat_counter *entries;
+    struct natasha_nat_counter *entry;
+
+    if (reply->len == reply->size) {
+        entries = realloc(reply->entries,
+                          (reply->size * 2 + 1024) * sizeof(*entries));
+        if (entries == NULL) {
+            reply->error = 1;
+            return ;
+        }
+        reply->entries = entries;
+        reply->size = reply->size * 2 + 1024;
+    }
+
+    entry = &reply->entries[reply->len++];
+    entry->from = rte_cpu_to_be_32(from);
+    entry->to = rte_cpu_to_be_32(to);
+    entry->packets = rte_cpu_to_be_64(counter->packets);
+    entry->bytes = rte_cpu_to_be_64(counter->bytes);
+}
+
+static int
+handle_cmd_nat_counters(struct natasha_client *client, struct core *cores,
+                        uint8_t cmd_type)
+{
+    struct nat_counters_reply counters = {NULL, 0, 0, 0};
+    struct natasha_cmd_reply reply;
+    uint32_t nb_entries;
+    int ret = 0;
+
+    reply.type = cmd_type;
+    reply.status = NATASHA_REPLY_OK;
+    reply.data_size = 0;
+
+    if (app_config_nat_counters(cores, &append_nat_counter, &counters) < 0 ||
+        counters.error) {
+        reply.status = -1;
+    }
+
+    if (send_reply_data(client, &reply, sizeof(reply)) < 0) {
+        ret = -1;
+        goto end;
+    }
+
+    if (reply.status != NATASHA_REPLY_OK) {
+        goto end;
+    }
+
+    // About 3MB for 64k rules, far more than the socket send buffer
+    nb_entries = rte_cpu_to_be_32(counters.len);
+    if (send_reply_data(client, &nb_entries, sizeof(nb_entries)) < 0 ||
+        send_reply_data(client, counters.entries,
+                        counters.len * sizeof(*counters.entries)) < 0) {
+        ret = -1;
+    }
+
+end:
+    free(counters.entries);
+    return ret;
+}
+
 const struct natasha_command natasha_commands[] = {
     {
         .cmd_type = NATASHA_CMD_STATUS,
@@ -283,6 +694,34 @@ const struct natasha_command natasha_commands[] = {
         .cmd_type = NATASHA_CMD_APP_STATS,
         .func = handle_cmd_app_stats,
     },
+    {
+        .cmd_type = NATASHA_CMD_RELOAD_STATS,
+        .func = handle_cmd_reload_stats,
+    },
+    {
+        .cmd_type = NATASHA_CMD_NAT_ADD,
+        .func = handle_cmd_nat_rule,
+    },
+    {
+        .cmd_type = NATASHA_CMD_NAT_DEL,
+        .func = handle_cmd_nat_rule,
+    },
+    {
+        .cmd_type = NATASHA_CMD_NAT_REPLACE,
+        .func = handle_cmd_nat_rule,
+    },
+    {
+        .cmd_type = NATASHA_CMD_NAT_UPDATE,
+        .func = handle_cmd_nat_update,
+    },
+    {
+        .cmd_type = NATASHA_CMD_NAT_COUNTERS,
+        .func = handle_cmd_nat_counters,
+    },
+    {
+        .cmd_type = NATASHA_CMD_SLOWPATH_STATS,
+        .func = handle_cmd_slowpath_stats,
+    },
 };
 
 static int
@@ -371,9 +810,13 @@ adm_loop(int s, struct core *cores, int argc, char **argv)
             }
         }
 
-        /* Setup timeout */
+        /* Setup timeout, shorter while replaced configs wait to be freed */
         memset(&timeout, 0, sizeof(timeout));
-        timeout.tv_sec = 1;
+        if (app_config_reclaim(cores) > 0) {
+            timeout.tv_usec = 1000;
+        } else {
+            timeout.tv_sec = 1;
+        }
 
         events = select(maxfd + 1, &readfds, NULL, NULL, &timeout);
         if ((events < 0) && (errno != EINTR)) {
@@ -443,15 +886,10 @@ adm_loop(int s, struct core *cores, int argc, char **argv)
                     disconnect_client(&clients[i]);
                     --cur_clients;
                 }
-                else if (sizeof(struct natasha_query) != nbread) {
-                    RTE_LOG(ERR, APP,
-                            "Adm server: Receiving data lenght from client error,"
-                            "expected 0x%x received 0x%x\n",
-                            (uint32_t)sizeof(struct natasha_query),
-                            (uint32_t)nbread);
-                    disconnect_client(&clients[i]);
-                    --cur_clients;
-                } else {
+                else {
+                    /* Queries may be followed by data, see cli.h */
+                    clients[i].len = nbread;
+                    clients[i].pos = sizeof(struct natasha_query);
                     if (handle_client_query(&clients[i], cores) < 0) {
                         disconnect_client(&clients[i]);
                         --cur_clients;
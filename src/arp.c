@@ -2,12 +2,17 @@
 #include <rte_arp.h>
 #include <rte_ether.h>
 
+#include "local_addrs.h"
 #include "natasha.h"
 #include "network_headers.h"
 
 
-static int
-arp_request(struct rte_mbuf *pkt, uint8_t port, struct core *core)
+/*
+ * Reply to an ARP request for one of our addresses on port. Called by the slow
+ * path thread, see slowpath.c.
+ */
+int
+arp_reply(struct rte_mbuf *pkt, uint8_t port, struct core *core)
 {
     uint32_t source_ip;
     uint32_t target_ip;
@@ -25,14 +30,6 @@ arp_request(struct rte_mbuf *pkt, uint8_t port, struct core *core)
             VLAN_ID(pkt)
     );
 
-    if (!is_natasha_port_ip(core->app_config, target_ip, VLAN_ID(pkt), port)) {
-        RTE_LOG(DEBUG, APP,
-                "Port %d: " IPv4_FMT " is not my IP address on vlan %d,"
-                " ARP request ignored\n", port, IPv4_FMTARGS(target_ip),
-                VLAN_ID(pkt));
-        return -1;
-    }
-
     rte_eth_macaddr_get(port, &my_eth_addr);
 
     // Request for me, forge the reply
@@ -72,23 +69,58 @@ arp_request(struct rte_mbuf *pkt, uint8_t port, struct core *core)
         VLAN_ID(pkt)
     );
 
-    return tx_send(pkt, port, &core->tx_queues[port], core->stats);
+    return tx_send(pkt, port, core);
 }
 
-int
-arp_handle(struct rte_mbuf *pkt, uint8_t port, struct core *core)
+/*
+ * Handle nb_pkts ARP packets, at most MAX_RX_BURST, each on the port it was
+ * received on. ARP requests for one of our addresses on their port are handed
+ * off to the slow path, other packets are dropped.
+ *
+ * The target addresses of all the requests are looked up at once with
+ * local_addrs_lookup_bulk().
+ *
+ * @return
+ *  - The number of packets dropped, already freed.
+ */
+unsigned int
+arp_handle_burst(struct rte_mbuf **pkts, unsigned int nb_pkts,
+                 struct core *core)
 {
+    uint64_t keys[LOCAL_ADDRS_MAX_BULK];
+    struct arp_hdr *arp_hdr;
+    unsigned int dropped = 0;
+    unsigned int nb_keys = 0;
+    uint64_t requests = 0;
+    uint64_t hits;
+    unsigned int i, j;
+
+    RTE_BUILD_BUG_ON(MAX_RX_BURST > LOCAL_ADDRS_MAX_BULK);
+
+    for (i = 0; i < nb_pkts; ++i) {
+        arp_hdr = arp_header(pkts[i]);
+        if (arp_hdr->arp_op != rte_cpu_to_be_16(ARP_OP_REQUEST)) {
+            continue ;
+        }
+        keys[nb_keys++] = local_addrs_key(
+            rte_be_to_cpu_32(arp_hdr->arp_data.arp_tip), VLAN_ID(pkts[i]),
+            pkts[i]->port);
+        requests |= UINT64_C(1) << i;
+    }
 
-    switch (rte_be_to_cpu_16(arp_header(pkt)->arp_op)) {
-
-    case ARP_OP_REQUEST:
-        return arp_request(pkt, port, core);
-
-    default:
-        RTE_LOG(DEBUG, APP,
-                "ARP packet received on port %d/vlan %d, but not of type "
-                "ARP_OP_REQUEST – skip\n", port, VLAN_ID(pkt));
-        break ;
+    hits = nb_keys
+        ? local_addrs_lookup_bulk(core->app_config->local_addrs, keys, nb_keys)
+        : 0;
+
+    // The j-th request is the j-th key
+    for (i = 0, j = 0; i < nb_pkts; ++i) {
+        if ((requests & (UINT64_C(1) << i)) &&
+            (hits & (UINT64_C(1) << j++))) {
+            slowpath_handoff(pkts[i], core);
+            continue ;
+        }
+        pkt_free(pkts[i], core);
+        dropped++;
     }
-    return -1;
+    return dropped;
 }
@@ -21,9 +21,18 @@ enum natasha_cmd_type {
     NATASHA_CMD_DPDK_XSTATS,
     NATASHA_CMD_APP_STATS,
     NATASHA_CMD_VERSION,
+    NATASHA_CMD_RELOAD_STATS,
+    NATASHA_CMD_NAT_ADD,
+    NATASHA_CMD_NAT_DEL,
+    NATASHA_CMD_NAT_REPLACE,
+    NATASHA_CMD_NAT_UPDATE,
+    NATASHA_CMD_NAT_COUNTERS,
+    NATASHA_CMD_SLOWPATH_STATS,
 };
 
 #define NATASHA_REPLY_OK     0
+// NAT updates failed, but some of them may have been applied.
+#define NATASHA_REPLY_PARTIAL   1
 
 struct natasha_cmd_reply {
     uint8_t     type;
@@ -33,6 +42,50 @@ struct natasha_cmd_reply {
 
 char natasha_version[100];
 
+/*
+ * Queries NATASHA_CMD_NAT_ADD, NATASHA_CMD_NAT_DEL and NATASHA_CMD_NAT_REPLACE:
+ * the command type is followed by a rule. Addresses are in network order.
+ */
+struct natasha_nat_rule {
+    uint32_t    int_ip;
+    uint32_t    ext_ip;
+} __attribute__((packed));
+
+enum natasha_nat_op {
+    NATASHA_NAT_ADD,
+    NATASHA_NAT_DEL,
+    NATASHA_NAT_REPLACE,
+};
+
+/*
+ * Query NATASHA_CMD_NAT_UPDATE: the command type is followed by the number of
+ * updates (uint32_t, network order), then by the updates.
+ */
+#define NATASHA_MAX_NAT_UPDATES 65536
+struct natasha_nat_update {
+    uint8_t                 op;     /* enum natasha_nat_op */
+    struct natasha_nat_rule rule;
+} __attribute__((packed));
+
+/*
+ * Reply to NATASHA_CMD_NAT_COUNTERS: data_size is 0, and the reply is followed
+ * by the number of entries (uint32_t, network order), then by the entries.
+ * Each NAT rule has two entries, one for each direction. All the fields are
+ * in network order.
+ */
+struct natasha_nat_counter {
+    uint32_t    from;                   /* address before the rewrite */
+    uint32_t    to;                     /* address after the rewrite */
+    uint64_t    packets;
+    uint64_t    bytes;                  /* IPv4 total length */
+} __attribute__((packed));
+
+/*
+ * Buckets of tx_batches: bucket i counts the TX bursts of 2^i to 2^(i+1) - 1
+ * packets, the last one the full bursts of 32 packets.
+ */
+#define NATASHA_TX_BATCH_BUCKETS 6
+
 /*
  * Structure for nat related statistics
  * These stats SHOULD be kept per core.
@@ -45,6 +98,46 @@ struct natasha_app_stats {
     uint64_t drop_unknown_icmp;
     uint64_t drop_unhandled_ethertype;
     uint64_t drop_tx_notsent;
+    uint64_t flow_cache_hit;
+    uint64_t flow_cache_miss;
+    uint64_t napt_sessions_created;
+    uint64_t napt_sessions_expired;
+    uint64_t napt_handoff;
+    uint64_t drop_napt;
+    uint64_t rx_packets;
+    uint64_t nat_prefilter_drop;
+    uint64_t nat_prefilter_false_positive;
+    uint64_t tx_retry;                  /* kept for a later TX burst */
+    uint64_t tx_retry_sent;
+    uint64_t tx_batches[NATASHA_TX_BATCH_BUCKETS];  /* TX bursts by size */
+    uint64_t slowpath_handoff;          /* handed off to the slow path */
+    uint64_t drop_slowpath;             /* slow path ring full */
+};
+
+/*
+ * Statistics of the slow path thread, replying to ARP and ICMP echo requests
+ * addressed to natasha. See slowpath.c.
+ */
+struct natasha_slowpath_stats {
+    uint64_t arp_replies;
+    uint64_t icmp_echo_replies;
+    uint64_t drop_arp_rate;             /* over "slowpath arp" */
+    uint64_t drop_icmp_rate;            /* over "slowpath icmp" */
+    uint64_t drop_tx_notsent;
+};
+
+/*
+ * Configuration reload statistics, see config.c/app_config_reload_all().
+ * Durations are in microseconds.
+ */
+struct natasha_reload_stats {
+    uint64_t reloads;                   /* successful reloads */
+    uint64_t reload_failures;
+    uint64_t last_load_us;              /* parse, build and publish */
+    uint64_t max_load_us;
+    uint64_t last_grace_us;             /* until the old config is freed */
+    uint64_t max_grace_us;
+    uint64_t pending;                   /* replaced configs not freed yet */
 };
 
 /* Structures and definition retreived from DPDK 18.02.2 stable */
@@ -1,9 +1,13 @@
 /* vim: ts=4 sw=4 et */
 #include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <rte_cycles.h>
 #include <rte_ip.h>
+#include <rte_launch.h>
 #include <rte_malloc.h>
 
 #include "natasha.h"
@@ -11,6 +15,7 @@
 
 #include "actions.h"
 #include "conds.h"
+#include "local_addrs.h"
 
 #include "parseconfig.tab.h"
 #include "parseconfig.yy.h"
@@ -50,6 +55,18 @@ app_config_free(struct app_config *config)
         return ;
     }
 
+    // Built for this configuration, even if it is a clone
+    local_addrs_free(config->local_addrs);
+    nat_table_free(config->nat_tables[NAT_DIR_OUT]);
+    nat_table_free(config->nat_tables[NAT_DIR_IN]);
+    rules_free(config->program);
+
+    // Owned by the origin
+    if (config->origin) {
+        rte_free(config);
+        return ;
+    }
+
     // Free ports IP addresses
     for (i = 0; i < sizeof(config->ports) / sizeof(*config->ports); ++i) {
         struct port_ip_addr *ip;
@@ -64,8 +81,8 @@ app_config_free(struct app_config *config)
         config->ports[i].ip_addresses = NULL;
     }
 
-    // Empty NAT lookup table
-    nat_reset_lookup_table(config->nat_lookup);
+    // Empty NAT rules
+    nat_rules_free(&config->nat_rules);
 
     // Free packet rules
     config->rules = reset_rules(config->rules);
@@ -73,6 +90,60 @@ app_config_free(struct app_config *config)
     rte_free(config);
 }
 
+/*
+ * Build the set of local addresses and the NAT lookup table, and compile the
+ * rules of config on socket_id.
+ */
+static int
+app_config_build(struct app_config *config, unsigned int socket_id)
+{
+    enum nat_dir dir;
+
+    config->local_addrs = local_addrs_create(config->ports,
+                                             RTE_DIM(config->ports),
+                                             socket_id);
+    if (config->local_addrs == NULL) {
+        return -1;
+    }
+
+    // Build the NAT lookup tables from the rules of the configuration file
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (config->nat_rules.len == 0 && config->nat_rules.nb_prefixes == 0) {
+            break ;
+        }
+
+        config->nat_tables[dir] = nat_table_create(config->nat_table_type,
+                                                   &config->nat_rules, dir,
+                                                   config->nat_prefilter,
+                                                   socket_id);
+        if (config->nat_tables[dir] == NULL) {
+            return -1;
+        }
+        RTE_LOG(DEBUG, APP, "NAT table %s %s: %u rules, %u prefix rules, "
+                "%zu bytes\n",
+                nat_table_name(config->nat_table_type),
+                dir == NAT_DIR_OUT ? "out" : "in", config->nat_rules.len,
+                config->nat_rules.nb_prefixes,
+                nat_table_memory(config->nat_tables[dir]));
+
+        if (config->nat_counters &&
+            nat_table_counters_alloc(config->nat_tables[dir], socket_id) < 0) {
+            return -1;
+        }
+    }
+
+    // Compile the packet rules
+    if (config->rules) {
+        config->program = rules_compile(config->rules, socket_id);
+        if (config->program == NULL) {
+            return -1;
+        }
+        RTE_LOG(DEBUG, APP, "Rules compiled to %u instructions\n",
+                config->program->len);
+    }
+    return 0;
+}
+
 /*
  * Load and return configuration.
  */
@@ -92,6 +163,11 @@ app_config_load(int argc, char **argv, unsigned int socket_id)
         return NULL;
     }
 
+    napt_config_default(&config->napt);
+    for (i = 0; i < SLOWPATH_NB_TYPES; ++i) {
+        config->slowpath_rates[i] = SLOWPATH_DEFAULT_RATE;
+    }
+
     config_file = "/etc/natasha.conf";
 
     // Parse argv. Can't use getopt, since option parsing needs to be
@@ -141,6 +217,45 @@ app_config_load(int argc, char **argv, unsigned int socket_id)
         return NULL;
     }
 
+    if (app_config_build(config, socket_id) < 0) {
+        app_config_free(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+/*
+ * Return a copy of origin for the workers of socket_id, without parsing the
+ * configuration file again.
+ *
+ * Only the local addresses, the NAT lookup table and the program, read for
+ * each packet, are built on socket_id. The rest of the configuration is
+ * shared with origin, which must be freed after its clones.
+ */
+struct app_config *
+app_config_clone(struct app_config *origin, unsigned int socket_id)
+{
+    struct app_config *config;
+
+    config = rte_malloc_socket(NULL, sizeof(*config), RTE_CACHE_LINE_SIZE,
+                               socket_id);
+    if (config == NULL) {
+        RTE_LOG(EMERG, APP, "app_config_clone malloc failed\n");
+        return NULL;
+    }
+
+    *config = *origin;
+    config->origin = origin;
+    config->local_addrs = NULL;
+    config->nat_tables[NAT_DIR_OUT] = NULL;
+    config->nat_tables[NAT_DIR_IN] = NULL;
+    config->program = NULL;
+
+    if (app_config_build(config, socket_id) < 0) {
+        app_config_free(config);
+        return NULL;
+    }
     return config;
 }
 
@@ -160,56 +275,459 @@ support_per_queue_statistics(uint8_t port)
         !!strcmp(dev_info.driver_name, "net_e1000_igb");
 }
 
+/*
+ * Configurations replaced by a reload, or NAT tables replaced by
+ * app_config_nat_update(), waiting to be freed.
+ */
+struct retired_configs {
+    struct app_config *configs[RTE_MAX_NUMA_NODES];
+    struct nat_table *nat_tables[RTE_MAX_NUMA_NODES][NAT_NB_DIRS];
+    // Quiescent counter of each worker when the configurations were replaced.
+    uint64_t quiescent[RTE_MAX_LCORE];
+    // When the configurations were replaced, in timer cycles.
+    uint64_t retire_cycles;
+    struct retired_configs *next;
+};
+
+// Most recently replaced first. Only accessed by the master core.
+static struct retired_configs *retired_configs;
+
+static struct natasha_reload_stats reload_stats;
+
+static uint64_t
+cycles_to_us(uint64_t cycles)
+{
+    return cycles * US_PER_S / rte_get_timer_hz();
+}
+
+/*
+ * Free the configurations of all sockets, clones before their origin.
+ */
+static void
+app_config_free_all(struct app_config **configs)
+{
+    unsigned int socket_id;
+
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; ++socket_id) {
+        if (configs[socket_id] && configs[socket_id]->origin) {
+            app_config_free(configs[socket_id]);
+            configs[socket_id] = NULL;
+        }
+    }
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; ++socket_id) {
+        app_config_free(configs[socket_id]);
+        configs[socket_id] = NULL;
+    }
+}
+
+/*
+ * Queue old to be freed by app_config_reclaim(). Must be called after the
+ * replacements of its content have been published.
+ */
+static void
+retire(struct retired_configs *old, const struct core *cores)
+{
+    unsigned int core;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        old->quiescent[core] = cores[core].quiescent;
+    }
+    old->retire_cycles = rte_get_timer_cycles();
+    old->next = retired_configs;
+    retired_configs = old;
+    ++reload_stats.pending;
+}
+
 /*
  * Reload the configuration of each worker.
+ *
+ * The configuration file is parsed once, and the NAT lookup table and the
+ * program are built once per NUMA socket used by the workers. Workers of the
+ * same socket share the same read-only configuration, so the memory used and
+ * the time spent to reload don't grow with the number of cores.
+ *
+ * The new configurations are published to all the workers at once, and this
+ * function returns without waiting for the workers: the replaced
+ * configurations are freed later by app_config_reclaim().
  */
 int
 app_config_reload_all(struct core *cores, int argc, char **argv)
 {
     unsigned int core;
-    struct app_config *master_config;
+    unsigned int socket_id;
+    struct app_config *origin = NULL;
+    struct app_config *new_configs[RTE_MAX_NUMA_NODES] = {};
+    struct retired_configs *old;
+    uint64_t start;
+    uint64_t load_us;
+    int has_old = 0;
+
+    start = rte_get_timer_cycles();
+
+    old = rte_zmalloc(NULL, sizeof(*old), 0);
+    if (old == NULL) {
+        RTE_LOG(EMERG, APP, "app_config_reload_all zmalloc failed\n");
+        ++reload_stats.reload_failures;
+        return -1;
+    }
+
+    // Parse the configuration for the socket of the first worker, and clone
+    // it for the other sockets. Workers are only reloaded if the
+    // configuration is valid for all of them.
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        socket_id = rte_lcore_to_socket_id(core);
+
+        if (new_configs[socket_id]) {
+            continue ;
+        }
+
+        if (origin == NULL) {
+            origin = app_config_load(argc, argv, socket_id);
+            new_configs[socket_id] = origin;
+        } else {
+            new_configs[socket_id] = app_config_clone(origin, socket_id);
+        }
 
-    // Ensure configuration is valid
-    master_config = app_config_load(argc, argv, SOCKET_ID_ANY);
-    if (master_config == NULL) {
+        if (new_configs[socket_id] == NULL) {
+            RTE_LOG(EMERG, APP,
+                    "Unable to load configuration for socket %u. This is "
+                    "probably due to a syntax error, but you should check "
+                    "server logs. Workers have not been reloaded.\n",
+                    socket_id);
+            app_config_free_all(new_configs);
+            rte_free(old);
+            ++reload_stats.reload_failures;
+            return -1;
+        }
+    }
+
+    // TX queues set up with DEV_TX_OFFLOAD_MBUF_FAST_FREE can't send the
+    // packets NAPT hands off between sockets. See core.c/can_fast_free().
+    if (tx_fast_free && origin->napt.nb_addresses && workers_span_sockets()) {
         RTE_LOG(EMERG, APP,
-                "Unable to load configuration. This is probably due to a syntax"
-                " error, but you should check server logs."
-                "Workers have not been reloaded.\n");
+                "\"napt pool\" can't be enabled without restarting, TX mbuf "
+                "fast free is enabled. Workers have not been reloaded.\n");
+        app_config_free_all(new_configs);
+        rte_free(old);
+        ++reload_stats.reload_failures;
         return -1;
     }
 
-    // Reload workers
+    // Publish the new configurations to every worker
     RTE_LCORE_FOREACH_SLAVE(core) {
-        unsigned int socket_id;
-        struct app_config *old_config;
-        struct app_config *new_config;
-
         socket_id = rte_lcore_to_socket_id(core);
 
-        if ((new_config = app_config_load(argc, argv, socket_id)) == NULL) {
-            RTE_LOG(EMERG, APP,
-                    "Core %i: unable to load configuration on lcore\n", core);
-            app_config_free(master_config);
+        if (cores[core].app_config) {
+            old->configs[socket_id] = cores[core].app_config;
+            has_old = 1;
+        }
+        cores[core].app_config = new_configs[socket_id];
+    }
+
+    // The new configurations must be visible to the workers before the
+    // quiescent counters are read: see app_config_reclaim().
+    rte_smp_mb();
+
+    slowpath_set_rates(origin->slowpath_rates);
+
+    load_us = cycles_to_us(rte_get_timer_cycles() - start);
+    ++reload_stats.reloads;
+    reload_stats.last_load_us = load_us;
+    reload_stats.max_load_us = RTE_MAX(reload_stats.max_load_us, load_us);
+
+    // At application startup, there is no configuration to free.
+    if (has_old) {
+        retire(old, cores);
+    } else {
+        rte_free(old);
+    }
+
+    RTE_LOG(INFO, APP, "%i NAT rules reloaded in %" PRIu64 " us\n",
+            origin ? nat_number_of_rules(origin->nat_tables[NAT_DIR_OUT]) : 0,
+            load_us);
+    return 0;
+}
+
+/*
+ * NAT tables of the first worker, NULL if there are none.
+ */
+static struct nat_table *const *
+app_config_nat_tables(const struct core *cores)
+{
+    unsigned int core;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        if (cores[core].app_config) {
+            return cores[core].app_config->nat_tables;
+        }
+        break ;
+    }
+    return NULL;
+}
+
+/*
+ * Whether every worker went through a quiescent state since the
+ * configurations of old have been replaced.
+ *
+ * A worker increments its counter at the top of its main loop, after having
+ * switched to the last published configuration. The first increment after the
+ * counters have been read happens after the new configurations were
+ * published, so the loop following the second increment started with the new
+ * configuration and nothing of the previous iterations is kept. Workers which
+ * are not running do not reference any configuration.
+ */
+static int
+retired_configs_quiescent(const struct retired_configs *old,
+                          const struct core *cores)
+{
+    unsigned int core;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        if (rte_eal_get_lcore_state(core) != RUNNING) {
+            continue ;
+        }
+        if (cores[core].quiescent - old->quiescent[core] < 2) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Free the replaced configurations no longer referenced by the workers. Called
+ * periodically by the master core. Return the number of replaced
+ * configurations still waiting to be freed.
+ */
+int
+app_config_reclaim(struct core *cores)
+{
+    struct nat_table *const *tables;
+    struct retired_configs **prev;
+    struct retired_configs *old;
+    unsigned int socket_id;
+    uint64_t grace_us;
+    enum nat_dir dir;
+    int freed = 0;
+
+    prev = &retired_configs;
+    while ((old = *prev) != NULL) {
+        if (!retired_configs_quiescent(old, cores)) {
+            prev = &old->next;
+            continue ;
+        }
+
+        grace_us = cycles_to_us(rte_get_timer_cycles() - old->retire_cycles);
+        reload_stats.last_grace_us = grace_us;
+        reload_stats.max_grace_us = RTE_MAX(reload_stats.max_grace_us,
+                                            grace_us);
+        --reload_stats.pending;
+
+        *prev = old->next;
+        for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; ++socket_id) {
+            for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+                nat_table_counters_archive(old->nat_tables[socket_id][dir]);
+                nat_table_free(old->nat_tables[socket_id][dir]);
+                if (old->configs[socket_id]) {
+                    nat_table_counters_archive(
+                        old->configs[socket_id]->nat_tables[dir]);
+                }
+            }
+        }
+        app_config_free_all(old->configs);
+        rte_free(old);
+        freed = 1;
+    }
+
+    // Archived counters of removed rules are no longer needed
+    if (freed) {
+        tables = app_config_nat_tables(cores);
+        nat_table_counters_prune(tables, tables ? NAT_NB_DIRS : 0);
+    }
+    return reload_stats.pending;
+}
+
+/*
+ * Apply updates to the NAT tables of each worker, without reloading the
+ * configuration. See nat_table.c/nat_table_update().
+ *
+ * Tables are updated in place while workers keep looking them up. A table
+ * without room for the updates is replaced by a bigger copy, and freed by
+ * app_config_reclaim() once the workers no longer reference it.
+ *
+ * Updates are lost on the next reload: the configuration file should be
+ * updated too.
+ *
+ * @return
+ *  - -1 if no update was applied.
+ *  - NATASHA_REPLY_PARTIAL if the tables of a socket can't be updated: updates
+ *    may have been applied to some tables, in place or on other sockets.
+ */
+int
+app_config_nat_update(struct core *cores, const struct nat_update *updates,
+                      unsigned int nb_updates)
+{
+    struct app_config *configs[RTE_MAX_NUMA_NODES] = {};
+    struct nat_table *tables[NAT_NB_DIRS];
+    struct retired_configs *old;
+    unsigned int socket_id;
+    enum nat_dir dir;
+    unsigned int core;
+    unsigned int i;
+    int has_old = 0;
+
+    // 0.0.0.0 marks empty entries in NAT tables
+    for (i = 0; i < nb_updates; ++i) {
+        if (updates[i].rule.int_ip == 0 || updates[i].rule.ext_ip == 0) {
+            RTE_LOG(ERR, APP, "Invalid NAT update " IPv4_FMT " -> " IPv4_FMT
+                    "\n", IPv4_FMTARGS(updates[i].rule.int_ip),
+                    IPv4_FMTARGS(updates[i].rule.ext_ip));
             return -1;
         }
+    }
+
+    old = rte_zmalloc(NULL, sizeof(*old), 0);
+    if (old == NULL) {
+        RTE_LOG(EMERG, APP, "app_config_nat_update zmalloc failed\n");
+        return -1;
+    }
 
-        // Switch to the new configuration
-        old_config = cores[core].app_config;
-        cores[core].app_config = new_config;
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        socket_id = rte_lcore_to_socket_id(core);
+        configs[socket_id] = cores[core].app_config;
+    }
 
-        // If there's an old config (ie. we're in the context of a reload, and
-        // not at application startup), wait until the new configuration is
-        // used and free the old config.
-        if (old_config) {
-            while (!(new_config->flags & NAT_FLAG_USED))
-                continue;
-            app_config_free(old_config);
+    for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; ++socket_id) {
+        struct app_config *config = configs[socket_id];
+
+        if (config == NULL) {
+            continue ;
         }
+
+        tables[NAT_DIR_OUT] = config->nat_tables[NAT_DIR_OUT];
+        tables[NAT_DIR_IN] = config->nat_tables[NAT_DIR_IN];
+        if (nat_table_update(tables, config->nat_table_type,
+                             config->nat_prefilter, config->nat_counters,
+                             updates, nb_updates, socket_id) < 0) {
+            RTE_LOG(ERR, APP, "Unable to update the NAT tables of socket "
+                    "%u, updates may have been applied in part\n",
+                    socket_id);
+            // Updates applied in place are not reverted: outcomes cached
+            // by workers might be no longer valid.
+            rte_smp_wmb();
+            config->nat_version++;
+            break ;
+        }
+
+        for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+            if (tables[dir] == config->nat_tables[dir]) {
+                continue ;
+            }
+            old->nat_tables[socket_id][dir] = config->nat_tables[dir];
+            has_old = 1;
+
+            // The new table must be complete before workers see it
+            rte_smp_wmb();
+            config->nat_tables[dir] = tables[dir];
+        }
+
+        // Outcomes cached by workers are no longer valid
+        rte_smp_wmb();
+        config->nat_version++;
+    }
+
+    // The new tables must be visible to the workers before the quiescent
+    // counters are read: see app_config_reclaim().
+    rte_smp_mb();
+
+    if (has_old) {
+        retire(old, cores);
+    } else {
+        rte_free(old);
+    }
+
+    if (socket_id < RTE_MAX_NUMA_NODES) {
+        return NATASHA_REPLY_PARTIAL;
     }
 
-    RTE_LOG(INFO, APP, "%i NAT rules reloaded\n",
-            nat_number_of_rules(master_config->nat_lookup));
-    app_config_free(master_config);
+    RTE_LOG(INFO, APP, "%u NAT updates applied\n", nb_updates);
     return 0;
 }
+
+void
+app_config_reload_stats(struct natasha_reload_stats *stats)
+{
+    *stats = reload_stats;
+}
+
+/*
+ * Call func with the counters of each entry of the NAT tables, summed over all
+ * the workers. See nat_table.c/nat_table_counters_read().
+ *
+ * The counters of the tables replaced but not freed yet are included, so the
+ * counters of an entry never go backwards across a reload.
+ *
+ * @return
+ *  - -1 if counters are disabled, or on failure.
+ */
+int
+app_config_nat_counters(struct core *cores,
+                        void (*func)(uint32_t from, uint32_t to,
+                                     const struct nat_counter *counter,
+                                     void *arg),
+                        void *arg)
+{
+    const struct retired_configs *old;
+    struct nat_table **tables;
+    struct nat_table *table;
+    unsigned int nb_tables;
+    unsigned int socket_id;
+    unsigned int core;
+    enum nat_dir dir;
+    unsigned int i;
+    size_t n;
+    int ret = 0;
+
+    n = RTE_MAX_LCORE;
+    for (old = retired_configs; old; old = old->next) {
+        n += RTE_MAX_NUMA_NODES * 2;
+    }
+    tables = malloc(n * sizeof(*tables));
+    if (tables == NULL) {
+        return -1;
+    }
+
+    // The entries of each direction are only looked up in the tables of the
+    // same direction.
+    for (dir = 0; dir < NAT_NB_DIRS && ret == 0; ++dir) {
+        // Tables used by the workers first, each once
+        nb_tables = 0;
+        RTE_LCORE_FOREACH_SLAVE(core) {
+            if (cores[core].app_config == NULL ||
+                (table = cores[core].app_config->nat_tables[dir]) == NULL) {
+                continue ;
+            }
+            for (i = 0; i < nb_tables && tables[i] != table; ++i)
+                ;
+            if (i == nb_tables) {
+                tables[nb_tables++] = table;
+            }
+        }
+
+        for (old = retired_configs; old; old = old->next) {
+            for (socket_id = 0; socket_id < RTE_MAX_NUMA_NODES; ++socket_id) {
+                if (old->nat_tables[socket_id][dir]) {
+                    tables[nb_tables++] = old->nat_tables[socket_id][dir];
+                }
+                if (old->configs[socket_id] &&
+                    old->configs[socket_id]->nat_tables[dir]) {
+                    tables[nb_tables++] =
+                        old->configs[socket_id]->nat_tables[dir];
+                }
+            }
+        }
+
+        ret = nat_table_counters_read(tables, nb_tables, func, arg);
+    }
+    free(tables);
+    return ret;
+}
@@ -11,6 +11,7 @@
 #include <rte_errno.h>
 #include <rte_ethdev.h>
 #include <rte_log.h>
+#include <rte_malloc.h>
 #include <rte_mempool.h>
 #include <rte_memzone.h>
 #include <rte_prefetch.h>
@@ -20,96 +21,143 @@
 #endif
 
 #include "natasha.h"
+#include "actions.h"
+#include "flow_cache.h"
+#include "napt.h"
+#include "network_headers.h"
 
 /* check DPDK version */
 #if RTE_VER_YEAR != 18 || RTE_VER_MONTH != 02
 #error The DPDK version you are using is not supported, please use DPDK v18.02
 #endif
 
+int tx_fast_free;
+
+/*
+ * Read packets on port, split them by type and hand each vector to its
+ * handler.
+ *
+ * The burst is processed in three passes, so the memory accesses of a pass
+ * are done in parallel for all the packets instead of one packet after the
+ * other:
+ *
+ * 1. prefetch the packets headers,
+ * 2. parse the headers (see network_headers.h/pkt_parse()), drop packets
+ *    with a bad IPv4 checksum, and split the others in a vector of IPv4
+ *    packets, whose NAT table entries are prefetched, and a vector of ARP
+ *    packets,
+ * 3. process each vector with its handler, which loops over packets of the
+ *    same type: the branches of a handler are predicted from the previous
+ *    packet, and its code stays in the instruction cache for the whole
+ *    vector.
+ *
+ * The first two passes are software pipelined: the header of a packet is
+ * prefetched PREFETCH_OFFSET packets before its addresses are read.
+ *
+ * Drops are counted once per burst, and dropped packets are returned to the
+ * mempool all at once at the end.
+ */
+#define PREFETCH_OFFSET 8
 static int
-dispatch_packet(struct rte_mbuf *pkt, uint8_t port, struct core *core)
+handle_port(uint8_t port, struct core *core)
 {
-    struct ether_hdr *eth_hdr;
-    uint16_t eth_type;
-    int status;
-
-    /* Drop only bad l3 checksumed packet earlier in the stack */
-    if (unlikely((pkt->ol_flags & PKT_RX_IP_CKSUM_MASK) ==
-                 PKT_RX_IP_CKSUM_BAD)) {
-        core->stats->drop_bad_l3_cksum++;
-        rte_pktmbuf_free(pkt);
-        return -1;
-    }
-    if (unlikely((pkt->ol_flags & PKT_RX_L4_CKSUM_MASK) == PKT_RX_L4_CKSUM_BAD))
-        core->stats->rx_bad_l4_cksum++;
-
-    eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
-    eth_type = eth_hdr->ether_type;
-
-    status = -1;
+    struct rte_mbuf *pkts[MAX_RX_BURST];
+    struct rte_mbuf *ipv4_pkts[MAX_RX_BURST];
+    struct rte_mbuf *arp_pkts[MAX_RX_BURST];
+    int ptypes = core->rx_queues[port].ptypes;
+    struct rte_mbuf *pkt;
+    uint16_t nb_ipv4 = 0;
+    uint16_t nb_arp = 0;
+    uint16_t bad_l3_cksum = 0;
+    uint16_t bad_l4_cksum = 0;
+    uint16_t unhandled = 0;
+    uint16_t i;
+    uint16_t nb_pkts;
 
-    // We could convert eth_type to host byte order with
-    //
-    //      eth_type = rte_be_to_cpu_16(eth_type)
-    //
-    // and compare against little endian numbers, but the swap instruction is a
-    // bottleneck: comparing eth_type against big endian numbers improves
-    // performances a lot (+100 000 pps).
-    //
-    // We can't call rte_cpu_to_be_16() in a switch/case (compiler raises "case
-    // label does not reduce to an integer constant"), hence the define.
-    #if RTE_BYTE_ORDER == RTE_LITTLE_ENDIAN
-    #define _htons(x) ((((x) & 0x00ffU) << 8) | (((x) & 0xff00U) >> 8))
-    #else
-    #define _htons(x) (x)
-    #endif
+    nb_pkts = rte_eth_rx_burst(port, core->rx_queues[port].id,
+                               pkts, core->rx_queues[port].burst);
 
-    switch (eth_type) {
-    case _htons(ETHER_TYPE_IPv4):
-        status = ipv4_handle(pkt, port, core);
-        break ;
+    if (unlikely(nb_pkts == 0)) {
+        return 0;
+    }
+    core->stats->rx_packets += nb_pkts;
 
-    case _htons(ETHER_TYPE_ARP):
-        status = arp_handle(pkt, port, core);
-        break ;
+    for (i = 0; i < PREFETCH_OFFSET && i < nb_pkts; ++i) {
+        rte_prefetch0(rte_pktmbuf_mtod(pkts[i], void *));
+    }
 
-    case _htons(ETHER_TYPE_IPv6):
-    default:
-        RTE_LOG(DEBUG, APP, "Unhandled proto %x on port %d\n", eth_type, port);
-        break ;
+    for (i = 0; i < nb_pkts; ++i) {
+        if (i + PREFETCH_OFFSET < nb_pkts) {
+            rte_prefetch0(rte_pktmbuf_mtod(pkts[i + PREFETCH_OFFSET], void *));
+        }
+        pkt = pkts[i];
+
+        /* Drop only bad l3 checksumed packet earlier in the stack */
+        if (unlikely((pkt->ol_flags & PKT_RX_IP_CKSUM_MASK) ==
+                     PKT_RX_IP_CKSUM_BAD)) {
+            bad_l3_cksum++;
+            pkt_free(pkt, core);
+            continue ;
+        }
+        bad_l4_cksum += (pkt->ol_flags & PKT_RX_L4_CKSUM_MASK) ==
+                        PKT_RX_L4_CKSUM_BAD;
+
+        pkt_parse(pkt, ptypes);
+
+        if (likely(RTE_ETH_IS_IPV4_HDR(pkt->packet_type))) {
+            action_nat_prefetch(pkt, core);
+            ipv4_pkts[nb_ipv4++] = pkt;
+        } else if ((pkt->packet_type & RTE_PTYPE_L2_MASK) ==
+                   RTE_PTYPE_L2_ETHER_ARP) {
+            arp_pkts[nb_arp++] = pkt;
+        } else {
+            // IPv6, other ethertypes, and IPv4 packets with an invalid header
+            RTE_LOG(DEBUG, APP, "Unhandled proto %x on port %d\n",
+                    rte_be_to_cpu_16(eth_header(pkt)->ether_type), port);
+            unhandled++;
+            pkt_free(pkt, core);
+        }
     }
 
-    if (status < 0) {
-        core->stats->drop_unhandled_ethertype++;
-        rte_pktmbuf_free(pkt);
+    if (nb_ipv4) {
+        unhandled += ipv4_handle_burst(ipv4_pkts, nb_ipv4, core);
+    }
+    if (nb_arp) {
+        unhandled += arp_handle_burst(arp_pkts, nb_arp, core);
     }
 
-    return 0;
+    if (unlikely(bad_l3_cksum | bad_l4_cksum | unhandled)) {
+        core->stats->drop_bad_l3_cksum += bad_l3_cksum;
+        core->stats->rx_bad_l4_cksum += bad_l4_cksum;
+        core->stats->drop_unhandled_ethertype += unhandled;
+    }
+    pkt_free_flush(core);
+    return nb_pkts;
 }
+#undef PREFETCH_OFFSET
 
 /*
- * Read packets on port and call dispatch_packet for each of them.
+ * Whether the main loop flushes queue now, with "tx hold <microseconds>;".
+ *
+ * A flush writes the doorbell register of the NIC: at moderate load, the
+ * packets received during one iteration of the main loop are too few to fill
+ * a TX burst. While traffic is received, the packets of a queue that isn't
+ * full wait for more packets, at most hold cycles after the main loop first
+ * found them. tx_send() flushes the queue once full, and the main loop
+ * flushes it right away when it received nothing: no packet would join the
+ * burst, so waiting would only add latency.
  */
-static int
-handle_port(uint8_t port, struct core *core)
+static inline int
+tx_hold_expired(struct tx_queue *queue, uint64_t now, uint64_t hold)
 {
-    struct rte_mbuf *pkts[32];
-    uint16_t i;
-    uint16_t nb_pkts;
-
-    nb_pkts = rte_eth_rx_burst(port, core->rx_queues[port].id,
-                               pkts, sizeof(pkts) / sizeof(*pkts));
-
-    if (unlikely(nb_pkts == 0)) {
-        return 0;
+    if (queue->len == 0 || queue->retry_len) {
+        return 1;
     }
-
-    for (i = 0; i < nb_pkts - 1; ++i) {
-        rte_prefetch0(rte_pktmbuf_mtod(pkts[i + 1], void *));
-        dispatch_packet(pkts[i], port, core);
+    if (queue->hold_start == 0) {
+        queue->hold_start = now;
+        return 0;
     }
-    dispatch_packet(pkts[i], port, core);
-    return i;
+    return now - queue->hold_start >= hold;
 }
 
 /*
@@ -121,26 +169,66 @@ main_loop(void *pcore)
     uint8_t port;
     uint8_t eth_dev_count;
     struct core *core = pcore;
+    struct app_config *config;
+    struct rte_mbuf *pkts[MAX_RX_BURST];
+    unsigned int nb_pkts;
+    unsigned int nb_rx;
+    uint64_t tx_hold = 0;
+    uint64_t now;
 
     eth_dev_count = rte_eth_dev_count();
 
     while (!force_quit) {
         // At any time, config.c/app_config_reload_all() can update
-        // core->app_config to load a new configuration. The reload function
-        // needs to free the old configuration, and for that it waits us to
-        // mark the new configuration as used, which implies we no longer
-        // reference the old config.
-        core->app_config->flags |= NAT_FLAG_USED;
+        // core->app_config to load a new configuration, and
+        // config.c/app_config_nat_update() can update its NAT table. Cached
+        // outcomes reference the previous configuration and are flushed.
+        //
+        // The configuration is shared with the other cores of the NUMA
+        // socket: the acknowledgement is stored in our own core structure to
+        // avoid writing to the shared cache lines.
+        config = core->app_config;
+        if (unlikely(core->app_config_used != config ||
+                     core->nat_version != config->nat_version)) {
+            flow_cache_reset(core, config->flow_cache_size);
+            napt_reset(core, &config->napt);
+            core->app_config_used = config;
+            core->nat_version = config->nat_version;
+            tx_hold = (uint64_t)config->tx_hold_us * rte_get_tsc_hz() /
+                      1000000;
+        }
+
+        // Quiescent state: we no longer reference configurations replaced
+        // before the check above. config.c/app_config_reclaim() frees them
+        // once every worker went through a quiescent state.
+        core->quiescent++;
 
+        nb_rx = 0;
         for (port = 0; port < eth_dev_count; ++port) {
             // Read and process incoming packets.
-            handle_port(port, core);
+            nb_rx += handle_port(port, core);
         }
 
+        // Process packets handed off by the other workers, see napt.h.
+        // They were parsed and checked by the worker which received them.
+        nb_pkts = napt_poll(core, pkts, MAX_RX_BURST);
+        if (nb_pkts) {
+            core->stats->drop_unhandled_ethertype +=
+                ipv4_handle_burst(pkts, nb_pkts, core);
+        }
+        nb_rx += nb_pkts;
+
+        now = (tx_hold && nb_rx) ? rte_rdtsc() : 0;
         for (port = 0; port < eth_dev_count; ++port) {
             // Write out packets.
-            tx_flush(port, &core->tx_queues[port], core->stats);
+            if (now == 0 ||
+                tx_hold_expired(&core->tx_queues[port], now, tx_hold)) {
+                tx_flush(port, core);
+            }
         }
+
+        // Dropped handed off packets, and packets not sent.
+        pkt_free_flush(core);
     }
     return 0;
 }
@@ -235,19 +323,188 @@ set_rx_chksum_offload(uint8_t port_id, struct rte_eth_dev_info *dev_info,
 
     return 0;
 }
+
+/*
+ * Whether the workers run on several NUMA sockets, and thus use several
+ * mempools.
+ */
+int
+workers_span_sockets(void)
+{
+    unsigned int core;
+    int socket = -1;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        if (socket >= 0 && (int)rte_lcore_to_socket_id(core) != socket) {
+            return 1;
+        }
+        socket = rte_lcore_to_socket_id(core);
+    }
+    return 0;
+}
+
+/*
+ * Whether the TX queues of port can free mbufs with
+ * DEV_TX_OFFLOAD_MBUF_FAST_FREE: the mbufs sent by a worker must all come from
+ * the mempool of its socket, and have a reference count of 1. Mbufs are never
+ * cloned, but packets handed off by "nat napt;" can come from the mempool of
+ * a worker of another socket, so the offload is disabled if NAPT is
+ * configured with workers on several sockets.
+ */
+static int
+can_fast_free(uint8_t port, const struct rte_eth_dev_info *dev_info,
+              const struct app_config *app_config)
+{
+    if ((dev_info->tx_offload_capa & DEV_TX_OFFLOAD_MBUF_FAST_FREE) == 0) {
+        RTE_LOG(INFO, APP, "Port %i doesn't support TX mbuf fast free\n",
+                port);
+        return 0;
+    }
+    if (app_config->napt.nb_addresses && workers_span_sockets()) {
+        RTE_LOG(INFO, APP, "Port %i: TX mbuf fast free disabled, NAPT hands "
+                "packets off between sockets\n", port);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Whether the RX queues of port set the packet types used by
+ * network_headers.h/pkt_parse(): IPv4 without options, and TCP, UDP or
+ * fragment. A NIC which only reports some of them would leave fragments
+ * typed as TCP or UDP, so the headers are then parsed in software.
+ */
+static int
+rx_ptypes_supported(uint8_t port)
+{
+    uint32_t ptypes[64];
+    int has_ipv4 = 0;
+    int has_tcp = 0;
+    int has_udp = 0;
+    int has_frag = 0;
+    int n;
+    int i;
+
+    n = rte_eth_dev_get_supported_ptypes(port,
+                                         RTE_PTYPE_L3_MASK | RTE_PTYPE_L4_MASK,
+                                         ptypes, RTE_DIM(ptypes));
+    for (i = 0; i < n && i < (int)RTE_DIM(ptypes); ++i) {
+        has_ipv4 |= ptypes[i] == RTE_PTYPE_L3_IPV4;
+        has_tcp |= ptypes[i] == RTE_PTYPE_L4_TCP;
+        has_udp |= ptypes[i] == RTE_PTYPE_L4_UDP;
+        has_frag |= ptypes[i] == RTE_PTYPE_L4_FRAG;
+    }
+    if (!(has_ipv4 && has_tcp && has_udp && has_frag)) {
+        RTE_LOG(INFO, APP, "Port %i: packet types not reported by the NIC, "
+                "headers parsed in software\n", port);
+        return 0;
+    }
+    RTE_LOG(INFO, APP, "Port %i: using the packet types of the NIC\n", port);
+    return 1;
+}
+
+// Mbufs cached by each worker, see docs/DPDK_INITIALIZATION.md.
+#define MBUF_CACHE_SIZE 512
+
+/*
+ * Create the mempool of each NUMA socket running workers, shared by the
+ * queues of all its workers and ports, and log its hugepage footprint.
+ *
+ * It holds the mbufs of the RX and TX rings, of the bursts and of the TX
+ * retry buffers of its workers, of their NAPT handoff and slow path rings, and
+ * of the mempool caches. Replies of the slow path reuse the mbufs of the
+ * requests, and can fill the TX rings and retry buffers of the slow path with
+ * mbufs of any socket. Its mbufs fit the largest MTU of the ports.
+ */
+static int
+setup_mempools(const struct app_config *app_config, struct core *cores)
+{
+    struct rte_mempool *mempools[RTE_MAX_NUMA_NODES] = {};
+    uint32_t nb_mbufs[RTE_MAX_NUMA_NODES] = {};
+    char name[RTE_MEMZONE_NAMESIZE];
+    const struct port_config *port_config;
+    uint8_t eth_dev_count = rte_eth_dev_count();
+    uint32_t per_worker = 0;
+    uint32_t slowpath = 0;
+    uint32_t data_room;
+    uint32_t obj_size;
+    unsigned int socket;
+    unsigned int core;
+    uint16_t max_mtu = 0;
+    uint8_t port;
+
+    for (port = 0; port < eth_dev_count; ++port) {
+        port_config = &app_config->ports[port];
+        per_worker += port_config->rx_ring_size + port_config->tx_ring_size +
+                      port_config->rx_burst + MAX_TX_BURST + TX_RETRY_SIZE;
+        slowpath += port_config->tx_ring_size + MAX_TX_BURST + TX_RETRY_SIZE;
+        max_mtu = RTE_MAX(max_mtu, port_config->mtu);
+    }
+    // A mempool cache holds up to 1.5 times its size
+    per_worker += MAX_RX_BURST + MAX_FREE_BURST + NAPT_HANDOFF_RING_SIZE +
+                  SLOWPATH_RING_SIZE + MBUF_CACHE_SIZE * 3 / 2;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        socket = rte_lcore_to_socket_id(core);
+        if (nb_mbufs[socket] == 0) {
+            nb_mbufs[socket] = slowpath;
+        }
+        nb_mbufs[socket] += per_worker;
+    }
+
+    data_room = RTE_MAX((uint32_t)max_mtu, (uint32_t)RTE_MBUF_DEFAULT_DATAROOM) +
+                RTE_PKTMBUF_HEADROOM;
+    obj_size = rte_mempool_calc_obj_size(sizeof(struct rte_mbuf) + data_room,
+                                         0, NULL);
+
+    for (socket = 0; socket < RTE_MAX_NUMA_NODES; ++socket) {
+        if (nb_mbufs[socket] == 0) {
+            continue ;
+        }
+        // The mempool is optimal with 2^n - 1 elements
+        nb_mbufs[socket] = rte_align32pow2(nb_mbufs[socket]) - 1;
+
+        snprintf(name, sizeof(name), "mbufs:%u", socket);
+        mempools[socket] = rte_pktmbuf_pool_create(
+            name,
+            nb_mbufs[socket],               // nb elements
+            MBUF_CACHE_SIZE,                // cache size
+            0,                              // priv size
+            data_room,                      // data room size
+            socket                          // socket id
+        );
+        if (mempools[socket] == NULL) {
+            RTE_LOG(ERR, APP, "Socket %u: unable to create mempool: %s\n",
+                    socket, rte_strerror(rte_errno));
+            return -1;
+        }
+        RTE_LOG(INFO, APP,
+                "Socket %u: mempool of %u mbufs of %u bytes, %" PRIu64
+                " MB of hugepages\n",
+                socket, nb_mbufs[socket], data_room,
+                ((uint64_t)nb_mbufs[socket] * obj_size) >> 20);
+    }
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        cores[core].mempool = mempools[rte_lcore_to_socket_id(core)];
+    }
+    return 0;
+}
+
 static int
-setup_queues(uint8_t port, struct core *cores, unsigned int ncores,
-             int enable_vlan_offload)
+setup_queues(uint8_t port, const struct port_config *port_config,
+             struct core *cores, unsigned int ncores, int enable_vlan_offload,
+             int fast_free)
 {
-    char mempool_name[RTE_MEMZONE_NAMESIZE];
-    static const int rx_ring_size = 256;
-    static const int tx_ring_size = 512;
+    uint16_t rx_ring_size = port_config->rx_ring_size;
+    uint16_t tx_ring_size = port_config->tx_ring_size;
     struct rte_eth_dev_info dev_info;
     struct rte_eth_txconf txq_conf;
+    struct rte_eth_txconf slowpath_txq_conf;
     struct rte_eth_rxconf rxq_conf;
-    struct rte_mempool *mempool;
     int per_queue_stats_enabled;
     uint16_t queue_id = 0;
+    int ptypes;
     int rx_stats_idx;
     int tx_stats_idx;
     uint32_t core;
@@ -256,13 +513,36 @@ setup_queues(uint8_t port, struct core *cores, unsigned int ncores,
 
     rte_eth_dev_info_get(port, &dev_info);
     per_queue_stats_enabled = support_per_queue_statistics(port);
+    ptypes = rx_ptypes_supported(port);
+    txq_conf = dev_info.default_txconf;
+    rxq_conf = dev_info.default_rxconf;
     if (enable_vlan_offload && set_vlan_offload(port, &dev_info, &txq_conf,
                                                 &rxq_conf))
         return -1;
+    // The slow path sends the requests of every worker
+    slowpath_txq_conf = txq_conf;
+    if (fast_free) {
+        // Both flags are converted to DEV_TX_OFFLOAD_MBUF_FAST_FREE by
+        // drivers still using txq_flags.
+        txq_conf.txq_flags |= ETH_TXQ_FLAGS_NOREFCOUNT |
+                              ETH_TXQ_FLAGS_NOMULTMEMP;
+        txq_conf.offloads |= DEV_TX_OFFLOAD_MBUF_FAST_FREE;
+    }
     if (set_rx_chksum_offload(port, &dev_info, &rxq_conf))
         RTE_LOG(INFO, APP,
                 "Rx checksum offloads not enabled on port %" PRIu8 ",\n", port);
 
+    // Round the ring sizes to the limits of the driver
+    ret = rte_eth_dev_adjust_nb_rx_tx_desc(port, &rx_ring_size, &tx_ring_size);
+    if (ret < 0) {
+        RTE_LOG(ERR, APP, "Port %i: invalid ring sizes: %s\n",
+                port, rte_strerror(-ret));
+        return -1;
+    }
+    RTE_LOG(INFO, APP, "Port %i: RX ring %u, TX ring %u descriptors, "
+            "bursts of %u packets\n",
+            port, rx_ring_size, tx_ring_size, port_config->rx_burst);
+
     RTE_LCORE_FOREACH_SLAVE(core) {
         rx_stats_idx = queue_id;
         tx_stats_idx = queue_id + ncores - 1;
@@ -270,25 +550,10 @@ setup_queues(uint8_t port, struct core *cores, unsigned int ncores,
         // NUMA socket of this processor
         socket = rte_lcore_to_socket_id(core);
 
-        snprintf(mempool_name, sizeof(mempool_name), "%u:%u", port, queue_id);
-
-        mempool = rte_pktmbuf_pool_create(
-            mempool_name,
-            8192,                           // nb elements
-            512,                            // cache size
-            0,                              // priv size
-            9216 + RTE_PKTMBUF_HEADROOM,    // data room size
-            socket                          // socket id
-        );
-        if (!mempool) {
-            RTE_LOG(ERR, APP, "Port %i: unable to create mempool: %s\n",
-                    port, rte_strerror(rte_errno));
-            return -1;
-        }
-
-        // RX queue
+        // RX queue, filled with mbufs of the mempool of the socket. See
+        // setup_mempools().
         ret = rte_eth_rx_queue_setup(port, queue_id, rx_ring_size, socket,
-                                     &rxq_conf, mempool);
+                                     &rxq_conf, cores[core].mempool);
         if (ret < 0) {
             RTE_LOG(ERR, APP,
                     "Port %i: failed to setup RX queue %i on core %i: %s\n",
@@ -335,11 +600,34 @@ setup_queues(uint8_t port, struct core *cores, unsigned int ncores,
                 port, queue_id, core, socket);
 
         cores[core].rx_queues[port].id = queue_id;
+        cores[core].rx_queues[port].burst = port_config->rx_burst;
+        cores[core].rx_queues[port].ptypes = ptypes;
         cores[core].tx_queues[port].id = queue_id;
+        cores[core].tx_queues[port].retry = rte_zmalloc_socket(
+            "tx_retry", TX_RETRY_SIZE * sizeof(struct rte_mbuf *),
+            RTE_CACHE_LINE_SIZE, socket);
+        if (cores[core].tx_queues[port].retry == NULL) {
+            RTE_LOG(ERR, APP,
+                    "Port %i: unable to allocate the TX retry buffer of "
+                    "core %i\n", port, core);
+            return -1;
+        }
 
         ++queue_id;
     }
-    return 0;
+
+    // TX queue of the slow path thread, running on the master core. See
+    // slowpath.c.
+    socket = rte_lcore_to_socket_id(rte_get_master_lcore());
+    ret = rte_eth_tx_queue_setup(port, queue_id, tx_ring_size, socket,
+                                 &slowpath_txq_conf);
+    if (ret < 0) {
+        RTE_LOG(ERR, APP,
+                "Port %i: failed to setup TX queue %i of the slow path: %s\n",
+                port, queue_id, rte_strerror(rte_errno));
+        return ret;
+    }
+    return slowpath_setup_port(port, queue_id, socket);
 }
 
 /*
@@ -355,6 +643,9 @@ setup_queues(uint8_t port, struct core *cores, unsigned int ncores,
  * Core 4: RX Queue 1 (stats idx=1), TX Queue 1 (stats idx=4)
  * Core 5: RX Queue 2 (stats idx=2), TX Queue 2 (stats idx=5)
  *
+ * An extra TX queue, TX Queue 3 in this example, sends the replies of the
+ * slow path thread (see slowpath.c). Its statistics are not collected.
+ *
  * DPDK initialization parameters documentation is available in
  * docs/DPDK_INITIALIZATION.md.
  */
@@ -365,6 +656,9 @@ setup_port(uint8_t port, struct app_config *app_config, struct core *cores)
 
     struct rte_eth_dev_info dev_info;
     int enable_vlan_offload = 0;
+    int rss_symmetric = 0;
+    int fast_free;
+    uint8_t rss_key[RSS_MAX_KEY_SIZE];
     unsigned int ncores;
     uint16_t nqueues;
     struct rte_eth_conf eth_conf = {
@@ -419,10 +713,26 @@ setup_port(uint8_t port, struct app_config *app_config, struct core *cores)
 
     ncores = rte_lcore_count();
 
-    // One RX and one TX queue per core, except for the master core
+    // One RX and one TX queue per core, except for the master core, and the
+    // TX queue of the slow path
     nqueues = ncores - 1;
 
-    ret = rte_eth_dev_configure(port, nqueues, nqueues, &eth_conf);
+    // Both directions of a flow to the same worker, see rss.c
+    if (app_config->rss_symmetric) {
+        rss_symmetric = rss_setup_symmetric(port, &dev_info, &eth_conf,
+                                            rss_key) == 0;
+    }
+
+    ret = rte_eth_dev_configure(port, nqueues, nqueues + 1, &eth_conf);
+    if (ret < 0 && rss_symmetric) {
+        RTE_LOG(WARNING, APP,
+                "Port %i: symmetric RSS key rejected, using the default key\n",
+                port);
+        rss_symmetric = 0;
+        eth_conf.rx_adv_conf.rss_conf.rss_key = NULL;
+        eth_conf.rx_adv_conf.rss_conf.rss_key_len = 0;
+        ret = rte_eth_dev_configure(port, nqueues, nqueues + 1, &eth_conf);
+    }
     if (ret < 0) {
         RTE_LOG(ERR, APP, "Failed to configure ethernet device port %i\n",
                 port);
@@ -446,7 +756,9 @@ setup_port(uint8_t port, struct app_config *app_config, struct core *cores)
     }
 
     // Configure network queues
-    ret = setup_queues(port, cores, ncores, enable_vlan_offload);
+    fast_free = can_fast_free(port, &dev_info, app_config);
+    ret = setup_queues(port, &app_config->ports[port], cores, ncores,
+                       enable_vlan_offload, fast_free);
     if (ret < 0) {
         RTE_LOG(ERR, APP, "Port %i: unable to setup network queues\n", port);
         return ret;
@@ -459,6 +771,11 @@ setup_port(uint8_t port, struct app_config *app_config, struct core *cores)
         return ret;
     }
     RTE_LOG(DEBUG, APP, "Port %i: started!\n", port);
+    tx_fast_free |= fast_free;
+
+    if (rss_check(port, nqueues, rss_symmetric) < 0) {
+        return -1;
+    }
     return 0;
 }
 
@@ -534,6 +851,19 @@ setup_app(struct core *cores, int argc, char **argv)
     RTE_LOG(INFO, APP, "Using %i ethernet devices\n", eth_dev_count);
     RTE_LOG(INFO, APP, "Using %i logical cores\n", ncores);
 
+    // Ports without configuration use the default sizes
+    for (port = 0; port < eth_dev_count; ++port) {
+        if (app_config->ports[port].rx_ring_size == 0) {
+            app_config->ports[port].rx_ring_size = PORT_DEFAULT_RX_RING;
+            app_config->ports[port].tx_ring_size = PORT_DEFAULT_TX_RING;
+            app_config->ports[port].rx_burst = PORT_DEFAULT_RX_BURST;
+        }
+    }
+
+    if (setup_mempools(app_config, cores) < 0) {
+        return -1;
+    }
+
     // Configure ports
     for (port = 0; port < eth_dev_count; ++port) {
         RTE_LOG(INFO, APP, "Configuring port %i...\n", port);
@@ -552,7 +882,11 @@ setup_app(struct core *cores, int argc, char **argv)
     // Initialize workers
     RTE_LCORE_FOREACH_SLAVE(core) {
         cores[core].id = core;
-        memset(&cores[core].app_config, 0, sizeof(cores[core].app_config));
+        cores[core].app_config = NULL;
+        cores[core].app_config_used = NULL;
+        cores[core].nat_version = 0;
+        cores[core].quiescent = 0;
+        cores[core].flow_cache = NULL;
         /* init natasha stats per core */
         cores[core].stats = init_natasha_app_stats();
         if (!cores[core].stats) {
@@ -561,11 +895,23 @@ setup_app(struct core *cores, int argc, char **argv)
         }
     }
 
+    if (napt_init(cores) < 0) {
+        return -1;
+    }
+
+    if (slowpath_init(cores) < 0) {
+        return -1;
+    }
+
     // Load the configuration for each worker
     if (app_config_reload_all(cores, argc, argv) < 0) {
         return -1;
     }
 
+    if (slowpath_start() < 0) {
+        return -1;
+    }
+
     return 0;
 }
 
@@ -583,6 +929,7 @@ natasha_exit()
         else
             RTE_LOG(INFO, APP, "Core %d successfuly stoped.\n", lcore_id);
     }
+    slowpath_stop();
 #ifdef RTE_LIBRTE_PDUMP
         rte_pdump_uninit();
 #endif
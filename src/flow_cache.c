@@ -0,0 +1,214 @@
+/* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+
+#include "actions.h"
+#include "flow_cache.h"
+#include "natasha.h"
+#include "network_headers.h"
+
+/*
+ * The cache is a set-associative table: a flow is hashed to a set of
+ * FLOW_CACHE_WAYS entries, stored in two cache lines.
+ *
+ * Eviction: a new flow replaces an empty entry of its set, or the last entry
+ * if the set is full. On each hit, an entry moves one slot forward. Flows
+ * with many packets stay in the first slots, while flows with a single packet
+ * are evicted first.
+ */
+
+static inline uint32_t
+flow_hash(const struct flow_cache_entry *key)
+{
+    return rte_hash_crc_4byte(key->dst_addr,
+                              rte_hash_crc_4byte(key->src_addr,
+                                                 key->vlan << 8 | key->port));
+}
+
+static inline struct flow_cache_entry *
+flow_cache_set(const struct flow_cache *cache,
+               const struct flow_cache_entry *key)
+{
+    return &cache->entries[(flow_hash(key) & cache->mask) * FLOW_CACHE_WAYS];
+}
+
+void
+flow_cache_free(struct flow_cache *cache)
+{
+    if (cache == NULL) {
+        return ;
+    }
+    rte_free(cache->entries);
+    rte_free(cache);
+}
+
+/*
+ * Empty the cache of core, and resize it to hold nb_entries flows. Called by
+ * the worker when it switches to a new configuration, since cached entries
+ * reference the previous configuration.
+ *
+ * If nb_entries is 0, the cache is disabled.
+ *
+ * @return
+ *  - -1 if memory can't be allocated. The cache is disabled.
+ */
+int
+flow_cache_reset(struct core *core, unsigned int nb_entries)
+{
+    struct flow_cache *cache = core->flow_cache;
+    uint64_t nb_sets;
+
+    // nb_entries is at most FLOW_CACHE_MAX_ENTRIES, see parseconfig.y
+    nb_sets = 1;
+    while (nb_sets * FLOW_CACHE_WAYS < nb_entries) {
+        nb_sets <<= 1;
+    }
+
+    if (cache && nb_entries && (uint64_t)cache->mask + 1 == nb_sets) {
+        memset(cache->entries, 0,
+               nb_sets * FLOW_CACHE_WAYS * sizeof(*cache->entries));
+        cache->recording = 0;
+        return 0;
+    }
+
+    flow_cache_free(cache);
+    core->flow_cache = NULL;
+
+    if (nb_entries == 0) {
+        return 0;
+    }
+
+    cache = rte_zmalloc_socket(NULL, sizeof(*cache), RTE_CACHE_LINE_SIZE,
+                               rte_socket_id());
+    if (cache == NULL) {
+        RTE_LOG(ERR, APP, "Core %i: unable to allocate flow cache\n",
+                core->id);
+        return -1;
+    }
+
+    cache->mask = nb_sets - 1;
+    cache->entries = rte_zmalloc_socket(
+        NULL, nb_sets * FLOW_CACHE_WAYS * sizeof(*cache->entries),
+        RTE_CACHE_LINE_SIZE, rte_socket_id());
+    if (cache->entries == NULL) {
+        RTE_LOG(ERR, APP, "Core %i: unable to allocate flow cache of %u "
+                "entries\n", core->id, nb_entries);
+        rte_free(cache);
+        return -1;
+    }
+
+    core->flow_cache = cache;
+    return 0;
+}
+
+/*
+ * Look up the flow of pkt in the cache of core. On a hit, apply the cached
+ * outcome to pkt. On a miss, start recording the outcome of the rules for
+ * pkt, which is stored by flow_cache_insert().
+ *
+ * @return
+ *  - 0 if pkt has been processed.
+ *  - -1 if the rules need to be processed.
+ */
+int
+flow_cache_process(struct rte_mbuf *pkt, uint8_t port, struct core *core)
+{
+    struct flow_cache *cache = core->flow_cache;
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    const struct nat_table *table;
+    struct flow_cache_entry *set;
+    struct flow_cache_entry *entry;
+    struct flow_cache_entry tmp;
+    int i;
+
+    cache->recording = 0;
+
+    if (unlikely(ipv4_hdr->next_proto_id == IPPROTO_ICMP)) {
+        return -1;
+    }
+
+    cache->record.src_addr = ipv4_hdr->src_addr;
+    cache->record.dst_addr = ipv4_hdr->dst_addr;
+    cache->record.vlan = VLAN_ID(pkt);
+    cache->record.port = port;
+    cache->record.action = FLOW_ACTION_NONE;
+    cache->record.slot = FLOW_CACHE_NO_SLOT;
+
+    set = flow_cache_set(cache, &cache->record);
+    for (i = 0; i < FLOW_CACHE_WAYS; ++i) {
+        if (set[i].action != FLOW_ACTION_NONE &&
+            set[i].src_addr == cache->record.src_addr &&
+            set[i].dst_addr == cache->record.dst_addr &&
+            set[i].vlan == cache->record.vlan &&
+            set[i].port == cache->record.port) {
+            break ;
+        }
+    }
+
+    if (i == FLOW_CACHE_WAYS) {
+        core->stats->flow_cache_miss++;
+        cache->recording = 1;
+        return -1;
+    }
+
+    core->stats->flow_cache_hit++;
+
+    entry = &set[i];
+    if (i > 0) {
+        tmp = set[i - 1];
+        set[i - 1] = set[i];
+        set[i] = tmp;
+        entry = &set[i - 1];
+    }
+
+    if (entry->action == FLOW_ACTION_DROP) {
+        action_drop(pkt, port, core, entry->data);
+        return 0;
+    }
+
+    // The NAT table may have been replaced since the outcome was recorded:
+    // the cache is only flushed at the next iteration of the main loop.
+    if (entry->slot != FLOW_CACHE_NO_SLOT) {
+        table = core->app_config->nat_tables[
+            (entry->slot & FLOW_CACHE_SLOT_IN) ? NAT_DIR_IN : NAT_DIR_OUT];
+        if (table) {
+            nat_table_count(table, core->id,
+                            entry->slot & ~FLOW_CACHE_SLOT_IN,
+                            rte_be_to_cpu_16(ipv4_hdr->total_length));
+        }
+    }
+
+    if (entry->new_src_addr != ipv4_hdr->src_addr) {
+        nat_rewrite_address(pkt, &ipv4_hdr->src_addr, entry->new_src_addr);
+    }
+    if (entry->new_dst_addr != ipv4_hdr->dst_addr) {
+        nat_rewrite_address(pkt, &ipv4_hdr->dst_addr, entry->new_dst_addr);
+    }
+    action_out(pkt, port, core, entry->data);
+    return 0;
+}
+
+/*
+ * Store the outcome recorded since flow_cache_process(), if any.
+ */
+void
+flow_cache_insert(struct flow_cache *cache)
+{
+    struct flow_cache_entry *set;
+    int i;
+
+    if (!cache->recording || cache->record.action == FLOW_ACTION_NONE) {
+        return ;
+    }
+    cache->recording = 0;
+
+    set = flow_cache_set(cache, &cache->record);
+    for (i = 0; i < FLOW_CACHE_WAYS - 1; ++i) {
+        if (set[i].action == FLOW_ACTION_NONE) {
+            break ;
+        }
+    }
+    set[i] = cache->record;
+}
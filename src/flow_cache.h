@@ -0,0 +1,144 @@
+/* vim: ts=4 sw=4 et */
+#ifndef FLOW_CACHE_H_
+#define FLOW_CACHE_H_
+
+#include <stdint.h>
+
+#include <rte_mbuf.h>
+
+#include "natasha.h"
+#include "network_headers.h"
+
+/*
+ * Per-core flow cache.
+ *
+ * The outcome of the rules for a flow (source address, destination address,
+ * VLAN and input port) is stored after the first packet of the flow has been
+ * processed. The next packets of the flow are rewritten and sent, or dropped,
+ * without processing the rules nor looking up the NAT table.
+ *
+ * An outcome is only cached if it only depends on the flow: packets going
+ * through "print", through conditions other than ipv4.src_addr, ipv4.dst_addr
+ * and vlan, or dropped because their address is not in the NAT table, are not
+ * cached. ICMP packets are never cached, since ICMP errors require to rewrite
+ * their inner IPv4 header.
+ *
+ * The cache is enabled with "flow cache <entries>;", and flushed when a new
+ * configuration is loaded. See docs/CONFIGURATION.md.
+ */
+
+enum flow_action {
+    FLOW_ACTION_NONE, // Empty entry
+    FLOW_ACTION_OUT, // action_out
+    FLOW_ACTION_DROP, // action_drop
+};
+
+// Number of entries of a set.
+#define FLOW_CACHE_WAYS 4
+
+#define FLOW_CACHE_NO_SLOT UINT32_MAX
+// Set in the slot of an entry of the NAT_DIR_IN table.
+#define FLOW_CACHE_SLOT_IN  (1U << 31)
+
+// 32 bytes: two entries per cache line.
+struct flow_cache_entry {
+    // Key, in network order.
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t vlan;
+    uint8_t port;
+
+    // enum flow_action.
+    uint8_t action;
+
+    // Addresses after the rewrite, in network order.
+    uint32_t new_src_addr;
+    uint32_t new_dst_addr;
+
+    // Slot of the NAT table entry which rewrote an address, to update its
+    // counters, with FLOW_CACHE_SLOT_IN for the NAT_DIR_IN table, or
+    // FLOW_CACHE_NO_SLOT.
+    uint32_t slot;
+
+    // Data of action_out, from the configuration. The cache is flushed before
+    // the configuration is freed.
+    void *data;
+} __rte_aligned(32);
+
+struct flow_cache {
+    // Number of sets - 1. The number of sets is a power of 2.
+    uint32_t mask;
+
+    // Whether the outcome of the packet being processed can be cached, and
+    // its entry.
+    int recording;
+    struct flow_cache_entry record;
+
+    struct flow_cache_entry *entries;
+};
+
+// flow_cache.c
+int flow_cache_reset(struct core *core, unsigned int nb_entries);
+void flow_cache_free(struct flow_cache *cache);
+int flow_cache_process(struct rte_mbuf *pkt, uint8_t port, struct core *core);
+void flow_cache_insert(struct flow_cache *cache);
+
+/*
+ * Called by actions ending the processing of pkt, to store their outcome in
+ * the cache.
+ */
+static inline void
+flow_cache_record(struct core *core, struct rte_mbuf *pkt,
+                  enum flow_action action, void *data)
+{
+    struct flow_cache *cache = core->flow_cache;
+    struct ipv4_hdr *ipv4_hdr;
+
+    if (cache == NULL || !cache->recording) {
+        return ;
+    }
+
+    ipv4_hdr = ipv4_header(pkt);
+    cache->record.action = action;
+    cache->record.new_src_addr = ipv4_hdr->src_addr;
+    cache->record.new_dst_addr = ipv4_hdr->dst_addr;
+    cache->record.data = data;
+}
+
+/*
+ * Called by action_nat when the entry at slot of the NAT table of direction
+ * dir rewrites an address. Only one entry per flow can be counted on a hit.
+ */
+static inline void
+flow_cache_record_slot(struct core *core, enum nat_dir dir, uint32_t slot)
+{
+    struct flow_cache *cache = core->flow_cache;
+
+    if (cache == NULL || !cache->recording) {
+        return ;
+    }
+
+    if (cache->record.slot != FLOW_CACHE_NO_SLOT) {
+        cache->recording = 0;
+        return ;
+    }
+    // Slots of prefix rules are not counted, nor slots using the flag
+    if (slot == NAT_PREFIX_SLOT || (slot & FLOW_CACHE_SLOT_IN)) {
+        return ;
+    }
+    cache->record.slot = dir == NAT_DIR_IN ? slot | FLOW_CACHE_SLOT_IN : slot;
+}
+
+/*
+ * Called when the outcome of the packet being processed doesn't only depend
+ * on its flow.
+ */
+static inline void
+flow_cache_record_abort(struct core *core)
+{
+    if (core->flow_cache) {
+        core->flow_cache->recording = 0;
+    }
+}
+
+#endif
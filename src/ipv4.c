@@ -1,14 +1,18 @@
 /* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_acl.h>
 #include <rte_ethdev.h>
 
+#include "flow_cache.h"
 #include "natasha.h"
 #include "network_headers.h"
 
 
 /*
- * Reply to a ICMP echo query.
+ * Reply to a ICMP echo query. Called by the slow path thread, see slowpath.c.
  */
-static int
+int
 icmp_echo(struct rte_mbuf *pkt, uint8_t port, struct core *core)
 {
     struct ether_hdr *eth_hdr;
@@ -40,42 +44,19 @@ icmp_echo(struct rte_mbuf *pkt, uint8_t port, struct core *core)
     icmp_hdr->icmp_cksum = 0;
     icmp_hdr->icmp_cksum = ~rte_raw_cksum(
         icmp_hdr,
-        rte_be_to_cpu_16(ipv4_hdr->total_length) - sizeof(*ipv4_hdr)
+        rte_be_to_cpu_16(ipv4_hdr->total_length) - pkt->l3_len
     );
 
-    return tx_send(pkt, port, &core->tx_queues[port], core->stats);
+    return tx_send(pkt, port, core);
 }
 
 /*
- * Answer to an ICMP packet depending on its type.
- *
- * @return
- *  - -1 if processing this type is not yet implemented.
- */
-static int
-icmp_dispatch(struct rte_mbuf *pkt, uint8_t port, struct core *core)
-{
-    struct icmp_hdr *icmp_hdr;
-
-    icmp_hdr = icmp_header(pkt);
-
-    switch (icmp_hdr->icmp_type) {
-
-    case IP_ICMP_ECHO_REQUEST:
-        return icmp_echo(pkt, port, core);
-
-    default:
-        break ;
-    }
-    return -1;
-}
-
-/*
- * Call icmp_dispatch() if pkt is addressed to one of our interfaces.
+ * Hand ICMP echo requests addressed to one of our interfaces off to the slow
+ * path. Other ICMP packets addressed to us are dropped.
  *
  * @return
  *  - -1 if pkt is not addresses to one of our interfaces.
- *  - The return value of icmp_dispatch() otherwise.
+ *  - 0 otherwise.
  */
 static int
 icmp_answer(struct rte_mbuf *pkt, uint8_t port, struct core *core)
@@ -92,92 +73,314 @@ icmp_answer(struct rte_mbuf *pkt, uint8_t port, struct core *core)
 
     // Even if we can't handle pkt, it is addressed to us. Drop it and
     // return 0 to mark it as processed.
-    if (icmp_dispatch(pkt, port, core) < 0) {
+    if (icmp_header(pkt)->icmp_type != IP_ICMP_ECHO_REQUEST) {
         core->stats->drop_unknown_icmp++;
-        rte_pktmbuf_free(pkt);
+        pkt_free(pkt, core);
+        return 0;
     }
+
+    slowpath_handoff(pkt, core);
     return 0;
 }
 
-#define X(cond) do {    \
-    if ((cond) < 0) {   \
-        return -1;      \
-    }                   \
-} while (0)
-
 /*
- * Process the rules AST for pkt.
+ * Execute the rules program for pkt.
+ *
+ * With GCC, each instruction jumps directly to the code of the next one
+ * (computed goto) instead of going back to the switch: each opcode gets its own
+ * indirect branch, which is better predicted.
  *
  * See detailed documentation in docs/CONFIGURATION.md.
+ *
+ * @return
+ *  - -1 if an action stopped the processing of pkt (eg. action_out or
+ *    action_drop).
  */
+#ifdef __GNUC__
+    #define SWITCH(op)      goto *targets[op];
+    #define TARGET(op)      target_ ## op:
+    #define DISPATCH()      goto *targets[(insn = &insns[pc])->op]
+#else
+    #define SWITCH(op)      switch (op)
+    #define TARGET(op)      case op:
+    #define DISPATCH()      continue
+#endif
 static int
-process_rules(struct app_config_node *node, struct rte_mbuf *pkt, uint8_t port,
-              struct core *core)
+process_rules(const struct rules_program *program, struct rte_mbuf *pkt,
+              uint8_t port, struct core *core)
 {
+#ifdef __GNUC__
+    static const void *const targets[] = {
+        [RULES_OP_END] = &&target_RULES_OP_END,
+        [RULES_OP_ACTION] = &&target_RULES_OP_ACTION,
+        [RULES_OP_ACTION_BURST] = &&target_RULES_OP_ACTION_BURST,
+        [RULES_OP_COND] = &&target_RULES_OP_COND,
+        [RULES_OP_SRC_IN] = &&target_RULES_OP_SRC_IN,
+        [RULES_OP_DST_IN] = &&target_RULES_OP_DST_IN,
+        [RULES_OP_VLAN] = &&target_RULES_OP_VLAN,
+        [RULES_OP_JUMP] = &&target_RULES_OP_JUMP,
+        [RULES_OP_CLASSIFY] = &&target_RULES_OP_CLASSIFY,
+    };
+#endif
+    const struct rules_insn *insns = program->insns;
+    const struct rules_insn *insn;
+    struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
+    struct rules_acl_key key = {};
+    const uint8_t *data = (const uint8_t *)&key;
+    uint32_t result;
+    uint32_t pc = 0;
     int ret;
 
-    if (!node) {
-        return 0;
-    }
-
-    switch (node->type) {
+    for (;;) {
+        insn = &insns[pc];
 
-    // Execute node's action.
-    case ACTION:
-        return node->action(pkt, port, core, node->data);
+        SWITCH(insn->op) {
 
-    // Execute left and right parts.
-    case SEQ:
-        X(process_rules(node->left, pkt, port, core));
-        X(process_rules(node->right, pkt, port, core));
-        return 0;
+        TARGET(RULES_OP_END)
+            return 0;
 
-    // The left part of a IF node is a COND node, the right part is the else
-    // clause. Only execute the else clause if the COND is false.
-    case IF:
-        X(ret = process_rules(node->left, pkt, port, core));
-        if (ret == 0) {
-            X(process_rules(node->right, pkt, port, core));
+        TARGET(RULES_OP_ACTION)
+            if (insn->call.f(pkt, port, core, insn->call.data) < 0) {
+                return -1;
+            }
+            pc = insn->next[0];
+            DISPATCH();
+
+        TARGET(RULES_OP_ACTION_BURST)
+            // A vector of one packet
+            if (insn->burst.f(&pkt, 1, core, insn->burst.data) == 0) {
+                return -1;
+            }
+            pc = insn->next[0];
+            DISPATCH();
+
+        TARGET(RULES_OP_COND)
+            // The condition might depend on more than the flow.
+            flow_cache_record_abort(core);
+            if ((ret = insn->call.f(pkt, port, core, insn->call.data)) < 0) {
+                return -1;
+            }
+            pc = insn->next[ret != 0];
+            DISPATCH();
+
+        TARGET(RULES_OP_SRC_IN)
+            pc = insn->next[(rte_be_to_cpu_32(ipv4_hdr->src_addr) &
+                             insn->network.mask) == insn->network.ip];
+            DISPATCH();
+
+        TARGET(RULES_OP_DST_IN)
+            pc = insn->next[(rte_be_to_cpu_32(ipv4_hdr->dst_addr) &
+                             insn->network.mask) == insn->network.ip];
+            DISPATCH();
+
+        TARGET(RULES_OP_VLAN)
+            pc = insn->next[VLAN_ID(pkt) == insn->vlan];
+            DISPATCH();
+
+        TARGET(RULES_OP_JUMP)
+            pc = insn->next[0];
+            DISPATCH();
+
+        TARGET(RULES_OP_CLASSIFY)
+            key.src_addr = ipv4_hdr->src_addr;
+            key.dst_addr = ipv4_hdr->dst_addr;
+            key.vlan = rte_cpu_to_be_16(VLAN_ID(pkt));
+            rte_acl_classify(insn->classify.ctx, &data, &result, 1, 1);
+            pc = insn->classify.targets[result];
+            DISPATCH();
         }
-        return 0;
+    }
+}
+#undef SWITCH
+#undef TARGET
+#undef DISPATCH
 
-    // The left part of a COND node is an ACTION node where
-    // node->left->action() returns a boolean. The right part is the condition
-    // body, that needs to be executed if the boolean is true.
-    case COND:
-        X(ret = process_rules(node->left, pkt, port, core));
-        if (ret == 0) {
-            return 0;
-        }
-        X(process_rules(node->right, pkt, port, core));
-        return 1;
-
-    // The left and the right part of a AND nodes are ACTION nodes where
-    // node->{{side}}->action() returns a boolean. Return true if both
-    // functions return true.
-    case AND:
-        X(ret = process_rules(node->left, pkt, port, core));
-        if (!ret)
-            return 0;
-        X(ret = process_rules(node->right, pkt, port, core));
-        return ret;
-
-    // Almost like the AND node.
-    case OR:
-        X(ret = process_rules(node->left, pkt, port, core));
-        if (ret)
-            return 1;
-        X(ret = process_rules(node->right, pkt, port, core));
-        return ret;
-
-    default:
-        break ;
+/*
+ * Packets of a burst waiting at the instruction pc, see process_rules_burst().
+ */
+struct rules_pending {
+    uint32_t pc;
+    uint64_t mask;
+};
+
+/*
+ * Add the packets of mask to the packets waiting at pc. pending is sorted by
+ * decreasing pc, and has an entry per instruction with packets waiting.
+ */
+static inline void
+rules_pending_add(struct rules_pending *pending, unsigned int *nb_pending,
+                  uint32_t pc, uint64_t mask)
+{
+    unsigned int i;
+
+    if (mask == 0) {
+        return ;
     }
 
-    return 0;
+    for (i = *nb_pending; i > 0 && pending[i - 1].pc < pc; --i)
+        ;
+    if (i > 0 && pending[i - 1].pc == pc) {
+        pending[i - 1].mask |= mask;
+        return ;
+    }
+    memmove(&pending[i + 1], &pending[i], (*nb_pending - i) * sizeof(*pending));
+    pending[i].pc = pc;
+    pending[i].mask = mask;
+    (*nb_pending)++;
 }
 
-#undef X
+// Iterate over the packets of mask, in order: i is the index of each packet.
+#define FOREACH_PKT(i, mask, tmp)                                   \
+    for ((tmp) = (mask);                                            \
+         (tmp) && ((i) = __builtin_ctzll(tmp), 1);                  \
+         (tmp) &= (tmp) - 1)
+
+/*
+ * Execute the rules program for the nb_pkts packets of pkts, at most
+ * MAX_RX_BURST.
+ *
+ * Instead of executing the whole program for a packet, then for the next one,
+ * each instruction is executed once for all the packets reaching it. A set of
+ * packets is a bitmask of indexes in pkts:
+ *
+ *  - conditions are evaluated for every packet of the set, which is split in
+ *    the packets for which the condition is true and the others,
+ *  - RULES_OP_CLASSIFY looks up all the packets of the set with a single call
+ *    to rte_acl_classify(),
+ *  - actions with a batched variant (RULES_OP_ACTION_BURST, such as
+ *    "nat rewrite", "out" and "drop") are called once for the set. Other
+ *    actions are called for each packet of the set.
+ *
+ * Instructions only continue to instructions after them (see rules.c), so
+ * when the first instruction with packets waiting is executed, every packet
+ * that will reach it is waiting: the sets of packets following the same path
+ * are merged back, and each instruction is executed at most once per burst.
+ *
+ * Outcomes are not recorded in the flow cache: ipv4_handle_burst() uses
+ * process_rules() when the flow cache is enabled.
+ */
+static void
+process_rules_burst(const struct rules_program *program,
+                    struct rte_mbuf **pkts, unsigned int nb_pkts,
+                    struct core *core)
+{
+    const struct rules_insn *insns = program->insns;
+    const struct rules_insn *insn;
+    struct rules_pending pending[MAX_RX_BURST];
+    struct rules_acl_key keys[MAX_RX_BURST];
+    const uint8_t *data[MAX_RX_BURST];
+    uint32_t results[MAX_RX_BURST];
+    uint8_t indexes[MAX_RX_BURST];
+    unsigned int nb_pending = 0;
+    struct ipv4_hdr *ipv4_hdr;
+    uint64_t mask;
+    uint64_t match;
+    uint64_t tmp;
+    unsigned int n;
+    unsigned int i;
+    int ret;
+
+    RTE_BUILD_BUG_ON(MAX_RX_BURST > 64);
+
+    rules_pending_add(pending, &nb_pending, 0,
+                      nb_pkts == 64 ? UINT64_MAX : (UINT64_C(1) << nb_pkts) - 1);
+
+    while (nb_pending) {
+        // The first instruction with packets waiting
+        --nb_pending;
+        insn = &insns[pending[nb_pending].pc];
+        mask = pending[nb_pending].mask;
+        match = 0;
+
+        switch (insn->op) {
+
+        case RULES_OP_END:
+            break ;
+
+        case RULES_OP_ACTION:
+            FOREACH_PKT(i, mask, tmp) {
+                if (insn->call.f(pkts[i], pkts[i]->port, core,
+                                 insn->call.data) < 0) {
+                    mask &= ~(UINT64_C(1) << i);
+                }
+            }
+            rules_pending_add(pending, &nb_pending, insn->next[0], mask);
+            break ;
+
+        case RULES_OP_ACTION_BURST:
+            mask = insn->burst.f(pkts, mask, core, insn->burst.data);
+            rules_pending_add(pending, &nb_pending, insn->next[0], mask);
+            break ;
+
+        case RULES_OP_COND:
+            FOREACH_PKT(i, mask, tmp) {
+                ret = insn->call.f(pkts[i], pkts[i]->port, core,
+                                   insn->call.data);
+                if (ret < 0) {
+                    mask &= ~(UINT64_C(1) << i);
+                } else if (ret) {
+                    match |= UINT64_C(1) << i;
+                }
+            }
+            goto split;
+
+        case RULES_OP_SRC_IN:
+            FOREACH_PKT(i, mask, tmp) {
+                ipv4_hdr = ipv4_header(pkts[i]);
+                match |= (uint64_t)((rte_be_to_cpu_32(ipv4_hdr->src_addr) &
+                                     insn->network.mask) ==
+                                    insn->network.ip) << i;
+            }
+            goto split;
+
+        case RULES_OP_DST_IN:
+            FOREACH_PKT(i, mask, tmp) {
+                ipv4_hdr = ipv4_header(pkts[i]);
+                match |= (uint64_t)((rte_be_to_cpu_32(ipv4_hdr->dst_addr) &
+                                     insn->network.mask) ==
+                                    insn->network.ip) << i;
+            }
+            goto split;
+
+        case RULES_OP_VLAN:
+            FOREACH_PKT(i, mask, tmp) {
+                match |= (uint64_t)(VLAN_ID(pkts[i]) == insn->vlan) << i;
+            }
+            goto split;
+
+        case RULES_OP_JUMP:
+            rules_pending_add(pending, &nb_pending, insn->next[0], mask);
+            break ;
+
+        case RULES_OP_CLASSIFY:
+            n = 0;
+            FOREACH_PKT(i, mask, tmp) {
+                ipv4_hdr = ipv4_header(pkts[i]);
+                memset(&keys[n], 0, sizeof(keys[n]));
+                keys[n].src_addr = ipv4_hdr->src_addr;
+                keys[n].dst_addr = ipv4_hdr->dst_addr;
+                keys[n].vlan = rte_cpu_to_be_16(VLAN_ID(pkts[i]));
+                data[n] = (const uint8_t *)&keys[n];
+                indexes[n++] = i;
+            }
+            rte_acl_classify(insn->classify.ctx, data, results, n, 1);
+            for (i = 0; i < n; ++i) {
+                rules_pending_add(pending, &nb_pending,
+                                  insn->classify.targets[results[i]],
+                                  UINT64_C(1) << indexes[i]);
+            }
+            break ;
+
+        split:
+            rules_pending_add(pending, &nb_pending, insn->next[0],
+                              mask & ~match);
+            rules_pending_add(pending, &nb_pending, insn->next[1],
+                              mask & match);
+            break ;
+        }
+    }
+}
+#undef FOREACH_PKT
 
 /*
  * Fix CISCO Nexus 9000 series bug when untagging a packet.
@@ -229,26 +432,29 @@ fix_nexus9000_padding_bug(struct rte_mbuf *pkt, struct ipv4_hdr *ipv4_hdr)
     //
     // We don't want padding_len to be inferior to 0, as it would cause a
     // buffer overflow when casted as unsigned in memset.
-    padding_len = pkt->pkt_len - sizeof(struct ether_hdr) - ipv4_len;
+    padding_len = pkt->pkt_len - pkt->l2_len - ipv4_len;
 
     if (padding_len > 0) {
         pkt_data = rte_pktmbuf_mtod(pkt, unsigned char *);
-        memset(pkt_data + sizeof(struct ether_hdr) + ipv4_len,
+        memset(pkt_data + pkt->l2_len + ipv4_len,
                0x00,
                padding_len);
     }
 }
 
 /*
- * Handle the ipv4 pkt:
+ * Handle the ipv4 pkt, received on port:
  *  - if it is a ICMP message addressed to one of our interfaces, answer to it.
- *  - otherwise, process the configuration rules.
+ *  - otherwise, it has to go through the rules.
+ *
+ * @return
+ *  - 1 if pkt has to go through the rules.
+ *  - 0 if pkt has been handled.
  */
-int
+static inline int
 ipv4_handle(struct rte_mbuf *pkt, uint8_t port, struct core *core)
 {
     struct ipv4_hdr *ipv4_hdr = ipv4_header(pkt);
-    int ret;
 
     fix_nexus9000_padding_bug(pkt, ipv4_hdr);
 
@@ -259,21 +465,81 @@ ipv4_handle(struct rte_mbuf *pkt, uint8_t port, struct core *core)
     /* } */
     /* ipv4_hdr->time_to_live--; */
 
-    if (unlikely(ipv4_hdr->next_proto_id == IPPROTO_ICMP)) {
-        if ((ret = icmp_answer(pkt, port, core)) >= 0) {
-            return ret;
+    if (unlikely(pkt_l4_proto(pkt) == IPPROTO_ICMP)) {
+        if (icmp_answer(pkt, port, core) >= 0) {
+            return 0;
         }
     }
+    return 1;
+}
 
-    // No rules for this packet, free it
-    if (unlikely(core->app_config->rules == NULL)) {
-        return -1;
+/*
+ * Process the rules of program for pkt, unless the outcome of its flow is in
+ * the flow cache.
+ */
+static inline void
+ipv4_process_flow(const struct rules_program *program, struct rte_mbuf *pkt,
+                  uint8_t port, struct core *core)
+{
+    if (flow_cache_process(pkt, port, core) == 0) {
+        return ;
     }
 
     // process_rules returns -1 if it encounters a breaking rule (eg.
-    // action_out or action_drop). We don't want to return -1 because the
-    // caller function – dispatch_patcher() in core.c – would free pkt.
-    (void)process_rules(core->app_config->rules, pkt, port, core);
+    // action_out or action_drop), which already sent or freed pkt.
+    (void)process_rules(program, pkt, port, core);
 
-    return 0;
+    flow_cache_insert(core->flow_cache);
+}
+
+/*
+ * Handle nb_pkts IPv4 packets, parsed by network_headers.h/pkt_parse(). Each
+ * packet is handled on the port it was received on, pkt->port.
+ *
+ * Packets which have to go through the rules are gathered in a vector,
+ * processed by process_rules_burst(), or one by one by process_rules() with
+ * the flow cache.
+ *
+ * The rules are read once for the whole vector: it is handled within a single
+ * iteration of the main loop, so the configuration can't be freed meanwhile.
+ *
+ * @return
+ *  - The number of packets dropped, already freed.
+ */
+unsigned int
+ipv4_handle_burst(struct rte_mbuf **pkts, unsigned int nb_pkts,
+                  struct core *core)
+{
+    struct rules_program *program = core->app_config->program;
+    struct rte_mbuf *rules_pkts[MAX_RX_BURST];
+    unsigned int nb_rules = 0;
+    unsigned int dropped = 0;
+    unsigned int i;
+
+    for (i = 0; i < nb_pkts; ++i) {
+        if (ipv4_handle(pkts[i], pkts[i]->port, core) == 0) {
+            continue ;
+        }
+        // No rules for this packet, free it
+        if (unlikely(program == NULL)) {
+            pkt_free(pkts[i], core);
+            dropped++;
+            continue ;
+        }
+        rules_pkts[nb_rules++] = pkts[i];
+    }
+
+    if (nb_rules == 0) {
+        return dropped;
+    }
+
+    if (core->flow_cache == NULL) {
+        process_rules_burst(program, rules_pkts, nb_rules, core);
+        return dropped;
+    }
+
+    for (i = 0; i < nb_rules; ++i) {
+        ipv4_process_flow(program, rules_pkts[i], rules_pkts[i]->port, core);
+    }
+    return dropped;
 }
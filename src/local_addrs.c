@@ -0,0 +1,110 @@
+/* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_common.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "natasha.h"
+#include "local_addrs.h"
+
+// Smallest number of slots.
+#define LOCAL_ADDRS_MIN_SLOTS   8
+
+static void
+local_addrs_add(struct local_addrs *set, uint64_t key)
+{
+    uint32_t slot = local_addrs_slot(set, key);
+
+    while (set->keys[slot] != LOCAL_ADDRS_EMPTY) {
+        // The same address can be configured on several ports
+        if (set->keys[slot] == key) {
+            return ;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    set->keys[slot] = key;
+    set->len++;
+}
+
+/*
+ * Build the set of the addresses of the nb_ports ports on socket_id.
+ *
+ * @return
+ *  - NULL if the set can't be allocated.
+ */
+struct local_addrs *
+local_addrs_create(const struct port_config *ports, unsigned int nb_ports,
+                   unsigned int socket_id)
+{
+    const struct port_ip_addr *ip_addr;
+    struct local_addrs *set;
+    uint32_t nb_keys = 0;
+    uint32_t nb_slots;
+    unsigned int port;
+
+    for (port = 0; port < nb_ports; ++port) {
+        for (ip_addr = ports[port].ip_addresses; ip_addr;
+             ip_addr = ip_addr->next) {
+            nb_keys += 2;
+        }
+    }
+
+    // At most half full
+    nb_slots = RTE_MAX(rte_align32pow2(nb_keys * 2),
+                       (uint32_t)LOCAL_ADDRS_MIN_SLOTS);
+
+    set = rte_malloc_socket("local_addrs",
+                            sizeof(*set) + nb_slots * sizeof(*set->keys),
+                            RTE_CACHE_LINE_SIZE, socket_id);
+    if (set == NULL) {
+        RTE_LOG(ERR, APP, "Unable to allocate the set of local addresses\n");
+        return NULL;
+    }
+    set->mask = nb_slots - 1;
+    set->len = 0;
+    memset(set->keys, 0xff, nb_slots * sizeof(*set->keys));
+
+    for (port = 0; port < nb_ports; ++port) {
+        for (ip_addr = ports[port].ip_addresses; ip_addr;
+             ip_addr = ip_addr->next) {
+            local_addrs_add(set, local_addrs_key(ip_addr->addr.ip,
+                                                 ip_addr->addr.vlan, port));
+            local_addrs_add(set, local_addrs_key(ip_addr->addr.ip,
+                                                 ip_addr->addr.vlan,
+                                                 LOCAL_ADDRS_ANY_PORT));
+        }
+    }
+    return set;
+}
+
+void
+local_addrs_free(struct local_addrs *set)
+{
+    rte_free(set);
+}
+
+/*
+ * Look up the n keys, at most LOCAL_ADDRS_MAX_BULK: the slots of all the keys
+ * are hashed and prefetched before any of them is read.
+ *
+ * @return
+ *  - A bitmask, bit i set if keys[i] is in the set.
+ */
+uint64_t
+local_addrs_lookup_bulk(const struct local_addrs *set, const uint64_t *keys,
+                        unsigned int n)
+{
+    uint32_t slots[LOCAL_ADDRS_MAX_BULK];
+    uint64_t hits = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; ++i) {
+        slots[i] = local_addrs_slot(set, keys[i]);
+        rte_prefetch0(&set->keys[slots[i]]);
+    }
+    for (i = 0; i < n; ++i) {
+        hits |= (uint64_t)local_addrs_probe(set, keys[i], slots[i]) << i;
+    }
+    return hits;
+}
@@ -0,0 +1,82 @@
+/* vim: ts=4 sw=4 et */
+#ifndef LOCAL_ADDRS_H_
+#define LOCAL_ADDRS_H_
+
+#include <stdint.h>
+
+#include <rte_hash_crc.h>
+
+#include "natasha.h"
+
+/*
+ * Addresses of natasha.
+ *
+ * The addresses of "port <n> [vlan <vlan>] ip <ip>" are looked up for every
+ * ARP request and every ICMP packet. Instead of walking the addresses of each
+ * port, the configuration stores them in a flat hash set, built with the NAT
+ * tables for each NUMA socket: a lookup reads a single cache line, whatever
+ * the number of ports, VLANs and addresses.
+ *
+ * Each address is stored twice: once for its port, and once with
+ * LOCAL_ADDRS_ANY_PORT for the lookups of is_natasha_ip().
+ */
+
+#define LOCAL_ADDRS_ANY_PORT    0xffff
+// A VLAN has 12 bits: no key has all its bits set.
+#define LOCAL_ADDRS_EMPTY       UINT64_MAX
+#define LOCAL_ADDRS_HASH_SEED   0xdeadbeef
+// Lookups of local_addrs_lookup_bulk().
+#define LOCAL_ADDRS_MAX_BULK    64
+
+// Open addressing with linear probing. The set is at most half full.
+struct local_addrs {
+    // Number of slots - 1, a power of 2 minus 1.
+    uint32_t mask;
+    // Number of keys.
+    uint32_t len;
+    uint64_t keys[] __rte_cache_aligned;
+};
+
+// local_addrs.c
+struct local_addrs *local_addrs_create(const struct port_config *ports,
+                                       unsigned int nb_ports,
+                                       unsigned int socket_id);
+void local_addrs_free(struct local_addrs *set);
+uint64_t local_addrs_lookup_bulk(const struct local_addrs *set,
+                                 const uint64_t *keys, unsigned int n);
+
+static inline uint64_t
+local_addrs_key(uint32_t ip, int vlan, uint16_t port)
+{
+    return ((uint64_t)ip << 32) | ((uint64_t)(vlan & 0xffff) << 16) | port;
+}
+
+static inline uint32_t
+local_addrs_slot(const struct local_addrs *set, uint64_t key)
+{
+    return rte_hash_crc_8byte(key, LOCAL_ADDRS_HASH_SEED) & set->mask;
+}
+
+/*
+ * Whether key, from local_addrs_key(), is in the set, starting the probe at
+ * slot.
+ */
+static inline int
+local_addrs_probe(const struct local_addrs *set, uint64_t key, uint32_t slot)
+{
+    while (set->keys[slot] != LOCAL_ADDRS_EMPTY) {
+        if (set->keys[slot] == key) {
+            return 1;
+        }
+        slot = (slot + 1) & set->mask;
+    }
+    return 0;
+}
+
+static inline int
+local_addrs_contains(const struct local_addrs *set, uint64_t key)
+{
+    return local_addrs_probe(set, key, local_addrs_slot(set, key));
+}
+
+#endif
@@ -0,0 +1,330 @@
+/* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_hash_crc.h>
+#include <rte_malloc.h>
+
+#include "natasha.h"
+#include "napt.h"
+
+#define NAPT_HASH_SEED 0xdeadbeef
+
+/*
+ * Defaults of RFC 4787 (UDP), RFC 5382 (TCP, established connections) and
+ * RFC 5508 (ICMP).
+ */
+void
+napt_config_default(struct napt_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->max_sessions = 65536;
+    config->timeouts[NAPT_PROTO_TCP] = 7440;
+    config->timeouts[NAPT_PROTO_UDP] = 300;
+    config->timeouts[NAPT_PROTO_ICMP] = 60;
+}
+
+static inline uint32_t
+napt_hash(enum napt_proto proto, uint32_t ip, uint16_t port)
+{
+    return rte_hash_crc_4byte(ip, rte_hash_crc_4byte(
+        ((uint32_t)proto << 16) | port, NAPT_HASH_SEED));
+}
+
+void
+napt_table_free(struct napt_table *table)
+{
+    if (table == NULL) {
+        return ;
+    }
+    rte_free(table->sessions);
+    rte_free(table->out_buckets);
+    rte_free(table->in_buckets);
+    rte_free(table->free_pairs);
+    rte_free(table);
+}
+
+/*
+ * Create the session table of the worker-th worker out of nb_workers.
+ *
+ * @return
+ *  - NULL on failure.
+ */
+struct napt_table *
+napt_table_create(const struct napt_config *config, unsigned int worker,
+                  unsigned int nb_workers, int socket_id)
+{
+    struct napt_table *table;
+    uint64_t nb_pairs;
+    uint32_t nb_buckets;
+    uint32_t i;
+
+    table = rte_zmalloc_socket(NULL, sizeof(*table), RTE_CACHE_LINE_SIZE,
+                               socket_id);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->config = *config;
+    table->worker = worker;
+    table->nb_workers = nb_workers;
+    table->hz = rte_get_timer_hz();
+    table->now = rte_get_timer_cycles() / table->hz;
+    table->wheel_time = table->now;
+    table->expiring = NAPT_NONE;
+
+    // A worker can't have more sessions than ports
+    nb_pairs = (uint64_t)config->nb_addresses * (NAPT_NB_PORTS / nb_workers);
+    table->nb_pairs = RTE_MIN(nb_pairs, (uint64_t)UINT32_MAX);
+    table->max_sessions = RTE_MIN(config->max_sessions, table->nb_pairs);
+
+    nb_buckets = 1;
+    while (nb_buckets < table->max_sessions) {
+        nb_buckets <<= 1;
+    }
+    table->mask = nb_buckets - 1;
+
+    table->sessions = rte_malloc_socket(
+        NULL, (size_t)table->max_sessions * sizeof(*table->sessions),
+        RTE_CACHE_LINE_SIZE, socket_id);
+    table->out_buckets = rte_malloc_socket(
+        NULL, (size_t)nb_buckets * sizeof(*table->out_buckets),
+        RTE_CACHE_LINE_SIZE, socket_id);
+    table->in_buckets = rte_malloc_socket(
+        NULL, (size_t)nb_buckets * sizeof(*table->in_buckets),
+        RTE_CACHE_LINE_SIZE, socket_id);
+    table->free_pairs = rte_malloc_socket(
+        NULL, (size_t)table->max_sessions * sizeof(*table->free_pairs),
+        0, socket_id);
+    if (table->sessions == NULL || table->out_buckets == NULL ||
+        table->in_buckets == NULL || table->free_pairs == NULL) {
+        RTE_LOG(ERR, APP, "Unable to allocate %u NAPT sessions\n",
+                table->max_sessions);
+        napt_table_free(table);
+        return NULL;
+    }
+
+    memset(table->out_buckets, 0xff, nb_buckets * sizeof(*table->out_buckets));
+    memset(table->in_buckets, 0xff, nb_buckets * sizeof(*table->in_buckets));
+    memset(table->wheel, 0xff, sizeof(table->wheel));
+
+    for (i = 0; i < table->max_sessions; ++i) {
+        table->sessions[i].next_out = i + 1;
+    }
+    if (table->max_sessions) {
+        table->sessions[table->max_sessions - 1].next_out = NAPT_NONE;
+        table->free_session = 0;
+    } else {
+        table->free_session = NAPT_NONE;
+    }
+    return table;
+}
+
+struct napt_session *
+napt_lookup_out(struct napt_table *table, enum napt_proto proto,
+                uint32_t int_ip, uint16_t int_port)
+{
+    struct napt_session *session;
+    uint32_t idx;
+
+    idx = table->out_buckets[napt_hash(proto, int_ip, int_port) & table->mask];
+    while (idx != NAPT_NONE) {
+        session = &table->sessions[idx];
+        if (session->int_ip == int_ip && session->int_port == int_port &&
+            session->proto == proto) {
+            return session;
+        }
+        idx = session->next_out;
+    }
+    return NULL;
+}
+
+struct napt_session *
+napt_lookup_in(struct napt_table *table, enum napt_proto proto,
+               uint32_t ext_ip, uint16_t ext_port)
+{
+    struct napt_session *session;
+    uint32_t idx;
+
+    idx = table->in_buckets[napt_hash(proto, ext_ip, ext_port) & table->mask];
+    while (idx != NAPT_NONE) {
+        session = &table->sessions[idx];
+        if (session->ext_ip == ext_ip && session->ext_port == ext_port &&
+            session->proto == proto) {
+            return session;
+        }
+        idx = session->next_in;
+    }
+    return NULL;
+}
+
+/*
+ * Address and port of the pair-th pair of the worker.
+ */
+static void
+napt_pair(const struct napt_table *table, uint32_t pair, uint32_t *ip,
+          uint16_t *port)
+{
+    const uint32_t ports_per_ip = NAPT_NB_PORTS / table->nb_workers;
+
+    *ip = table->config.pool_ip + pair / ports_per_ip;
+    *port = NAPT_FIRST_PORT + (pair % ports_per_ip) * table->nb_workers +
+            table->worker;
+}
+
+static uint32_t
+napt_pair_index(const struct napt_table *table, uint32_t ip, uint16_t port)
+{
+    const uint32_t ports_per_ip = NAPT_NB_PORTS / table->nb_workers;
+
+    return (ip - table->config.pool_ip) * ports_per_ip +
+           (port - NAPT_FIRST_PORT) / table->nb_workers;
+}
+
+/*
+ * Create the session of (proto, int_ip, int_port), which must not exist, with
+ * a free public address and port.
+ *
+ * @return
+ *  - NULL if there are no free sessions or ports.
+ */
+struct napt_session *
+napt_session_create(struct napt_table *table, enum napt_proto proto,
+                    uint32_t int_ip, uint16_t int_port)
+{
+    struct napt_session *session;
+    uint32_t bucket;
+    uint32_t pair;
+    uint32_t idx;
+
+    if (table->free_session == NAPT_NONE) {
+        return NULL;
+    }
+
+    if (table->nb_free_pairs) {
+        pair = table->free_pairs[--table->nb_free_pairs];
+    } else if (table->next_pair < table->nb_pairs) {
+        pair = table->next_pair++;
+    } else {
+        return NULL;
+    }
+
+    idx = table->free_session;
+    session = &table->sessions[idx];
+    table->free_session = session->next_out;
+    table->nb_sessions++;
+
+    session->int_ip = int_ip;
+    session->int_port = int_port;
+    napt_pair(table, pair, &session->ext_ip, &session->ext_port);
+    session->proto = proto;
+    napt_session_refresh(table, session);
+
+    bucket = napt_hash(proto, int_ip, int_port) & table->mask;
+    session->next_out = table->out_buckets[bucket];
+    table->out_buckets[bucket] = idx;
+
+    bucket = napt_hash(proto, session->ext_ip, session->ext_port) &
+             table->mask;
+    session->next_in = table->in_buckets[bucket];
+    table->in_buckets[bucket] = idx;
+
+    bucket = session->expire % NAPT_WHEEL_SIZE;
+    session->next_timer = table->wheel[bucket];
+    table->wheel[bucket] = idx;
+    return session;
+}
+
+/*
+ * Remove the session idx from the list starting at *head, linked by the field
+ * at offset next of struct napt_session.
+ */
+static void
+napt_unlink(struct napt_table *table, uint32_t *head, uint32_t idx,
+            size_t next)
+{
+    uint32_t *cur = head;
+
+    while (*cur != idx) {
+        cur = (uint32_t *)((char *)&table->sessions[*cur] + next);
+    }
+    *cur = *(uint32_t *)((char *)&table->sessions[idx] + next);
+}
+
+static void
+napt_session_delete(struct napt_table *table, uint32_t idx)
+{
+    struct napt_session *session = &table->sessions[idx];
+
+    napt_unlink(table,
+                &table->out_buckets[napt_hash(session->proto, session->int_ip,
+                                              session->int_port) &
+                                    table->mask],
+                idx, offsetof(struct napt_session, next_out));
+    napt_unlink(table,
+                &table->in_buckets[napt_hash(session->proto, session->ext_ip,
+                                             session->ext_port) &
+                                   table->mask],
+                idx, offsetof(struct napt_session, next_in));
+
+    table->free_pairs[table->nb_free_pairs++] =
+        napt_pair_index(table, session->ext_ip, session->ext_port);
+
+    session->next_out = table->free_session;
+    table->free_session = idx;
+    table->nb_sessions--;
+}
+
+/*
+ * Advance the timer wheel to now (seconds), and handle at most
+ * NAPT_EXPIRE_BURST sessions of the reached slots. Called by the worker once
+ * per iteration of its main loop.
+ *
+ * The sessions of a slot are detached when the slot is reached. A session
+ * refreshed since it was linked to the slot is linked to the slot of its new
+ * expiration time, the others are deleted. Both count toward the burst: the
+ * rest of the detached sessions is handled by the next calls.
+ *
+ * @return
+ *  - Number of sessions deleted.
+ */
+unsigned int
+napt_expire(struct napt_table *table, uint32_t now)
+{
+    struct napt_session *session;
+    unsigned int nb_expired = 0;
+    unsigned int nb_handled = 0;
+    uint32_t slot;
+    uint32_t idx;
+
+    table->now = now;
+
+    while (nb_handled < NAPT_EXPIRE_BURST) {
+        if (table->expiring == NAPT_NONE) {
+            if (table->wheel_time == now) {
+                break ;
+            }
+            table->wheel_time++;
+            slot = table->wheel_time % NAPT_WHEEL_SIZE;
+            table->expiring = table->wheel[slot];
+            table->wheel[slot] = NAPT_NONE;
+            continue ;
+        }
+
+        idx = table->expiring;
+        session = &table->sessions[idx];
+        table->expiring = session->next_timer;
+        nb_handled++;
+
+        if ((int32_t)(session->expire - now) > 0) {
+            slot = session->expire % NAPT_WHEEL_SIZE;
+            session->next_timer = table->wheel[slot];
+            table->wheel[slot] = idx;
+            continue ;
+        }
+
+        napt_session_delete(table, idx);
+        nb_expired++;
+    }
+    return nb_expired;
+}
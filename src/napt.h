@@ -0,0 +1,176 @@
+/* vim: ts=4 sw=4 et */
+#ifndef NAPT_H_
+#define NAPT_H_
+
+#include <stdint.h>
+
+/*
+ * Stateful NAPT (port-translating NAT).
+ *
+ * The action "nat napt;" shares a pool of public addresses between many
+ * internal hosts: the source address and port (or ICMP echo identifier) of an
+ * outgoing packet are translated to a public address and port of the pool,
+ * and packets sent back to this address and port are translated back.
+ *
+ * Each worker has its own table of sessions, without locks:
+ *
+ * - The ports of the pool are split between the workers: the port p of a
+ *   public address belongs to the worker (p - NAPT_FIRST_PORT) % number of
+ *   workers. A worker only allocates its own ports, so an incoming packet is
+ *   processed by the worker owning its destination port. If the NIC delivered
+ *   it to another worker, it is handed off to the owner through the owner's
+ *   ring, and the owner processes the rules for it.
+ * - Sessions expire after a timeout depending on their protocol, refreshed by
+ *   each packet. Expiry uses a timer wheel of one second slots: a packet only
+ *   updates the expiration time of its session, which is moved to the right
+ *   slot when its current slot is reached.
+ *
+ * Mappings are endpoint independent: a session is identified by the protocol
+ * and the internal address and port, and accepts packets from any remote
+ * host. See docs/CONFIGURATION.md.
+ */
+
+// Ports below are never allocated.
+#define NAPT_FIRST_PORT         1024
+#define NAPT_NB_PORTS           (65536 - NAPT_FIRST_PORT)
+
+// Slots of one second of the timer wheel.
+#define NAPT_WHEEL_SIZE         1024
+// Sessions handled, deleted or relinked, at most by napt_expire() call, to
+// bound the time spent out of packet processing.
+#define NAPT_EXPIRE_BURST       64
+
+// Packets a worker can hand off to another before dropping them.
+#define NAPT_HANDOFF_RING_SIZE  4096
+
+// End of a list of sessions.
+#define NAPT_NONE               UINT32_MAX
+
+enum napt_proto {
+    NAPT_PROTO_TCP,
+    NAPT_PROTO_UDP,
+    NAPT_PROTO_ICMP,
+    NAPT_NB_PROTOS,
+};
+
+// Configuration of the NAPT, from the configuration file.
+struct napt_config {
+    // Public addresses (host order), set with "napt pool <network>;". 0 if
+    // the NAPT is disabled.
+    uint32_t pool_ip;
+    uint32_t nb_addresses;
+    // Maximum number of sessions of each worker, "napt sessions <n>;".
+    uint32_t max_sessions;
+    // Timeouts in seconds, "napt timeout tcp|udp|icmp <seconds>;".
+    uint32_t timeouts[NAPT_NB_PROTOS];
+};
+
+// 32 bytes, two sessions per cache line.
+struct napt_session {
+    // Host order.
+    uint32_t int_ip;
+    uint32_t ext_ip;
+    uint16_t int_port;
+    uint16_t ext_port;
+    // enum napt_proto.
+    uint8_t proto;
+    // Expiration time, in seconds.
+    uint32_t expire;
+    // Next session of the same bucket of out_buckets, of in_buckets, and of
+    // the same slot of the timer wheel. next_out links free sessions.
+    uint32_t next_out;
+    uint32_t next_in;
+    uint32_t next_timer;
+};
+
+struct napt_table {
+    struct napt_config config;
+
+    // Index of the worker, and number of workers, to know the ports owned by
+    // the worker.
+    unsigned int worker;
+    unsigned int nb_workers;
+
+    // Current time in seconds, updated by napt_expire().
+    uint32_t now;
+
+    // Sessions, and first free session. max_sessions is
+    // config.max_sessions, bounded by the number of ports of the worker.
+    struct napt_session *sessions;
+    uint32_t free_session;
+    uint32_t nb_sessions;
+    uint32_t max_sessions;
+
+    // Sessions by internal and by external address and port. The number of
+    // buckets is a power of 2.
+    uint32_t *out_buckets;
+    uint32_t *in_buckets;
+    uint32_t mask;
+
+    // (address, port) pairs owned by the worker are numbered from 0 to
+    // nb_pairs - 1. Pairs from next_pair have never been allocated, freed
+    // pairs are pushed on free_pairs.
+    uint32_t nb_pairs;
+    uint32_t next_pair;
+    uint32_t *free_pairs;
+    uint32_t nb_free_pairs;
+
+    // Timer wheel: sessions whose expiration time modulo NAPT_WHEEL_SIZE is
+    // the slot. Slots up to wheel_time have been processed, except for the
+    // sessions left in expiring.
+    uint32_t wheel[NAPT_WHEEL_SIZE];
+    uint32_t wheel_time;
+    uint32_t expiring;
+
+    uint64_t hz;
+};
+
+// napt.c
+void napt_config_default(struct napt_config *config);
+struct napt_table *napt_table_create(const struct napt_config *config,
+                                     unsigned int worker,
+                                     unsigned int nb_workers, int socket_id);
+void napt_table_free(struct napt_table *table);
+struct napt_session *napt_lookup_out(struct napt_table *table,
+                                     enum napt_proto proto, uint32_t int_ip,
+                                     uint16_t int_port);
+struct napt_session *napt_lookup_in(struct napt_table *table,
+                                    enum napt_proto proto, uint32_t ext_ip,
+                                    uint16_t ext_port);
+struct napt_session *napt_session_create(struct napt_table *table,
+                                         enum napt_proto proto,
+                                         uint32_t int_ip, uint16_t int_port);
+unsigned int napt_expire(struct napt_table *table, uint32_t now);
+
+/*
+ * Whether ip (host order) is a public address of the pool.
+ */
+static inline int
+napt_pool_contains(const struct napt_config *config, uint32_t ip)
+{
+    return ip - config->pool_ip < config->nb_addresses;
+}
+
+/*
+ * Index of the worker owning the public port (host order), -1 if no worker
+ * allocates it.
+ */
+static inline int
+napt_port_owner(const struct napt_table *table, uint16_t port)
+{
+    if (port < NAPT_FIRST_PORT) {
+        return -1;
+    }
+    return (port - NAPT_FIRST_PORT) % table->nb_workers;
+}
+
+/*
+ * Refresh the expiration time of session, after a packet.
+ */
+static inline void
+napt_session_refresh(struct napt_table *table, struct napt_session *session)
+{
+    session->expire = table->now + table->config.timeouts[session->proto];
+}
+
+#endif
@@ -0,0 +1,67 @@
+/* vim: ts=4 sw=4 et */
+#include "natasha.h"
+#include "nat_deterministic.h"
+
+static int
+ranges_overlap(uint32_t a, uint32_t nb_a, uint32_t b, uint32_t nb_b)
+{
+    return (uint64_t)a < (uint64_t)b + nb_b && (uint64_t)b < (uint64_t)a + nb_a;
+}
+
+/*
+ * Add the mapping of the private network int_ip/int_prefix to the public
+ * network ext_ip/ext_prefix, with blocks of ports ports.
+ *
+ * @return
+ *  - -1 if the mapping is invalid, if there are not enough public ports for
+ *    every private address, or if a network overlaps another mapping.
+ */
+int
+nat_det_add(struct nat_det *det, uint32_t int_ip, int int_prefix,
+            uint32_t ext_ip, int ext_prefix, int ports)
+{
+    struct nat_det_mapping m;
+    uint64_t nb_blocks;
+    unsigned int i;
+
+    if (det->nb_mappings == NAT_DET_MAX_MAPPINGS) {
+        RTE_LOG(ERR, APP, "Too many deterministic NAT mappings\n");
+        return -1;
+    }
+
+    // A /0 can't be represented by nb_int and nb_ext
+    if (int_prefix <= 0 || ext_prefix <= 0 || ports <= 0 ||
+        ports > NAT_DET_NB_PORTS) {
+        RTE_LOG(ERR, APP, "Invalid deterministic NAT mapping\n");
+        return -1;
+    }
+
+    m.nb_int = 1U << (32 - int_prefix);
+    m.int_ip = int_ip & ~(m.nb_int - 1);
+    m.nb_ext = 1U << (32 - ext_prefix);
+    m.ext_ip = ext_ip & ~(m.nb_ext - 1);
+    m.ports = ports;
+
+    nb_blocks = (uint64_t)m.nb_ext * (NAT_DET_NB_PORTS / m.ports);
+    if (nb_blocks < m.nb_int) {
+        RTE_LOG(ERR, APP,
+                "Deterministic NAT: " IPv4_FMT "/%i has %u addresses, but "
+                IPv4_FMT "/%i only has %" PRIu64 " blocks of %u ports\n",
+                IPv4_FMTARGS(m.int_ip), int_prefix, m.nb_int,
+                IPv4_FMTARGS(m.ext_ip), ext_prefix, nb_blocks, m.ports);
+        return -1;
+    }
+
+    for (i = 0; i < det->nb_mappings; ++i) {
+        if (ranges_overlap(m.int_ip, m.nb_int, det->mappings[i].int_ip,
+                           det->mappings[i].nb_int) ||
+            ranges_overlap(m.ext_ip, m.nb_ext, det->mappings[i].ext_ip,
+                           det->mappings[i].nb_ext)) {
+            RTE_LOG(ERR, APP, "Deterministic NAT mappings overlap\n");
+            return -1;
+        }
+    }
+
+    det->mappings[det->nb_mappings++] = m;
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* vim: ts=4 sw=4 et */
+#ifndef NAT_DETERMINISTIC_H_
+#define NAT_DETERMINISTIC_H_
+
+#include <stdint.h>
+
+/*
+ * Deterministic NAT (carrier-grade NAT without state, in the spirit of RFC
+ * 7422).
+ *
+ * "nat deterministic <private network> -> <public network> ports <n>;" gives
+ * each address of the private network a block of n ports of an address of
+ * the public network, computed from the configuration only: the i-th private
+ * address uses the public address i % (number of public addresses), and its
+ * block is the i / (number of public addresses)-th block of n ports from
+ * NAT_DET_FIRST_PORT. Consecutive private addresses use different public
+ * addresses.
+ *
+ * Without state, the translation of the ports must be reversible: a private
+ * host (usually the NAT of a customer's router) must use source ports (or
+ * ICMP echo identifiers) from NAT_DET_FIRST_PORT to NAT_DET_FIRST_PORT + n -
+ * 1, translated to the same offset in its block. The configuration of every
+ * customer is the same, whatever its block. Packets from other ports are
+ * dropped.
+ *
+ * See docs/CONFIGURATION.md.
+ */
+
+// First port of the blocks, and of the private ports.
+#define NAT_DET_FIRST_PORT      1024
+#define NAT_DET_NB_PORTS        (65536 - NAT_DET_FIRST_PORT)
+
+// Mappings of a configuration.
+#define NAT_DET_MAX_MAPPINGS    16
+
+// Addresses are in host order.
+struct nat_det_mapping {
+    uint32_t int_ip;
+    uint32_t nb_int;
+    uint32_t ext_ip;
+    uint32_t nb_ext;
+    // Ports per private address.
+    uint32_t ports;
+};
+
+struct nat_det {
+    unsigned int nb_mappings;
+    struct nat_det_mapping mappings[NAT_DET_MAX_MAPPINGS];
+};
+
+// nat_deterministic.c
+int nat_det_add(struct nat_det *det, uint32_t int_ip, int int_prefix,
+                uint32_t ext_ip, int ext_prefix, int ports);
+
+/*
+ * Mapping whose private network contains ip, NULL if none.
+ */
+static inline const struct nat_det_mapping *
+nat_det_find_int(const struct nat_det *det, uint32_t ip)
+{
+    unsigned int i;
+
+    for (i = 0; i < det->nb_mappings; ++i) {
+        if (ip - det->mappings[i].int_ip < det->mappings[i].nb_int) {
+            return &det->mappings[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Mapping whose public network contains ip, NULL if none.
+ */
+static inline const struct nat_det_mapping *
+nat_det_find_ext(const struct nat_det *det, uint32_t ip)
+{
+    unsigned int i;
+
+    for (i = 0; i < det->nb_mappings; ++i) {
+        if (ip - det->mappings[i].ext_ip < det->mappings[i].nb_ext) {
+            return &det->mappings[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Public address of the private address int_ip of the mapping.
+ */
+static inline uint32_t
+nat_det_ext_ip(const struct nat_det_mapping *m, uint32_t int_ip)
+{
+    return m->ext_ip + (int_ip - m->int_ip) % m->nb_ext;
+}
+
+/*
+ * Public address and port of the private address and port.
+ *
+ * @return
+ *  - -1 if int_port is not a private port.
+ */
+static inline int
+nat_det_out(const struct nat_det_mapping *m, uint32_t int_ip,
+            uint16_t int_port, uint32_t *ext_ip, uint16_t *ext_port)
+{
+    const uint32_t i = int_ip - m->int_ip;
+    const uint32_t offset = (uint32_t)int_port - NAT_DET_FIRST_PORT;
+
+    if (offset >= m->ports) {
+        return -1;
+    }
+    *ext_ip = m->ext_ip + i % m->nb_ext;
+    *ext_port = NAT_DET_FIRST_PORT + (i / m->nb_ext) * m->ports + offset;
+    return 0;
+}
+
+/*
+ * Private address and port of the public address and port.
+ *
+ * @return
+ *  - -1 if ext_port is not in the block of a private address.
+ */
+static inline int
+nat_det_in(const struct nat_det_mapping *m, uint32_t ext_ip,
+           uint16_t ext_port, uint32_t *int_ip, uint16_t *int_port)
+{
+    const uint32_t offset = (uint32_t)ext_port - NAT_DET_FIRST_PORT;
+    uint32_t i;
+
+    if (ext_port < NAT_DET_FIRST_PORT) {
+        return -1;
+    }
+    i = (offset / m->ports) * m->nb_ext + (ext_ip - m->ext_ip);
+    if (i >= m->nb_int) {
+        return -1;
+    }
+    *int_ip = m->int_ip + i;
+    *int_port = NAT_DET_FIRST_PORT + offset % m->ports;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1080 @@
+/* vim: ts=4 sw=4 et */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <rte_atomic.h>
+#include <rte_byteorder.h>
+#include <rte_common.h>
+#include <rte_hash_crc.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+
+static const struct nat_table_ops *
+nat_table_ops(enum nat_table_type type)
+{
+    switch (type) {
+    case NAT_TABLE_HASH:
+        return &nat_table_hash_ops;
+    case NAT_TABLE_DIR24_8:
+        return &nat_table_dir24_8_ops;
+    case NAT_TABLE_LEGACY:
+    default:
+        return &nat_table_legacy_ops;
+    }
+}
+
+const char *
+nat_table_name(enum nat_table_type type)
+{
+    return nat_table_ops(type)->name;
+}
+
+/*
+ * Make room for nb_rules more rules in rules.
+ *
+ * @return
+ *  - -1 on failure
+ */
+static int
+nat_rules_reserve(struct nat_rules *rules, unsigned int nb_rules,
+                  int socket_id)
+{
+    struct nat_rule *new_rules;
+    unsigned int new_size;
+
+    if (rules->size - rules->len >= nb_rules) {
+        return 0;
+    }
+
+    new_size = rules->size ? rules->size * 2 : 1024;
+    while (new_size - rules->len < nb_rules) {
+        new_size *= 2;
+    }
+
+    new_rules = rte_malloc_socket(NULL, new_size * sizeof(*new_rules), 0,
+                                  socket_id);
+    if (new_rules == NULL) {
+        return -1;
+    }
+
+    if (rules->rules) {
+        memcpy(new_rules, rules->rules, rules->len * sizeof(*new_rules));
+        rte_free(rules->rules);
+    }
+    rules->rules = new_rules;
+    rules->size = new_size;
+    return 0;
+}
+
+/*
+ * Append a NAT rule to rules.
+ *
+ * @return
+ *  - -1 on failure
+ */
+int
+nat_rules_add(struct nat_rules *rules, uint32_t int_ip, uint32_t ext_ip,
+              int socket_id)
+{
+    if (nat_rules_reserve(rules, 1, socket_id) < 0) {
+        return -1;
+    }
+
+    rules->rules[rules->len].int_ip = int_ip;
+    rules->rules[rules->len].ext_ip = ext_ip;
+    rules->len++;
+    return 0;
+}
+
+/*
+ * Append the rules of the binary file path to rules. See
+ * struct nat_rules_file_header.
+ *
+ * The file is mapped and its rules are copied all at once, instead of being
+ * parsed and added one by one.
+ *
+ * @return
+ *  - -1 on failure
+ */
+int
+nat_rules_load(struct nat_rules *rules, const char *path, int socket_id)
+{
+    const struct nat_rules_file_header *header;
+    const struct nat_rule *file_rules;
+    struct stat st;
+    uint32_t nb_rules;
+    void *map;
+    int ret = -1;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        RTE_LOG(ERR, APP, "Unable to open NAT rules file %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*header)) {
+        RTE_LOG(ERR, APP, "NAT rules file %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd,
+               0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        RTE_LOG(ERR, APP, "Unable to map NAT rules file %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    header = map;
+    file_rules = (const struct nat_rule *)(header + 1);
+    nb_rules = rte_le_to_cpu_32(header->nb_rules);
+
+    if (memcmp(header->magic, NAT_RULES_FILE_MAGIC,
+               sizeof(header->magic)) != 0 ||
+        rte_le_to_cpu_32(header->version) != NAT_RULES_FILE_VERSION) {
+        RTE_LOG(ERR, APP, "%s is not a NAT rules file, or has an "
+                "unsupported version\n", path);
+        goto out;
+    }
+
+    if ((size_t)st.st_size !=
+        sizeof(*header) + (size_t)nb_rules * sizeof(*file_rules)) {
+        RTE_LOG(ERR, APP, "NAT rules file %s has an invalid size\n", path);
+        goto out;
+    }
+
+    if (nat_rules_reserve(rules, nb_rules, socket_id) < 0) {
+        RTE_LOG(ERR, APP, "Unable to allocate %u NAT rules\n", nb_rules);
+        goto out;
+    }
+
+#if RTE_BYTE_ORDER == RTE_LITTLE_ENDIAN
+    memcpy(&rules->rules[rules->len], file_rules,
+           nb_rules * sizeof(*file_rules));
+#else
+    {
+        uint32_t i;
+
+        for (i = 0; i < nb_rules; ++i) {
+            rules->rules[rules->len + i].int_ip =
+                rte_le_to_cpu_32(file_rules[i].int_ip);
+            rules->rules[rules->len + i].ext_ip =
+                rte_le_to_cpu_32(file_rules[i].ext_ip);
+        }
+    }
+#endif
+    rules->len += nb_rules;
+    ret = 0;
+
+out:
+    munmap(map, st.st_size);
+    return ret;
+}
+
+static uint32_t
+prefix_mask(int prefix)
+{
+    return prefix ? ~0U << (32 - prefix) : 0;
+}
+
+/*
+ * Append the prefix rule int_ip/prefix -> ext_ip/prefix to rules.
+ *
+ * @return
+ *  - -1 if there are too many prefix rules, if prefix is invalid, or if a
+ *    network is already translated by another prefix rule.
+ */
+int
+nat_rules_add_prefix(struct nat_rules *rules, uint32_t int_ip,
+                     uint32_t ext_ip, int prefix)
+{
+    const struct nat_prefix_rule *other;
+    uint32_t mask;
+    unsigned int i;
+
+    if (rules->nb_prefixes == NAT_MAX_PREFIX_RULES) {
+        RTE_LOG(ERR, APP, "Too many prefix NAT rules\n");
+        return -1;
+    }
+
+    if (prefix <= 0 || prefix > 32) {
+        RTE_LOG(ERR, APP, "Invalid prefix NAT rule\n");
+        return -1;
+    }
+
+    mask = prefix_mask(prefix);
+    int_ip &= mask;
+    ext_ip &= mask;
+
+    // With the same network on the same side of several rules, the
+    // translation of an address would depend on the order of the rules.
+    for (i = 0; i < rules->nb_prefixes; ++i) {
+        other = &rules->prefixes[i];
+        if (other->prefix == prefix &&
+            (other->int_ip == int_ip || other->ext_ip == ext_ip)) {
+            RTE_LOG(ERR, APP, "Network " IPv4_FMT "/%i already used by a "
+                    "prefix NAT rule\n",
+                    IPv4_FMTARGS(other->int_ip == int_ip ? int_ip : ext_ip),
+                    prefix);
+            return -1;
+        }
+    }
+
+    rules->prefixes[rules->nb_prefixes].int_ip = int_ip;
+    rules->prefixes[rules->nb_prefixes].ext_ip = ext_ip;
+    rules->prefixes[rules->nb_prefixes].prefix = prefix;
+    rules->nb_prefixes++;
+    return 0;
+}
+
+void
+nat_rules_free(struct nat_rules *rules)
+{
+    rte_free(rules->rules);
+    memset(rules, 0, sizeof(*rules));
+}
+
+static int
+nat_prefix_cmp(const void *a, const void *b)
+{
+    const struct nat_prefix *pa = a;
+    const struct nat_prefix *pb = b;
+
+    // Longest prefix first: the mask with more bits set is the greatest.
+    if (pa->mask != pb->mask) {
+        return (pa->mask < pb->mask) - (pa->mask > pb->mask);
+    }
+    return (pa->network > pb->network) - (pa->network < pb->network);
+}
+
+/*
+ * Store the entries of the prefix rules in the table of their direction.
+ */
+static void
+nat_table_set_prefixes(struct nat_table *table, const struct nat_rules *rules)
+{
+    const struct nat_prefix_rule *rule;
+    struct nat_prefix *prefix;
+    unsigned int i;
+
+    for (i = 0; i < rules->nb_prefixes; ++i) {
+        rule = &rules->prefixes[i];
+        prefix = &table->prefixes[i];
+        prefix->mask = prefix_mask(rule->prefix);
+        if (table->dir == NAT_DIR_OUT) {
+            prefix->network = rule->int_ip;
+            prefix->to = rule->ext_ip;
+        } else {
+            prefix->network = rule->ext_ip;
+            prefix->to = rule->int_ip;
+        }
+    }
+    table->nb_prefixes = rules->nb_prefixes;
+    qsort(table->prefixes, table->nb_prefixes, sizeof(*table->prefixes),
+          &nat_prefix_cmp);
+}
+
+/*
+ * Set the bits of key in the prefilter of table. Called before the entry of
+ * key is set, so a worker never misses the entry because of the prefilter.
+ * Keys whose bits are already set don't count against prefilter_max_keys.
+ */
+static void
+nat_prefilter_add(struct nat_table *table, uint32_t key)
+{
+    uint64_t *block;
+    uint64_t bits;
+    uint32_t bit;
+    int i;
+
+    if (nat_prefilter_contains(table, key)) {
+        return ;
+    }
+    table->prefilter_nb_keys++;
+
+    block = nat_prefilter_block(table, key, &bits);
+    for (i = 0; i < NAT_PREFILTER_NB_HASHES; ++i) {
+        bit = (bits >> (64 - 9 * (i + 1))) & 511;
+        block[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+static void
+nat_prefilter_add_entry(uint32_t from, uint32_t to, uint32_t slot, void *arg)
+{
+    nat_prefilter_add(arg, from);
+}
+
+static void
+nat_prefilter_count_entry(uint32_t from, uint32_t to, uint32_t slot,
+                          void *arg)
+{
+    (*(uint32_t *)arg)++;
+}
+
+/*
+ * Build the prefilter of table from its backend entries, sized for the
+ * entries plus nb_entries new ones and NAT_PREFILTER_ROOM more. Must be
+ * called before table is published to the workers.
+ *
+ * @return
+ *  - -1 on failure.
+ */
+static int
+nat_prefilter_build(struct nat_table *table, unsigned int nb_entries,
+                    int socket_id)
+{
+    uint32_t nb_keys = 0;
+    uint64_t max_keys;
+    uint32_t nb_blocks;
+
+    table->ops->iter(table, &nat_prefilter_count_entry, &nb_keys);
+    max_keys = (uint64_t)nb_keys + nb_entries + NAT_PREFILTER_ROOM;
+
+    nb_blocks = rte_align32pow2(RTE_MAX(
+        max_keys * NAT_PREFILTER_BITS_PER_KEY / (RTE_CACHE_LINE_SIZE * 8),
+        1));
+    table->prefilter = rte_zmalloc_socket(
+        NULL, (size_t)nb_blocks * RTE_CACHE_LINE_SIZE, RTE_CACHE_LINE_SIZE,
+        socket_id);
+    if (table->prefilter == NULL) {
+        RTE_LOG(ERR, APP, "Unable to allocate a NAT prefilter of %lu keys\n",
+                (unsigned long)max_keys);
+        return -1;
+    }
+    table->prefilter_mask = nb_blocks - 1;
+    // Blocks are rounded up to a power of 2
+    table->prefilter_max_keys = RTE_MIN(
+        (uint64_t)nb_blocks * RTE_CACHE_LINE_SIZE * 8 /
+        NAT_PREFILTER_BITS_PER_KEY, UINT32_MAX);
+    table->prefilter_nb_keys = 0;
+
+    table->ops->iter(table, &nat_prefilter_add_entry, table);
+    return 0;
+}
+
+/*
+ * @return
+ *  - True if nb_entries new keys can be added to the prefilter of table, or
+ *    if table has no prefilter.
+ */
+static int
+nat_prefilter_room(const struct nat_table *table, unsigned int nb_entries)
+{
+    return table->prefilter == NULL ||
+           (uint64_t)table->prefilter_nb_keys + nb_entries <=
+           table->prefilter_max_keys;
+}
+
+/*
+ * Build the NAT table of direction dir of the given type from rules, with a
+ * prefilter if prefilter is set.
+ *
+ * @return
+ *  - NULL if there are no rules, or on failure.
+ */
+struct nat_table *
+nat_table_create(enum nat_table_type type, const struct nat_rules *rules,
+                 enum nat_dir dir, int prefilter, int socket_id)
+{
+    const struct nat_table_ops *ops = nat_table_ops(type);
+    struct nat_table *table;
+
+    if (rules->len == 0 && rules->nb_prefixes == 0) {
+        return NULL;
+    }
+
+    table = ops->create(rules->rules, rules->len, dir, socket_id);
+    if (table == NULL) {
+        RTE_LOG(ERR, APP, "Unable to create NAT table %s of %u rules\n",
+                ops->name, rules->len);
+        return NULL;
+    }
+
+    table->type = type;
+    table->ops = ops;
+    table->dir = dir;
+    nat_table_set_prefixes(table, rules);
+
+    if (prefilter && nat_prefilter_build(table, 0, socket_id) < 0) {
+        nat_table_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void
+nat_table_free(struct nat_table *table)
+{
+    unsigned int lcore_id;
+
+    if (table) {
+        for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; ++lcore_id) {
+            rte_free(table->counters[lcore_id]);
+        }
+        rte_free(table->prefilter);
+        table->ops->free(table);
+    }
+}
+
+/*
+ * Add the counters of the workers for the entry at slot to sum.
+ */
+static void
+nat_table_counters_sum(const struct nat_table *table, uint32_t slot,
+                       struct nat_counter *sum)
+{
+    unsigned int lcore_id;
+
+    for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; ++lcore_id) {
+        if (table->counters[lcore_id]) {
+            sum->packets += table->counters[lcore_id][slot].packets;
+            sum->bytes += table->counters[lcore_id][slot].bytes;
+        }
+    }
+}
+
+/*
+ * Set the entry of key to value (network order) with ops->set. If the entry
+ * translated to another address, its counters belonged to another rule and
+ * are reset: a packet counted by a worker during the reset may be kept.
+ *
+ * @return
+ *  - -1 if the backend or the prefilter of table is full.
+ */
+static int
+nat_table_set(struct nat_table *table, uint32_t key, uint32_t value)
+{
+    unsigned int lcore_id;
+    uint32_t slot;
+    uint32_t cur;
+
+    if (value && !nat_prefilter_room(table, 1)) {
+        return -1;
+    }
+
+    if (table->nb_slots &&
+        nat_table_lookup_slot(table, key, &cur, &slot) == 0 &&
+        slot != NAT_PREFIX_SLOT && cur != value) {
+        for (lcore_id = 0; lcore_id < RTE_MAX_LCORE; ++lcore_id) {
+            if (table->counters[lcore_id]) {
+                memset(&table->counters[lcore_id][slot], 0,
+                       sizeof(struct nat_counter));
+            }
+        }
+    }
+
+    if (table->prefilter && value) {
+        nat_prefilter_add(table, key);
+        rte_smp_wmb();
+    }
+    return table->ops->set(table, key, value);
+}
+
+/*
+ * Remove the entry of key if it translates to value (host order): the entry
+ * may belong to another rule. Prefix rules are not removed.
+ */
+static void
+nat_table_unset(struct nat_table *table, uint32_t key, uint32_t value)
+{
+    uint32_t slot;
+    uint32_t cur;
+
+    if (nat_table_lookup_slot(table, key, &cur, &slot) == 0 &&
+        slot != NAT_PREFIX_SLOT && cur == rte_cpu_to_be_32(value)) {
+        nat_table_set(table, key, 0);
+    }
+}
+
+/*
+ * Apply update to the tables of both directions.
+ */
+static int
+nat_table_apply(struct nat_table **tables, const struct nat_update *update)
+{
+    const struct nat_rule *rule = &update->rule;
+    struct nat_table *out = tables[NAT_DIR_OUT];
+    struct nat_table *in = tables[NAT_DIR_IN];
+    uint32_t prev;
+
+    switch (update->op) {
+    case NAT_UPDATE_DEL:
+        nat_table_unset(out, rule->int_ip, rule->ext_ip);
+        nat_table_unset(in, rule->ext_ip, rule->int_ip);
+        return 0;
+
+    case NAT_UPDATE_REPLACE:
+        if (nat_table_lookup(out, rule->int_ip, &prev) == 0 &&
+            rte_be_to_cpu_32(prev) != rule->ext_ip) {
+            nat_table_unset(in, rte_be_to_cpu_32(prev), rule->int_ip);
+        }
+        /* fallthrough */
+    case NAT_UPDATE_ADD:
+    default:
+        if (nat_table_set(out, rule->int_ip,
+                          rte_cpu_to_be_32(rule->ext_ip)) < 0 ||
+            nat_table_set(in, rule->ext_ip,
+                          rte_cpu_to_be_32(rule->int_ip)) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+}
+
+/*
+ * Copy of table with room for nb_entries new entries, including its prefix
+ * entries. The prefilter of the copy is rebuilt for its entries, without the
+ * entries removed from table.
+ */
+static struct nat_table *
+nat_table_copy(const struct nat_table *table, unsigned int nb_entries,
+               int socket_id)
+{
+    struct nat_table *copy;
+
+    copy = table->ops->copy(table, nb_entries, socket_id);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy->type = table->type;
+    copy->ops = table->ops;
+    copy->dir = table->dir;
+    copy->nb_prefixes = table->nb_prefixes;
+    memcpy(copy->prefixes, table->prefixes,
+           table->nb_prefixes * sizeof(*table->prefixes));
+
+    if (table->prefilter &&
+        nat_prefilter_build(copy, nb_entries, socket_id) < 0) {
+        nat_table_free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/*
+ * Table of direction dir with room for nb_entries new entries: table itself,
+ * or a copy of table, or a new empty table if table is NULL, with a prefilter
+ * if prefilter is set.
+ */
+static struct nat_table *
+nat_table_reserve(struct nat_table *table, enum nat_table_type type,
+                  enum nat_dir dir, int prefilter, unsigned int nb_entries,
+                  int socket_id)
+{
+    const struct nat_table_ops *ops = nat_table_ops(type);
+    struct nat_table *new_table = table;
+    struct nat_table *copy;
+
+    // Configurations without NAT rules have no table
+    if (table == NULL) {
+        new_table = ops->create(NULL, 0, dir, socket_id);
+        if (new_table == NULL) {
+            return NULL;
+        }
+        new_table->type = type;
+        new_table->ops = ops;
+        new_table->dir = dir;
+        if (prefilter &&
+            nat_prefilter_build(new_table, nb_entries, socket_id) < 0) {
+            nat_table_free(new_table);
+            return NULL;
+        }
+    }
+
+    if ((ops->room && !ops->room(new_table, nb_entries)) ||
+        !nat_prefilter_room(new_table, nb_entries)) {
+        copy = nat_table_copy(new_table, nb_entries, socket_id);
+        if (new_table != table) {
+            nat_table_free(new_table);
+        }
+        new_table = copy;
+    }
+    return new_table;
+}
+
+/*
+ * Allocate the counters of the tables of new_tables which are not in tables.
+ */
+static int
+nat_table_new_counters(struct nat_table *const *tables,
+                       struct nat_table *const *new_tables, int socket_id)
+{
+    unsigned int dir;
+
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (new_tables[dir] != tables[dir] &&
+            nat_table_counters_alloc(new_tables[dir], socket_id) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Apply updates to tables, the tables of both directions, while workers are
+ * looking them up.
+ *
+ * Updates are applied in place if a table, and its prefilter, have room for
+ * them. Otherwise, or if a table is NULL, they are applied to a new table, stored in tables, and the
+ * previous table is left untouched: the caller publishes the new table, and
+ * frees the previous one once the workers no longer reference it. A new
+ * table has a prefilter if prefilter is set, and a copy if its table has one.
+ * If counters is set, new tables get counters. Those of the tables reserved
+ * for the updates are allocated before any update is applied in place. Those
+ * of copies made once a table ran out of room anyway are allocated once the
+ * remaining updates are applied, since sizing the counters of a legacy table
+ * limits its rows.
+ *
+ * @return
+ *  - -1 on failure. tables is left untouched, but updates applied in place
+ *    are not reverted.
+ */
+int
+nat_table_update(struct nat_table **tables, enum nat_table_type type,
+                 int prefilter, int counters, const struct nat_update *updates,
+                 unsigned int nb_updates, int socket_id)
+{
+    struct nat_table *new_tables[NAT_NB_DIRS] = {};
+    struct nat_table *copy;
+    int copied = 0;
+    unsigned int dir;
+    unsigned int i;
+
+    // Each update adds at most one entry to each table
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        new_tables[dir] = nat_table_reserve(tables[dir], type, dir,
+                                            prefilter, nb_updates, socket_id);
+        if (new_tables[dir] == NULL) {
+            goto fail;
+        }
+    }
+    if (counters && nat_table_new_counters(tables, new_tables, socket_id) < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < nb_updates; ++i) {
+        if (nat_table_apply(new_tables, &updates[i]) == 0) {
+            continue ;
+        }
+
+        // A table ran out of room anyway: apply the remaining updates to
+        // copies of both tables, once. An update applied twice has the same
+        // effect, so the failed update is applied again.
+        if (copied) {
+            goto fail;
+        }
+        for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+            copy = new_tables[dir]->ops->copy ?
+                nat_table_copy(new_tables[dir], nb_updates - i, socket_id) :
+                NULL;
+            if (new_tables[dir] != tables[dir]) {
+                nat_table_free(new_tables[dir]);
+            }
+            new_tables[dir] = copy;
+        }
+        if (new_tables[NAT_DIR_OUT] == NULL || new_tables[NAT_DIR_IN] == NULL) {
+            goto fail;
+        }
+        copied = 1;
+        --i;
+    }
+    if (copied && counters &&
+        nat_table_new_counters(tables, new_tables, socket_id) < 0) {
+        goto fail;
+    }
+
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        tables[dir] = new_tables[dir];
+    }
+    return 0;
+
+fail:
+    RTE_LOG(ERR, APP, "Unable to update NAT table %s\n",
+            nat_table_name(type));
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (new_tables[dir] != tables[dir]) {
+            nat_table_free(new_tables[dir]);
+        }
+    }
+    return -1;
+}
+
+size_t
+nat_table_memory(const struct nat_table *table)
+{
+    if (table == NULL) {
+        return 0;
+    }
+    return table->ops->memory(table) +
+        (table->prefilter ?
+         ((size_t)table->prefilter_mask + 1) * RTE_CACHE_LINE_SIZE : 0);
+}
+
+/*
+ * Allocate the counters of the workers of socket_id, which use table. Must be
+ * called before table is published to the workers.
+ *
+ * @return
+ *  - -1 on failure. The counters are freed with table.
+ */
+int
+nat_table_counters_alloc(struct nat_table *table, int socket_id)
+{
+    unsigned int lcore_id;
+    uint32_t nb_slots;
+
+    nb_slots = table->ops->nb_slots(table);
+
+    RTE_LCORE_FOREACH_SLAVE(lcore_id) {
+        if ((int)rte_lcore_to_socket_id(lcore_id) != socket_id) {
+            continue ;
+        }
+        table->counters[lcore_id] = rte_zmalloc_socket(
+            NULL, (size_t)nb_slots * sizeof(struct nat_counter),
+            RTE_CACHE_LINE_SIZE, socket_id);
+        if (table->counters[lcore_id] == NULL) {
+            RTE_LOG(ERR, APP, "Unable to allocate NAT counters of %u "
+                    "entries\n", nb_slots);
+            return -1;
+        }
+    }
+    table->nb_slots = nb_slots;
+    return 0;
+}
+
+/*
+ * Counters of the entries of freed tables, summed by translation. An entry
+ * which is still in the table of the workers after a reload or a copy keeps
+ * its counters this way. Only accessed by the master core.
+ *
+ * Open addressing hash table, at most half full. Entries whose to is 0 are
+ * empty.
+ */
+struct nat_counters_entry {
+    uint32_t from;
+    uint32_t to;
+    struct nat_counter counter;
+};
+
+static struct {
+    struct nat_counters_entry *entries;
+    // Number of entries - 1, or 0 if entries is NULL.
+    uint32_t mask;
+    uint32_t len;
+} archive;
+
+static struct nat_counters_entry *
+archive_slot(struct nat_counters_entry *entries, uint32_t mask, uint32_t from,
+             uint32_t to)
+{
+    uint32_t idx;
+
+    idx = rte_hash_crc_4byte(to, rte_hash_crc_4byte(from, 0)) & mask;
+    while (entries[idx].to != 0 &&
+           (entries[idx].from != from || entries[idx].to != to)) {
+        idx = (idx + 1) & mask;
+    }
+    return &entries[idx];
+}
+
+/*
+ * Whether the entry from -> to (host order) is in one of tables.
+ */
+static int
+nat_tables_contain(struct nat_table *const *tables, unsigned int nb_tables,
+                   uint32_t from, uint32_t to)
+{
+    uint32_t value;
+    unsigned int i;
+
+    for (i = 0; i < nb_tables; ++i) {
+        if (nat_table_lookup(tables[i], from, &value) == 0 &&
+            value == rte_cpu_to_be_32(to)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rehash the archive to nb_entries entries, keeping only the entries still in
+ * one of tables if nb_tables is not 0.
+ */
+static int
+archive_resize(uint32_t nb_entries, struct nat_table *const *tables,
+               unsigned int nb_tables)
+{
+    struct nat_counters_entry *entries;
+    struct nat_counters_entry *entry;
+    uint32_t i;
+
+    entries = calloc(nb_entries, sizeof(*entries));
+    if (entries == NULL) {
+        return -1;
+    }
+
+    archive.len = 0;
+    for (i = 0; archive.entries && i <= archive.mask; ++i) {
+        entry = &archive.entries[i];
+        if (entry->to == 0) {
+            continue ;
+        }
+        if (nb_tables &&
+            !nat_tables_contain(tables, nb_tables, entry->from, entry->to)) {
+            continue ;
+        }
+        *archive_slot(entries, nb_entries - 1, entry->from, entry->to) =
+            *entry;
+        archive.len++;
+    }
+
+    free(archive.entries);
+    archive.entries = entries;
+    archive.mask = nb_entries - 1;
+    return 0;
+}
+
+static void
+nat_archive_entry(uint32_t from, uint32_t to, uint32_t slot, void *arg)
+{
+    const struct nat_table *table = arg;
+    struct nat_counters_entry *entry;
+    struct nat_counter sum = {0, 0};
+
+    nat_table_counters_sum(table, slot, &sum);
+    if (sum.packets == 0) {
+        return ;
+    }
+
+    if ((archive.len + 1) * 2 > archive.mask + 1 &&
+        archive_resize(archive.entries ? (archive.mask + 1) * 2 : 1024,
+                       NULL, 0) < 0) {
+        RTE_LOG(ERR, APP, "Unable to archive NAT counters of " IPv4_FMT
+                " -> " IPv4_FMT "\n", IPv4_FMTARGS(from), IPv4_FMTARGS(to));
+        return ;
+    }
+
+    entry = archive_slot(archive.entries, archive.mask, from, to);
+    if (entry->to == 0) {
+        entry->from = from;
+        entry->to = to;
+        archive.len++;
+    }
+    entry->counter.packets += sum.packets;
+    entry->counter.bytes += sum.bytes;
+}
+
+/*
+ * Keep the counters of table, which is about to be freed and no longer used
+ * by the workers.
+ */
+void
+nat_table_counters_archive(const struct nat_table *table)
+{
+    if (table && table->nb_slots) {
+        table->ops->iter(table, &nat_archive_entry, (void *)table);
+    }
+}
+
+/*
+ * Forget the archived counters of the entries which are not in tables, the
+ * tables now used by the workers. tables may contain NULL.
+ */
+void
+nat_table_counters_prune(struct nat_table *const *tables,
+                         unsigned int nb_tables)
+{
+    unsigned int i;
+
+    if (archive.entries == NULL) {
+        return ;
+    }
+
+    for (i = 0; i < nb_tables && tables[i] == NULL; ++i)
+        ;
+    if (i == nb_tables) {
+        free(archive.entries);
+        memset(&archive, 0, sizeof(archive));
+        return ;
+    }
+
+    if (archive_resize(archive.mask + 1, tables, nb_tables) < 0) {
+        RTE_LOG(ERR, APP, "Unable to prune NAT counters\n");
+    }
+}
+
+struct nat_counters_read {
+    struct nat_table *const *tables;
+    unsigned int nb_tables;
+    void (*func)(uint32_t from, uint32_t to,
+                 const struct nat_counter *counter, void *arg);
+    void *arg;
+};
+
+static void
+nat_read_entry(uint32_t from, uint32_t to, uint32_t slot, void *arg)
+{
+    const struct nat_counters_read *read = arg;
+    const struct nat_counters_entry *entry;
+    struct nat_counter counter = {0, 0};
+    uint32_t value;
+    unsigned int i;
+
+    if (archive.entries) {
+        entry = archive_slot(archive.entries, archive.mask, from, to);
+        counter = entry->counter;
+    }
+
+    nat_table_counters_sum(read->tables[0], slot, &counter);
+    for (i = 1; i < read->nb_tables; ++i) {
+        if (read->tables[i]->nb_slots &&
+            nat_table_lookup_slot(read->tables[i], from, &value, &slot) == 0 &&
+            slot != NAT_PREFIX_SLOT && value == rte_cpu_to_be_32(to)) {
+            nat_table_counters_sum(read->tables[i], slot, &counter);
+        }
+    }
+
+    read->func(from, to, &counter, read->arg);
+}
+
+/*
+ * Call func with the counters of each entry of tables[0], summed over the
+ * workers of all the tables and the archived counters. tables are the tables
+ * of the workers of each socket, followed by the replaced tables not freed
+ * yet: their entries are those of tables[0].
+ *
+ * Workers keep counting while the counters are read.
+ *
+ * @return
+ *  - -1 if counters are disabled.
+ */
+int
+nat_table_counters_read(struct nat_table *const *tables,
+                        unsigned int nb_tables,
+                        void (*func)(uint32_t from, uint32_t to,
+                                     const struct nat_counter *counter,
+                                     void *arg),
+                        void *arg)
+{
+    struct nat_counters_read read = {tables, nb_tables, func, arg};
+
+    if (nb_tables == 0 || tables[0] == NULL || tables[0]->nb_slots == 0) {
+        return -1;
+    }
+
+    tables[0]->ops->iter(tables[0], &nat_read_entry, &read);
+    return 0;
+}
+
+struct nat_entries {
+    struct nat_rule *entries;
+    size_t len;
+};
+
+static void
+nat_count_entry(uint32_t from, uint32_t to, uint32_t slot, void *arg)
+{
+    ++*(size_t *)arg;
+}
+
+static void
+nat_collect_entry(uint32_t from, uint32_t to, uint32_t slot, void *arg)
+{
+    struct nat_entries *entries = arg;
+
+    entries->entries[entries->len].int_ip = from;
+    entries->entries[entries->len].ext_ip = to;
+    entries->len++;
+}
+
+static int
+nat_entry_cmp(const void *a, const void *b)
+{
+    const struct nat_rule *ra = a;
+    const struct nat_rule *rb = b;
+
+    return (ra->int_ip > rb->int_ip) - (ra->int_ip < rb->int_ip);
+}
+
+/*
+ * Display the entries of the NAT lookup table, sorted by source address, then
+ * its prefix entries.
+ *
+ * @return
+ *  - Number of entries in table.
+ */
+int
+nat_dump_rules(int out_fd, const struct nat_table *table)
+{
+    struct nat_entries entries;
+    size_t n;
+    size_t i;
+
+    if (table == NULL) {
+        return 0;
+    }
+
+    n = 0;
+    table->ops->iter(table, &nat_count_entry, &n);
+
+    entries.len = 0;
+    entries.entries = malloc(n * sizeof(*entries.entries));
+    if (entries.entries == NULL) {
+        return -1;
+    }
+    table->ops->iter(table, &nat_collect_entry, &entries);
+
+    qsort(entries.entries, entries.len, sizeof(*entries.entries),
+          &nat_entry_cmp);
+
+    for (i = 0; i < entries.len; ++i) {
+        dprintf(out_fd, IPv4_FMT " -> " IPv4_FMT "\n",
+                IPv4_FMTARGS(entries.entries[i].int_ip),
+                IPv4_FMTARGS(entries.entries[i].ext_ip));
+    }
+
+    free(entries.entries);
+
+    for (i = 0; i < table->nb_prefixes; ++i) {
+        dprintf(out_fd, IPv4_FMT "/%i -> " IPv4_FMT "/%i\n",
+                IPv4_FMTARGS(table->prefixes[i].network),
+                __builtin_popcount(table->prefixes[i].mask),
+                IPv4_FMTARGS(table->prefixes[i].to),
+                __builtin_popcount(table->prefixes[i].mask));
+    }
+
+    return n + table->nb_prefixes;
+}
+
+/*
+ * Number of rules in table: each rule has one entry in the table of each
+ * direction.
+ */
+int
+nat_number_of_rules(const struct nat_table *table)
+{
+    size_t n;
+
+    if (table == NULL) {
+        return 0;
+    }
+
+    n = 0;
+    table->ops->iter(table, &nat_count_entry, &n);
+    return n + table->nb_prefixes;
+}
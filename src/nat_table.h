@@ -0,0 +1,463 @@
+/* vim: ts=4 sw=4 et */
+#ifndef NAT_TABLE_H_
+#define NAT_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <rte_byteorder.h>
+#include <rte_config.h>
+#include <rte_hash_crc.h>
+
+/*
+ * NAT lookup tables.
+ *
+ * A NAT table maps an IPv4 address (host order) to the IPv4 address (network
+ * order) it should be translated to. Each direction has its own table: the
+ * rule "10.1.2.3 -> 212.10.11.12" is stored as the entry 10.1.2.3 ->
+ * 212.10.11.12 of the NAT_DIR_OUT table, and as the entry 212.10.11.12 ->
+ * 10.1.2.3 of the NAT_DIR_IN table.
+ *
+ * Several backends are available, and selected in the configuration section
+ * with "nat table <backend>;". See docs/CONFIGURATION.md.
+ */
+
+enum nat_dir {
+    // Internal to external addresses, looked up by "nat rewrite
+    // ipv4.src_addr".
+    NAT_DIR_OUT,
+    // External to internal addresses, looked up by "nat rewrite
+    // ipv4.dst_addr".
+    NAT_DIR_IN,
+    NAT_NB_DIRS,
+};
+
+enum nat_table_type {
+    // 3 levels table: 256 x 256 x 65536 addresses. Fast for rules packed in
+    // a few /16, but each /16 used costs 256KB.
+    NAT_TABLE_LEGACY,
+    // Open addressing hash table with cache line sized buckets. Costs a few
+    // bytes per rule, and a lookup reads a single cache line.
+    NAT_TABLE_HASH,
+    // DIR-24-8 table (rte_lpm). Costs a fixed 64MB plus 1KB per /24 used,
+    // and a lookup reads at most two entries.
+    NAT_TABLE_DIR24_8,
+};
+
+// A NAT rule, as read from the configuration file. Addresses are in host
+// order.
+struct nat_rule {
+    uint32_t int_ip;
+    uint32_t ext_ip;
+};
+
+// Key and value of the entry of rule in the table of direction dir.
+static inline uint32_t
+nat_rule_from(const struct nat_rule *rule, enum nat_dir dir)
+{
+    return dir == NAT_DIR_OUT ? rule->int_ip : rule->ext_ip;
+}
+
+static inline uint32_t
+nat_rule_to(const struct nat_rule *rule, enum nat_dir dir)
+{
+    return dir == NAT_DIR_OUT ? rule->ext_ip : rule->int_ip;
+}
+
+// Change of a NAT rule applied to a live table, see nat_table_update().
+enum nat_update_op {
+    // Add the rule, like "nat rule" in the configuration file.
+    NAT_UPDATE_ADD,
+    // Remove both entries of the rule.
+    NAT_UPDATE_DEL,
+    // Add the rule, and remove the NAT_DIR_IN entry of the previous external
+    // address of int_ip.
+    NAT_UPDATE_REPLACE,
+};
+
+struct nat_update {
+    enum nat_update_op op;
+    struct nat_rule rule;
+};
+
+/*
+ * Binary NAT rules file, loaded with "nat rules FILE;" and generated by
+ * tools/nat_rules_convert.py.
+ *
+ * The header is followed by nb_rules struct nat_rule, sorted by internal
+ * address, so neither an internal nor an external address may be used by
+ * several rules. All the fields are little-endian: on x86, the file is the array of rules as stored in
+ * memory.
+ */
+#define NAT_RULES_FILE_MAGIC    "NATRULES"
+#define NAT_RULES_FILE_VERSION  1
+
+struct nat_rules_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_rules;
+};
+
+/*
+ * Prefix NAT rule, "nat rule 10.8.0.0/16 51.15.0.0/16;": each address of the
+ * internal network is translated to the address of the external network with
+ * the same host bits, and back. Addresses are in host order.
+ *
+ * A prefix rule is stored as a prefix entry in the header of the table of
+ * each direction, instead of one entry per address in the backend: entries set
+ * with "nat rule" take precedence over prefix rules, and longer prefixes over
+ * shorter ones.
+ */
+#define NAT_MAX_PREFIX_RULES    32
+
+struct nat_prefix_rule {
+    uint32_t int_ip;
+    uint32_t ext_ip;
+    int prefix;
+};
+
+// Growable array of NAT rules, and prefix NAT rules.
+struct nat_rules {
+    struct nat_rule *rules;
+    unsigned int len;
+    unsigned int size;
+
+    struct nat_prefix_rule prefixes[NAT_MAX_PREFIX_RULES];
+    unsigned int nb_prefixes;
+};
+
+// Entry of a prefix rule: addresses matching network/mask are
+// translated to to | (address & ~mask). Host order.
+struct nat_prefix {
+    uint32_t network;
+    uint32_t mask;
+    uint32_t to;
+};
+
+/*
+ * Packets and bytes translated by an entry of a NAT table, counted when
+ * enabled with "nat counters;".
+ *
+ * Each worker counts in its own array, allocated on its socket and indexed by
+ * the slot of the entry in the table: counting a packet is a single increment
+ * in memory only written by the worker, without atomics nor false sharing.
+ * The arrays of all the workers are summed on demand by
+ * nat_table_counters_read().
+ */
+struct nat_counter {
+    uint64_t packets;
+    uint64_t bytes;
+};
+
+struct nat_table;
+
+// Functions implemented by each backend.
+struct nat_table_ops {
+    const char *name;
+
+    // Build the table of direction dir from nb_rules rules, on the NUMA
+    // socket socket_id.
+    struct nat_table *(*create)(const struct nat_rule *rules,
+                                unsigned int nb_rules, enum nat_dir dir,
+                                int socket_id);
+    void (*free)(struct nat_table *table);
+
+    // Call func for each entry of the table, in no particular order. from
+    // and to are in host order, slot is the slot of the entry.
+    void (*iter)(const struct nat_table *table,
+                 void (*func)(uint32_t from, uint32_t to, uint32_t slot,
+                              void *arg),
+                 void *arg);
+
+    // Memory used by the table, in bytes.
+    size_t (*memory)(const struct nat_table *table);
+
+    // Set the entry of key (host order) to value (network order), or remove
+    // it if value is 0, while workers are looking up the table: a lookup
+    // returns either the previous or the new value.
+    int (*set)(struct nat_table *table, uint32_t key, uint32_t value);
+
+    // Whether nb_entries new entries can be set. NULL if the table never
+    // runs out of room.
+    int (*room)(const struct nat_table *table, unsigned int nb_entries);
+
+    // Copy of table with room for nb_entries new entries, on the NUMA socket
+    // socket_id. Only required if room is set, or if set can fail.
+    struct nat_table *(*copy)(const struct nat_table *table,
+                              unsigned int nb_entries, int socket_id);
+
+    // Upper bound of the slots returned by lookups, to size the counters.
+    // Once called, set fails instead of using a slot above the bound.
+    uint32_t (*nb_slots)(struct nat_table *table);
+};
+
+// Slot returned by lookups of addresses translated by a prefix rule, which
+// have no counters.
+#define NAT_PREFIX_SLOT UINT32_MAX
+
+/*
+ * Prefilter of a NAT table, enabled with "nat prefilter;": a blocked Bloom
+ * filter of the keys of the backend entries, checked before the backend
+ * lookup. An address without entry is usually rejected by reading a single
+ * cache line of the filter, instead of missing in the backend, which is
+ * often a DRAM access.
+ *
+ * The filter is an array of blocks of the size of a cache line. The block of
+ * a key is selected by a CRC32 hash of the key, and NAT_PREFILTER_NB_HASHES
+ * bits of the block by a multiplicative hash. With
+ * NAT_PREFILTER_BITS_PER_KEY bits per key, about 0.5% of the addresses
+ * without entry pass the filter.
+ *
+ * Bits are only set: entries removed by nat_table_update() stay in the filter
+ * until the table is rebuilt or copied. The filter is sized for its entries
+ * plus those nat_table_update() is about to add and NAT_PREFILTER_ROOM more,
+ * like the room of the backends. Once that many keys have been added, updates
+ * are applied to a copy of the table, with a new filter, so the rate of false
+ * positives stays bounded.
+ */
+#define NAT_PREFILTER_BITS_PER_KEY  16
+#define NAT_PREFILTER_ROOM          1024
+#define NAT_PREFILTER_NB_HASHES     4
+#define NAT_PREFILTER_BLOCK_WORDS   (RTE_CACHE_LINE_SIZE / sizeof(uint64_t))
+#define NAT_PREFILTER_SEED          0x5bd1e995
+
+// Header of every backend table.
+struct nat_table {
+    enum nat_table_type type;
+    const struct nat_table_ops *ops;
+    enum nat_dir dir;
+
+    // Entries of the prefix rules, longest prefixes first. Looked up when
+    // the backend doesn't have an entry for the address.
+    unsigned int nb_prefixes;
+    struct nat_prefix prefixes[NAT_MAX_PREFIX_RULES];
+
+    // Prefilter of the backend entries, NULL if disabled. The number of
+    // blocks is prefilter_mask + 1, a power of 2.
+    uint64_t *prefilter;
+    uint32_t prefilter_mask;
+    // Keys the prefilter is sized for, and keys added to it, including the
+    // keys of removed entries.
+    uint32_t prefilter_max_keys;
+    uint32_t prefilter_nb_keys;
+
+    // Counters of each worker using the table, indexed by slot, see
+    // struct nat_counter. nb_slots is 0 if counters are disabled.
+    uint32_t nb_slots;
+    struct nat_counter *counters[RTE_MAX_LCORE];
+};
+
+extern const struct nat_table_ops nat_table_legacy_ops;
+extern const struct nat_table_ops nat_table_hash_ops;
+extern const struct nat_table_ops nat_table_dir24_8_ops;
+
+int nat_table_legacy_lookup(const struct nat_table *table, uint32_t ip,
+                            uint32_t *value, uint32_t *slot);
+int nat_table_hash_lookup(const struct nat_table *table, uint32_t ip,
+                          uint32_t *value, uint32_t *slot);
+int nat_table_dir24_8_lookup(const struct nat_table *table, uint32_t ip,
+                             uint32_t *value, uint32_t *slot);
+
+void nat_table_legacy_prefetch(const struct nat_table *table, uint32_t ip);
+void nat_table_hash_prefetch(const struct nat_table *table, uint32_t ip);
+void nat_table_dir24_8_prefetch(const struct nat_table *table, uint32_t ip);
+
+/*
+ * Block of the prefilter of table where ip is stored, and the bits of ip in
+ * the block in bits.
+ */
+static inline uint64_t *
+nat_prefilter_block(const struct nat_table *table, uint32_t ip, uint64_t *bits)
+{
+    *bits = (uint64_t)ip * 0x9e3779b97f4a7c15ULL;
+    return &table->prefilter[(rte_hash_crc_4byte(ip, NAT_PREFILTER_SEED) &
+                              table->prefilter_mask) *
+                             NAT_PREFILTER_BLOCK_WORDS];
+}
+
+/*
+ * @return
+ *  - 0 if ip has no entry in the backend of table, which has a prefilter.
+ *    Otherwise, ip may have an entry.
+ */
+static inline int
+nat_prefilter_contains(const struct nat_table *table, uint32_t ip)
+{
+    const uint64_t *block;
+    uint64_t missing;
+    uint64_t bits;
+    uint32_t bit;
+    int i;
+
+    block = nat_prefilter_block(table, ip, &bits);
+    missing = 0;
+    for (i = 0; i < NAT_PREFILTER_NB_HASHES; ++i) {
+        // 9 bits per hash, from the most significant bits of the product
+        bit = (bits >> (64 - 9 * (i + 1))) & 511;
+        missing |= ~block[bit / 64] & (1ULL << (bit % 64));
+    }
+    return missing == 0;
+}
+
+/*
+ * Longest prefix match of ip in the prefix entries of table: the entries are
+ * sorted by decreasing prefix length, so the first match is the longest.
+ */
+static inline int
+nat_table_prefix_lookup(const struct nat_table *table, uint32_t ip,
+                        uint32_t *value, uint32_t *slot)
+{
+    const struct nat_prefix *prefix;
+    unsigned int i;
+
+    for (i = 0; i < table->nb_prefixes; ++i) {
+        prefix = &table->prefixes[i];
+        if ((ip & prefix->mask) == prefix->network) {
+            *value = rte_cpu_to_be_32(prefix->to | (ip & ~prefix->mask));
+            if (slot) {
+                *slot = NAT_PREFIX_SLOT;
+            }
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Search for ip in the NAT table, and store the result in value, and the slot
+ * of the entry in slot if it is not NULL. The slot of an entry doesn't change
+ * while the entry is in the table. Addresses translated by a prefix rule have
+ * the slot NAT_PREFIX_SLOT.
+ *
+ * The backend is called directly instead of through nat_table_ops: the table
+ * type never changes for a given configuration, so the branch is always
+ * correctly predicted.
+ *
+ * @return
+ *  - -1 if ip is not in table.
+ */
+static inline int
+nat_table_lookup_slot(const struct nat_table *table, uint32_t ip,
+                      uint32_t *value, uint32_t *slot)
+{
+    int ret;
+
+    if (table == NULL) {
+        return -1;
+    }
+
+    if (table->prefilter && !nat_prefilter_contains(table, ip)) {
+        return nat_table_prefix_lookup(table, ip, value, slot);
+    }
+
+    switch (table->type) {
+    case NAT_TABLE_HASH:
+        ret = nat_table_hash_lookup(table, ip, value, slot);
+        break ;
+    case NAT_TABLE_DIR24_8:
+        ret = nat_table_dir24_8_lookup(table, ip, value, slot);
+        break ;
+    case NAT_TABLE_LEGACY:
+    default:
+        ret = nat_table_legacy_lookup(table, ip, value, slot);
+        break ;
+    }
+
+    if (ret < 0 && table->nb_prefixes) {
+        return nat_table_prefix_lookup(table, ip, value, slot);
+    }
+    return ret;
+}
+
+static inline int
+nat_table_lookup(const struct nat_table *table, uint32_t ip, uint32_t *value)
+{
+    return nat_table_lookup_slot(table, ip, value, NULL);
+}
+
+/*
+ * Count a packet of bytes bytes translated by the entry at slot, if counters
+ * are enabled. Only called by the worker lcore_id.
+ */
+static inline void
+nat_table_count(const struct nat_table *table, unsigned int lcore_id,
+                uint32_t slot, uint32_t bytes)
+{
+    struct nat_counter *counter;
+
+    if (table->counters[lcore_id] == NULL || slot >= table->nb_slots) {
+        return ;
+    }
+    counter = &table->counters[lcore_id][slot];
+    counter->packets++;
+    counter->bytes += bytes;
+}
+
+/*
+ * Prefetch the cache line where ip would be stored, so a later
+ * nat_table_lookup() of ip doesn't wait for the memory.
+ *
+ * Call it for a whole burst of packets before looking them up: the memory
+ * accesses of the burst are done in parallel instead of one after the other.
+ *
+ * If table has a prefilter, it is checked first, and addresses it rejects are
+ * not prefetched: a flood of packets to addresses without entry doesn't load
+ * the backend in the caches.
+ */
+static inline void
+nat_table_prefetch(const struct nat_table *table, uint32_t ip)
+{
+    if (table == NULL ||
+        (table->prefilter && !nat_prefilter_contains(table, ip))) {
+        return ;
+    }
+
+    switch (table->type) {
+    case NAT_TABLE_HASH:
+        nat_table_hash_prefetch(table, ip);
+        break ;
+    case NAT_TABLE_DIR24_8:
+        nat_table_dir24_8_prefetch(table, ip);
+        break ;
+    case NAT_TABLE_LEGACY:
+    default:
+        nat_table_legacy_prefetch(table, ip);
+        break ;
+    }
+}
+
+// nat_table.c
+int nat_rules_add(struct nat_rules *rules, uint32_t int_ip, uint32_t ext_ip,
+                  int socket_id);
+void nat_rules_free(struct nat_rules *rules);
+int nat_rules_load(struct nat_rules *rules, const char *path, int socket_id);
+int nat_rules_add_prefix(struct nat_rules *rules, uint32_t int_ip,
+                         uint32_t ext_ip, int prefix);
+
+struct nat_table *nat_table_create(enum nat_table_type type,
+                                   const struct nat_rules *rules,
+                                   enum nat_dir dir, int prefilter,
+                                   int socket_id);
+void nat_table_free(struct nat_table *table);
+int nat_table_update(struct nat_table **tables, enum nat_table_type type,
+                     int prefilter, int counters,
+                     const struct nat_update *updates,
+                     unsigned int nb_updates, int socket_id);
+const char *nat_table_name(enum nat_table_type type);
+size_t nat_table_memory(const struct nat_table *table);
+
+int nat_table_counters_alloc(struct nat_table *table, int socket_id);
+void nat_table_counters_archive(const struct nat_table *table);
+void nat_table_counters_prune(struct nat_table *const *tables,
+                              unsigned int nb_tables);
+int nat_table_counters_read(struct nat_table *const *tables,
+                            unsigned int nb_tables,
+                            void (*func)(uint32_t from, uint32_t to,
+                                         const struct nat_counter *counter,
+                                         void *arg),
+                            void *arg);
+
+int nat_dump_rules(int out_fd, const struct nat_table *table);
+int nat_number_of_rules(const struct nat_table *table);
+
+#endif
@@ -0,0 +1,347 @@
+/* vim: ts=4 sw=4 et */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_atomic.h>
+#include <rte_errno.h>
+#include <rte_ip.h>
+#include <rte_lpm.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+/*
+ * DIR-24-8 table, implemented with rte_lpm.
+ *
+ * The first 24 bits of an address index a table of 2^24 entries. NAT entries
+ * are /32 routes, so the entry of each /24 holding at least one of them
+ * points to a tbl8 group of 256 next hops, indexed by the last 8 bits: a
+ * lookup reads two entries.
+ *
+ * rte_lpm next hops are only 24 bits wide, so the next hop of an address is
+ * an index in the values array, which contains the translated address in
+ * network order. keys is only used to iterate over the table.
+ *
+ * Entries removed by nat_table_update() stay in rte_lpm with a value of 0: a
+ * deleted rte_lpm group could be reused for another /24 while a worker is
+ * reading it. They are dropped when the table is copied.
+ *
+ * The slot of an entry, used to index counters, is its index in values.
+ */
+
+// Room left for nat_table_update() when a table is created or copied, in
+// entries and in groups of 256 entries.
+#define NAT_DIR24_8_ROOM 1024
+
+struct nat_table_dir24_8 {
+    struct nat_table table;
+    struct rte_lpm *lpm;
+    uint32_t nb_entries;
+    uint32_t max_entries;
+    // Groups used, and allocated.
+    uint32_t nb_tbl8s;
+    uint32_t max_tbl8s;
+    uint32_t *keys;
+    uint32_t *values;
+};
+
+int
+nat_table_dir24_8_lookup(const struct nat_table *table, uint32_t ip,
+                         uint32_t *value, uint32_t *slot)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+    uint32_t idx;
+
+    if (rte_lpm_lookup(t->lpm, ip, &idx) != 0) {
+        return -1;
+    }
+
+    *value = t->values[idx];
+    if (slot) {
+        *slot = idx;
+    }
+    return *value ? 0 : -1;
+}
+
+/*
+ * Only the first level entry can be prefetched without waiting for the memory.
+ */
+void
+nat_table_dir24_8_prefetch(const struct nat_table *table, uint32_t ip)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+
+    rte_prefetch0(&t->lpm->tbl24[ip >> 8]);
+}
+
+static void
+nat_table_dir24_8_free(struct nat_table *table)
+{
+    struct nat_table_dir24_8 *t = (struct nat_table_dir24_8 *)table;
+
+    rte_lpm_free(t->lpm);
+    rte_free(t->keys);
+    rte_free(t->values);
+    rte_free(t);
+}
+
+static int
+uint32_cmp(const void *a, const void *b)
+{
+    const uint32_t ua = *(const uint32_t *)a;
+    const uint32_t ub = *(const uint32_t *)b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+/*
+ * Set key -> value in t, or remove key if value is 0. If key is already in the
+ * table, its value is overridden, as in the legacy table.
+ *
+ * The value of a new entry is written before its index is added to rte_lpm,
+ * so a concurrent lookup of key either misses or returns value.
+ */
+static int
+nat_table_dir24_8_set(struct nat_table *table, uint32_t key, uint32_t value)
+{
+    struct nat_table_dir24_8 *t = (struct nat_table_dir24_8 *)table;
+    int new_group;
+    uint32_t idx;
+
+    if (rte_lpm_is_rule_present(t->lpm, key, 32, &idx) == 1) {
+        t->values[idx] = value;
+        return 0;
+    }
+
+    if (value == 0) {
+        return 0;
+    }
+
+    if (t->nb_entries == t->max_entries) {
+        return -1;
+    }
+
+    new_group = !t->lpm->tbl24[key >> 8].valid_group;
+
+    idx = t->nb_entries;
+    t->keys[idx] = key;
+    t->values[idx] = value;
+    rte_smp_wmb();
+    if (rte_lpm_add(t->lpm, key, 32, idx) < 0) {
+        return -1;
+    }
+    t->nb_entries++;
+    t->nb_tbl8s += new_group;
+    return 0;
+}
+
+/*
+ * Allocate an empty table with room for nb_entries entries, of which
+ * nb_prefixes different /24.
+ */
+static struct nat_table_dir24_8 *
+nat_table_dir24_8_alloc(uint32_t nb_entries, uint32_t nb_prefixes,
+                        int socket_id)
+{
+    static unsigned int nb_tables = 0;
+    char name[RTE_LPM_NAMESIZE];
+    struct rte_lpm_config config;
+    struct nat_table_dir24_8 *t;
+
+    t = rte_zmalloc_socket(NULL, sizeof(*t), 0, socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    t->max_entries = nb_entries + NAT_DIR24_8_ROOM;
+    t->max_tbl8s = nb_prefixes + NAT_DIR24_8_ROOM;
+
+    t->keys = rte_malloc_socket(NULL, t->max_entries * sizeof(*t->keys), 0,
+                                socket_id);
+    t->values = rte_malloc_socket(NULL, t->max_entries * sizeof(*t->values),
+                                  0, socket_id);
+    if (t->keys == NULL || t->values == NULL) {
+        nat_table_dir24_8_free(&t->table);
+        return NULL;
+    }
+
+    config.max_rules = t->max_entries;
+    config.number_tbl8s = t->max_tbl8s;
+    config.flags = 0;
+
+    snprintf(name, sizeof(name), "nat_dir24_8_%u", nb_tables++);
+    t->lpm = rte_lpm_create(name, socket_id, &config);
+    if (t->lpm == NULL) {
+        RTE_LOG(ERR, APP, "Unable to create DIR-24-8 table: %s\n",
+                rte_strerror(rte_errno));
+        nat_table_dir24_8_free(&t->table);
+        return NULL;
+    }
+    return t;
+}
+
+/*
+ * Each /24 containing a NAT entry requires a group of 256 entries. Count
+ * them to size the table. Sorts prefixes.
+ */
+static uint32_t
+count_prefixes(uint32_t *prefixes, uint32_t nb_prefixes)
+{
+    uint32_t count;
+    uint32_t i;
+
+    qsort(prefixes, nb_prefixes, sizeof(*prefixes), &uint32_cmp);
+
+    count = 0;
+    for (i = 0; i < nb_prefixes; ++i) {
+        if (i == 0 || prefixes[i] != prefixes[i - 1]) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static struct nat_table *
+nat_table_dir24_8_create(const struct nat_rule *rules, unsigned int nb_rules,
+                         enum nat_dir dir, int socket_id)
+{
+    struct nat_table_dir24_8 *t;
+    uint32_t *prefixes;
+    uint32_t nb_entries;
+    uint32_t nb_prefixes;
+    unsigned int i;
+
+    nb_entries = nb_rules;
+
+    prefixes = malloc((nb_entries + 1) * sizeof(*prefixes));
+    if (prefixes == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < nb_rules; ++i) {
+        prefixes[i] = nat_rule_from(&rules[i], dir) >> 8;
+    }
+    nb_prefixes = count_prefixes(prefixes, nb_entries);
+    free(prefixes);
+
+    t = nat_table_dir24_8_alloc(nb_entries, nb_prefixes, socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    // Values are stored in network order.
+    for (i = 0; i < nb_rules; ++i) {
+        if (nat_table_dir24_8_set(
+                &t->table, nat_rule_from(&rules[i], dir),
+                rte_cpu_to_be_32(nat_rule_to(&rules[i], dir))) < 0) {
+            nat_table_dir24_8_free(&t->table);
+            return NULL;
+        }
+    }
+    return &t->table;
+}
+
+static int
+nat_table_dir24_8_room(const struct nat_table *table, unsigned int nb_entries)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+
+    // In the worst case, each entry is in a new /24
+    return (uint64_t)t->nb_entries + nb_entries <= t->max_entries &&
+           (uint64_t)t->nb_tbl8s + nb_entries <= t->max_tbl8s;
+}
+
+static struct nat_table *
+nat_table_dir24_8_copy(const struct nat_table *table, unsigned int nb_entries,
+                       int socket_id)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+    struct nat_table_dir24_8 *copy;
+    uint32_t *prefixes;
+    uint32_t nb_prefixes;
+    uint32_t n;
+    uint32_t i;
+
+    // Removed entries are dropped
+    prefixes = malloc((t->nb_entries + 1) * sizeof(*prefixes));
+    if (prefixes == NULL) {
+        return NULL;
+    }
+    n = 0;
+    for (i = 0; i < t->nb_entries; ++i) {
+        if (t->values[i]) {
+            prefixes[n++] = t->keys[i] >> 8;
+        }
+    }
+    nb_prefixes = count_prefixes(prefixes, n);
+    free(prefixes);
+
+    copy = nat_table_dir24_8_alloc(n + nb_entries, nb_prefixes + nb_entries,
+                                   socket_id);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < t->nb_entries; ++i) {
+        if (t->values[i] &&
+            nat_table_dir24_8_set(&copy->table, t->keys[i],
+                                  t->values[i]) < 0) {
+            nat_table_dir24_8_free(&copy->table);
+            return NULL;
+        }
+    }
+    return &copy->table;
+}
+
+static void
+nat_table_dir24_8_iter(const struct nat_table *table,
+                       void (*func)(uint32_t from, uint32_t to, uint32_t slot,
+                                    void *arg),
+                       void *arg)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+    uint32_t i;
+
+    for (i = 0; i < t->nb_entries; ++i) {
+        if (t->values[i]) {
+            func(t->keys[i], rte_be_to_cpu_32(t->values[i]), i, arg);
+        }
+    }
+}
+
+static size_t
+nat_table_dir24_8_memory(const struct nat_table *table)
+{
+    const struct nat_table_dir24_8 *t =
+        (const struct nat_table_dir24_8 *)table;
+
+    return sizeof(*t)
+        + sizeof(*t->lpm)
+        + (size_t)t->max_tbl8s * RTE_LPM_TBL8_GROUP_NUM_ENTRIES *
+            sizeof(struct rte_lpm_tbl_entry)
+        + (size_t)t->max_entries * (sizeof(*t->keys) + sizeof(*t->values));
+}
+
+static uint32_t
+nat_table_dir24_8_nb_slots(struct nat_table *table)
+{
+    return ((struct nat_table_dir24_8 *)table)->max_entries;
+}
+
+const struct nat_table_ops nat_table_dir24_8_ops = {
+    .name = "dir24_8",
+    .create = nat_table_dir24_8_create,
+    .free = nat_table_dir24_8_free,
+    .iter = nat_table_dir24_8_iter,
+    .memory = nat_table_dir24_8_memory,
+    .set = nat_table_dir24_8_set,
+    .room = nat_table_dir24_8_room,
+    .copy = nat_table_dir24_8_copy,
+    .nb_slots = nat_table_dir24_8_nb_slots,
+};
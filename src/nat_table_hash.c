@@ -0,0 +1,295 @@
+/* vim: ts=4 sw=4 et */
+#include <rte_atomic.h>
+#include <rte_hash_crc.h>
+#include <rte_ip.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+/*
+ * Open addressing hash table.
+ *
+ * Entries are stored in buckets of the size of a cache line. An address is
+ * hashed to a bucket, and if the bucket is full, the next buckets are used
+ * (linear probing). The table is sized so that buckets are at most 75% full,
+ * which makes overflows rare: a lookup almost always reads a single cache
+ * line.
+ *
+ * Keys and values of a bucket are stored in two separate arrays, so the keys
+ * of a bucket are compared all at once without branches (the compiler
+ * vectorizes the loop).
+ *
+ * Keys are in host order, values in network order. A slot whose key and value
+ * are 0 has never been used. Slots of a bucket are filled in order, so a
+ * bucket is full if its last slot has been used.
+ *
+ * Entries removed by nat_table_update() keep their key with a value of 0, like
+ * in the legacy table, so they don't break the chain of buckets of the other
+ * keys. Their slot is only reused by the same key, and dropped when the table
+ * is copied.
+ *
+ * The slot of an entry, used to index counters, is its position in the
+ * buckets: bucket index * NAT_HASH_BUCKET_ENTRIES + position in the bucket.
+ */
+
+#define NAT_HASH_BUCKET_ENTRIES 8
+#define NAT_HASH_SEED 0xdeadbeef
+
+struct nat_hash_bucket {
+    uint32_t keys[NAT_HASH_BUCKET_ENTRIES];
+    uint32_t values[NAT_HASH_BUCKET_ENTRIES];
+} __rte_cache_aligned;
+
+struct nat_table_hash {
+    struct nat_table table;
+    // Number of buckets - 1. The number of buckets is a power of 2.
+    uint32_t mask;
+    // Number of slots used, including removed entries.
+    uint32_t nb_used;
+    struct nat_hash_bucket *buckets;
+};
+
+static inline uint32_t
+nat_hash(uint32_t ip)
+{
+    return rte_hash_crc_4byte(ip, NAT_HASH_SEED);
+}
+
+int
+nat_table_hash_lookup(const struct nat_table *table, uint32_t ip,
+                      uint32_t *value, uint32_t *slot)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+    const struct nat_hash_bucket *bucket;
+    uint32_t match;
+    uint32_t idx;
+    int i;
+
+    idx = nat_hash(ip) & t->mask;
+    while (1) {
+        bucket = &t->buckets[idx];
+
+        match = 0;
+        for (i = 0; i < NAT_HASH_BUCKET_ENTRIES; ++i) {
+            match |= (bucket->keys[i] == ip) << i;
+        }
+
+        if (likely(match)) {
+            i = __builtin_ctz(match);
+            *value = bucket->values[i];
+            if (slot) {
+                *slot = idx * NAT_HASH_BUCKET_ENTRIES + i;
+            }
+            return *value ? 0 : -1;
+        }
+
+        // Bucket not full, ip is not in the table
+        if (likely(bucket->keys[NAT_HASH_BUCKET_ENTRIES - 1] == 0 &&
+                   bucket->values[NAT_HASH_BUCKET_ENTRIES - 1] == 0)) {
+            return -1;
+        }
+        idx = (idx + 1) & t->mask;
+    }
+}
+
+void
+nat_table_hash_prefetch(const struct nat_table *table, uint32_t ip)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+
+    rte_prefetch0(&t->buckets[nat_hash(ip) & t->mask]);
+}
+
+static inline int
+nat_hash_slot_unused(const struct nat_hash_bucket *bucket, int i)
+{
+    return bucket->keys[i] == 0 && bucket->values[i] == 0;
+}
+
+/*
+ * Set the entry of key to value, or remove it if value is 0. A new entry's key
+ * is written before its value, so a concurrent lookup of key either misses or
+ * returns value.
+ */
+static int
+nat_table_hash_set(struct nat_table *table, uint32_t key, uint32_t value)
+{
+    struct nat_table_hash *t = (struct nat_table_hash *)table;
+    struct nat_hash_bucket *bucket;
+    uint32_t idx;
+    int i;
+
+    idx = nat_hash(key) & t->mask;
+    while (1) {
+        bucket = &t->buckets[idx];
+        for (i = 0; i < NAT_HASH_BUCKET_ENTRIES; ++i) {
+            // Previous or removed entry of key, overridden as in the legacy
+            // table.
+            if (bucket->keys[i] == key && !nat_hash_slot_unused(bucket, i)) {
+                bucket->values[i] = value;
+                return 0;
+            }
+
+            // End of the chain: key is not in the table.
+            if (nat_hash_slot_unused(bucket, i)) {
+                if (value == 0) {
+                    return 0;
+                }
+                bucket->keys[i] = key;
+                rte_smp_wmb();
+                bucket->values[i] = value;
+                t->nb_used++;
+                return 0;
+            }
+        }
+        idx = (idx + 1) & t->mask;
+    }
+}
+
+static void
+nat_table_hash_free(struct nat_table *table)
+{
+    struct nat_table_hash *t = (struct nat_table_hash *)table;
+
+    rte_free(t->buckets);
+    rte_free(t);
+}
+
+/*
+ * Allocate an empty table for nb_entries entries, with buckets at most 75%
+ * full.
+ */
+static struct nat_table_hash *
+nat_table_hash_alloc(uint64_t nb_entries, int socket_id)
+{
+    struct nat_table_hash *t;
+    uint32_t nb_buckets;
+
+    t = rte_zmalloc_socket(NULL, sizeof(*t), 0, socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    nb_buckets = 1;
+    while ((uint64_t)nb_buckets * NAT_HASH_BUCKET_ENTRIES * 3 < nb_entries * 4) {
+        nb_buckets <<= 1;
+    }
+
+    t->mask = nb_buckets - 1;
+    t->buckets = rte_zmalloc_socket(NULL, nb_buckets * sizeof(*t->buckets),
+                                    RTE_CACHE_LINE_SIZE, socket_id);
+    if (t->buckets == NULL) {
+        rte_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static struct nat_table *
+nat_table_hash_create(const struct nat_rule *rules, unsigned int nb_rules,
+                      enum nat_dir dir, int socket_id)
+{
+    struct nat_table_hash *t;
+    unsigned int i;
+
+    t = nat_table_hash_alloc(nb_rules, socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    // Values are stored in network order.
+    for (i = 0; i < nb_rules; ++i) {
+        nat_table_hash_set(&t->table, nat_rule_from(&rules[i], dir),
+                           rte_cpu_to_be_32(nat_rule_to(&rules[i], dir)));
+    }
+    return &t->table;
+}
+
+static int
+nat_table_hash_room(const struct nat_table *table, unsigned int nb_entries)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+    const uint64_t nb_slots = ((uint64_t)t->mask + 1) * NAT_HASH_BUCKET_ENTRIES;
+
+    return ((uint64_t)t->nb_used + nb_entries) * 4 <= nb_slots * 3;
+}
+
+static struct nat_table *
+nat_table_hash_copy(const struct nat_table *table, unsigned int nb_entries,
+                    int socket_id)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+    const struct nat_hash_bucket *bucket;
+    struct nat_table_hash *copy;
+    uint32_t idx;
+    int i;
+
+    copy = nat_table_hash_alloc((uint64_t)t->nb_used + nb_entries, socket_id);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    // Removed entries are dropped
+    for (idx = 0; idx <= t->mask; ++idx) {
+        bucket = &t->buckets[idx];
+        for (i = 0; i < NAT_HASH_BUCKET_ENTRIES; ++i) {
+            if (bucket->values[i]) {
+                nat_table_hash_set(&copy->table, bucket->keys[i],
+                                   bucket->values[i]);
+            }
+        }
+    }
+    return &copy->table;
+}
+
+static void
+nat_table_hash_iter(const struct nat_table *table,
+                    void (*func)(uint32_t from, uint32_t to, uint32_t slot,
+                                 void *arg),
+                    void *arg)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+    uint32_t idx;
+    int i;
+
+    for (idx = 0; idx <= t->mask; ++idx) {
+        for (i = 0; i < NAT_HASH_BUCKET_ENTRIES; ++i) {
+            if (t->buckets[idx].values[i] == 0) {
+                continue ;
+            }
+            func(t->buckets[idx].keys[i],
+                 rte_be_to_cpu_32(t->buckets[idx].values[i]),
+                 idx * NAT_HASH_BUCKET_ENTRIES + i, arg);
+        }
+    }
+}
+
+static size_t
+nat_table_hash_memory(const struct nat_table *table)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+
+    return sizeof(*t) + ((size_t)t->mask + 1) * sizeof(*t->buckets);
+}
+
+static uint32_t
+nat_table_hash_nb_slots(struct nat_table *table)
+{
+    const struct nat_table_hash *t = (const struct nat_table_hash *)table;
+
+    return (t->mask + 1) * NAT_HASH_BUCKET_ENTRIES;
+}
+
+const struct nat_table_ops nat_table_hash_ops = {
+    .name = "hash",
+    .create = nat_table_hash_create,
+    .free = nat_table_hash_free,
+    .iter = nat_table_hash_iter,
+    .memory = nat_table_hash_memory,
+    .set = nat_table_hash_set,
+    .room = nat_table_hash_room,
+    .copy = nat_table_hash_copy,
+    .nb_slots = nat_table_hash_nb_slots,
+};
@@ -0,0 +1,312 @@
+/* vim: ts=4 sw=4 et */
+#include <rte_atomic.h>
+#include <rte_ip.h>
+#include <rte_malloc.h>
+#include <rte_prefetch.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+/*
+ * Size of the first, second and third row of the NAT lookup table.
+ */
+static const int lkp_fs = 256; // 2^8
+static const int lkp_ss = 256; // 2^8
+static const int lkp_ts = 65536; // 2^16
+
+/*
+ * The rule "10.1.2.3 -> 212.10.11.12" is stored as two entries, as follow:
+ *
+ * - lookup = table of 256 (2^8) int **
+ * - lookup[10] = table of 256 (2^8) int *
+ * - lookup[10][1] = table of 65536 (2^16) int
+ * - lookup[10][1][2 << 16 & 3] = 212.10.11.12
+ *
+ * and:
+ *
+ * - lookup = table of 256 (2^8) int **
+ * - lookup[212] = table of 256 (2^8) int *
+ * - lookup[212][10] = table of 65536 (2^16) int
+ * - lookup[212][10][11 << 16 & 12] = 10.1.2.3
+ *
+ * Third rows are numbered in the order they are allocated, and their number is
+ * stored after their last entry. The slot of an entry, used to index counters,
+ * is number * 65536 + last 2 bytes.
+ */
+
+// Third rows which can be allocated by nat_table_update() once counters are
+// sized, before the table has to be copied.
+#define NAT_LEGACY_ROOM 4
+
+struct nat_table_legacy {
+    struct nat_table table;
+    uint32_t **lookup[256];
+    // Number of third rows allocated.
+    unsigned int nb_leaves;
+    // Maximum number of third rows, 0 if unlimited. See nb_slots.
+    unsigned int max_leaves;
+    // NUMA socket of the rows.
+    int socket_id;
+};
+
+int
+nat_table_legacy_lookup(const struct nat_table *table, uint32_t ip,
+                        uint32_t *value, uint32_t *slot)
+{
+    const struct nat_table_legacy *t = (const struct nat_table_legacy *)table;
+    // first byte, second byte, last 2 bytes
+    const int fstb = (ip >> 24) & 0xff;
+    const int sndb = (ip >> 16) & 0xff;
+    const int l2b = (ip & 0xff00) | (ip & 0xff);
+
+    if (t->lookup[fstb] == NULL ||
+        t->lookup[fstb][sndb] == NULL ||
+        t->lookup[fstb][sndb][l2b] == 0)
+        return -1;
+
+    *value = t->lookup[fstb][sndb][l2b];
+    if (slot) {
+        *slot = t->lookup[fstb][sndb][lkp_ts] * lkp_ts + l2b;
+    }
+
+    return 0;
+}
+
+/*
+ * The first and second rows are small and shared by many addresses, so they
+ * are usually in cache: only prefetch the third row entry.
+ */
+void
+nat_table_legacy_prefetch(const struct nat_table *table, uint32_t ip)
+{
+    const struct nat_table_legacy *t = (const struct nat_table_legacy *)table;
+    const int fstb = (ip >> 24) & 0xff;
+    const int sndb = (ip >> 16) & 0xff;
+    const int l2b = (ip & 0xff00) | (ip & 0xff);
+
+    if (t->lookup[fstb] && t->lookup[fstb][sndb]) {
+        rte_prefetch0(&t->lookup[fstb][sndb][l2b]);
+    }
+}
+
+static void
+nat_table_legacy_free(struct nat_table *table)
+{
+    struct nat_table_legacy *t = (struct nat_table_legacy *)table;
+    int i, j;
+
+    for (i = 0; i < lkp_fs; ++i) {
+        if (t->lookup[i]) {
+            for (j = 0; j < lkp_ss; ++j) {
+                rte_free(t->lookup[i][j]);
+            }
+            rte_free(t->lookup[i]);
+        }
+    }
+    rte_free(t);
+}
+
+/*
+ * Rows are zeroed before being linked to the table, so workers looking up the
+ * table while an entry is set never see a partially initialized row.
+ */
+static int
+add_rule_to_table(struct nat_table_legacy *t, uint32_t key, uint32_t value)
+{
+    // first byte, second byte, last 2 bytes
+    const int fstb = (key >> 24) & 0xff;
+    const int sndb = (key >> 16) & 0xff;
+    const int l2b = (key & 0xff00) | (key & 0xff);
+    uint32_t **snd_row;
+    uint32_t *leaf;
+
+    if (t->lookup[fstb] == NULL) {
+        // Nothing to remove
+        if (value == 0) {
+            return 0;
+        }
+        snd_row = rte_zmalloc_socket(NULL, lkp_ss * sizeof(**t->lookup), 0,
+                                     t->socket_id);
+        if (snd_row == NULL) {
+            return -1;
+        }
+        rte_smp_wmb();
+        t->lookup[fstb] = snd_row;
+    }
+
+    if (t->lookup[fstb][sndb] == NULL) {
+        if (value == 0) {
+            return 0;
+        }
+        if (t->max_leaves && t->nb_leaves == t->max_leaves) {
+            return -1;
+        }
+        // Row number stored after the last entry
+        leaf = rte_zmalloc_socket(NULL, (lkp_ts + 1) * sizeof(***t->lookup),
+                                  0, t->socket_id);
+        if (leaf == NULL) {
+            return -1;
+        }
+        leaf[lkp_ts] = t->nb_leaves;
+        rte_smp_wmb();
+        t->lookup[fstb][sndb] = leaf;
+        t->nb_leaves++;
+    }
+
+    t->lookup[fstb][sndb][l2b] = value;
+    return 0;
+}
+
+static int
+nat_table_legacy_set(struct nat_table *table, uint32_t key, uint32_t value)
+{
+    return add_rule_to_table((struct nat_table_legacy *)table, key, value);
+}
+
+static struct nat_table_legacy *
+nat_table_legacy_alloc(int socket_id)
+{
+    struct nat_table_legacy *t;
+
+    t = rte_zmalloc_socket(NULL, sizeof(*t), 0, socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+    t->socket_id = socket_id;
+    return t;
+}
+
+static struct nat_table *
+nat_table_legacy_create(const struct nat_rule *rules, unsigned int nb_rules,
+                        enum nat_dir dir, int socket_id)
+{
+    struct nat_table_legacy *t;
+    unsigned int i;
+
+    t = nat_table_legacy_alloc(socket_id);
+    if (t == NULL) {
+        return NULL;
+    }
+
+    // Values are stored in network order.
+    for (i = 0; i < nb_rules; ++i) {
+        if (add_rule_to_table(
+                t, nat_rule_from(&rules[i], dir),
+                rte_cpu_to_be_32(nat_rule_to(&rules[i], dir))) < 0) {
+            nat_table_legacy_free(&t->table);
+            return NULL;
+        }
+    }
+    return &t->table;
+}
+
+/*
+ * The table never runs out of room, unless its counters have been sized: it is
+ * then copied to number the rows again.
+ */
+static struct nat_table *
+nat_table_legacy_copy(const struct nat_table *table, unsigned int nb_entries,
+                      int socket_id)
+{
+    const struct nat_table_legacy *t = (const struct nat_table_legacy *)table;
+    struct nat_table_legacy *copy;
+    int i, j, k;
+
+    copy = nat_table_legacy_alloc(socket_id);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    for (i = 0; i < lkp_fs; ++i) {
+        if (t->lookup[i] == NULL) {
+            continue ;
+        }
+        for (j = 0; j < lkp_ss; ++j) {
+            if (t->lookup[i][j] == NULL) {
+                continue ;
+            }
+            for (k = 0; k < lkp_ts; ++k) {
+                if (t->lookup[i][j][k] &&
+                    add_rule_to_table(copy,
+                                      IPv4(i, j, (k >> 8) & 0xff, k & 0xff),
+                                      t->lookup[i][j][k]) < 0) {
+                    nat_table_legacy_free(&copy->table);
+                    return NULL;
+                }
+            }
+        }
+    }
+    return &copy->table;
+}
+
+static void
+nat_table_legacy_iter(const struct nat_table *table,
+                      void (*func)(uint32_t from, uint32_t to, uint32_t slot,
+                                   void *arg),
+                      void *arg)
+{
+    const struct nat_table_legacy *t = (const struct nat_table_legacy *)table;
+    int i, j, k;
+
+    for (i = 0; i < lkp_fs; ++i) {
+        if (t->lookup[i] == NULL) {
+            continue ;
+        }
+
+        for (j = 0; j < lkp_ss; ++j) {
+            if (t->lookup[i][j] == NULL) {
+                continue ;
+            }
+
+            for (k = 0; k < lkp_ts; ++k) {
+                if (t->lookup[i][j][k] == 0) {
+                    continue ;
+                }
+
+                func(IPv4(i, j, (k >> 8) & 0xff, k & 0xff),
+                     rte_be_to_cpu_32(t->lookup[i][j][k]),
+                     t->lookup[i][j][lkp_ts] * lkp_ts + k, arg);
+            }
+        }
+    }
+}
+
+static size_t
+nat_table_legacy_memory(const struct nat_table *table)
+{
+    const struct nat_table_legacy *t = (const struct nat_table_legacy *)table;
+    size_t size;
+    int i;
+
+    size = sizeof(*t) + t->nb_leaves * (lkp_ts + 1) * sizeof(***t->lookup);
+    for (i = 0; i < lkp_fs; ++i) {
+        if (t->lookup[i]) {
+            size += lkp_ss * sizeof(**t->lookup);
+        }
+    }
+    return size;
+}
+
+/*
+ * Counters cost 1MB per row and per worker: only leave room for a few more
+ * rows. The slots of 65536 rows would not fit in 32 bits.
+ */
+static uint32_t
+nat_table_legacy_nb_slots(struct nat_table *table)
+{
+    struct nat_table_legacy *t = (struct nat_table_legacy *)table;
+
+    t->max_leaves = RTE_MIN(t->nb_leaves + NAT_LEGACY_ROOM, lkp_fs * lkp_ss - 1);
+    return t->max_leaves * lkp_ts;
+}
+
+const struct nat_table_ops nat_table_legacy_ops = {
+    .name = "legacy",
+    .create = nat_table_legacy_create,
+    .free = nat_table_legacy_free,
+    .iter = nat_table_legacy_iter,
+    .memory = nat_table_legacy_memory,
+    .set = nat_table_legacy_set,
+    .copy = nat_table_legacy_copy,
+    .nb_slots = nat_table_legacy_nb_slots,
+};
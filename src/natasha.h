@@ -9,6 +9,9 @@
 #include <rte_malloc.h>
 
 #include "cli.h"
+#include "nat_table.h"
+#include "napt.h"
+#include "nat_deterministic.h"
 
 /*
  * Logging configuration.
@@ -34,9 +37,22 @@
 /* Variable used to stop slaves mainloop */
 volatile bool force_quit;
 
+// Whether TX queues free sent mbufs with DEV_TX_OFFLOAD_MBUF_FAST_FREE, which
+// requires the mbufs of a TX queue to come from a single mempool. Set by
+// core.c when ports are configured. See docs/DPDK_INITIALIZATION.md.
+extern int tx_fast_free;
+
 // Forward declaration. Defined under "Workers and queues configuration".
 struct core;
 
+// Defined in flow_cache.h.
+struct flow_cache;
+
+// Defined in local_addrs.h.
+struct local_addrs;
+
+struct rte_ring;
+
 // Network port.
 struct ip_vlan {
     uint32_t ip;
@@ -48,9 +64,21 @@ struct port_ip_addr {
     struct port_ip_addr *next;
 };
 
+// Defaults of "port <n> [rx ring <descriptors>] [tx ring <descriptors>]
+// [burst <packets>] ...;".
+#define PORT_DEFAULT_RX_RING    256
+#define PORT_DEFAULT_TX_RING    512
+#define PORT_DEFAULT_RX_BURST   32
+#define PORT_MAX_RING           4096
+
 struct port_config {
     struct port_ip_addr *ip_addresses;
     int mtu;
+    // Descriptors of the RX and TX rings of each queue, and packets read at
+    // once from the RX ring, at most MAX_RX_BURST. Only read at startup.
+    uint16_t rx_ring_size;
+    uint16_t tx_ring_size;
+    uint16_t rx_burst;
 };
 
 // A condition, to specify whether an action should be processed or not.
@@ -82,51 +110,167 @@ struct app_config_node {
     void *data;
 };
 
-// Software configuration.
-/*
- * Size of the first, second and third row of the NAT lookup table.
- */
-static const int lkp_fs = 256; // 2^8
-static const int lkp_ss = 256; // 2^8
-static const int lkp_ts = 65536; // 2^16
+// The rules AST is compiled to a flat array of instructions, so processing
+// the rules of a packet is a loop instead of a recursive walk of the AST. See
+// rules.c.
+enum rules_opcode {
+    RULES_OP_END, // Stop processing rules
+    RULES_OP_ACTION, // Call an action, stop if it returns -1
+    RULES_OP_ACTION_BURST, // Call the batched variant of an action
+    RULES_OP_COND, // Call a condition
+    RULES_OP_SRC_IN, // True if ipv4.src_addr is in network
+    RULES_OP_DST_IN, // True if ipv4.dst_addr is in network
+    RULES_OP_VLAN, // True if the packet VLAN is vlan
+    RULES_OP_JUMP, // Continue at next[0]
+    RULES_OP_CLASSIFY, // Continue at the body of the first matching if
+};
+
+// Input of the classifier of RULES_OP_CLASSIFY, in network order. See
+// rules.c/classifier_create().
+struct rules_acl_key {
+    // rte_acl requires the first field to be one byte long. Unused.
+    uint8_t unused;
+    uint8_t pad[3];
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t vlan;
+    uint16_t pad2;
+};
 
-struct nat_address {
-    uint64_t bytes;
-    uint32_t address;
+struct rte_acl_ctx;
+
+struct rules_insn {
+    enum rules_opcode op;
+
+    // Index of the instruction to execute after this one, if the condition is
+    // false (next[0]) or true (next[1]). For other instructions, both are
+    // equal.
+    uint32_t next[2];
+
+    // Operands.
+    union {
+        // RULES_OP_SRC_IN and RULES_OP_DST_IN. ip is already masked.
+        struct {
+            uint32_t ip;
+            uint32_t mask;
+        } network;
+
+        // RULES_OP_VLAN.
+        int vlan;
+
+        // RULES_OP_ACTION and RULES_OP_COND.
+        struct {
+            int (*f)(struct rte_mbuf *pkt, uint8_t port, struct core *core,
+                     void *data);
+            void *data;
+        } call;
+
+        // RULES_OP_ACTION_BURST. The batched variant of an action, called
+        // with the packets of pkts whose bit is set in mask, at most 64. It
+        // returns the mask of the packets to continue processing.
+        struct {
+            uint64_t (*f)(struct rte_mbuf **pkts, uint64_t mask,
+                          struct core *core, void *data);
+            void *data;
+        } burst;
+
+        // RULES_OP_CLASSIFY. The classifier returns n > 0 if the n-th if
+        // of the sequence matches first, and the instruction continues at
+        // targets[n]. It returns 0 if no if matches.
+        struct {
+            struct rte_acl_ctx *ctx;
+            uint32_t *targets;
+        } classify;
+    };
+} __rte_aligned(32);
+
+struct rules_program {
+    uint32_t len;
+    struct rules_insn insns[] __rte_cache_aligned;
 };
 
+// Control traffic addressed to natasha, replied to by the slow path thread
+// instead of the workers. See slowpath.c.
+enum slowpath_type {
+    SLOWPATH_ARP,
+    SLOWPATH_ICMP,
+    SLOWPATH_NB_TYPES,
+};
+// Default and largest "slowpath arp|icmp <packets per second>;".
+#define SLOWPATH_DEFAULT_RATE   1000
+#define SLOWPATH_MAX_RATE       1000000
+// Requests a worker can hand off before the slow path thread dequeues them.
+#define SLOWPATH_RING_SIZE      1024
+
+// Largest "flow cache <entries>;": 512MB per core.
+#define FLOW_CACHE_MAX_ENTRIES  (1 << 24)
+
+// Software configuration.
 #define NATASHA_MAX_ETHPORTS    2
 struct app_config {
     struct port_config ports[NATASHA_MAX_ETHPORTS];
 
-    /*
-     * Contain NAT rules. The rule "10.1.2.3 -> 212.10.11.12" is stored as
-     * two entries, as follow:
-     *
-     * - nat_lookup = table of 256 (2^8) int **
-     * - nat_lookup[10] = table of 256 (2^8) int *
-     * - nat_lookup[10][1] = table of 65536 (2^16) int
-     * - nat_lookup[10][1][2 << 16 & 3] = 212.10.11.12
-     *
-     * and:
-     *
-     * - nat_lookup = table of 256 (2^8) int **
-     * - nat_lookup[212] = table of 256 (2^8) int *
-     * - nat_lookup[212][10] = table of 65536 (2^16) int
-     * - nat_lookup[212][10][11 << 16 & 12] = 10.1.2.3
-     */
-    uint32_t ***nat_lookup;
+    // Addresses of ports, built from ports once the configuration file is
+    // parsed. See local_addrs.h.
+    struct local_addrs *local_addrs;
 
+    // NAT rules, as read from the configuration file.
+    struct nat_rules nat_rules;
+
+    // Backend of nat_tables, set with "nat table <backend>;".
+    enum nat_table_type nat_table_type;
+
+    // NAT lookup table of each direction, built from nat_rules once the
+    // configuration file is parsed. NULL if there are no NAT rules. See
+    // nat_table.h.
+    struct nat_table *nat_tables[NAT_NB_DIRS];
+    // Incremented when nat_tables are updated by app_config_nat_update().
+    volatile uint32_t nat_version;
+
+    // Whether NAT entries have packet and byte counters, set with "nat
+    // counters;". See struct nat_counter.
+    int nat_counters;
+
+    // Whether NAT tables have a prefilter, set with "nat prefilter;". See
+    // nat_table.h.
+    int nat_prefilter;
+
+    // Rules AST, as read from the configuration file.
     struct app_config_node *rules;
 
-    /* NATASHA flags */
-#define NAT_FLAG_USED           0x0001  /* If NAT_FLAG_USED, this configuration
-                                         * has been used at least once and in
-                                         * case of reload (see config.c/app_config_relaod_all),
-                                         * old configuration is no longer used
-                                         * by the core and can safely be freed.
-                                         */
-    volatile uint32_t flags;
+    // rules compiled by rules_compile(). NULL if there are no rules.
+    struct rules_program *program;
+
+    // Number of entries of the flow cache of each core, set with "flow cache
+    // <entries>;". 0 if the cache is disabled.
+    unsigned int flow_cache_size;
+
+    // Deterministic NAT mappings, set with "nat deterministic <network> ->
+    // <network> ports <n>;". See nat_deterministic.h.
+    struct nat_det nat_det;
+
+    // Whether the NICs hash both directions of a flow to the same worker,
+    // set with "rss symmetric;". See rss.c.
+    int rss_symmetric;
+
+    // Longest time, in microseconds, packets wait in a TX queue for more
+    // packets while traffic is received, set with "tx hold <microseconds>;".
+    // 0 if TX queues are flushed at every iteration of the main loop. See
+    // core.c/tx_hold_expired().
+    unsigned int tx_hold_us;
+
+    // Replies per second of the slow path thread for each type of control
+    // traffic, set with "slowpath arp|icmp <packets per second>;".
+    unsigned int slowpath_rates[SLOWPATH_NB_TYPES];
+
+    // Stateful NAPT, set with "napt pool|sessions|timeout ...;". See napt.h.
+    struct napt_config napt;
+
+    // Configuration this one has been cloned from by app_config_clone(). The
+    // ports, the NAT rules and the rules AST belong to the origin, only the
+    // NAT table and the program are built for this configuration. NULL for
+    // configurations returned by app_config_load().
+    struct app_config *origin;
 
 } __rte_cache_aligned;
 
@@ -135,12 +279,27 @@ struct app_config {
  * Workers and queues configuration.
  */
 
+#define MAX_RX_BURST 64
 // Network receive queue.
 struct rx_queue {
     uint16_t id;
+    // Packets read at once, see struct port_config.
+    uint16_t burst;
+    // Whether the NIC sets the IPv4 packet types, see
+    // network_headers.h/pkt_parse().
+    int ptypes;
 };
 
 #define MAX_TX_BURST 32
+// Packets the TX ring didn't accept are kept for the next flushes, see
+// pkt.c/tx_flush(). They are dropped if none of them can be sent during
+// TX_RETRY_BUDGET flushes, or if they are still not sent after
+// TX_RETRY_DRAIN_US microseconds.
+#define TX_RETRY_SIZE       512
+#define TX_RETRY_BUDGET     16
+#define TX_RETRY_DRAIN_US   200
+// Largest "tx hold <microseconds>;".
+#define TX_HOLD_MAX_US      1000
 // Network transmit queue.
 struct tx_queue {
     // Packets to send.
@@ -148,14 +307,60 @@ struct tx_queue {
     uint16_t id;
     // Number of packets in pkts.
     uint16_t len;
+    // Packets not sent yet, sent before pkts: retry_len packets from
+    // retry[retry_head]. TX_RETRY_SIZE entries, allocated on the socket of
+    // the worker.
+    struct rte_mbuf **retry;
+    uint16_t retry_head;
+    uint16_t retry_len;
+    // Flushes left without progress, and timer cycles before the retry
+    // packets are dropped.
+    uint16_t retry_budget;
+    uint64_t retry_deadline;
+    // TSC when the main loop first held the packets of pkts, 0 if not held.
+    uint64_t hold_start;
+};
+
+#define MAX_FREE_BURST 64
+// Packets dropped by a worker, returned to their mempool all at once by
+// pkt.c/pkt_free_flush().
+struct free_queue {
+    struct rte_mbuf *pkts[MAX_FREE_BURST];
+    uint16_t len;
 };
 
 #define NATASHA_MAX_QUEUES    16
+// Largest RSS key supported, see rss.c.
+#define RSS_MAX_KEY_SIZE      64
 // A core and its queues. Each core has one rx queue and one tx queue per port.
 struct core {
+    // Configuration of the NUMA socket of this core, shared with the other
+    // cores of the same socket. It is read-only for workers.
     struct app_config *app_config;
+    // Last configuration seen by the worker, to flush what the worker keeps
+    // from the previous configuration when a new one is published.
+    struct app_config *app_config_used;
+    // app_config_used->nat_version when last seen by the worker.
+    uint32_t nat_version;
+    // Number of quiescent states the worker went through. Incremented by the
+    // worker only, at the top of its main loop, and read by
+    // config.c/app_config_reclaim() to know when replaced configurations are
+    // no longer referenced and can be freed.
+    volatile uint64_t quiescent;
+    // Cache of the outcome of the rules, NULL if disabled. See flow_cache.h.
+    struct flow_cache *flow_cache;
+    // NAPT sessions of the worker, NULL if the NAPT is disabled, and packets
+    // handed off to the worker by the others. See napt.h.
+    struct napt_table *napt;
+    struct rte_ring *napt_ring;
+    // ARP requests and ICMP echo requests to natasha, handed off to the slow
+    // path thread. See slowpath.c.
+    struct rte_ring *slowpath_ring;
     struct rx_queue rx_queues[NATASHA_MAX_QUEUES];
     struct tx_queue tx_queues[NATASHA_MAX_QUEUES];
+    struct free_queue free_queue;
+    // Mbufs received by the worker on every port.
+    struct rte_mempool *mempool;
     struct natasha_app_stats *stats;
     uint32_t id;
 } __rte_cache_aligned;
@@ -166,9 +371,13 @@ struct core {
 
 #define NATASHA_SOCKET_PORT     4242
 #define NATASHA_MAX_CLIENTS     2
+#define NATASHA_ADM_READ_TIMEOUT 5 // seconds
 struct natasha_client {
     int fd;
     char buf[4096];
+    // Number of bytes read in buf, and consumed by the current query.
+    size_t len;
+    size_t pos;
 };
 
 struct natasha_query {
@@ -187,15 +396,31 @@ struct natasha_command {
 // config.c
 struct app_config *app_config_load(int argc, char **argv,
                                    unsigned int socket_id);
+struct app_config *app_config_clone(struct app_config *origin,
+                                    unsigned int socket_id);
 void app_config_free(struct app_config *config);
 int support_per_queue_statistics(uint8_t port);
 int app_config_reload_all(struct core *cores, int argc, char **argv);
+int app_config_reclaim(struct core *cores);
+int app_config_nat_update(struct core *cores, const struct nat_update *updates,
+                          unsigned int nb_updates);
+void app_config_reload_stats(struct natasha_reload_stats *stats);
+int app_config_nat_counters(struct core *cores,
+                            void (*func)(uint32_t from, uint32_t to,
+                                         const struct nat_counter *counter,
+                                         void *arg),
+                            void *arg);
+
+// rules.c
+struct rules_program *rules_compile(struct app_config_node *root,
+                                    unsigned int socket_id);
+void rules_free(struct rules_program *program);
 
 // pkt.c
-uint16_t tx_send(struct rte_mbuf *pkt, uint8_t port, struct tx_queue *queue,
-                  struct natasha_app_stats *stats);
-uint16_t tx_flush(uint8_t port, struct tx_queue *queue,
-                  struct natasha_app_stats *stats);
+uint16_t tx_send(struct rte_mbuf *pkt, uint8_t port, struct core *core);
+uint16_t tx_flush(uint8_t port, struct core *core);
+void pkt_free(struct rte_mbuf *pkt, struct core *core);
+void pkt_free_flush(struct core *core);
 
 int is_natasha_ip(struct app_config *app_config,
                   uint32_t ip, int vlan);
@@ -203,12 +428,38 @@ int is_natasha_port_ip(struct app_config *app_config,
                        uint32_t ip, int vlan, uint8_t port);
 
 // arp.c
-int arp_handle(struct rte_mbuf *pkt, uint8_t port, struct core *core);
-int ipv4_handle(struct rte_mbuf *pkt, uint8_t port, struct core *core);
+unsigned int arp_handle_burst(struct rte_mbuf **pkts, unsigned int nb_pkts,
+                              struct core *core);
+int arp_reply(struct rte_mbuf *pkt, uint8_t port, struct core *core);
+
+// ipv4.c
+unsigned int ipv4_handle_burst(struct rte_mbuf **pkts, unsigned int nb_pkts,
+                               struct core *core);
+int icmp_echo(struct rte_mbuf *pkt, uint8_t port, struct core *core);
+
+// slowpath.c
+int slowpath_init(struct core *cores);
+int slowpath_setup_port(uint8_t port, uint16_t queue_id, int socket);
+int slowpath_start(void);
+void slowpath_stop(void);
+void slowpath_set_rates(const unsigned int *rates);
+void slowpath_handoff(struct rte_mbuf *pkt, struct core *core);
+void slowpath_stats(struct natasha_slowpath_stats *stats);
+
+// rss.c
+void rss_symmetric_key(uint8_t *key, size_t len);
+int rss_setup_symmetric(uint8_t port, const struct rte_eth_dev_info *dev_info,
+                        struct rte_eth_conf *eth_conf, uint8_t *key);
+uint32_t rss_hash(const uint8_t *key, uint32_t src_addr, uint32_t dst_addr,
+                  uint16_t src_port, uint16_t dst_port, int l4);
+int rss_check(uint8_t port, uint16_t nb_queues, int symmetric);
 
 // adm.c
 int adm_server(struct core *cores, int argc, char **argv);
 
+// core.c
+int workers_span_sockets(void);
+
 /*
  * Utility macros.
  */
@@ -20,24 +20,24 @@ eth_header(struct rte_mbuf *pkt)
     return rte_pktmbuf_mtod((pkt), struct ether_hdr *);
 }
 
-#define L3_HEADER(proto, type)                                                  \
-    static inline type *                                                        \
-    proto ## _header(struct rte_mbuf *pkt)                                      \
-    {                                                                           \
-        unsigned char *p;                                                       \
-                                                                                \
-        p = rte_pktmbuf_mtod(pkt, unsigned char *) + sizeof(struct ether_hdr);  \
-        return (type *)p;                                                       \
+/*
+ * The headers are located with the offsets recorded by pkt_parse() when the
+ * packet was received.
+ */
+#define L3_HEADER(proto, type)                                  \
+    static inline type *                                        \
+    proto ## _header(struct rte_mbuf *pkt)                      \
+    {                                                           \
+        return rte_pktmbuf_mtod_offset(pkt, type *,             \
+                                       pkt->l2_len);            \
     }
 
-#define L4_HEADER(proto, type)                              \
-    static inline type *                                    \
-    proto ## _header(struct rte_mbuf *pkt)                  \
-    {                                                       \
-        struct ipv4_hdr *p;                                 \
-                                                            \
-        p = ipv4_header(pkt);                               \
-        return (type *)((unsigned char *)p + sizeof(*p));   \
+#define L4_HEADER(proto, type)                                  \
+    static inline type *                                        \
+    proto ## _header(struct rte_mbuf *pkt)                      \
+    {                                                           \
+        return rte_pktmbuf_mtod_offset(pkt, type *,             \
+                                       pkt->l2_len + pkt->l3_len); \
     }
 
 L3_HEADER(arp, struct arp_hdr);
@@ -62,6 +62,117 @@ L4_HEADER(udp, struct udp_hdr);
 // last 12 bits of the TCI field
 #define VLAN_ID(pkt) ((pkt)->vlan_tci & 0xfff)
 
+/*
+ * Parse the headers of a received packet once, and record them in its mbuf
+ * for every later stage:
+ *
+ *  - l2_len, the offset of the L3 header: VLAN tags are stripped by the NIC.
+ *  - l3_len, the length of the IPv4 header with its options (IHL).
+ *  - packet_type: RTE_PTYPE_L3_IPV4 without options, RTE_PTYPE_L3_IPV4_EXT
+ *    with options, or no L3 type if pkt is not IPv4 or its IHL is invalid.
+ *    ARP packets are RTE_PTYPE_L2_ETHER_ARP.
+ *    The L4 type is RTE_PTYPE_L4_FRAG for fragments, whose transport header
+ *    is only in the first one, otherwise RTE_PTYPE_L4_TCP, _UDP, _ICMP or
+ *    _NONFRAG.
+ *
+ * l2_len and l3_len are also the offsets used by the NIC to offload the
+ * checksums.
+ *
+ * ptypes is set if the NIC of the port reports the IPv4 packet types: the
+ * IPv4 header of a packet without options then doesn't need to be decoded.
+ */
+static inline void
+pkt_parse(struct rte_mbuf *pkt, int ptypes)
+{
+    struct ether_hdr *eth_hdr = eth_header(pkt);
+    struct ipv4_hdr *ipv4_hdr;
+    uint32_t packet_type;
+
+    pkt->l2_len = sizeof(*eth_hdr);
+
+    if (ptypes &&
+        (pkt->packet_type & RTE_PTYPE_L3_MASK) == RTE_PTYPE_L3_IPV4) {
+        pkt->l3_len = sizeof(*ipv4_hdr);
+        return ;
+    }
+
+    if (eth_hdr->ether_type != rte_cpu_to_be_16(ETHER_TYPE_IPv4)) {
+        pkt->l3_len = 0;
+        pkt->packet_type =
+            eth_hdr->ether_type == rte_cpu_to_be_16(ETHER_TYPE_ARP) ?
+            RTE_PTYPE_L2_ETHER_ARP : RTE_PTYPE_L2_ETHER;
+        return ;
+    }
+
+    ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+    pkt->l3_len = (ipv4_hdr->version_ihl & IPV4_HDR_IHL_MASK) *
+                  IPV4_IHL_MULTIPLIER;
+    if (unlikely(pkt->l3_len < sizeof(*ipv4_hdr))) {
+        pkt->l3_len = 0;
+        pkt->packet_type = RTE_PTYPE_L2_ETHER;
+        return ;
+    }
+
+    packet_type = RTE_PTYPE_L2_ETHER;
+    packet_type |= likely(pkt->l3_len == sizeof(*ipv4_hdr)) ?
+                   RTE_PTYPE_L3_IPV4 : RTE_PTYPE_L3_IPV4_EXT;
+
+    if (unlikely(ipv4_hdr->fragment_offset &
+                 rte_cpu_to_be_16(IPV4_HDR_MF_FLAG | IPV4_HDR_OFFSET_MASK))) {
+        packet_type |= RTE_PTYPE_L4_FRAG;
+    } else {
+        switch (ipv4_hdr->next_proto_id) {
+        case IPPROTO_TCP:
+            packet_type |= RTE_PTYPE_L4_TCP;
+            break ;
+        case IPPROTO_UDP:
+            packet_type |= RTE_PTYPE_L4_UDP;
+            break ;
+        case IPPROTO_ICMP:
+            packet_type |= RTE_PTYPE_L4_ICMP;
+            break ;
+        default:
+            packet_type |= RTE_PTYPE_L4_NONFRAG;
+            break ;
+        }
+    }
+    pkt->packet_type = packet_type;
+}
+
+/*
+ * Whether pkt is an IPv4 fragment, first one included.
+ */
+static inline int
+pkt_is_fragment(const struct rte_mbuf *pkt)
+{
+    return (pkt->packet_type & RTE_PTYPE_L4_MASK) == RTE_PTYPE_L4_FRAG;
+}
+
+/*
+ * Transport protocol of an IPv4 packet, or 0 for fragments other than the
+ * first one, which have no transport header. Only fragments and protocols
+ * other than TCP, UDP and ICMP read the IPv4 header.
+ */
+static inline uint8_t
+pkt_l4_proto(struct rte_mbuf *pkt)
+{
+    struct ipv4_hdr *ipv4_hdr;
+
+    switch (pkt->packet_type & RTE_PTYPE_L4_MASK) {
+    case RTE_PTYPE_L4_TCP:
+        return IPPROTO_TCP;
+    case RTE_PTYPE_L4_UDP:
+        return IPPROTO_UDP;
+    case RTE_PTYPE_L4_ICMP:
+        return IPPROTO_ICMP;
+    case RTE_PTYPE_L4_FRAG:
+        ipv4_hdr = ipv4_header(pkt);
+        return NATA_IS_FRAG(ipv4_hdr) ? 0 : ipv4_hdr->next_proto_id;
+    default:
+        return ipv4_header(pkt)->next_proto_id;
+    }
+}
+
 /* incremental checksum update */
 static inline void
 cksum_update(uint16_t *csum, uint32_t from, uint32_t to)
@@ -5,6 +5,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <rte_malloc.h>
 
@@ -31,7 +32,26 @@
 %token TOK_MTU
 %token TOK_VLAN
 %token TOK_NAT_RULE
+%token TOK_NAT_RULES
+%token TOK_NAT_TABLE
+%token TOK_NAT_COUNTERS
+%token TOK_NAT_PREFILTER
 %token TOK_NAT_REWRITE
+%token TOK_FLOW_CACHE
+%token TOK_NAPT_POOL
+%token TOK_NAPT_SESSIONS
+%token TOK_NAPT_TIMEOUT
+%token TOK_NAT_NAPT
+%token TOK_RSS_SYMMETRIC
+%token TOK_TX_HOLD
+%token TOK_SLOWPATH_ARP
+%token TOK_SLOWPATH_ICMP
+%token TOK_RX_RING
+%token TOK_TX_RING
+%token TOK_BURST
+%token TOK_NAT_DETERMINISTIC
+%token TOK_PORTS
+%token TOK_ARROW
 %token TOK_IF
 %token TOK_ELSE
 %token TOK_AND
@@ -64,12 +84,22 @@
 %token <ipv4_address>   IPV4_ADDRESS
 %token <ipv4_network>   IPV4_NETWORK
 %token <number>         NAT_REWRITE_FIELD
+%token <number>         NAT_TABLE_TYPE
+%token <number>         NAPT_PROTO
 %token <mac>            MAC_ADDRESS
+%token <string>         STRING
+
+/* Free strings discarded on parsing errors */
+%destructor { free($$); } <string>
 
 /* Config section */
 %type<number>          config_port_opt_mtu
+%type<number>          config_port_opt_rx_ring
+%type<number>          config_port_opt_tx_ring
+%type<number>          config_port_opt_burst
 %type<number>          config_port_opt_vlan
 %type<port_ip_addrs>   config_port_extra_ips
+%type<number>          config_slowpath_type
 
 /* Rules types */
 %type<config_node> rules_content
@@ -82,6 +112,8 @@
 
 %type<config_node> action
 %type<config_node> action_nat_rewrite
+%type<config_node> action_nat_napt
+%type<config_node> action_nat_deterministic
 %type<config_node> action_out
 %type<number>      action_out_opt_vlan
 %type<config_node> action_print
@@ -126,12 +158,30 @@ config_lines:
     | config_lines ';'
     | config_lines config_port
     | config_lines config_nat_rule
+    | config_lines config_nat_rules
+    | config_lines config_nat_table
+    | config_lines config_nat_counters
+    | config_lines config_nat_prefilter
+    | config_lines config_flow_cache
+    | config_lines config_napt_pool
+    | config_lines config_napt_sessions
+    | config_lines config_napt_timeout
+    | config_lines config_rss_symmetric
+    | config_lines config_tx_hold
+    | config_lines config_slowpath
+    | config_lines config_nat_deterministic
 ;
 
-/* port n [mtu MTU] [vlan VLAN] ip IP [[vlan VLAN] ip IP...] */
+/*
+ * port n [mtu MTU] [rx ring DESCRIPTORS] [tx ring DESCRIPTORS] [burst PACKETS]
+ *     [vlan VLAN] ip IP [[vlan VLAN] ip IP...]
+ */
 config_port:
     TOK_PORT NUMBER[port]
     config_port_opt_mtu[mtu]
+    config_port_opt_rx_ring[rx_ring]
+    config_port_opt_tx_ring[tx_ring]
+    config_port_opt_burst[burst]
     config_port_opt_vlan[vlan] TOK_IP IPV4_ADDRESS[ip]
     config_port_extra_ips[next_ips] ';' {
         struct port_ip_addr *port_ip;
@@ -149,6 +199,9 @@ config_port:
         port_ip->next = $next_ips;
 
         config->ports[$port].mtu = $mtu;
+        config->ports[$port].rx_ring_size = $rx_ring;
+        config->ports[$port].tx_ring_size = $tx_ring;
+        config->ports[$port].rx_burst = $burst;
         config->ports[$port].ip_addresses = port_ip;
     }
 ;
@@ -158,6 +211,39 @@ config_port_opt_mtu:
     | TOK_MTU NUMBER[mtu]   { $$ = $mtu; }
 ;
 
+config_port_opt_rx_ring:
+    /* empty */                 { $$ = PORT_DEFAULT_RX_RING; }
+    | TOK_RX_RING NUMBER[size]  {
+        if ($size <= 0 || $size > PORT_MAX_RING) {
+            yyerror(scanner, config, socket_id, "Invalid RX ring size");
+            YYERROR;
+        }
+        $$ = $size;
+    }
+;
+
+config_port_opt_tx_ring:
+    /* empty */                 { $$ = PORT_DEFAULT_TX_RING; }
+    | TOK_TX_RING NUMBER[size]  {
+        if ($size <= 0 || $size > PORT_MAX_RING) {
+            yyerror(scanner, config, socket_id, "Invalid TX ring size");
+            YYERROR;
+        }
+        $$ = $size;
+    }
+;
+
+config_port_opt_burst:
+    /* empty */                 { $$ = PORT_DEFAULT_RX_BURST; }
+    | TOK_BURST NUMBER[size]    {
+        if ($size <= 0 || $size > MAX_RX_BURST) {
+            yyerror(scanner, config, socket_id, "Invalid burst size");
+            YYERROR;
+        }
+        $$ = $size;
+    }
+;
+
 config_port_opt_vlan:
     /* empty */             { $$ = 0; }
     | TOK_VLAN NUMBER[vlan] { $$ = $vlan; }
@@ -183,11 +269,154 @@ config_port_extra_ips:
 config_nat_rule:
     TOK_NAT_RULE IPV4_ADDRESS[from] IPV4_ADDRESS[to] ';'
     {
-        if (add_rules_to_table(&config->nat_lookup, $from, $to, socket_id) < 0) {
+        if (nat_rules_add(&config->nat_rules, $from, $to, socket_id) < 0) {
             yyerror(scanner, config, socket_id, "Unable to add NAT rule");
             YYERROR;
         }
     }
+    | TOK_NAT_RULE IPV4_NETWORK[from] IPV4_NETWORK[to] ';'
+    {
+        if ($from.mask != $to.mask) {
+            yyerror(scanner, config, socket_id,
+                    "NAT rule networks must have the same prefix length");
+            YYERROR;
+        }
+        if (nat_rules_add_prefix(&config->nat_rules, $from.ip, $to.ip,
+                                 $from.mask) < 0) {
+            yyerror(scanner, config, socket_id, "Unable to add NAT rule");
+            YYERROR;
+        }
+    }
+;
+
+/* nat rules "FILE"; */
+config_nat_rules:
+    TOK_NAT_RULES STRING[path] ';'
+    {
+        int ret;
+
+        ret = nat_rules_load(&config->nat_rules, $path, socket_id);
+        free($path);
+        if (ret < 0) {
+            yyerror(scanner, config, socket_id, "Unable to load NAT rules");
+            YYERROR;
+        }
+    }
+;
+
+/* nat table legacy|hash|dir24_8; */
+config_nat_table:
+    TOK_NAT_TABLE NAT_TABLE_TYPE[type] ';' {
+        config->nat_table_type = $type;
+    }
+;
+
+/* nat counters; */
+config_nat_counters:
+    TOK_NAT_COUNTERS ';' {
+        config->nat_counters = 1;
+    }
+;
+
+/* nat prefilter; */
+config_nat_prefilter:
+    TOK_NAT_PREFILTER ';' {
+        config->nat_prefilter = 1;
+    }
+;
+
+/* flow cache ENTRIES; */
+config_flow_cache:
+    TOK_FLOW_CACHE NUMBER[entries] ';' {
+        if ($entries < 0 || $entries > FLOW_CACHE_MAX_ENTRIES) {
+            yyerror(scanner, config, socket_id, "Invalid flow cache size");
+            YYERROR;
+        }
+        config->flow_cache_size = $entries;
+    }
+;
+
+/* napt pool NETWORK; */
+config_napt_pool:
+    TOK_NAPT_POOL IPV4_NETWORK[network] ';' {
+        if ($network.mask == 0) {
+            yyerror(scanner, config, socket_id, "Invalid NAPT pool");
+            YYERROR;
+        }
+        config->napt.pool_ip = $network.ip &
+                               (0xffffffff << (32 - $network.mask));
+        config->napt.nb_addresses = 1U << (32 - $network.mask);
+    }
+;
+
+/* napt sessions SESSIONS; */
+config_napt_sessions:
+    TOK_NAPT_SESSIONS NUMBER[sessions] ';' {
+        if ($sessions <= 0) {
+            yyerror(scanner, config, socket_id,
+                    "Invalid number of NAPT sessions");
+            YYERROR;
+        }
+        config->napt.max_sessions = $sessions;
+    }
+;
+
+/* napt timeout tcp|udp|icmp SECONDS; */
+config_napt_timeout:
+    TOK_NAPT_TIMEOUT NAPT_PROTO[proto] NUMBER[seconds] ';' {
+        if ($seconds <= 0) {
+            yyerror(scanner, config, socket_id, "Invalid NAPT timeout");
+            YYERROR;
+        }
+        config->napt.timeouts[$proto] = $seconds;
+    }
+;
+
+/* nat deterministic NETWORK -> NETWORK ports PORTS; */
+config_nat_deterministic:
+    TOK_NAT_DETERMINISTIC IPV4_NETWORK[from] TOK_ARROW IPV4_NETWORK[to]
+    TOK_PORTS NUMBER[ports] ';' {
+        if (nat_det_add(&config->nat_det, $from.ip, $from.mask, $to.ip,
+                        $to.mask, $ports) < 0) {
+            yyerror(scanner, config, socket_id,
+                    "Invalid deterministic NAT mapping");
+            YYERROR;
+        }
+    }
+;
+
+/* rss symmetric; */
+config_rss_symmetric:
+    TOK_RSS_SYMMETRIC ';' {
+        config->rss_symmetric = 1;
+    }
+;
+
+/* tx hold MICROSECONDS; */
+config_tx_hold:
+    TOK_TX_HOLD NUMBER[us] ';' {
+        if ($us < 0 || $us > TX_HOLD_MAX_US) {
+            yyerror(scanner, config, socket_id, "Invalid TX hold time");
+            YYERROR;
+        }
+        config->tx_hold_us = $us;
+    }
+;
+
+/* slowpath arp|icmp PACKETS_PER_SECOND; */
+config_slowpath:
+    config_slowpath_type[type] NUMBER[rate] ';' {
+        if ($rate < 0 || $rate > SLOWPATH_MAX_RATE) {
+            yyerror(scanner, config, socket_id, "Invalid slow path rate");
+            YYERROR;
+        }
+        config->slowpath_rates[$type] = $rate;
+    }
+;
+
+config_slowpath_type:
+    TOK_SLOWPATH_ARP            { $$ = SLOWPATH_ARP; }
+    | TOK_SLOWPATH_ICMP         { $$ = SLOWPATH_ICMP; }
 ;
 
 
@@ -336,6 +565,8 @@ cond_vlan:
 
 action:
     action_nat_rewrite
+    | action_nat_napt
+    | action_nat_deterministic
     | action_out
     | action_print
     | action_drop
@@ -366,6 +597,34 @@ action_nat_rewrite:
     }
 ;
 
+action_nat_napt:
+    TOK_NAT_NAPT ';' {
+        struct app_config_node *node;
+
+        node = rte_zmalloc_socket(NULL, sizeof(*node), 0, socket_id);
+        CHECK_PTR(node);
+
+        node->type = ACTION;
+        node->action = action_napt;
+
+        $$ = node;
+    }
+;
+
+action_nat_deterministic:
+    TOK_NAT_DETERMINISTIC ';' {
+        struct app_config_node *node;
+
+        node = rte_zmalloc_socket(NULL, sizeof(*node), 0, socket_id);
+        CHECK_PTR(node);
+
+        node->type = ACTION;
+        node->action = action_nat_deterministic;
+
+        $$ = node;
+    }
+;
+
 action_out:
     TOK_OUT TOK_PORT NUMBER[port] TOK_MAC MAC_ADDRESS[mac] action_out_opt_vlan[vlan] ';' {
         struct app_config_node *node;
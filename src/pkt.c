@@ -1,7 +1,13 @@
 /* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_cycles.h>
 #include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
 
 #include "natasha.h"
+#include "local_addrs.h"
 
 
 /*
@@ -12,16 +18,8 @@ int
 is_natasha_port_ip(struct app_config *app_config, uint32_t ip, int vlan,
                    uint8_t port)
 {
-    struct port_ip_addr *ip_addr;
-
-    ip_addr = app_config->ports[port].ip_addresses;
-    while (ip_addr) {
-        if (ip_addr->addr.ip == ip && ip_addr->addr.vlan == vlan) {
-            return 1;
-        }
-        ip_addr = ip_addr->next;
-    }
-    return 0;
+    return local_addrs_contains(app_config->local_addrs,
+                                local_addrs_key(ip, vlan, port));
 }
 
 /*
@@ -31,36 +29,182 @@ is_natasha_port_ip(struct app_config *app_config, uint32_t ip, int vlan,
 int
 is_natasha_ip(struct app_config *app_config, uint32_t ip, int vlan)
 {
-    uint8_t port;
+    return local_addrs_contains(app_config->local_addrs,
+                                local_addrs_key(ip, vlan,
+                                                LOCAL_ADDRS_ANY_PORT));
+}
+
+/*
+ * Return the dropped packets of core to their mempool.
+ *
+ * rte_pktmbuf_free() returns each segment to its mempool on its own: when
+ * most of a burst is dropped, the mempool operations cost more than the
+ * processing of the packets. Segments are instead returned with one
+ * rte_mempool_put_bulk() per run of segments of the same mempool, usually
+ * one per burst.
+ */
+void
+pkt_free_flush(struct core *core)
+{
+    struct free_queue *queue = &core->free_queue;
+    void *objs[MAX_FREE_BURST];
+    struct rte_mempool *pool = NULL;
+    struct rte_mbuf *seg;
+    struct rte_mbuf *next;
+    unsigned int n = 0;
+    uint16_t i;
+
+    for (i = 0; i < queue->len; ++i) {
+        for (seg = queue->pkts[i]; seg; seg = next) {
+            next = seg->next;
 
-    for (port = 0; port < rte_eth_dev_count(); ++port) {
-        if (is_natasha_port_ip(app_config, ip, vlan, port)) {
-            return 1;
+            // NULL if the segment is still referenced
+            seg = rte_pktmbuf_prefree_seg(seg);
+            if (seg == NULL) {
+                continue ;
+            }
+
+            if (seg->pool != pool || n == MAX_FREE_BURST) {
+                if (n) {
+                    rte_mempool_put_bulk(pool, objs, n);
+                }
+                pool = seg->pool;
+                n = 0;
+            }
+            objs[n++] = seg;
         }
     }
-    return 0;
+    if (n) {
+        rte_mempool_put_bulk(pool, objs, n);
+    }
+    queue->len = 0;
 }
 
 /*
- * Send a burst of output packets on the transmit @queue of @port.
+ * Drop pkt: it is returned to its mempool with the other packets dropped by
+ * core, by pkt_free_flush() at the end of the burst or once the queue is full.
+ */
+void
+pkt_free(struct rte_mbuf *pkt, struct core *core)
+{
+    struct free_queue *queue = &core->free_queue;
+
+    queue->pkts[queue->len++] = pkt;
+    if (unlikely(queue->len == MAX_FREE_BURST)) {
+        pkt_free_flush(core);
+    }
+}
+
+/*
+ * Drop the packets of the retry buffer of queue.
+ */
+static void
+tx_retry_drop(struct tx_queue *queue, struct core *core)
+{
+    uint16_t i;
+
+    for (i = 0; i < queue->retry_len; ++i) {
+        core->stats->drop_tx_notsent++;
+        pkt_free(queue->retry[queue->retry_head + i], core);
+    }
+    queue->retry_head = 0;
+    queue->retry_len = 0;
+}
+
+/*
+ * Send the packets of the retry buffer of queue, oldest first. They are
+ * dropped if the NIC didn't accept any of them during the last
+ * TX_RETRY_BUDGET calls, or once their drain timer expired.
  *
- * Packets that can't be stored in the transmit ring are freed.
+ * @return
+ *  - The number of packets sent.
+ */
+static uint16_t
+tx_retry(uint8_t port, struct tx_queue *queue, struct core *core)
+{
+    uint16_t sent;
+
+    sent = rte_eth_tx_burst(port, queue->id, &queue->retry[queue->retry_head],
+                            queue->retry_len);
+    core->stats->tx_retry_sent += sent;
+    queue->retry_head += sent;
+    queue->retry_len -= sent;
+
+    if (queue->retry_len == 0) {
+        queue->retry_head = 0;
+        return sent;
+    }
+
+    if (sent) {
+        queue->retry_budget = TX_RETRY_BUDGET;
+    } else {
+        queue->retry_budget--;
+    }
+    if (queue->retry_budget == 0 ||
+        rte_get_timer_cycles() > queue->retry_deadline) {
+        tx_retry_drop(queue, core);
+    }
+    return sent;
+}
+
+/*
+ * Keep the packets of queue->pkts from the first one not sent in the retry
+ * buffer. Packets that don't fit are dropped.
+ */
+static void
+tx_retry_add(struct tx_queue *queue, uint16_t sent, struct core *core)
+{
+    uint16_t n;
+
+    // Start the drain timer
+    if (queue->retry_len == 0) {
+        queue->retry_head = 0;
+        queue->retry_budget = TX_RETRY_BUDGET;
+        queue->retry_deadline = rte_get_timer_cycles() +
+            rte_get_timer_hz() * TX_RETRY_DRAIN_US / 1000000;
+    } else if (queue->retry_head + queue->retry_len + queue->len - sent >
+               TX_RETRY_SIZE) {
+        memmove(queue->retry, &queue->retry[queue->retry_head],
+                queue->retry_len * sizeof(*queue->retry));
+        queue->retry_head = 0;
+    }
+
+    for (n = sent; n < queue->len; ++n) {
+        if (queue->retry_len == TX_RETRY_SIZE) {
+            core->stats->drop_tx_notsent++;
+            pkt_free(queue->pkts[n], core);
+            continue ;
+        }
+        queue->retry[queue->retry_head + queue->retry_len++] = queue->pkts[n];
+        core->stats->tx_retry++;
+    }
+}
+
+/*
+ * Send a burst of output packets on the transmit queue of core on port.
  *
- * XXX: we should keep the packets not sent for a later call instead of
- *      discarding them.
+ * Packets that can't be stored in the transmit ring are kept in the retry
+ * buffer of the queue, and sent first by the next calls: the TX ring is
+ * usually drained a few microseconds later. New packets are not sent while
+ * the retry buffer isn't empty, to keep the order of the packets of a flow.
  *
  * @return
- *  - The return value of rte_eth_tx_burst(), ie. the number of packets
- *    actually stored in transmit descriptors of the transmit ring.
+ *  - The number of packets actually stored in transmit descriptors of the
+ *    transmit ring, by rte_eth_tx_burst().
  */
 uint16_t
-tx_flush(uint8_t port, struct tx_queue *queue, struct natasha_app_stats *stats)
+tx_flush(uint8_t port, struct core *core)
 {
-    uint16_t sent;
-    uint16_t n;
+    struct tx_queue *queue = &core->tx_queues[port];
+    uint16_t sent = 0;
+    uint16_t n = 0;
+
+    if (unlikely(queue->retry_len)) {
+        sent = tx_retry(port, queue, core);
+    }
 
     if (!queue->len) {
-        return 0;
+        return sent;
     }
 
     // rte_eth_tx_prepare updates queue->pkts to offload TCP/UDP checksums.
@@ -73,15 +217,19 @@ tx_flush(uint8_t port, struct tx_queue *queue, struct natasha_app_stats *stats)
     // function rte_net_intel_cksum_flags_prepare() in rte_net.h cannot fail.
     (void)rte_eth_tx_prepare(port, queue->id, queue->pkts, queue->len);
 
-    sent = rte_eth_tx_burst(port, queue->id, queue->pkts, queue->len);
+    // MAX_TX_BURST packets at most: bucket NATASHA_TX_BATCH_BUCKETS - 1
+    core->stats->tx_batches[31 - __builtin_clz(queue->len)]++;
+    queue->hold_start = 0;
 
-    // rte_eth_tx_burst() is responsible to free the sent packets. We need to
-    // free the packets not sent.
-    n = sent;
-    while (n < queue->len) {
-        stats->drop_tx_notsent++;
-        rte_pktmbuf_free(queue->pkts[n]);
-        n++;
+    if (likely(queue->retry_len == 0)) {
+        n = rte_eth_tx_burst(port, queue->id, queue->pkts, queue->len);
+        sent += n;
+    }
+
+    // rte_eth_tx_burst() is responsible to free the sent packets. The
+    // packets not sent are kept for later.
+    if (unlikely(n < queue->len)) {
+        tx_retry_add(queue, n, core);
     }
 
     queue->len = 0;
@@ -90,29 +238,29 @@ tx_flush(uint8_t port, struct tx_queue *queue, struct natasha_app_stats *stats)
 }
 
 /*
- * Enqueue a packet. If the queue is full, flush it.
+ * Enqueue a packet on the transmit queue of core on port. If the queue is
+ * full, flush it.
  *
  * @return
  *  - The number of packets sent. Zero if the packet is only enqueued and the
  *    queue isn't full, otherwise the value returned by tx_flush().
  */
 uint16_t
-tx_send(struct rte_mbuf *pkt, uint8_t port, struct tx_queue *queue,
-        struct natasha_app_stats *stats)
+tx_send(struct rte_mbuf *pkt, uint8_t port, struct core *core)
 {
+    struct tx_queue *queue = &core->tx_queues[port];
+
     // Offload VLAN tagging if pkt has a non-zero vlan
     if (pkt->vlan_tci) {
         pkt->ol_flags |= PKT_TX_VLAN_PKT;
     }
 
-    pkt->l2_len = sizeof(struct ether_hdr);
-    pkt->l3_len = sizeof(struct ipv4_hdr);
-
+    // l2_len and l3_len, to offload the checksums, are set by pkt_parse()
     queue->pkts[queue->len] = pkt;
     queue->len++;
 
     if (queue->len >= sizeof(queue->pkts) / sizeof(*queue->pkts)) {
-        return tx_flush(port, queue, stats);
+        return tx_flush(port, core);
     }
     return 0;
 }
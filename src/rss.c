@@ -0,0 +1,211 @@
+/* vim: ts=4 sw=4 et */
+#include <string.h>
+
+#include <rte_ethdev.h>
+#include <rte_ip.h>
+#include <rte_thash.h>
+
+#include "natasha.h"
+
+/*
+ * Receive Side Scaling.
+ *
+ * The NIC hashes the addresses and ports of a packet with the Toeplitz
+ * function and a key, and the hash selects the RX queue, i.e. the worker. With
+ * the default key, the packets of a flow and its replies hash to different
+ * workers.
+ *
+ * The hash is the XOR of the 32-bit windows of the key at the positions of the
+ * bits set in the input. With a key repeating a 16-bit pattern, all the
+ * windows at a given bit position of a 16-bit word are equal: swapping the
+ * source and destination addresses, or ports, doesn't change the hash (see
+ * "Scalable TCP Session Monitoring with Symmetric Receive-side Scaling",
+ * Woo and Park). 0x6d5a keeps a good distribution of the hashes.
+ */
+
+// Key size when the driver doesn't report it.
+#define RSS_DEFAULT_KEY_SIZE    40
+
+// Flows hashed by rss_check().
+#define RSS_CHECK_FLOWS         4096
+
+/*
+ * Fill key with the symmetric pattern.
+ */
+void
+rss_symmetric_key(uint8_t *key, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        key[i] = (i % 2) ? 0x5a : 0x6d;
+    }
+}
+
+/*
+ * Set the symmetric key in the RSS configuration of port. key must be
+ * RSS_MAX_KEY_SIZE bytes long, and live until the port is configured.
+ *
+ * @return
+ *  - -1 if the driver doesn't accept a key.
+ */
+int
+rss_setup_symmetric(uint8_t port, const struct rte_eth_dev_info *dev_info,
+                    struct rte_eth_conf *eth_conf, uint8_t *key)
+{
+    size_t len = dev_info->hash_key_size;
+
+    if (len == 0) {
+        len = RSS_DEFAULT_KEY_SIZE;
+    }
+    if (len > RSS_MAX_KEY_SIZE) {
+        RTE_LOG(WARNING, APP, "Port %i: unsupported RSS key size %zu\n",
+                port, len);
+        return -1;
+    }
+
+    rss_symmetric_key(key, len);
+    eth_conf->rx_adv_conf.rss_conf.rss_key = key;
+    eth_conf->rx_adv_conf.rss_conf.rss_key_len = len;
+    return 0;
+}
+
+/*
+ * Queue of hash, from the redirection table of the port. reta is NULL if the
+ * table can't be read: drivers fill it with the queues in turn by default.
+ */
+static uint16_t
+rss_queue(uint32_t hash, const struct rte_eth_rss_reta_entry64 *reta,
+          uint16_t reta_size, uint16_t nb_queues)
+{
+    uint16_t idx;
+
+    if (reta == NULL || reta_size == 0) {
+        return hash % nb_queues;
+    }
+    idx = hash % reta_size;
+    return reta[idx / RTE_RETA_GROUP_SIZE].reta[idx % RTE_RETA_GROUP_SIZE];
+}
+
+/*
+ * Hash of the IPv4 flow with the key, as computed by the NIC for TCP and UDP
+ * packets (l4 != 0) or other IPv4 packets.
+ */
+uint32_t
+rss_hash(const uint8_t *key, uint32_t src_addr, uint32_t dst_addr,
+         uint16_t src_port, uint16_t dst_port, int l4)
+{
+    struct rte_ipv4_tuple tuple;
+
+    tuple.src_addr = src_addr;
+    tuple.dst_addr = dst_addr;
+    tuple.sport = src_port;
+    tuple.dport = dst_port;
+    return rte_softrss((uint32_t *)&tuple,
+                       l4 ? RTE_THASH_V4_L4_LEN : RTE_THASH_V4_L3_LEN, key);
+}
+
+/*
+ * Self-test of the RSS configuration of a started port: hash sample flows
+ * and their replies with the key and the redirection table of the port, log
+ * whether both directions reach the same queue, and the balance of the flows
+ * between the nb_queues queues.
+ *
+ * @return
+ *  - -1 if symmetric is set and a flow and its reply reach different
+ *    queues.
+ */
+int
+rss_check(uint8_t port, uint16_t nb_queues, int symmetric)
+{
+    struct rte_eth_rss_reta_entry64 reta[ETH_RSS_RETA_SIZE_512 /
+                                         RTE_RETA_GROUP_SIZE];
+    struct rte_eth_rss_reta_entry64 *reta_ptr = reta;
+    struct rte_eth_dev_info dev_info;
+    struct rte_eth_rss_conf rss_conf;
+    uint64_t flows[NATASHA_MAX_QUEUES] = {};
+    uint8_t key[RSS_MAX_KEY_SIZE];
+    unsigned int nb_asymmetric;
+    uint64_t max_flows;
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint16_t queue;
+    unsigned int i;
+
+    if (nb_queues == 0 || nb_queues > NATASHA_MAX_QUEUES) {
+        return 0;
+    }
+
+    rte_eth_dev_info_get(port, &dev_info);
+
+    memset(key, 0, sizeof(key));
+    memset(&rss_conf, 0, sizeof(rss_conf));
+    rss_conf.rss_key = key;
+    rss_conf.rss_key_len = sizeof(key);
+    if (rte_eth_dev_rss_hash_conf_get(port, &rss_conf) < 0) {
+        RTE_LOG(WARNING, APP, "Port %i: unable to read the RSS key\n", port);
+        return symmetric ? -1 : 0;
+    }
+
+    memset(reta, 0, sizeof(reta));
+    for (i = 0; i < RTE_DIM(reta); ++i) {
+        reta[i].mask = UINT64_MAX;
+    }
+    if (dev_info.reta_size > ETH_RSS_RETA_SIZE_512 ||
+        rte_eth_dev_rss_reta_query(port, reta, dev_info.reta_size) < 0) {
+        reta_ptr = NULL;
+    }
+
+    nb_asymmetric = 0;
+    for (i = 0; i < RSS_CHECK_FLOWS; ++i) {
+        // Pseudo-random flows, from an internal address to a remote one
+        src_addr = IPv4(10, 0, 0, 0) + ((i * 2654435761u) & 0xffffff);
+        dst_addr = (i * 40503u + 1) * 2246822519u;
+        src_port = 1024 + i * 7919;
+        dst_port = (i % 2) ? 443 : 53;
+
+        queue = rss_queue(rss_hash(key, src_addr, dst_addr, src_port,
+                                   dst_port, 1),
+                          reta_ptr, dev_info.reta_size, nb_queues);
+        if (queue >= NATASHA_MAX_QUEUES) {
+            RTE_LOG(WARNING, APP, "Port %i: invalid RSS queue %i\n",
+                    port, queue);
+            return symmetric ? -1 : 0;
+        }
+        flows[queue]++;
+
+        if (queue != rss_queue(rss_hash(key, dst_addr, src_addr, dst_port,
+                                        src_port, 1),
+                               reta_ptr, dev_info.reta_size, nb_queues) ||
+            rss_queue(rss_hash(key, src_addr, dst_addr, 0, 0, 0),
+                      reta_ptr, dev_info.reta_size, nb_queues) !=
+            rss_queue(rss_hash(key, dst_addr, src_addr, 0, 0, 0),
+                      reta_ptr, dev_info.reta_size, nb_queues)) {
+            nb_asymmetric++;
+        }
+    }
+
+    max_flows = 0;
+    for (queue = 0; queue < nb_queues; ++queue) {
+        RTE_LOG(DEBUG, APP, "Port %i: RSS queue %i: %" PRIu64 " flows\n",
+                port, queue, flows[queue]);
+        max_flows = RTE_MAX(max_flows, flows[queue]);
+    }
+
+    // Imbalance: load of the busiest queue relative to the average, 1.00 if
+    // perfectly balanced.
+    RTE_LOG(INFO, APP,
+            "Port %i: RSS %s, %u/%u sample flows reach another queue in "
+            "reply, queue imbalance %.2f\n",
+            port, nb_asymmetric ? "asymmetric" : "symmetric", nb_asymmetric,
+            RSS_CHECK_FLOWS,
+            (double)max_flows * nb_queues / RSS_CHECK_FLOWS);
+
+    if (symmetric && nb_asymmetric) {
+        RTE_LOG(ERR, APP, "Port %i: RSS is not symmetric\n", port);
+        return -1;
+    }
+    return 0;
+}
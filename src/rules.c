@@ -0,0 +1,794 @@
+/* vim: ts=4 sw=4 et */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_acl.h>
+#include <rte_errno.h>
+#include <rte_malloc.h>
+
+#include "actions.h"
+#include "conds.h"
+#include "natasha.h"
+
+/*
+ * Compile the rules AST into a flat program, executed by
+ * ipv4.c/process_rules().
+ *
+ * The rules:
+ *
+ *      if (ipv4.src_addr in 10.8.0.0/16 and vlan 10) {
+ *          nat rewrite ipv4.src_addr;
+ *      } else {
+ *          print;
+ *      }
+ *      drop;
+ *
+ * are compiled to:
+ *
+ *      0: ipv4.src_addr in 10.8.0.0/16 ? 1 : 4
+ *      1: vlan 10 ? 2 : 4
+ *      2: action -> 5
+ *      3: jump -> 5
+ *      4: action -> 5
+ *      5: action -> 6
+ *      6: end
+ *
+ * The jump at the end of the if body is never executed: instructions
+ * continuing to a jump continue to its target directly.
+ *
+ * Actions with a batched variant, which handles a set of packets at once, are
+ * compiled to RULES_OP_ACTION_BURST. Instructions only continue to
+ * instructions after them, which ipv4.c/process_rules_burst() relies on to
+ * execute each instruction once for all the packets of a burst reaching it.
+ *
+ * A sequence of at least RULES_CLASSIFY_MIN_IFS "if" without else, whose
+ * conditions only test ipv4.src_addr, ipv4.dst_addr and vlan, is preceded by
+ * a RULES_OP_CLASSIFY instruction. It looks up the packet in a rte_acl
+ * classifier built from the conditions of the sequence, and continues at the
+ * body of the first matching "if", or after the sequence if none matches: the
+ * cost doesn't depend on the number of "if". The conditions are still compiled
+ * since a body, if it doesn't stop the processing, might modify the packet
+ * before the next conditions are evaluated.
+ *
+ * The target of a forward jump is unknown when the jump is emitted, so
+ * instructions reference labels during the compilation. Once the whole AST is
+ * compiled, labels are replaced by the index of the instruction they are bound
+ * to.
+ */
+
+#define RULES_CLASSIFY_MIN_IFS 4
+
+// Maximum number of classifier rules for the condition of an "if". A
+// condition is converted to a disjunction of conjunctions, and each
+// conjunction requires a classifier rule.
+#define RULES_CLASSIFY_MAX_CONJS 64
+
+struct rules_compiler {
+    unsigned int socket_id;
+
+    struct rules_insn *insns;
+    uint32_t len;
+    uint32_t size;
+
+    // labels[label] is the index of the instruction bound to label.
+    uint32_t *labels;
+    uint32_t nb_labels;
+    uint32_t labels_size;
+};
+
+/*
+ * @return
+ *  - A new label, to bind later with bind_label().
+ *  - -1 if memory can't be allocated.
+ */
+static int
+new_label(struct rules_compiler *c)
+{
+    uint32_t *labels;
+
+    if (c->nb_labels == c->labels_size) {
+        c->labels_size = c->labels_size ? c->labels_size * 2 : 64;
+        labels = realloc(c->labels, c->labels_size * sizeof(*labels));
+        if (labels == NULL) {
+            return -1;
+        }
+        c->labels = labels;
+    }
+    return c->nb_labels++;
+}
+
+/*
+ * Make label point to the next instruction emitted.
+ */
+static void
+bind_label(struct rules_compiler *c, int label)
+{
+    c->labels[label] = c->len;
+}
+
+/*
+ * Append an instruction to the program. The instruction continues at
+ * label_false if it is a false condition, at label_true otherwise.
+ *
+ * @return
+ *  - NULL if memory can't be allocated.
+ */
+static struct rules_insn *
+emit(struct rules_compiler *c, enum rules_opcode op, int label_false,
+     int label_true)
+{
+    struct rules_insn *insns;
+    struct rules_insn *insn;
+
+    if (c->len == c->size) {
+        c->size = c->size ? c->size * 2 : 64;
+        insns = realloc(c->insns, c->size * sizeof(*insns));
+        if (insns == NULL) {
+            return NULL;
+        }
+        c->insns = insns;
+    }
+
+    insn = &c->insns[c->len++];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = op;
+    insn->next[0] = label_false;
+    insn->next[1] = label_true;
+    return insn;
+}
+
+/*
+ * Compile the condition node: continue at label_true if it is true, at
+ * label_false otherwise. AND and OR are short-circuited.
+ */
+static int
+compile_cond(struct rules_compiler *c, struct app_config_node *node,
+             int label_true, int label_false)
+{
+    struct ipv4_network *network;
+    struct rules_insn *insn;
+    int label;
+
+    switch (node->type) {
+
+    case AND:
+    case OR:
+        if ((label = new_label(c)) < 0) {
+            return -1;
+        }
+        if (node->type == AND) {
+            if (compile_cond(c, node->left, label, label_false) < 0) {
+                return -1;
+            }
+        } else {
+            if (compile_cond(c, node->left, label_true, label) < 0) {
+                return -1;
+            }
+        }
+        bind_label(c, label);
+        return compile_cond(c, node->right, label_true, label_false);
+
+    // Conditions implemented by cond_*.c are executed inline, other
+    // conditions are called.
+    case ACTION:
+        insn = emit(c, RULES_OP_COND, label_false, label_true);
+        if (insn == NULL) {
+            return -1;
+        }
+
+        if (node->action == cond_ipv4_src_in_network ||
+            node->action == cond_ipv4_dst_in_network) {
+            network = node->data;
+
+            insn->op = (node->action == cond_ipv4_src_in_network)
+                ? RULES_OP_SRC_IN
+                : RULES_OP_DST_IN;
+            insn->network.mask = network->mask
+                ? ~0u << (32 - network->mask)
+                : 0;
+            insn->network.ip = network->ip & insn->network.mask;
+        } else if (node->action == cond_vlan) {
+            insn->op = RULES_OP_VLAN;
+            insn->vlan = *(int *)node->data;
+        } else {
+            insn->call.f = node->action;
+            insn->call.data = node->data;
+        }
+        return 0;
+
+    default:
+        break ;
+    }
+
+    RTE_LOG(ERR, APP, "Unexpected node type %i in condition\n", node->type);
+    return -1;
+}
+
+/*
+ * Packets matched by a conjunction of conditions. A mask of 0 matches any
+ * address, a vlan of -1 matches any VLAN.
+ */
+struct rules_conj {
+    uint32_t src_ip;
+    uint32_t src_mask;
+    uint32_t dst_ip;
+    uint32_t dst_mask;
+    int vlan;
+};
+
+/*
+ * Intersection of two networks, stored in a.
+ *
+ * @return
+ *  - -1 if the intersection is empty.
+ */
+static int
+network_intersect(uint32_t *a_ip, uint32_t *a_mask, uint32_t b_ip,
+                  uint32_t b_mask)
+{
+    if ((*a_ip ^ b_ip) & *a_mask & b_mask) {
+        return -1;
+    }
+    // The longest prefix
+    *a_ip |= b_ip;
+    *a_mask |= b_mask;
+    return 0;
+}
+
+/*
+ * Convert the condition node to a disjunction of at most
+ * RULES_CLASSIFY_MAX_CONJS conjunctions, stored in out.
+ *
+ * @return
+ *  - The number of conjunctions in out.
+ *  - -1 if node can't be classified: it contains a condition other than
+ *    ipv4.src_addr, ipv4.dst_addr or vlan, or requires too many conjunctions.
+ */
+static int
+cond_to_dnf(const struct app_config_node *node, struct rules_conj *out)
+{
+    struct rules_conj left[RULES_CLASSIFY_MAX_CONJS];
+    struct rules_conj right[RULES_CLASSIFY_MAX_CONJS];
+    struct rules_conj conj;
+    const struct ipv4_network *network;
+    int nb_left, nb_right;
+    int n, i, j;
+
+    switch (node->type) {
+
+    case AND:
+    case OR:
+        if ((nb_left = cond_to_dnf(node->left, left)) < 0 ||
+            (nb_right = cond_to_dnf(node->right, right)) < 0) {
+            return -1;
+        }
+
+        if (node->type == OR) {
+            if (nb_left + nb_right > RULES_CLASSIFY_MAX_CONJS) {
+                return -1;
+            }
+            memcpy(out, left, nb_left * sizeof(*out));
+            memcpy(out + nb_left, right, nb_right * sizeof(*out));
+            return nb_left + nb_right;
+        }
+
+        n = 0;
+        for (i = 0; i < nb_left; ++i) {
+            for (j = 0; j < nb_right; ++j) {
+                conj = left[i];
+                if (network_intersect(&conj.src_ip, &conj.src_mask,
+                                      right[j].src_ip, right[j].src_mask) < 0 ||
+                    network_intersect(&conj.dst_ip, &conj.dst_mask,
+                                      right[j].dst_ip, right[j].dst_mask) < 0) {
+                    continue ;
+                }
+                if (right[j].vlan >= 0) {
+                    if (conj.vlan >= 0 && conj.vlan != right[j].vlan) {
+                        continue ;
+                    }
+                    conj.vlan = right[j].vlan;
+                }
+                if (n == RULES_CLASSIFY_MAX_CONJS) {
+                    return -1;
+                }
+                out[n++] = conj;
+            }
+        }
+        return n;
+
+    case ACTION:
+        memset(out, 0, sizeof(*out));
+        out->vlan = -1;
+
+        if (node->action == cond_ipv4_src_in_network ||
+            node->action == cond_ipv4_dst_in_network) {
+            network = node->data;
+
+            if (node->action == cond_ipv4_src_in_network) {
+                out->src_mask = network->mask ? ~0u << (32 - network->mask) : 0;
+                out->src_ip = network->ip & out->src_mask;
+            } else {
+                out->dst_mask = network->mask ? ~0u << (32 - network->mask) : 0;
+                out->dst_ip = network->ip & out->dst_mask;
+            }
+            return 1;
+        }
+
+        if (node->action == cond_vlan) {
+            out->vlan = *(int *)node->data;
+            return 1;
+        }
+        return -1;
+
+    default:
+        break ;
+    }
+    return -1;
+}
+
+/*
+ * @return
+ *  - true if node is an "if" without else which can be classified.
+ */
+static int
+is_classifiable(const struct app_config_node *node)
+{
+    struct rules_conj conjs[RULES_CLASSIFY_MAX_CONJS];
+
+    return node->type == IF
+        && node->right == NULL
+        && cond_to_dnf(node->left->left, conjs) >= 0;
+}
+
+enum {
+    ACL_FIELD_UNUSED,
+    ACL_FIELD_SRC_ADDR,
+    ACL_FIELD_DST_ADDR,
+    ACL_FIELD_VLAN,
+    ACL_NB_FIELDS,
+};
+
+RTE_ACL_RULE_DEF(rules_acl_rule, ACL_NB_FIELDS);
+
+/*
+ * Build a classifier for the conditions of the nb_ifs "if" nodes of ifs. When
+ * a struct rules_acl_key matches the condition of ifs[n] and of no previous
+ * "if", the classifier returns n + 1.
+ *
+ * @return
+ *  - NULL on error.
+ */
+static struct rte_acl_ctx *
+classifier_create(struct app_config_node **ifs, int nb_ifs,
+                  unsigned int socket_id)
+{
+    static unsigned int nb_classifiers = 0;
+    struct rules_conj conjs[RULES_CLASSIFY_MAX_CONJS];
+    char name[RTE_ACL_NAMESIZE];
+    struct rte_acl_param param;
+    struct rte_acl_config config;
+    struct rules_acl_rule rule;
+    struct rte_acl_ctx *ctx;
+    int nb_conjs;
+    int i, j;
+
+    snprintf(name, sizeof(name), "rules_acl_%u", nb_classifiers++);
+    param.name = name;
+    param.socket_id = socket_id;
+    param.rule_size = RTE_ACL_RULE_SZ(ACL_NB_FIELDS);
+    param.max_rule_num = nb_ifs * RULES_CLASSIFY_MAX_CONJS;
+
+    ctx = rte_acl_create(&param);
+    if (ctx == NULL) {
+        RTE_LOG(ERR, APP, "Unable to create classifier: %s\n",
+                rte_strerror(rte_errno));
+        return NULL;
+    }
+
+    for (i = 0; i < nb_ifs; ++i) {
+        nb_conjs = cond_to_dnf(ifs[i]->left->left, conjs);
+
+        for (j = 0; j < nb_conjs; ++j) {
+            memset(&rule, 0, sizeof(rule));
+
+            // The first "if" has the highest priority.
+            rule.data.category_mask = 1;
+            rule.data.priority = RTE_ACL_MAX_PRIORITY - i;
+            rule.data.userdata = i + 1;
+
+            rule.field[ACL_FIELD_SRC_ADDR].value.u32 = conjs[j].src_ip;
+            rule.field[ACL_FIELD_SRC_ADDR].mask_range.u32 =
+                __builtin_popcount(conjs[j].src_mask);
+            rule.field[ACL_FIELD_DST_ADDR].value.u32 = conjs[j].dst_ip;
+            rule.field[ACL_FIELD_DST_ADDR].mask_range.u32 =
+                __builtin_popcount(conjs[j].dst_mask);
+
+            if (conjs[j].vlan >= 0) {
+                rule.field[ACL_FIELD_VLAN].value.u16 = conjs[j].vlan;
+                rule.field[ACL_FIELD_VLAN].mask_range.u16 = conjs[j].vlan;
+            } else {
+                rule.field[ACL_FIELD_VLAN].value.u16 = 0;
+                rule.field[ACL_FIELD_VLAN].mask_range.u16 = 0xffff;
+            }
+
+            if (rte_acl_add_rules(ctx, (struct rte_acl_rule *)&rule, 1) < 0) {
+                RTE_LOG(ERR, APP, "Unable to add classifier rule\n");
+                rte_acl_free(ctx);
+                return NULL;
+            }
+        }
+    }
+
+    memset(&config, 0, sizeof(config));
+    config.num_categories = 1;
+    config.num_fields = ACL_NB_FIELDS;
+
+    config.defs[ACL_FIELD_UNUSED].type = RTE_ACL_FIELD_TYPE_BITMASK;
+    config.defs[ACL_FIELD_UNUSED].size = sizeof(uint8_t);
+    config.defs[ACL_FIELD_UNUSED].field_index = ACL_FIELD_UNUSED;
+    config.defs[ACL_FIELD_UNUSED].input_index = 0;
+    config.defs[ACL_FIELD_UNUSED].offset =
+        offsetof(struct rules_acl_key, unused);
+
+    config.defs[ACL_FIELD_SRC_ADDR].type = RTE_ACL_FIELD_TYPE_MASK;
+    config.defs[ACL_FIELD_SRC_ADDR].size = sizeof(uint32_t);
+    config.defs[ACL_FIELD_SRC_ADDR].field_index = ACL_FIELD_SRC_ADDR;
+    config.defs[ACL_FIELD_SRC_ADDR].input_index = 1;
+    config.defs[ACL_FIELD_SRC_ADDR].offset =
+        offsetof(struct rules_acl_key, src_addr);
+
+    config.defs[ACL_FIELD_DST_ADDR].type = RTE_ACL_FIELD_TYPE_MASK;
+    config.defs[ACL_FIELD_DST_ADDR].size = sizeof(uint32_t);
+    config.defs[ACL_FIELD_DST_ADDR].field_index = ACL_FIELD_DST_ADDR;
+    config.defs[ACL_FIELD_DST_ADDR].input_index = 2;
+    config.defs[ACL_FIELD_DST_ADDR].offset =
+        offsetof(struct rules_acl_key, dst_addr);
+
+    config.defs[ACL_FIELD_VLAN].type = RTE_ACL_FIELD_TYPE_RANGE;
+    config.defs[ACL_FIELD_VLAN].size = sizeof(uint16_t);
+    config.defs[ACL_FIELD_VLAN].field_index = ACL_FIELD_VLAN;
+    config.defs[ACL_FIELD_VLAN].input_index = 3;
+    config.defs[ACL_FIELD_VLAN].offset = offsetof(struct rules_acl_key, vlan);
+
+    if (rte_acl_build(ctx, &config) != 0) {
+        RTE_LOG(ERR, APP, "Unable to build classifier\n");
+        rte_acl_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int compile_stmt(struct rules_compiler *c, struct app_config_node *node);
+
+/*
+ * Compile the "if" node. Its body starts at label_body.
+ *
+ * node->left is a COND node, whose left part is the condition and right part
+ * is the body. node->right is the else clause.
+ */
+static int
+compile_if(struct rules_compiler *c, struct app_config_node *node,
+           int label_body)
+{
+    int label_else;
+    int label_end;
+
+    if ((label_end = new_label(c)) < 0) {
+        return -1;
+    }
+    label_else = label_end;
+    if (node->right && (label_else = new_label(c)) < 0) {
+        return -1;
+    }
+
+    if (compile_cond(c, node->left->left, label_body, label_else) < 0) {
+        return -1;
+    }
+
+    bind_label(c, label_body);
+    if (compile_stmt(c, node->left->right) < 0) {
+        return -1;
+    }
+
+    if (node->right) {
+        if (emit(c, RULES_OP_JUMP, label_end, label_end) == NULL) {
+            return -1;
+        }
+        bind_label(c, label_else);
+        if (compile_stmt(c, node->right) < 0) {
+            return -1;
+        }
+    }
+    bind_label(c, label_end);
+    return 0;
+}
+
+/*
+ * Compile the nb_ifs classifiable "if" nodes of ifs, preceded by a
+ * RULES_OP_CLASSIFY instruction.
+ */
+static int
+compile_classify(struct rules_compiler *c, struct app_config_node **ifs,
+                 int nb_ifs)
+{
+    struct rules_insn *insn;
+    uint32_t *targets;
+    int label;
+    int i;
+
+    targets = rte_malloc_socket(NULL, (nb_ifs + 1) * sizeof(*targets), 0,
+                                c->socket_id);
+    if (targets == NULL) {
+        return -1;
+    }
+
+    // targets contains labels until the whole sequence is compiled.
+    for (i = 0; i <= nb_ifs; ++i) {
+        if ((label = new_label(c)) < 0) {
+            rte_free(targets);
+            return -1;
+        }
+        targets[i] = label;
+    }
+
+    // Without classifier, the instruction would continue after the sequence.
+    insn = emit(c, RULES_OP_CLASSIFY, targets[0], targets[0]);
+    if (insn == NULL) {
+        rte_free(targets);
+        return -1;
+    }
+    // Freed by free_insns() on error.
+    insn->classify.targets = targets;
+    insn->classify.ctx = classifier_create(ifs, nb_ifs, c->socket_id);
+    if (insn->classify.ctx == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < nb_ifs; ++i) {
+        if (compile_if(c, ifs[i], targets[i + 1]) < 0) {
+            return -1;
+        }
+    }
+    bind_label(c, targets[0]);
+
+    for (i = 0; i <= nb_ifs; ++i) {
+        targets[i] = c->labels[targets[i]];
+    }
+    return 0;
+}
+
+/*
+ * Store the statements of the SEQ nodes tree in stmts, in order.
+ *
+ * @return
+ *  - The number of statements, or -1 if memory can't be allocated.
+ */
+static int
+flatten_seq(struct app_config_node *node, struct app_config_node ***stmts,
+            int *nb_stmts, int *size)
+{
+    struct app_config_node **new_stmts;
+
+    if (node->type == SEQ) {
+        if (flatten_seq(node->left, stmts, nb_stmts, size) < 0 ||
+            flatten_seq(node->right, stmts, nb_stmts, size) < 0) {
+            return -1;
+        }
+        return *nb_stmts;
+    }
+
+    if (*nb_stmts == *size) {
+        *size = *size ? *size * 2 : 64;
+        new_stmts = realloc(*stmts, *size * sizeof(*new_stmts));
+        if (new_stmts == NULL) {
+            return -1;
+        }
+        *stmts = new_stmts;
+    }
+    (*stmts)[(*nb_stmts)++] = node;
+    return *nb_stmts;
+}
+
+static int
+compile_seq(struct rules_compiler *c, struct app_config_node *node)
+{
+    struct app_config_node **stmts = NULL;
+    int nb_stmts = 0;
+    int size = 0;
+    int ret = -1;
+    int i, n;
+
+    if (flatten_seq(node, &stmts, &nb_stmts, &size) < 0) {
+        goto end;
+    }
+
+    for (i = 0; i < nb_stmts; i += n) {
+        for (n = 0; i + n < nb_stmts && is_classifiable(stmts[i + n]); ++n)
+            ;
+
+        if (n >= RULES_CLASSIFY_MIN_IFS) {
+            if (compile_classify(c, &stmts[i], n) < 0) {
+                goto end;
+            }
+        } else {
+            n = 1;
+            if (compile_stmt(c, stmts[i]) < 0) {
+                goto end;
+            }
+        }
+    }
+    ret = 0;
+
+end:
+    free(stmts);
+    return ret;
+}
+
+static int
+compile_stmt(struct rules_compiler *c, struct app_config_node *node)
+{
+    struct rules_insn *insn;
+    int label;
+
+    if (node == NULL) {
+        return 0;
+    }
+
+    switch (node->type) {
+
+    case ACTION:
+        if ((label = new_label(c)) < 0) {
+            return -1;
+        }
+        insn = emit(c, RULES_OP_ACTION, label, label);
+        if (insn == NULL) {
+            return -1;
+        }
+
+        if (node->action == action_nat_rewrite) {
+            insn->op = RULES_OP_ACTION_BURST;
+            insn->burst.f = action_nat_rewrite_burst;
+            insn->burst.data = node->data;
+        } else if (node->action == action_out) {
+            insn->op = RULES_OP_ACTION_BURST;
+            insn->burst.f = action_out_burst;
+            insn->burst.data = node->data;
+        } else if (node->action == action_drop) {
+            insn->op = RULES_OP_ACTION_BURST;
+            insn->burst.f = action_drop_burst;
+            insn->burst.data = node->data;
+        } else {
+            insn->call.f = node->action;
+            insn->call.data = node->data;
+        }
+        bind_label(c, label);
+        return 0;
+
+    case SEQ:
+        return compile_seq(c, node);
+
+    case IF:
+        if ((label = new_label(c)) < 0) {
+            return -1;
+        }
+        return compile_if(c, node, label);
+
+    default:
+        break ;
+    }
+
+    RTE_LOG(ERR, APP, "Unexpected node type %i in rules\n", node->type);
+    return -1;
+}
+
+/*
+ * @return
+ *  - The index of the instruction executed when continuing at idx: if idx is
+ *    a RULES_OP_JUMP, its target. Jumps are always forward, so this
+ *    terminates.
+ */
+static uint32_t
+skip_jumps(const struct rules_compiler *c, uint32_t idx)
+{
+    while (c->insns[idx].op == RULES_OP_JUMP) {
+        idx = c->insns[idx].next[0];
+    }
+    return idx;
+}
+
+/*
+ * Replace labels by instruction indexes, and make instructions continuing to a
+ * RULES_OP_JUMP continue to its target instead.
+ */
+static void
+resolve_labels(struct rules_compiler *c)
+{
+    struct rules_insn *insn;
+    uint32_t i;
+    int j;
+
+    // The last instruction is RULES_OP_END, which doesn't continue.
+    for (i = 0; i + 1 < c->len; ++i) {
+        insn = &c->insns[i];
+        for (j = 0; j < 2; ++j) {
+            insn->next[j] = c->labels[insn->next[j]];
+        }
+    }
+
+    for (i = c->len - 1; i > 0; --i) {
+        insn = &c->insns[i - 1];
+
+        for (j = 0; j < 2; ++j) {
+            insn->next[j] = skip_jumps(c, insn->next[j]);
+        }
+    }
+}
+
+/*
+ * Free the classifiers of the instructions.
+ */
+static void
+free_insns(struct rules_insn *insns, uint32_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (insns[i].op == RULES_OP_CLASSIFY) {
+            rte_acl_free(insns[i].classify.ctx);
+            rte_free(insns[i].classify.targets);
+        }
+    }
+}
+
+/*
+ * Compile the rules AST root.
+ *
+ * @return
+ *  - The program, to free with rules_free().
+ *  - NULL on error.
+ */
+struct rules_program *
+rules_compile(struct app_config_node *root, unsigned int socket_id)
+{
+    struct rules_compiler c = {};
+    struct rules_program *program = NULL;
+
+    c.socket_id = socket_id;
+
+    if (compile_stmt(&c, root) < 0 ||
+        emit(&c, RULES_OP_END, 0, 0) == NULL) {
+        RTE_LOG(ERR, APP, "Unable to compile rules\n");
+        free_insns(c.insns, c.len);
+        goto end;
+    }
+
+    resolve_labels(&c);
+
+    program = rte_zmalloc_socket(NULL,
+                                 sizeof(*program) + c.len * sizeof(*c.insns),
+                                 RTE_CACHE_LINE_SIZE, socket_id);
+    if (program == NULL) {
+        RTE_LOG(ERR, APP, "Unable to allocate rules program\n");
+        free_insns(c.insns, c.len);
+        goto end;
+    }
+    program->len = c.len;
+    memcpy(program->insns, c.insns, c.len * sizeof(*c.insns));
+
+end:
+    free(c.insns);
+    free(c.labels);
+    return program;
+}
+
+void
+rules_free(struct rules_program *program)
+{
+    if (program == NULL) {
+        return ;
+    }
+
+    free_insns(program->insns, program->len);
+    rte_free(program);
+}
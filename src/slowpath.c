@@ -0,0 +1,286 @@
+/* vim: ts=4 sw=4 et */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rte_cycles.h>
+#include <rte_errno.h>
+#include <rte_ether.h>
+#include <rte_lcore.h>
+#include <rte_malloc.h>
+#include <rte_ring.h>
+
+#include "natasha.h"
+
+/*
+ * Slow path.
+ *
+ * ARP requests and ICMP echo requests addressed to natasha are not replied to
+ * by the workers: a worker only checks the target address, and hands the
+ * packet off to the slow path thread through its ring. An ARP storm or a ping
+ * flood then only costs the workers an enqueue per packet, and the code
+ * building the replies and logging stays out of their instruction cache.
+ *
+ * The slow path thread is started by the master core and shares it with the
+ * management server: every lcore given to DPDK runs a worker. It polls the
+ * rings of the workers, sleeping SLOWPATH_IDLE_US when they are empty, and
+ * sends the replies on its own TX queue of each port, the queue after the
+ * ones of the workers (see core.c/setup_port()).
+ *
+ * The replies of each type are limited to "slowpath arp|icmp <packets per
+ * second>;" by a token bucket. Requests over the limit are dropped.
+ */
+
+// Sleep of the slow path thread when no request is pending, in microseconds.
+#define SLOWPATH_IDLE_US    100
+
+// Token bucket of a type of request. The bucket holds up to one second of
+// credit, in timer cycles, and each reply costs cost cycles.
+struct slowpath_limit {
+    // hz / rate, UINT64_MAX if no reply is allowed. Written by the master
+    // core on reload.
+    volatile uint64_t cost;
+    uint64_t credit;
+    uint64_t last;
+};
+
+// Workers handing off requests, set by slowpath_init().
+static struct core *slowpath_cores;
+
+// Queues, free queue and statistics of the slow path thread, to send replies
+// with pkt.c/tx_send().
+static struct core slowpath_core;
+static struct natasha_slowpath_stats slowpath_counters;
+static struct slowpath_limit slowpath_limits[SLOWPATH_NB_TYPES];
+
+static pthread_t slowpath_thread;
+static int slowpath_running;
+
+/*
+ * Create the slow path ring of each worker. Called before the workers are
+ * started.
+ */
+int
+slowpath_init(struct core *cores)
+{
+    char name[RTE_RING_NAMESIZE];
+    unsigned int core;
+
+    slowpath_cores = cores;
+
+    RTE_LCORE_FOREACH_SLAVE(core) {
+        snprintf(name, sizeof(name), "slowpath_%u", core);
+        cores[core].slowpath_ring = rte_ring_create(
+            name, SLOWPATH_RING_SIZE, rte_lcore_to_socket_id(core),
+            RING_F_SP_ENQ | RING_F_SC_DEQ);
+        if (cores[core].slowpath_ring == NULL) {
+            RTE_LOG(ERR, APP,
+                    "Unable to create slow path ring of core %u: %s\n",
+                    core, rte_strerror(rte_errno));
+            return -1;
+        }
+    }
+
+    slowpath_core.id = rte_get_master_lcore();
+    slowpath_core.stats = rte_zmalloc("slowpath stats",
+                                      sizeof(*slowpath_core.stats), 0);
+    if (slowpath_core.stats == NULL) {
+        RTE_LOG(ERR, APP, "Unable to allocate slow path statistics\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Use the TX queue queue_id of port, allocated on socket, to send the
+ * replies. Called by core.c/setup_queues().
+ */
+int
+slowpath_setup_port(uint8_t port, uint16_t queue_id, int socket)
+{
+    struct tx_queue *queue = &slowpath_core.tx_queues[port];
+
+    queue->id = queue_id;
+    queue->retry = rte_zmalloc_socket(
+        "tx_retry", TX_RETRY_SIZE * sizeof(struct rte_mbuf *),
+        RTE_CACHE_LINE_SIZE, socket);
+    if (queue->retry == NULL) {
+        RTE_LOG(ERR, APP,
+                "Port %i: unable to allocate the TX retry buffer of the slow "
+                "path\n", port);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set the replies per second of each type, from the "slowpath" statements of
+ * a newly loaded configuration.
+ */
+void
+slowpath_set_rates(const unsigned int *rates)
+{
+    uint64_t hz = rte_get_timer_hz();
+    unsigned int type;
+
+    for (type = 0; type < SLOWPATH_NB_TYPES; ++type) {
+        slowpath_limits[type].cost = rates[type] ? hz / rates[type]
+                                                 : UINT64_MAX;
+    }
+}
+
+/*
+ * Take a token from the bucket of limit.
+ *
+ * @return
+ *  - 0 if the limit is reached.
+ */
+static int
+slowpath_limit_allow(struct slowpath_limit *limit, uint64_t now, uint64_t hz)
+{
+    uint64_t cost = limit->cost;
+
+    limit->credit = RTE_MIN(limit->credit + (now - limit->last), hz);
+    limit->last = now;
+
+    if (limit->credit < cost) {
+        return 0;
+    }
+    limit->credit -= cost;
+    return 1;
+}
+
+/*
+ * Reply to a request handed off by a worker, if its type is below its rate.
+ */
+static void
+slowpath_process(struct rte_mbuf *pkt, uint64_t now, uint64_t hz)
+{
+    struct ether_hdr *eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    uint8_t port = pkt->port;
+
+    // Workers only hand off ARP requests and ICMP echo requests.
+    if (eth_hdr->ether_type == rte_cpu_to_be_16(ETHER_TYPE_ARP)) {
+        if (!slowpath_limit_allow(&slowpath_limits[SLOWPATH_ARP], now, hz)) {
+            slowpath_counters.drop_arp_rate++;
+            pkt_free(pkt, &slowpath_core);
+            return ;
+        }
+        slowpath_counters.arp_replies++;
+        arp_reply(pkt, port, &slowpath_core);
+        return ;
+    }
+
+    if (!slowpath_limit_allow(&slowpath_limits[SLOWPATH_ICMP], now, hz)) {
+        slowpath_counters.drop_icmp_rate++;
+        pkt_free(pkt, &slowpath_core);
+        return ;
+    }
+    slowpath_counters.icmp_echo_replies++;
+    icmp_echo(pkt, port, &slowpath_core);
+}
+
+static void *
+slowpath_loop(void *arg)
+{
+    struct rte_mbuf *pkts[MAX_RX_BURST];
+    uint8_t eth_dev_count = rte_eth_dev_count();
+    uint64_t hz = rte_get_timer_hz();
+    unsigned int nb_pkts;
+    unsigned int total;
+    unsigned int core;
+    unsigned int i;
+    uint64_t now;
+    uint8_t port;
+
+    now = rte_get_timer_cycles();
+    for (i = 0; i < SLOWPATH_NB_TYPES; ++i) {
+        slowpath_limits[i].last = now;
+    }
+
+    while (!force_quit) {
+        total = 0;
+        now = rte_get_timer_cycles();
+
+        RTE_LCORE_FOREACH_SLAVE(core) {
+            nb_pkts = rte_ring_sc_dequeue_burst(
+                slowpath_cores[core].slowpath_ring, (void **)pkts,
+                MAX_RX_BURST, NULL);
+            for (i = 0; i < nb_pkts; ++i) {
+                slowpath_process(pkts[i], now, hz);
+            }
+            total += nb_pkts;
+        }
+
+        for (port = 0; port < eth_dev_count; ++port) {
+            tx_flush(port, &slowpath_core);
+        }
+        pkt_free_flush(&slowpath_core);
+
+        if (total == 0) {
+            usleep(SLOWPATH_IDLE_US);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Start the slow path thread, once the ports are started and the rates are
+ * set.
+ */
+int
+slowpath_start(void)
+{
+    int ret;
+
+    ret = pthread_create(&slowpath_thread, NULL, slowpath_loop, NULL);
+    if (ret != 0) {
+        RTE_LOG(ERR, APP, "Unable to start the slow path thread: %s\n",
+                strerror(ret));
+        return -1;
+    }
+    rte_thread_setname(slowpath_thread, "slowpath");
+    slowpath_running = 1;
+    return 0;
+}
+
+/*
+ * Wait for the slow path thread to exit, once force_quit is set.
+ */
+void
+slowpath_stop(void)
+{
+    if (slowpath_running) {
+        pthread_join(slowpath_thread, NULL);
+        slowpath_running = 0;
+    }
+}
+
+/*
+ * Hand pkt off to the slow path thread. Called by the workers, pkt is dropped
+ * if the ring of core is full.
+ */
+void
+slowpath_handoff(struct rte_mbuf *pkt, struct core *core)
+{
+    if (unlikely(rte_ring_sp_enqueue(core->slowpath_ring, pkt) < 0)) {
+        core->stats->drop_slowpath++;
+        pkt_free(pkt, core);
+        return ;
+    }
+    core->stats->slowpath_handoff++;
+}
+
+/*
+ * Copy the statistics of the slow path thread to stats.
+ */
+void
+slowpath_stats(struct natasha_slowpath_stats *stats)
+{
+    *stats = slowpath_counters;
+    if (slowpath_core.stats) {
+        stats->drop_tx_notsent = slowpath_core.stats->drop_tx_notsent;
+    }
+}
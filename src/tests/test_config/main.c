@@ -38,6 +38,56 @@ dump_rules(struct app_config_node *root, int level)
     }
 }
 
+static void
+dump_program(const struct rules_program *program)
+{
+    const struct rules_insn *insn;
+    uint32_t i;
+
+    for (i = 0; i < program->len; ++i) {
+        insn = &program->insns[i];
+
+        printf("EXPECT: insn %u ", i);
+
+        switch (insn->op) {
+        case RULES_OP_END:
+            printf("END");
+            break ;
+        // Actions with a batched variant are dumped like the others
+        case RULES_OP_ACTION:
+        case RULES_OP_ACTION_BURST:
+            printf("ACTION -> %u", insn->next[0]);
+            break ;
+        case RULES_OP_COND:
+            printf("COND ? %u : %u", insn->next[1], insn->next[0]);
+            break ;
+        case RULES_OP_SRC_IN:
+        case RULES_OP_DST_IN:
+            printf("%s " IPv4_FMT " mask " IPv4_FMT " ? %u : %u",
+                   insn->op == RULES_OP_SRC_IN ? "SRC_IN" : "DST_IN",
+                   IPv4_FMTARGS(insn->network.ip),
+                   IPv4_FMTARGS(insn->network.mask),
+                   insn->next[1], insn->next[0]);
+            break ;
+        case RULES_OP_VLAN:
+            printf("VLAN %i ? %u : %u", insn->vlan, insn->next[1],
+                   insn->next[0]);
+            break ;
+        case RULES_OP_JUMP:
+            printf("JUMP -> %u", insn->next[0]);
+            break ;
+        case RULES_OP_CLASSIFY:
+            printf("CLASSIFY else %u", insn->next[0]);
+            break ;
+
+        default:
+            fprintf(stderr, "Test error: unexpected opcode %i\n", insn->op);
+            exit(1);
+        }
+
+        printf("\n");
+    }
+}
 
 int
 main(int argc, char **argv)
@@ -57,7 +107,7 @@ main(int argc, char **argv)
         exit(1);
     }
 
-    if (app_config->nat_lookup == NULL) {
+    if (app_config->nat_tables[NAT_DIR_OUT] == NULL) {
         printf("EXPECT: no NAT rules\n");
     }
 
@@ -77,11 +127,60 @@ main(int argc, char **argv)
 
             port_ip_addr = port_ip_addr->next;
         }
+
+        if (app_config->ports[i].ip_addresses &&
+            (app_config->ports[i].rx_ring_size != PORT_DEFAULT_RX_RING ||
+             app_config->ports[i].tx_ring_size != PORT_DEFAULT_TX_RING ||
+             app_config->ports[i].rx_burst != PORT_DEFAULT_RX_BURST)) {
+            printf("EXPECT: port %lu rx ring %u tx ring %u burst %u\n", i,
+                   app_config->ports[i].rx_ring_size,
+                   app_config->ports[i].tx_ring_size,
+                   app_config->ports[i].rx_burst);
+        }
+    }
+
+    if (app_config->flow_cache_size) {
+        printf("EXPECT: flow cache %u entries\n", app_config->flow_cache_size);
+    }
+
+    if (app_config->rss_symmetric) {
+        printf("EXPECT: rss symmetric\n");
     }
 
-    // Dump NAT rules
+    if (app_config->tx_hold_us) {
+        printf("EXPECT: tx hold %u us\n", app_config->tx_hold_us);
+    }
+
+    if (app_config->slowpath_rates[SLOWPATH_ARP] != SLOWPATH_DEFAULT_RATE ||
+        app_config->slowpath_rates[SLOWPATH_ICMP] != SLOWPATH_DEFAULT_RATE) {
+        printf("EXPECT: slowpath arp %u/s icmp %u/s\n",
+               app_config->slowpath_rates[SLOWPATH_ARP],
+               app_config->slowpath_rates[SLOWPATH_ICMP]);
+    }
+
+    if (app_config->napt.nb_addresses) {
+        printf("EXPECT: napt pool " IPv4_FMT " %u addresses, %u sessions, "
+               "timeouts tcp %u udp %u icmp %u\n",
+               IPv4_FMTARGS(app_config->napt.pool_ip),
+               app_config->napt.nb_addresses, app_config->napt.max_sessions,
+               app_config->napt.timeouts[NAPT_PROTO_TCP],
+               app_config->napt.timeouts[NAPT_PROTO_UDP],
+               app_config->napt.timeouts[NAPT_PROTO_ICMP]);
+    }
+
+    for (i = 0; i < app_config->nat_det.nb_mappings; ++i) {
+        const struct nat_det_mapping *m = &app_config->nat_det.mappings[i];
+
+        printf("EXPECT: nat deterministic " IPv4_FMT " %u addresses to "
+               IPv4_FMT " %u addresses, %u ports\n",
+               IPv4_FMTARGS(m->int_ip), m->nb_int,
+               IPv4_FMTARGS(m->ext_ip), m->nb_ext, m->ports);
+    }
+
+    // Dump NAT rules, internal to external addresses first
     fflush(stdout);
-    nat_dump_rules(STDOUT_FILENO, app_config->nat_lookup);
+    nat_dump_rules(STDOUT_FILENO, app_config->nat_tables[NAT_DIR_OUT]);
+    nat_dump_rules(STDOUT_FILENO, app_config->nat_tables[NAT_DIR_IN]);
 
     if (app_config->rules == NULL) {
         printf("EXPECT: no packet rules\n");
@@ -89,5 +188,9 @@ main(int argc, char **argv)
 
     dump_rules(app_config->rules, 0);
 
+    if (app_config->program) {
+        dump_program(app_config->program);
+    }
+
     return 0;
 }
@@ -0,0 +1,202 @@
+/*
+ * Check the set of local addresses answers like a walk of the addresses of the
+ * ports, and measure its lookups with a thousand addresses on VLANs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+
+#include "natasha.h"
+#include "local_addrs.h"
+
+
+// Addresses of each port, each on its own VLAN.
+#define NB_ADDRS    1000
+#define NB_LOOKUPS  (1 << 22)
+
+static struct port_ip_addr addrs[NATASHA_MAX_ETHPORTS][NB_ADDRS];
+
+static void
+init_ports(struct port_config *ports)
+{
+    unsigned int port;
+    unsigned int i;
+
+    memset(ports, 0, sizeof(*ports) * NATASHA_MAX_ETHPORTS);
+    for (port = 0; port < NATASHA_MAX_ETHPORTS; ++port) {
+        for (i = 0; i < NB_ADDRS; ++i) {
+            addrs[port][i].addr.ip = IPv4(10, port, i / 256, i % 256);
+            addrs[port][i].addr.vlan = 1 + i % 4000;
+            addrs[port][i].next = ports[port].ip_addresses;
+            ports[port].ip_addresses = &addrs[port][i];
+        }
+        // The same address on both ports
+        addrs[port][0].addr.ip = IPv4(192, 168, 0, 1);
+    }
+}
+
+// Reference: walk the addresses of the port.
+static int
+walk(const struct port_config *ports, uint32_t ip, int vlan, int port)
+{
+    const struct port_ip_addr *ip_addr;
+
+    for (ip_addr = ports[port].ip_addresses; ip_addr;
+         ip_addr = ip_addr->next) {
+        if (ip_addr->addr.ip == ip && ip_addr->addr.vlan == vlan) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Pseudo-random address, VLAN and port, configured one time out of two.
+static void
+sample(uint32_t i, uint32_t *ip, int *vlan, int *port)
+{
+    uint32_t r = i * 2654435761u;
+
+    *port = (r >> 8) % NATASHA_MAX_ETHPORTS;
+    if (i % 2) {
+        *ip = addrs[*port][r % NB_ADDRS].addr.ip;
+        *vlan = addrs[*port][r % NB_ADDRS].addr.vlan;
+    } else {
+        *ip = r;
+        *vlan = r % 4096;
+    }
+}
+
+static int
+check_lookups(const struct port_config *ports, const struct local_addrs *set)
+{
+    uint64_t keys[LOCAL_ADDRS_MAX_BULK];
+    uint64_t expected;
+    uint64_t hits;
+    uint32_t ip;
+    uint32_t i;
+    int vlan;
+    int port;
+    int any;
+    int j;
+
+    if (set->len != NATASHA_MAX_ETHPORTS * NB_ADDRS * 2 - 1) {
+        fprintf(stderr, "Invalid number of keys: %u\n", set->len);
+        return -1;
+    }
+
+    expected = 0;
+    for (i = 0; i < 1000000; ++i) {
+        sample(i, &ip, &vlan, &port);
+
+        any = 0;
+        for (j = 0; j < NATASHA_MAX_ETHPORTS; ++j) {
+            any |= walk(ports, ip, vlan, j);
+        }
+        if (local_addrs_contains(set, local_addrs_key(ip, vlan, port)) !=
+                walk(ports, ip, vlan, port) ||
+            local_addrs_contains(set, local_addrs_key(
+                ip, vlan, LOCAL_ADDRS_ANY_PORT)) != any) {
+            fprintf(stderr, "Invalid lookup of " IPv4_FMT " vlan %d port %d\n",
+                    IPv4_FMTARGS(ip), vlan, port);
+            return -1;
+        }
+
+        keys[i % LOCAL_ADDRS_MAX_BULK] = local_addrs_key(ip, vlan, port);
+        expected |= (uint64_t)walk(ports, ip, vlan, port) <<
+                    (i % LOCAL_ADDRS_MAX_BULK);
+        if (i % LOCAL_ADDRS_MAX_BULK == LOCAL_ADDRS_MAX_BULK - 1) {
+            hits = local_addrs_lookup_bulk(set, keys, LOCAL_ADDRS_MAX_BULK);
+            if (hits != expected) {
+                fprintf(stderr, "Invalid bulk lookup\n");
+                return -1;
+            }
+            expected = 0;
+        }
+    }
+    return 0;
+}
+
+static void
+measure(const struct port_config *ports, const struct local_addrs *set)
+{
+    uint64_t *keys;
+    uint64_t start;
+    uint64_t cycles;
+    uint64_t found;
+    uint32_t ip;
+    uint32_t i;
+    int vlan;
+    int port;
+
+    keys = malloc(NB_LOOKUPS * sizeof(*keys));
+    if (keys == NULL) {
+        return ;
+    }
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        sample(i, &ip, &vlan, &port);
+        keys[i] = local_addrs_key(ip, vlan, port);
+    }
+
+    found = 0;
+    start = rte_rdtsc();
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        found += local_addrs_contains(set, keys[i]);
+    }
+    cycles = rte_rdtsc() - start;
+    printf("%.1f cycles per lookup (%" PRIu64 " found)\n",
+           (double)cycles / NB_LOOKUPS, found);
+
+    found = 0;
+    start = rte_rdtsc();
+    for (i = 0; i < NB_LOOKUPS; i += LOCAL_ADDRS_MAX_BULK) {
+        found += __builtin_popcountll(local_addrs_lookup_bulk(
+            set, &keys[i], LOCAL_ADDRS_MAX_BULK));
+    }
+    cycles = rte_rdtsc() - start;
+    printf("%.1f cycles per bulk lookup (%" PRIu64 " found)\n",
+           (double)cycles / NB_LOOKUPS, found);
+
+    // The list of the port, for comparison
+    found = 0;
+    start = rte_rdtsc();
+    for (i = 0; i < NB_LOOKUPS / 64; ++i) {
+        sample(i, &ip, &vlan, &port);
+        found += walk(ports, ip, vlan, port);
+    }
+    cycles = rte_rdtsc() - start;
+    printf("%.1f cycles per walk of the addresses\n",
+           (double)cycles / (NB_LOOKUPS / 64));
+
+    free(keys);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct port_config ports[NATASHA_MAX_ETHPORTS];
+    struct local_addrs *set;
+
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    init_ports(ports);
+    set = local_addrs_create(ports, NATASHA_MAX_ETHPORTS, SOCKET_ID_ANY);
+    if (set == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (check_lookups(ports, set) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    measure(ports, set);
+
+    local_addrs_free(set);
+    return 0;
+}
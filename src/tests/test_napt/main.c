@@ -0,0 +1,366 @@
+/*
+ * Check NAPT sessions are created, found in both directions, expired after
+ * the timeout of their protocol and their ports reused, and measure the rate
+ * of session creations (new connections/s) and lookups (packets/s) with 1M
+ * and 10M concurrent sessions.
+ *
+ * Only the session table is measured: the rewrite of the packets is the same
+ * as for "nat rewrite".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+
+#include "natasha.h"
+#include "napt.h"
+
+
+// 256 public addresses: 16.5M ports for a single worker.
+#define POOL_IP     IPv4(51, 15, 0, 0)
+#define POOL_SIZE   256
+
+static void
+init_config(struct napt_config *config, uint32_t max_sessions)
+{
+    napt_config_default(config);
+    config->pool_ip = POOL_IP;
+    config->nb_addresses = POOL_SIZE;
+    config->max_sessions = max_sessions;
+}
+
+/*
+ * Internal address and port of the i-th session: 60000 ports per address.
+ */
+static inline uint32_t
+int_ip(uint32_t i)
+{
+    return IPv4(10, 0, 0, 0) + i / 60000;
+}
+
+static inline uint16_t
+int_port(uint32_t i)
+{
+    return 1024 + i % 60000;
+}
+
+/*
+ * Multiplying by a prime is a bijection modulo n if n is not a multiple of
+ * it: lookups are done in a random order, like for real traffic, but each
+ * session is looked up.
+ */
+static inline uint32_t
+shuffle(uint32_t i, uint32_t n)
+{
+    return (uint32_t)((uint64_t)i * 2654435761u % n);
+}
+
+static double
+rate(uint64_t nb, uint64_t cycles)
+{
+    return (double)nb * rte_get_tsc_hz() / cycles / 1000000;
+}
+
+/*
+ * Create nb sessions, measure the creation and lookup rates, and check every
+ * session is found in both directions.
+ */
+static int
+bench(uint32_t nb)
+{
+    struct napt_config config;
+    struct napt_table *table;
+    struct napt_session *session;
+    struct napt_session *found;
+    uint64_t create_cycles;
+    uint64_t out_cycles;
+    uint64_t in_cycles;
+    uint64_t expire_cycles;
+    uint64_t start;
+    uint32_t now;
+    uint32_t i;
+
+    init_config(&config, nb);
+    table = napt_table_create(&config, 0, 1, SOCKET_ID_ANY);
+    if (table == NULL) {
+        fprintf(stderr, "Unable to create a table of %u sessions\n", nb);
+        return -1;
+    }
+    now = table->now;
+
+    start = rte_rdtsc();
+    for (i = 0; i < nb; ++i) {
+        if (napt_session_create(table, NAPT_PROTO_UDP, int_ip(i),
+                                int_port(i)) == NULL) {
+            fprintf(stderr, "Unable to create session %u\n", i);
+            return -1;
+        }
+    }
+    create_cycles = rte_rdtsc() - start;
+
+    if (napt_session_create(table, NAPT_PROTO_UDP, int_ip(nb),
+                            int_port(nb)) != NULL) {
+        fprintf(stderr, "Session created in a full table\n");
+        return -1;
+    }
+
+    start = rte_rdtsc();
+    for (i = 0; i < nb; ++i) {
+        const uint32_t j = shuffle(i, nb);
+
+        session = napt_lookup_out(table, NAPT_PROTO_UDP, int_ip(j),
+                                  int_port(j));
+        if (session == NULL) {
+            fprintf(stderr, "Session %u not found\n", j);
+            return -1;
+        }
+        napt_session_refresh(table, session);
+    }
+    out_cycles = rte_rdtsc() - start;
+
+    // Walk sessions in their order of creation, to look up their public
+    // address and port in a random order.
+    start = rte_rdtsc();
+    for (i = 0; i < nb; ++i) {
+        session = &table->sessions[shuffle(i, nb)];
+        found = napt_lookup_in(table, NAPT_PROTO_UDP, session->ext_ip,
+                               session->ext_port);
+        if (found != session ||
+            !napt_pool_contains(&config, session->ext_ip) ||
+            session->ext_port < NAPT_FIRST_PORT) {
+            fprintf(stderr, "Invalid public address of session %u\n", i);
+            return -1;
+        }
+    }
+    in_cycles = rte_rdtsc() - start;
+
+    // All the sessions expire at once
+    start = rte_rdtsc();
+    now += config.timeouts[NAPT_PROTO_UDP];
+    while (napt_expire(table, now)) {
+    }
+    expire_cycles = rte_rdtsc() - start;
+
+    if (table->nb_sessions != 0) {
+        fprintf(stderr, "%u sessions not expired\n", table->nb_sessions);
+        return -1;
+    }
+
+    printf("%5u K sessions, memory: %4zu MB, new sessions: %6.2f M/s, "
+           "lookups out: %6.2f M/s, in: %6.2f M/s, expiry: %6.2f M/s\n",
+           nb / 1000,
+           ((size_t)nb * (sizeof(*table->sessions) + sizeof(uint32_t)) +
+            ((size_t)table->mask + 1) * sizeof(uint32_t) * 2) >> 20,
+           rate(nb, create_cycles), rate(nb, out_cycles),
+           rate(nb, in_cycles), rate(nb, expire_cycles));
+
+    napt_table_free(table);
+    return 0;
+}
+
+/*
+ * Sessions expire after the timeout of their protocol, unless refreshed, and
+ * their ports are reused.
+ */
+static int
+check_expiry(void)
+{
+    struct napt_config config;
+    struct napt_table *table;
+    struct napt_session *tcp;
+    struct napt_session *udp;
+    struct napt_session *icmp;
+    uint32_t ext_ip;
+    uint16_t ext_port;
+    uint32_t now;
+
+    init_config(&config, 2);
+    config.timeouts[NAPT_PROTO_ICMP] = 10;
+    config.timeouts[NAPT_PROTO_UDP] = 20;
+    // Longer than the timer wheel
+    config.timeouts[NAPT_PROTO_TCP] = NAPT_WHEEL_SIZE * 3;
+
+    table = napt_table_create(&config, 0, 1, SOCKET_ID_ANY);
+    if (table == NULL) {
+        return -1;
+    }
+    now = table->now;
+
+    tcp = napt_session_create(table, NAPT_PROTO_TCP, int_ip(0), int_port(0));
+    // Same address and port, other protocol
+    udp = napt_session_create(table, NAPT_PROTO_UDP, int_ip(0), int_port(0));
+    if (tcp == NULL || udp == NULL ||
+        napt_session_create(table, NAPT_PROTO_ICMP, int_ip(1),
+                            int_port(1)) != NULL) {
+        fprintf(stderr, "Invalid number of sessions\n");
+        return -1;
+    }
+    ext_ip = udp->ext_ip;
+    ext_port = udp->ext_port;
+
+    // Refreshed before its timeout, the UDP session is kept
+    napt_expire(table, now + 15);
+    napt_session_refresh(table, udp);
+    napt_expire(table, now + 30);
+    if (napt_lookup_out(table, NAPT_PROTO_UDP, int_ip(0), int_port(0)) != udp) {
+        fprintf(stderr, "Refreshed session expired\n");
+        return -1;
+    }
+
+    napt_expire(table, now + 35);
+    if (napt_lookup_out(table, NAPT_PROTO_UDP, int_ip(0), int_port(0)) ||
+        napt_lookup_in(table, NAPT_PROTO_UDP, ext_ip, ext_port) ||
+        napt_lookup_out(table, NAPT_PROTO_TCP, int_ip(0), int_port(0)) != tcp) {
+        fprintf(stderr, "UDP session not expired\n");
+        return -1;
+    }
+
+    // The port of the expired session is reused
+    icmp = napt_session_create(table, NAPT_PROTO_ICMP, int_ip(1), int_port(1));
+    if (icmp == NULL || icmp->ext_ip != ext_ip || icmp->ext_port != ext_port) {
+        fprintf(stderr, "Port of expired session not reused\n");
+        return -1;
+    }
+
+    // The TCP session goes through its slot of the timer wheel several
+    // times before it expires.
+    napt_expire(table, now + NAPT_WHEEL_SIZE * 3 - 1);
+    if (napt_lookup_out(table, NAPT_PROTO_TCP, int_ip(0), int_port(0)) != tcp ||
+        napt_lookup_out(table, NAPT_PROTO_ICMP, int_ip(1), int_port(1))) {
+        fprintf(stderr, "Invalid expiry of TCP and ICMP sessions\n");
+        return -1;
+    }
+    napt_expire(table, now + NAPT_WHEEL_SIZE * 3);
+    if (table->nb_sessions != 0) {
+        fprintf(stderr, "TCP session not expired\n");
+        return -1;
+    }
+
+    napt_table_free(table);
+    return 0;
+}
+
+/*
+ * A call of napt_expire() handles at most NAPT_EXPIRE_BURST sessions, even if
+ * they are all refreshed and linked to another slot.
+ */
+static int
+check_expire_burst(void)
+{
+    const uint32_t nb = NAPT_EXPIRE_BURST * 4;
+    struct napt_config config;
+    struct napt_table *table;
+    unsigned int nb_calls;
+    uint32_t now;
+    uint32_t i;
+
+    init_config(&config, nb);
+    table = napt_table_create(&config, 0, 1, SOCKET_ID_ANY);
+    if (table == NULL) {
+        return -1;
+    }
+    now = table->now;
+
+    for (i = 0; i < nb; ++i) {
+        if (napt_session_create(table, NAPT_PROTO_UDP, int_ip(i),
+                                int_port(i)) == NULL) {
+            fprintf(stderr, "Unable to create session %u\n", i);
+            return -1;
+        }
+    }
+
+    // All the sessions are refreshed: their slot is only walked
+    napt_expire(table, now + 1);
+    for (i = 0; i < nb; ++i) {
+        napt_session_refresh(table, &table->sessions[i]);
+    }
+    now += config.timeouts[NAPT_PROTO_UDP];
+    nb_calls = 0;
+    do {
+        if (napt_expire(table, now) != 0) {
+            fprintf(stderr, "Refreshed session expired\n");
+            return -1;
+        }
+        nb_calls++;
+    } while (table->expiring != NAPT_NONE);
+    if (nb_calls != nb / NAPT_EXPIRE_BURST) {
+        fprintf(stderr, "Slot of %u sessions walked in %u calls\n",
+                nb, nb_calls);
+        return -1;
+    }
+
+    napt_expire(table, now + 1);
+    if (table->nb_sessions != nb - NAPT_EXPIRE_BURST) {
+        fprintf(stderr, "%u sessions expired instead of %u\n",
+                nb - table->nb_sessions, NAPT_EXPIRE_BURST);
+        return -1;
+    }
+
+    napt_table_free(table);
+    return 0;
+}
+
+/*
+ * Workers only allocate the ports they own.
+ */
+static int
+check_workers(void)
+{
+    const unsigned int nb_workers = 3;
+    struct napt_config config;
+    struct napt_table *table;
+    struct napt_session *session;
+    unsigned int worker;
+    uint32_t i;
+
+    init_config(&config, NAPT_NB_PORTS);
+    config.nb_addresses = 2;
+
+    for (worker = 0; worker < nb_workers; ++worker) {
+        table = napt_table_create(&config, worker, nb_workers, SOCKET_ID_ANY);
+        if (table == NULL) {
+            return -1;
+        }
+        // Ports of both addresses
+        if (table->max_sessions != 2 * (NAPT_NB_PORTS / nb_workers)) {
+            fprintf(stderr, "Invalid number of sessions of worker %u\n",
+                    worker);
+            return -1;
+        }
+
+        for (i = 0; i < table->max_sessions; ++i) {
+            session = napt_session_create(table, NAPT_PROTO_TCP, int_ip(i),
+                                          int_port(i));
+            if (session == NULL ||
+                napt_port_owner(table, session->ext_port) != (int)worker ||
+                !napt_pool_contains(&config, session->ext_ip)) {
+                fprintf(stderr, "Invalid port allocated by worker %u\n",
+                        worker);
+                return -1;
+            }
+        }
+        napt_table_free(table);
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    if (check_expiry() < 0 || check_expire_burst() < 0 ||
+        check_workers() < 0 ||
+        bench(1000000) < 0 || bench(10000000) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Check deterministic NAT mappings are validated, and that every private
+ * address and port is translated to a distinct public address and port which
+ * is translated back to it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+
+#include "natasha.h"
+#include "nat_deterministic.h"
+
+
+static int
+check_config(void)
+{
+    struct nat_det det;
+
+    memset(&det, 0, sizeof(det));
+
+    // 16384 private addresses, 256 * 63 blocks of 1024 ports
+    if (nat_det_add(&det, IPv4(100, 64, 0, 0), 18, IPv4(51, 15, 0, 0), 24,
+                    1024) == 0) {
+        fprintf(stderr, "Mapping without enough ports accepted\n");
+        return -1;
+    }
+
+    if (nat_det_add(&det, IPv4(100, 64, 0, 0), 18, IPv4(51, 15, 0, 0), 24,
+                    0) == 0 ||
+        nat_det_add(&det, IPv4(100, 64, 0, 0), 18, IPv4(51, 15, 0, 0), 24,
+                    NAT_DET_NB_PORTS + 1) == 0 ||
+        nat_det_add(&det, IPv4(100, 64, 0, 0), 0, IPv4(51, 15, 0, 0), 24,
+                    1) == 0) {
+        fprintf(stderr, "Invalid mapping accepted\n");
+        return -1;
+    }
+
+    if (nat_det_add(&det, IPv4(100, 64, 0, 0), 18, IPv4(51, 15, 0, 0), 24,
+                    512) < 0 ||
+        nat_det_add(&det, IPv4(100, 64, 0, 0), 24, IPv4(51, 16, 0, 0), 24,
+                    512) == 0 ||
+        nat_det_add(&det, IPv4(100, 65, 0, 0), 24, IPv4(51, 15, 0, 128), 25,
+                    512) == 0) {
+        fprintf(stderr, "Overlapping mappings accepted\n");
+        return -1;
+    }
+
+    if (det.nb_mappings != 1 ||
+        nat_det_find_int(&det, IPv4(100, 64, 63, 255)) != &det.mappings[0] ||
+        nat_det_find_int(&det, IPv4(100, 64, 64, 0)) != NULL ||
+        nat_det_find_ext(&det, IPv4(51, 15, 0, 255)) != &det.mappings[0] ||
+        nat_det_find_ext(&det, IPv4(51, 15, 1, 0)) != NULL) {
+        fprintf(stderr, "Invalid mapping networks\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Translate every private address and port of the mapping, which uses all
+ * the blocks but a few.
+ */
+static int
+check_mapping(void)
+{
+    const uint32_t ports = 992;
+    struct nat_det det;
+    const struct nat_det_mapping *m;
+    uint8_t *used;
+    uint64_t cycles;
+    uint64_t start;
+    uint32_t ext_ip;
+    uint16_t ext_port;
+    uint32_t int_ip;
+    uint16_t int_port;
+    uint32_t bit;
+    uint32_t i;
+    uint32_t p;
+
+    memset(&det, 0, sizeof(det));
+    // 16384 private addresses, 256 * 65 blocks
+    if (nat_det_add(&det, IPv4(100, 64, 0, 0), 18, IPv4(51, 15, 0, 0), 24,
+                    ports) < 0) {
+        return -1;
+    }
+    m = &det.mappings[0];
+
+    used = calloc(256 * 65536 / 8, 1);
+    if (used == NULL) {
+        return -1;
+    }
+
+    start = rte_rdtsc();
+    for (i = 0; i < m->nb_int; ++i) {
+        for (p = 0; p < ports; ++p) {
+            if (nat_det_out(m, m->int_ip + i, NAT_DET_FIRST_PORT + p, &ext_ip,
+                            &ext_port) < 0 ||
+                ext_ip - m->ext_ip >= m->nb_ext ||
+                ext_port < NAT_DET_FIRST_PORT ||
+                ext_ip != nat_det_ext_ip(m, m->int_ip + i)) {
+                fprintf(stderr, "Invalid translation of %u:%u\n", i, p);
+                return -1;
+            }
+
+            bit = (ext_ip - m->ext_ip) * 65536 + ext_port;
+            if (used[bit / 8] & (1 << (bit % 8))) {
+                fprintf(stderr, "Public port used twice\n");
+                return -1;
+            }
+            used[bit / 8] |= 1 << (bit % 8);
+
+            if (nat_det_in(m, ext_ip, ext_port, &int_ip, &int_port) < 0 ||
+                int_ip != m->int_ip + i ||
+                int_port != NAT_DET_FIRST_PORT + p) {
+                fprintf(stderr, "Invalid reverse translation of %u:%u\n",
+                        i, p);
+                return -1;
+            }
+        }
+    }
+    cycles = rte_rdtsc() - start;
+
+    // Private ports outside of the block, public ports of no private address
+    if (nat_det_out(m, m->int_ip, NAT_DET_FIRST_PORT - 1, &ext_ip,
+                    &ext_port) == 0 ||
+        nat_det_out(m, m->int_ip, NAT_DET_FIRST_PORT + ports, &ext_ip,
+                    &ext_port) == 0 ||
+        nat_det_in(m, m->ext_ip, NAT_DET_FIRST_PORT - 1, &int_ip,
+                   &int_port) == 0 ||
+        nat_det_in(m, m->ext_ip + 255, 65535, &int_ip, &int_port) == 0) {
+        fprintf(stderr, "Invalid port translated\n");
+        return -1;
+    }
+
+    printf("%.2f M round trip translations/s\n",
+           (double)m->nb_int * ports * rte_get_tsc_hz() / cycles / 1000000);
+
+    free(used);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    if (check_config() < 0 || check_mapping() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Check a binary NAT rules file ("nat rules FILE;") loads the same rules as
+ * the equivalent "nat rule" statements, and compare their load times for 64k
+ * and 1M rules.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_byteorder.h>
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+
+#define TEXT_CONF   "bench_text.conf"
+#define BIN_CONF    "bench_bin.conf"
+#define BIN_RULES   "bench_rules.bin"
+
+/*
+ * Rules i: 10.0.0.0 + i -> 100.64.0.0 + i, sorted by internal address like
+ * tools/nat_rules_convert.py does.
+ */
+static int
+write_configs(unsigned int nb_rules)
+{
+    struct nat_rules_file_header header;
+    uint32_t rule[2];
+    unsigned int i;
+    FILE *text, *bin, *conf;
+
+    text = fopen(TEXT_CONF, "w");
+    bin = fopen(BIN_RULES, "w");
+    conf = fopen(BIN_CONF, "w");
+    if (text == NULL || bin == NULL || conf == NULL) {
+        perror("fopen");
+        return -1;
+    }
+
+    memcpy(header.magic, NAT_RULES_FILE_MAGIC, sizeof(header.magic));
+    header.version = rte_cpu_to_le_32(NAT_RULES_FILE_VERSION);
+    header.nb_rules = rte_cpu_to_le_32(nb_rules);
+    fwrite(&header, sizeof(header), 1, bin);
+
+    fprintf(text, "config {\n");
+    for (i = 0; i < nb_rules; ++i) {
+        rule[0] = IPv4(10, 0, 0, 0) + i;
+        rule[1] = IPv4(100, 64, 0, 0) + i;
+
+        fprintf(text, "    nat rule " IPv4_FMT " " IPv4_FMT ";\n",
+                IPv4_FMTARGS(rule[0]), IPv4_FMTARGS(rule[1]));
+
+        rule[0] = rte_cpu_to_le_32(rule[0]);
+        rule[1] = rte_cpu_to_le_32(rule[1]);
+        fwrite(rule, sizeof(rule), 1, bin);
+    }
+    fprintf(text, "}\n");
+
+    fprintf(conf, "config {\n    nat rules \"%s\";\n}\n", BIN_RULES);
+
+    fclose(text);
+    fclose(bin);
+    fclose(conf);
+    return 0;
+}
+
+/*
+ * Load the configuration file path, and store the time it took in ms.
+ */
+static struct app_config *
+load(const char *path, double *ms)
+{
+    char *argv[] = {"test", "-f", (char *)path};
+    struct app_config *config;
+    uint64_t start;
+
+    start = rte_get_timer_cycles();
+    config = app_config_load(3, argv, SOCKET_ID_ANY);
+    *ms = (rte_get_timer_cycles() - start) * 1000. / rte_get_timer_hz();
+
+    if (config == NULL) {
+        fprintf(stderr, "Unable to load %s\n", path);
+    }
+    return config;
+}
+
+static int
+run(unsigned int nb_rules)
+{
+    struct app_config *text_config, *bin_config;
+    double text_ms, bin_ms;
+    int ret = -1;
+
+    if (write_configs(nb_rules) < 0) {
+        return -1;
+    }
+
+    text_config = load(TEXT_CONF, &text_ms);
+    bin_config = load(BIN_CONF, &bin_ms);
+    if (text_config == NULL || bin_config == NULL) {
+        goto out;
+    }
+
+    if (text_config->nat_rules.len != nb_rules ||
+        bin_config->nat_rules.len != nb_rules ||
+        memcmp(text_config->nat_rules.rules, bin_config->nat_rules.rules,
+               nb_rules * sizeof(struct nat_rule)) != 0) {
+        fprintf(stderr, "Text and binary rules differ\n");
+        goto out;
+    }
+
+    if (nat_number_of_rules(bin_config->nat_tables[NAT_DIR_OUT]) !=
+        (int)nb_rules) {
+        fprintf(stderr, "Table has %i rules instead of %u\n",
+                nat_number_of_rules(bin_config->nat_tables[NAT_DIR_OUT]),
+                nb_rules);
+        goto out;
+    }
+
+    printf("%8u rules: text %9.2f ms, binary %9.2f ms (x%.1f)\n",
+           nb_rules, text_ms, bin_ms, text_ms / bin_ms);
+    ret = 0;
+
+out:
+    app_config_free(text_config);
+    app_config_free(bin_config);
+    remove(TEXT_CONF);
+    remove(BIN_CONF);
+    remove(BIN_RULES);
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    if (run(1 << 16) < 0 || run(1 << 20) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
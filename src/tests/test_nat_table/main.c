@@ -0,0 +1,973 @@
+/*
+ * Check every NAT table backend returns the same results, also after
+ * nat_table_update(), that NAT counters survive table copies, and compare
+ * their memory usage, build time and lookup rate, with and without
+ * prefetching. Internal addresses are looked up in the NAT_DIR_OUT table,
+ * external addresses in the NAT_DIR_IN table.
+ *
+ * Tables with a prefilter must return the same results, and their rate of
+ * false positives and of lookups of addresses without rule are compared to
+ * tables without prefilter.
+ *
+ * Two sets of rules are used:
+ *
+ * - dense: 65536 rules 10.8.0.0/16 -> 51.15.0.0/16.
+ * - sparse: 65536 rules spread over the whole 10.0.0.0/8 and 51.0.0.0/8.
+ *
+ * The dense rules are also compared to the prefix rule "nat rule 10.8.0.0/16
+ * 51.15.0.0/16;", which translates the same addresses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_cycles.h>
+#include <rte_eal.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+
+#include "natasha.h"
+#include "nat_table.h"
+
+
+#define NB_RULES    65536
+#define NB_LOOKUPS  (1 << 22)
+#define NB_UPDATES  4096
+
+static const enum nat_table_type backends[] = {
+    NAT_TABLE_LEGACY,
+    NAT_TABLE_HASH,
+    NAT_TABLE_DIR24_8,
+};
+
+static void
+gen_dense_rules(struct nat_rules *rules)
+{
+    uint32_t i;
+
+    for (i = 0; i < NB_RULES; ++i) {
+        nat_rules_add(rules, IPv4(10, 8, 0, 0) + i, IPv4(51, 15, 0, 0) + i,
+                      SOCKET_ID_ANY);
+    }
+}
+
+/*
+ * Multiplying by an odd number is a bijection modulo 2^24: addresses are
+ * unique, and spread over the /8.
+ */
+static void
+gen_sparse_rules(struct nat_rules *rules)
+{
+    uint32_t i;
+
+    for (i = 0; i < NB_RULES; ++i) {
+        nat_rules_add(rules,
+                      IPv4(10, 0, 0, 0) + ((i * 2654435761u) & 0xffffff),
+                      IPv4(51, 0, 0, 0) + ((i * 40503u + 1) & 0xffffff),
+                      SOCKET_ID_ANY);
+    }
+}
+
+static void
+free_tables(struct nat_table **tables)
+{
+    nat_table_free(tables[NAT_DIR_OUT]);
+    nat_table_free(tables[NAT_DIR_IN]);
+    tables[NAT_DIR_OUT] = NULL;
+    tables[NAT_DIR_IN] = NULL;
+}
+
+static int
+create_tables(struct nat_table **tables, enum nat_table_type type,
+              const struct nat_rules *rules, int prefilter)
+{
+    tables[NAT_DIR_OUT] = nat_table_create(type, rules, NAT_DIR_OUT,
+                                           prefilter, SOCKET_ID_ANY);
+    tables[NAT_DIR_IN] = nat_table_create(type, rules, NAT_DIR_IN,
+                                          prefilter, SOCKET_ID_ANY);
+    if (tables[NAT_DIR_OUT] == NULL || tables[NAT_DIR_IN] == NULL) {
+        fprintf(stderr, "Unable to create tables %s\n", nat_table_name(type));
+        free_tables(tables);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Free the tables of updated which are not in tables.
+ */
+static void
+free_updated_tables(struct nat_table **updated, struct nat_table **tables)
+{
+    enum nat_dir dir;
+
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (updated[dir] != tables[dir]) {
+            nat_table_free(updated[dir]);
+        }
+    }
+}
+
+static int
+check_lookup(const struct nat_table *table, uint32_t key, uint32_t expected)
+{
+    uint32_t value;
+
+    if (expected == 0) {
+        if (nat_table_lookup(table, key, &value) == 0) {
+            fprintf(stderr, "Lookup of " IPv4_FMT " should fail\n",
+                    IPv4_FMTARGS(key));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (nat_table_lookup(table, key, &value) < 0 ||
+        value != rte_cpu_to_be_32(expected)) {
+        fprintf(stderr, "Lookup of " IPv4_FMT " failed\n", IPv4_FMTARGS(key));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+check_nb_rules(struct nat_table *const *tables, unsigned int nb_rules)
+{
+    if (nat_number_of_rules(tables[NAT_DIR_OUT]) != (int)nb_rules ||
+        nat_number_of_rules(tables[NAT_DIR_IN]) != (int)nb_rules) {
+        fprintf(stderr, "Tables have %i and %i rules instead of %u\n",
+                nat_number_of_rules(tables[NAT_DIR_OUT]),
+                nat_number_of_rules(tables[NAT_DIR_IN]), nb_rules);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @return
+ *  - -1 if tables don't contain every rule in their direction, or contain
+ *    addresses which are not in rules.
+ */
+static int
+check_table(struct nat_table *const *tables, const struct nat_rules *rules)
+{
+    const struct nat_table *out = tables[NAT_DIR_OUT];
+    const struct nat_table *in = tables[NAT_DIR_IN];
+    const struct nat_rule *rule;
+    unsigned int i;
+
+    for (i = 0; i < rules->len; ++i) {
+        rule = &rules->rules[i];
+
+        if (check_lookup(out, rule->int_ip, rule->ext_ip) < 0 ||
+            check_lookup(in, rule->ext_ip, rule->int_ip) < 0 ||
+            // Each address is only in the table of its direction
+            check_lookup(out, rule->ext_ip, 0) < 0 ||
+            check_lookup(in, rule->int_ip, 0) < 0 ||
+            // 192.168.0.0/16 is never used in rules
+            check_lookup(out, IPv4(192, 168, 0, 0) + (i & 0xffff), 0) < 0 ||
+            check_lookup(in, IPv4(192, 168, 0, 0) + (i & 0xffff), 0) < 0) {
+            return -1;
+        }
+    }
+
+    return check_nb_rules(tables, rules->len + rules->nb_prefixes);
+}
+
+/*
+ * An external address of a rule can be the internal address of another: each
+ * is only looked up in the table of its direction.
+ */
+static int
+check_overlap(enum nat_table_type type)
+{
+    struct nat_rules rules = {};
+    struct nat_table *tables[NAT_NB_DIRS];
+    int ret = -1;
+
+    nat_rules_add(&rules, IPv4(10, 0, 0, 1), IPv4(51, 0, 0, 1),
+                  SOCKET_ID_ANY);
+    nat_rules_add(&rules, IPv4(51, 0, 0, 1), IPv4(52, 0, 0, 1),
+                  SOCKET_ID_ANY);
+
+    if (create_tables(tables, type, &rules, 0) < 0) {
+        goto out;
+    }
+    if (check_lookup(tables[NAT_DIR_OUT], IPv4(10, 0, 0, 1),
+                     IPv4(51, 0, 0, 1)) == 0 &&
+        check_lookup(tables[NAT_DIR_OUT], IPv4(51, 0, 0, 1),
+                     IPv4(52, 0, 0, 1)) == 0 &&
+        check_lookup(tables[NAT_DIR_IN], IPv4(51, 0, 0, 1),
+                     IPv4(10, 0, 0, 1)) == 0 &&
+        check_lookup(tables[NAT_DIR_IN], IPv4(52, 0, 0, 1),
+                     IPv4(51, 0, 0, 1)) == 0 &&
+        check_lookup(tables[NAT_DIR_IN], IPv4(10, 0, 0, 1), 0) == 0 &&
+        check_nb_rules(tables, 2) == 0) {
+        ret = 0;
+    }
+    free_tables(tables);
+
+out:
+    nat_rules_free(&rules);
+    return ret;
+}
+
+/*
+ * Replace the first rule, remove the second one and add NB_UPDATES rules,
+ * which is more than the room left by hash and dir24_8 tables.
+ *
+ * @return
+ *  - -1 if the updated tables are invalid.
+ */
+static int
+check_updates(struct nat_table **tables, enum nat_table_type type,
+              int prefilter, const struct nat_rules *rules)
+{
+    static struct nat_update updates[NB_UPDATES + 2];
+    const struct nat_rule *replaced = &rules->rules[0];
+    const struct nat_rule *removed = &rules->rules[1];
+    struct nat_table *updated[NAT_NB_DIRS];
+    struct nat_table *empty[NAT_NB_DIRS] = {};
+    unsigned int i;
+
+    updates[0].op = NAT_UPDATE_REPLACE;
+    updates[0].rule.int_ip = replaced->int_ip;
+    updates[0].rule.ext_ip = IPv4(100, 64, 0, 1);
+    updates[1].op = NAT_UPDATE_DEL;
+    updates[1].rule = *removed;
+    for (i = 0; i < NB_UPDATES; ++i) {
+        updates[i + 2].op = NAT_UPDATE_ADD;
+        updates[i + 2].rule.int_ip = IPv4(100, 65, 0, 0) + i;
+        updates[i + 2].rule.ext_ip = IPv4(100, 66, 0, 0) + i * 7;
+    }
+
+    updated[NAT_DIR_OUT] = tables[NAT_DIR_OUT];
+    updated[NAT_DIR_IN] = tables[NAT_DIR_IN];
+    if (nat_table_update(updated, type, prefilter, 0, updates,
+                         NB_UPDATES + 2, SOCKET_ID_ANY) < 0) {
+        fprintf(stderr, "Unable to update tables\n");
+        return -1;
+    }
+
+    if (check_lookup(updated[NAT_DIR_OUT], replaced->int_ip,
+                     IPv4(100, 64, 0, 1)) < 0 ||
+        check_lookup(updated[NAT_DIR_IN], IPv4(100, 64, 0, 1),
+                     replaced->int_ip) < 0 ||
+        check_lookup(updated[NAT_DIR_IN], replaced->ext_ip, 0) < 0 ||
+        check_lookup(updated[NAT_DIR_OUT], removed->int_ip, 0) < 0 ||
+        check_lookup(updated[NAT_DIR_IN], removed->ext_ip, 0) < 0 ||
+        check_lookup(updated[NAT_DIR_OUT], rules->rules[2].int_ip,
+                     rules->rules[2].ext_ip) < 0) {
+        goto err;
+    }
+
+    for (i = 0; i < NB_UPDATES; ++i) {
+        if (check_lookup(updated[NAT_DIR_OUT], updates[i + 2].rule.int_ip,
+                         updates[i + 2].rule.ext_ip) < 0 ||
+            check_lookup(updated[NAT_DIR_IN], updates[i + 2].rule.ext_ip,
+                         updates[i + 2].rule.int_ip) < 0) {
+            goto err;
+        }
+    }
+
+    if (check_nb_rules(updated, rules->len - 1 + NB_UPDATES) < 0) {
+        goto err;
+    }
+    free_updated_tables(updated, tables);
+
+    // Configurations without NAT rules have no table
+    if (nat_table_update(empty, type, prefilter, 0, &updates[2], NB_UPDATES,
+                         SOCKET_ID_ANY) < 0 ||
+        check_nb_rules(empty, NB_UPDATES) < 0) {
+        fprintf(stderr, "Unable to update empty tables\n");
+        free_tables(empty);
+        return -1;
+    }
+    free_tables(empty);
+    return 0;
+
+err:
+    free_updated_tables(updated, tables);
+    return -1;
+}
+
+#define NB_COUNTED_RULES 1024
+
+struct counters_check {
+    const struct nat_rules *rules;
+    // Packets expected for the internal address of each rule.
+    uint64_t expected[NB_COUNTED_RULES];
+    int errors;
+};
+
+/*
+ * Rule i translated i + 1 packets of 100 bytes from its internal address, and
+ * nothing from its external address.
+ */
+static void
+check_counter(uint32_t from, uint32_t to, const struct nat_counter *counter,
+              void *arg)
+{
+    struct counters_check *check = arg;
+    uint64_t expected = 0;
+    unsigned int i;
+
+    for (i = 0; i < NB_COUNTED_RULES; ++i) {
+        if (check->rules->rules[i].int_ip == from) {
+            expected = check->expected[i];
+            break ;
+        }
+    }
+
+    if (counter->packets != expected || counter->bytes != expected * 100) {
+        fprintf(stderr, "Counters of " IPv4_FMT " -> " IPv4_FMT ": %lu "
+                "packets, %lu bytes instead of %lu packets\n",
+                IPv4_FMTARGS(from), IPv4_FMTARGS(to),
+                (unsigned long)counter->packets,
+                (unsigned long)counter->bytes, (unsigned long)expected);
+        check->errors++;
+    }
+}
+
+static int
+check_counters_read(struct nat_table **tables, unsigned int nb_tables,
+                    struct counters_check *check)
+{
+    check->errors = 0;
+    if (nat_table_counters_read(tables, nb_tables, &check_counter,
+                                check) < 0) {
+        fprintf(stderr, "Unable to read counters\n");
+        return -1;
+    }
+    return check->errors ? -1 : 0;
+}
+
+/*
+ * Count packets of the first rules on the first worker, and check counters
+ * are reset when a rule is replaced, and kept when the tables are copied.
+ * Only the counters of the NAT_DIR_OUT table are checked.
+ *
+ * @return
+ *  - -1 if counters are invalid.
+ */
+static int
+check_counters(enum nat_table_type type, const struct nat_rules *rules)
+{
+    static struct nat_update updates[NB_UPDATES + 1];
+    static struct counters_check check;
+    struct nat_rules counted = {};
+    struct nat_table *tables[NAT_NB_DIRS] = {};
+    struct nat_table *replaced[NAT_NB_DIRS] = {};
+    struct nat_table *read[2];
+    unsigned int lcore_id;
+    enum nat_dir dir;
+    uint32_t value;
+    uint32_t slot;
+    unsigned int i, j;
+    int ret = -1;
+
+    lcore_id = rte_get_next_lcore(-1, 1, 0);
+    if (lcore_id >= RTE_MAX_LCORE) {
+        fprintf(stderr, "Counters require a worker lcore\n");
+        return -1;
+    }
+
+    for (i = 0; i < NB_COUNTED_RULES; ++i) {
+        nat_rules_add(&counted, rules->rules[i].int_ip, rules->rules[i].ext_ip,
+                      SOCKET_ID_ANY);
+    }
+    check.rules = &counted;
+
+    if (create_tables(tables, type, &counted, 0) < 0) {
+        goto out;
+    }
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (nat_table_counters_alloc(tables[dir],
+                                     rte_lcore_to_socket_id(lcore_id)) < 0) {
+            fprintf(stderr, "Unable to create tables with counters\n");
+            goto out;
+        }
+    }
+
+    for (i = 0; i < NB_COUNTED_RULES; ++i) {
+        nat_table_lookup_slot(tables[NAT_DIR_OUT], counted.rules[i].int_ip,
+                              &value, &slot);
+        for (j = 0; j <= i; ++j) {
+            nat_table_count(tables[NAT_DIR_OUT], lcore_id, slot, 100);
+        }
+        check.expected[i] = i + 1;
+    }
+    if (check_counters_read(tables, 1, &check) < 0) {
+        goto out;
+    }
+
+    // Replaced in place: the counters belong to the previous rule
+    updates[0].op = NAT_UPDATE_REPLACE;
+    updates[0].rule.int_ip = counted.rules[0].int_ip;
+    updates[0].rule.ext_ip = IPv4(100, 64, 0, 1);
+    replaced[NAT_DIR_OUT] = tables[NAT_DIR_OUT];
+    replaced[NAT_DIR_IN] = tables[NAT_DIR_IN];
+    if (nat_table_update(tables, type, 0, 0, updates, 1, SOCKET_ID_ANY) < 0 ||
+        tables[NAT_DIR_OUT] != replaced[NAT_DIR_OUT] ||
+        tables[NAT_DIR_IN] != replaced[NAT_DIR_IN]) {
+        fprintf(stderr, "Unable to replace a rule in place\n");
+        replaced[NAT_DIR_OUT] = NULL;
+        replaced[NAT_DIR_IN] = NULL;
+        goto out;
+    }
+    check.expected[0] = 0;
+    if (check_counters_read(tables, 1, &check) < 0) {
+        goto out;
+    }
+
+    // Too many updates, spread over many /16: the tables are copied
+    for (i = 0; i < NB_UPDATES; ++i) {
+        updates[i].op = NAT_UPDATE_ADD;
+        updates[i].rule.int_ip = IPv4(100, 64 + (i & 15), i >> 4, 1);
+        updates[i].rule.ext_ip = IPv4(100, 96 + (i & 15), i >> 4, 1);
+    }
+    if (nat_table_update(tables, type, 0, 1, updates, NB_UPDATES,
+                         rte_lcore_to_socket_id(lcore_id)) < 0 ||
+        tables[NAT_DIR_OUT] == replaced[NAT_DIR_OUT]) {
+        fprintf(stderr, "Unable to copy tables\n");
+        goto out;
+    }
+
+    // Replaced tables not freed yet, then archived
+    read[0] = tables[NAT_DIR_OUT];
+    read[1] = replaced[NAT_DIR_OUT];
+    if (check_counters_read(read, 2, &check) < 0) {
+        goto out;
+    }
+    for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+        if (replaced[dir] != tables[dir]) {
+            nat_table_counters_archive(replaced[dir]);
+            nat_table_free(replaced[dir]);
+        }
+        replaced[dir] = NULL;
+    }
+    nat_table_counters_prune(tables, NAT_NB_DIRS);
+    if (check_counters_read(tables, 1, &check) < 0) {
+        goto out;
+    }
+
+    nat_table_lookup_slot(tables[NAT_DIR_OUT], counted.rules[1].int_ip, &value,
+                          &slot);
+    nat_table_count(tables[NAT_DIR_OUT], lcore_id, slot, 100);
+    check.expected[1]++;
+    if (check_counters_read(tables, 1, &check) < 0) {
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free_updated_tables(replaced, tables);
+    free_tables(tables);
+    nat_table_counters_prune(NULL, 0);
+    nat_rules_free(&counted);
+    return ret;
+}
+
+/*
+ * @return
+ *  - Number of lookups per second of random addresses of rules. Odd keys are
+ *    external addresses.
+ */
+static double
+bench_lookups(struct nat_table *const *tables, const uint32_t *keys)
+{
+    uint64_t start, cycles;
+    uint32_t value;
+    uint32_t sum;
+    unsigned int i;
+
+    sum = 0;
+    start = rte_rdtsc();
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        if (nat_table_lookup(tables[(i & 1) ? NAT_DIR_IN : NAT_DIR_OUT],
+                             keys[i], &value) == 0) {
+            sum += value;
+        }
+    }
+    cycles = rte_rdtsc() - start;
+
+    // Prevent the compiler from removing the loop
+    if (sum == 42) {
+        printf("\n");
+    }
+    return (double)NB_LOOKUPS * rte_get_tsc_hz() / cycles;
+}
+
+/*
+ * Like bench_lookups, but keys are looked up by bursts of MAX_RX_BURST, and
+ * the entries of a burst are prefetched before being looked up, as
+ * core.c/handle_port() does.
+ *
+ * @return
+ *  - Number of lookups per second of random addresses of rules.
+ */
+static double
+bench_burst_lookups(struct nat_table *const *tables, const uint32_t *keys)
+{
+    uint64_t start, cycles;
+    uint32_t value;
+    uint32_t sum;
+    unsigned int i, j;
+
+    sum = 0;
+    start = rte_rdtsc();
+    for (i = 0; i < NB_LOOKUPS; i += MAX_RX_BURST) {
+        for (j = i; j < i + MAX_RX_BURST; ++j) {
+            nat_table_prefetch(tables[(j & 1) ? NAT_DIR_IN : NAT_DIR_OUT],
+                               keys[j]);
+        }
+        for (j = i; j < i + MAX_RX_BURST; ++j) {
+            if (nat_table_lookup(tables[(j & 1) ? NAT_DIR_IN : NAT_DIR_OUT],
+                                 keys[j], &value) == 0) {
+                sum += value;
+            }
+        }
+    }
+    cycles = rte_rdtsc() - start;
+
+    if (sum == 42) {
+        printf("\n");
+    }
+    return (double)NB_LOOKUPS * rte_get_tsc_hz() / cycles;
+}
+
+/*
+ * Build the tables of rules with each backend, check them with check if not
+ * NULL, and print their memory usage, build time and lookup rates of keys.
+ */
+static int
+bench_tables(const char *name, const struct nat_rules *rules,
+             const uint32_t *keys)
+{
+    struct nat_table *tables[NAT_NB_DIRS];
+    uint64_t start, cycles;
+    size_t b;
+
+    for (b = 0; b < sizeof(backends) / sizeof(*backends); ++b) {
+        start = rte_rdtsc();
+        if (create_tables(tables, backends[b], rules, 0) < 0) {
+            return -1;
+        }
+        cycles = rte_rdtsc() - start;
+
+        if (check_table(tables, rules) < 0) {
+            fprintf(stderr, "Table %s is invalid for %s rules\n",
+                    nat_table_name(backends[b]), name);
+            free_tables(tables);
+            return -1;
+        }
+
+        printf("%-6s %-8s memory: %8zu KB, build: %8.2f ms, "
+               "lookups: %6.2f M/s, with prefetch: %6.2f M/s\n",
+               name, nat_table_name(backends[b]),
+               (nat_table_memory(tables[NAT_DIR_OUT]) +
+                nat_table_memory(tables[NAT_DIR_IN])) / 1024,
+               cycles * 1000. / rte_get_tsc_hz(),
+               bench_lookups(tables, keys) / 1000000,
+               bench_burst_lookups(tables, keys) / 1000000);
+
+        if (rules->len && check_updates(tables, backends[b], 0, rules) < 0) {
+            fprintf(stderr, "Table %s is invalid after updates of %s rules\n",
+                    nat_table_name(backends[b]), name);
+            free_tables(tables);
+            return -1;
+        }
+
+        free_tables(tables);
+    }
+    return 0;
+}
+
+/*
+ * Check the tables of rules with a prefilter return the same results as
+ * without, also after updates, and print the rate of false positives of the
+ * prefilter and the rate of lookups of addresses without rule, with and
+ * without prefilter.
+ */
+static int
+bench_prefilter(const char *name, const struct nat_rules *rules)
+{
+    struct nat_table *tables[NAT_NB_DIRS];
+    struct nat_table *filtered[NAT_NB_DIRS];
+    unsigned int nb_passed;
+    uint32_t *keys;
+    double fpr;
+    unsigned int i;
+    size_t b;
+    int ret = -1;
+
+    // 192.0.0.0/8 is never used in rules
+    keys = malloc(NB_LOOKUPS * sizeof(*keys));
+    if (keys == NULL) {
+        fprintf(stderr, "Unable to allocate keys\n");
+        return -1;
+    }
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        keys[i] = IPv4(192, 0, 0, 0) + (rand() & 0xffffff);
+    }
+
+    for (b = 0; b < sizeof(backends) / sizeof(*backends); ++b) {
+        if (create_tables(tables, backends[b], rules, 0) < 0) {
+            goto out;
+        }
+        if (create_tables(filtered, backends[b], rules, 1) < 0) {
+            free_tables(tables);
+            goto out;
+        }
+
+        if (check_table(filtered, rules) < 0) {
+            fprintf(stderr, "Table %s with prefilter is invalid for %s "
+                    "rules\n", nat_table_name(backends[b]), name);
+            goto err;
+        }
+
+        nb_passed = 0;
+        for (i = 0; i < NB_LOOKUPS; ++i) {
+            nb_passed += nat_prefilter_contains(
+                filtered[(i & 1) ? NAT_DIR_IN : NAT_DIR_OUT], keys[i]);
+        }
+        fpr = 100. * nb_passed / NB_LOOKUPS;
+
+        printf("%-6s %-8s prefilter: %6zu KB, false positives: %5.2f%%, "
+               "misses: %6.2f M/s, with prefilter: %6.2f M/s\n",
+               name, nat_table_name(backends[b]),
+               ((size_t)filtered[NAT_DIR_OUT]->prefilter_mask +
+                filtered[NAT_DIR_IN]->prefilter_mask + 2) *
+               RTE_CACHE_LINE_SIZE / 1024,
+               fpr, bench_burst_lookups(tables, keys) / 1000000,
+               bench_burst_lookups(filtered, keys) / 1000000);
+
+        if (fpr > 2) {
+            fprintf(stderr, "Too many false positives\n");
+            goto err;
+        }
+
+        if (check_updates(filtered, backends[b], 1, rules) < 0) {
+            fprintf(stderr, "Table %s with prefilter is invalid after "
+                    "updates of %s rules\n", nat_table_name(backends[b]),
+                    name);
+            goto err;
+        }
+
+        free_tables(tables);
+        free_tables(filtered);
+    }
+    ret = 0;
+    goto out;
+
+err:
+    free_tables(tables);
+    free_tables(filtered);
+out:
+    free(keys);
+    return ret;
+}
+
+/*
+ * Add NB_UPDATES rules one at a time to tables with a prefilter, remove them,
+ * and add NB_UPDATES other rules: the prefilter must never hold more keys than
+ * it is sized for, so the tables have to be copied, and the rate of false
+ * positives must stay bounded.
+ *
+ * @return
+ *  - -1 if the prefilter degrades, or a lookup is invalid.
+ */
+static int
+check_prefilter_updates(enum nat_table_type type)
+{
+    struct nat_rules rules = {};
+    struct nat_table *tables[NAT_NB_DIRS] = {};
+    struct nat_table *updated[NAT_NB_DIRS];
+    struct nat_update update;
+    unsigned int nb_copies = 0;
+    unsigned int nb_passed = 0;
+    unsigned int dir;
+    unsigned int key;
+    unsigned int i;
+    int ret = -1;
+
+    nat_rules_add(&rules, IPv4(10, 0, 0, 1), IPv4(51, 0, 0, 1), SOCKET_ID_ANY);
+    if (create_tables(tables, type, &rules, 1) < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < 3 * NB_UPDATES; ++i) {
+        update.op = (i / NB_UPDATES == 1) ? NAT_UPDATE_DEL : NAT_UPDATE_ADD;
+        key = i < NB_UPDATES ? i : i - NB_UPDATES;
+        update.rule.int_ip = IPv4(100, 64, 0, 0) + key;
+        update.rule.ext_ip = IPv4(100, 96, 0, 0) + key;
+
+        updated[NAT_DIR_OUT] = tables[NAT_DIR_OUT];
+        updated[NAT_DIR_IN] = tables[NAT_DIR_IN];
+        if (nat_table_update(updated, type, 1, 0, &update, 1,
+                             SOCKET_ID_ANY) < 0) {
+            fprintf(stderr, "Unable to update tables\n");
+            goto out;
+        }
+        for (dir = 0; dir < NAT_NB_DIRS; ++dir) {
+            if (updated[dir] != tables[dir]) {
+                nat_table_free(tables[dir]);
+                tables[dir] = updated[dir];
+                nb_copies++;
+            }
+            if (tables[dir]->prefilter_nb_keys >
+                tables[dir]->prefilter_max_keys) {
+                fprintf(stderr, "Prefilter of %u keys holds %u keys\n",
+                        tables[dir]->prefilter_max_keys,
+                        tables[dir]->prefilter_nb_keys);
+                goto out;
+            }
+        }
+    }
+    if (nb_copies == 0) {
+        fprintf(stderr, "Prefilter never rebuilt\n");
+        goto out;
+    }
+
+    if (check_lookup(tables[NAT_DIR_OUT], IPv4(10, 0, 0, 1),
+                     IPv4(51, 0, 0, 1)) < 0 ||
+        check_lookup(tables[NAT_DIR_OUT], IPv4(100, 64, 0, 0), 0) < 0 ||
+        check_lookup(tables[NAT_DIR_OUT], IPv4(100, 64, 0, 0) + NB_UPDATES,
+                     IPv4(100, 96, 0, 0) + NB_UPDATES) < 0 ||
+        check_nb_rules(tables, 1 + NB_UPDATES) < 0) {
+        goto out;
+    }
+
+    // 192.0.0.0/8 is never used in rules
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        nb_passed += nat_prefilter_contains(
+            tables[(i & 1) ? NAT_DIR_IN : NAT_DIR_OUT],
+            IPv4(192, 0, 0, 0) + (rand() & 0xffffff));
+    }
+    if (100. * nb_passed / NB_LOOKUPS > 2) {
+        fprintf(stderr, "Too many false positives after updates: %.2f%%\n",
+                100. * nb_passed / NB_LOOKUPS);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    free_tables(tables);
+    nat_rules_free(&rules);
+    return ret;
+}
+
+/*
+ * Lookups of the rules of check_prefixes().
+ */
+static int
+check_prefix_lookups(struct nat_table *const *tables)
+{
+    const struct nat_table *out = tables[NAT_DIR_OUT];
+    const struct nat_table *in = tables[NAT_DIR_IN];
+
+    if (check_lookup(out, IPv4(10, 8, 0, 5), IPv4(51, 15, 0, 5)) < 0 ||
+        check_lookup(in, IPv4(51, 15, 255, 255), IPv4(10, 8, 255, 255)) < 0 ||
+        check_lookup(in, IPv4(10, 8, 0, 5), 0) < 0 ||
+        // Longest prefix
+        check_lookup(out, IPv4(10, 8, 1, 7), IPv4(100, 64, 1, 7)) < 0 ||
+        check_lookup(in, IPv4(100, 64, 1, 7), IPv4(10, 8, 1, 7)) < 0 ||
+        // Address rules first
+        check_lookup(out, IPv4(10, 8, 2, 3), IPv4(51, 16, 0, 1)) < 0 ||
+        check_lookup(in, IPv4(51, 16, 0, 1), IPv4(10, 8, 2, 3)) < 0 ||
+        check_lookup(out, IPv4(10, 9, 0, 0), 0) < 0 ||
+        check_lookup(in, IPv4(100, 64, 2, 0), 0) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Check prefix rules are looked up after the entries of the backend, longest
+ * prefix first, survive updates and copies of the tables, and aren't counted.
+ *
+ * @return
+ *  - -1 if a lookup is invalid.
+ */
+static int
+check_prefixes(enum nat_table_type type, int prefilter)
+{
+    static struct nat_update updates[NB_UPDATES];
+    struct nat_rules rules = {};
+    struct nat_table *tables[NAT_NB_DIRS] = {};
+    unsigned int lcore_id;
+    uint32_t value;
+    uint32_t slot;
+    unsigned int i;
+    int ret = -1;
+
+    if (nat_rules_add_prefix(&rules, IPv4(10, 8, 0, 0), IPv4(51, 15, 0, 0),
+                             16) < 0 ||
+        nat_rules_add_prefix(&rules, IPv4(10, 8, 1, 0), IPv4(100, 64, 1, 0),
+                             24) < 0 ||
+        nat_rules_add(&rules, IPv4(10, 8, 2, 3), IPv4(51, 16, 0, 1),
+                      SOCKET_ID_ANY) < 0) {
+        fprintf(stderr, "Unable to add prefix rules\n");
+        goto out;
+    }
+
+    // Network already translated in either direction, invalid prefix
+    if (nat_rules_add_prefix(&rules, IPv4(10, 9, 0, 0), IPv4(51, 15, 0, 0),
+                             16) == 0 ||
+        nat_rules_add_prefix(&rules, IPv4(10, 8, 0, 0), IPv4(51, 20, 0, 0),
+                             16) == 0 ||
+        nat_rules_add_prefix(&rules, IPv4(10, 9, 0, 0), IPv4(51, 20, 0, 0),
+                             0) == 0) {
+        fprintf(stderr, "Invalid prefix rules added\n");
+        goto out;
+    }
+
+    if (create_tables(tables, type, &rules, prefilter) < 0 ||
+        check_prefix_lookups(tables) < 0 ||
+        check_nb_rules(tables, 3) < 0) {
+        goto out;
+    }
+
+    // Rules added to the tables, or to copies
+    for (i = 0; i < NB_UPDATES; ++i) {
+        updates[i].op = NAT_UPDATE_ADD;
+        updates[i].rule.int_ip = IPv4(100, 64 + (i & 15), i >> 4, 1);
+        updates[i].rule.ext_ip = IPv4(100, 96 + (i & 15), i >> 4, 1);
+    }
+    if (nat_table_update(tables, type, prefilter, 0, updates, NB_UPDATES,
+                         SOCKET_ID_ANY) < 0) {
+        fprintf(stderr, "Unable to update tables with prefix rules\n");
+        goto out;
+    }
+    if (check_lookup(tables[NAT_DIR_OUT], IPv4(100, 64, 0, 1),
+                     IPv4(100, 96, 0, 1)) < 0 ||
+        check_prefix_lookups(tables) < 0) {
+        goto out;
+    }
+
+    lcore_id = rte_get_next_lcore(-1, 1, 0);
+    if (lcore_id < RTE_MAX_LCORE &&
+        nat_table_counters_alloc(tables[NAT_DIR_OUT],
+                                 rte_lcore_to_socket_id(lcore_id)) == 0) {
+        if (nat_table_lookup_slot(tables[NAT_DIR_OUT], IPv4(10, 8, 0, 5),
+                                  &value, &slot) < 0 ||
+            slot != NAT_PREFIX_SLOT) {
+            fprintf(stderr, "Prefix rules should have no counter\n");
+            goto out;
+        }
+        nat_table_count(tables[NAT_DIR_OUT], lcore_id, slot, 100);
+    }
+    ret = 0;
+
+out:
+    free_tables(tables);
+    nat_rules_free(&rules);
+    return ret;
+}
+
+/*
+ * Compare the prefix rule 10.8.0.0/16 -> 51.15.0.0/16 to the 65536 dense
+ * rules it replaces.
+ */
+static int
+bench_prefix(void)
+{
+    struct nat_rules rules = {};
+    uint32_t *keys;
+    unsigned int i;
+    size_t b;
+    int ret;
+
+    for (b = 0; b < sizeof(backends) / sizeof(*backends); ++b) {
+        if (check_prefixes(backends[b], 0) < 0 ||
+            check_prefixes(backends[b], 1) < 0) {
+            fprintf(stderr, "Prefix rules of table %s are invalid\n",
+                    nat_table_name(backends[b]));
+            return -1;
+        }
+    }
+
+    nat_rules_add_prefix(&rules, IPv4(10, 8, 0, 0), IPv4(51, 15, 0, 0), 16);
+
+    keys = malloc(NB_LOOKUPS * sizeof(*keys));
+    if (keys == NULL) {
+        fprintf(stderr, "Unable to allocate keys\n");
+        return -1;
+    }
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        keys[i] = ((i & 1) ? IPv4(51, 15, 0, 0) : IPv4(10, 8, 0, 0)) +
+                  (rand() & 0xffff);
+    }
+
+    ret = bench_tables("prefix", &rules, keys);
+
+    free(keys);
+    nat_rules_free(&rules);
+    return ret;
+}
+
+static int
+run(const char *name, void (*gen_rules)(struct nat_rules *))
+{
+    struct nat_rules rules = {};
+    uint32_t *keys;
+    unsigned int i;
+    size_t b;
+
+    gen_rules(&rules);
+
+    keys = malloc(NB_LOOKUPS * sizeof(*keys));
+    if (keys == NULL) {
+        fprintf(stderr, "Unable to allocate keys\n");
+        return -1;
+    }
+    for (i = 0; i < NB_LOOKUPS; ++i) {
+        const struct nat_rule *rule = &rules.rules[rand() % rules.len];
+
+        keys[i] = (i & 1) ? rule->ext_ip : rule->int_ip;
+    }
+
+    if (bench_tables(name, &rules, keys) < 0 ||
+        bench_prefilter(name, &rules) < 0) {
+        return -1;
+    }
+
+    for (b = 0; b < sizeof(backends) / sizeof(*backends); ++b) {
+        if (check_counters(backends[b], &rules) < 0) {
+            fprintf(stderr, "Counters of table %s are invalid for %s rules\n",
+                    nat_table_name(backends[b]), name);
+            return -1;
+        }
+        if (check_overlap(backends[b]) < 0) {
+            fprintf(stderr, "Overlapping rules of table %s are invalid\n",
+                    nat_table_name(backends[b]));
+            return -1;
+        }
+        if (check_prefilter_updates(backends[b]) < 0) {
+            fprintf(stderr, "Prefilter of table %s degrades with updates\n",
+                    nat_table_name(backends[b]));
+            return -1;
+        }
+    }
+
+    free(keys);
+    nat_rules_free(&rules);
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    if (run("dense", gen_dense_rules) < 0 ||
+        run("sparse", gen_sparse_rules) < 0 ||
+        bench_prefix() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
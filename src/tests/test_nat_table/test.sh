@@ -0,0 +1,5 @@
+#!/bin/sh
+
+cd $(dirname $0)
+
+./test_bin -c 0x3 || exit 1
@@ -0,0 +1,150 @@
+/*
+ * Check the metadata recorded by pkt_parse(), with and without the packet
+ * types of the NIC, and the headers located from it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+#include <rte_udp.h>
+
+#include "natasha.h"
+#include "network_headers.h"
+
+
+static uint8_t buf[RTE_PKTMBUF_HEADROOM + 256];
+
+// Build an Ethernet/IPv4 packet with ihl 32 bits words of IPv4 header.
+static void
+build_pkt(struct rte_mbuf *pkt, uint16_t ether_type, uint8_t ihl,
+          uint8_t proto, uint16_t fragment_offset)
+{
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ipv4_hdr;
+
+    memset(pkt, 0, sizeof(*pkt));
+    memset(buf, 0, sizeof(buf));
+    pkt->buf_addr = buf;
+    pkt->data_off = RTE_PKTMBUF_HEADROOM;
+
+    eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+    eth_hdr->ether_type = rte_cpu_to_be_16(ether_type);
+
+    ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+    ipv4_hdr->version_ihl = 0x40 | ihl;
+    ipv4_hdr->next_proto_id = proto;
+    ipv4_hdr->fragment_offset = rte_cpu_to_be_16(fragment_offset);
+}
+
+static int
+check(const char *name, uint16_t ether_type, uint8_t ihl, uint8_t proto,
+      uint16_t fragment_offset, uint32_t expected_type, uint8_t expected_proto)
+{
+    struct rte_mbuf pkt;
+    struct udp_hdr *udp_hdr;
+
+    build_pkt(&pkt, ether_type, ihl, proto, fragment_offset);
+    pkt_parse(&pkt, 0);
+
+    if (pkt.packet_type != expected_type) {
+        fprintf(stderr, "%s: invalid packet type 0x%x, expected 0x%x\n",
+                name, pkt.packet_type, expected_type);
+        return -1;
+    }
+    if (!RTE_ETH_IS_IPV4_HDR(pkt.packet_type)) {
+        return 0;
+    }
+    if (pkt.l2_len != sizeof(struct ether_hdr) || pkt.l3_len != ihl * 4) {
+        fprintf(stderr, "%s: invalid header lengths %u/%u\n",
+                name, (unsigned int)pkt.l2_len, (unsigned int)pkt.l3_len);
+        return -1;
+    }
+    if (pkt_l4_proto(&pkt) != expected_proto) {
+        fprintf(stderr, "%s: invalid protocol %u, expected %u\n",
+                name, pkt_l4_proto(&pkt), expected_proto);
+        return -1;
+    }
+    // The transport header follows the options
+    udp_hdr = udp_header(&pkt);
+    if ((uint8_t *)udp_hdr != buf + RTE_PKTMBUF_HEADROOM +
+                              sizeof(struct ether_hdr) + ihl * 4) {
+        fprintf(stderr, "%s: invalid L4 header offset\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+// A packet typed by the NIC is not decoded again.
+static int
+check_nic_ptypes(void)
+{
+    struct rte_mbuf pkt;
+
+    build_pkt(&pkt, ETHER_TYPE_IPv4, 5, IPPROTO_UDP, 0);
+    pkt.packet_type = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4 |
+                      RTE_PTYPE_L4_UDP;
+    // Not what the NIC reported: must be ignored
+    ipv4_header(&pkt)->next_proto_id = IPPROTO_TCP;
+    pkt_parse(&pkt, 1);
+    if (pkt.l3_len != sizeof(struct ipv4_hdr) ||
+        pkt_l4_proto(&pkt) != IPPROTO_UDP) {
+        fprintf(stderr, "NIC packet types not used\n");
+        return -1;
+    }
+
+    // Options: parsed in software
+    build_pkt(&pkt, ETHER_TYPE_IPv4, 7, IPPROTO_UDP, 0);
+    pkt.packet_type = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4_EXT |
+                      RTE_PTYPE_L4_UDP;
+    pkt_parse(&pkt, 1);
+    if (pkt.l3_len != 28) {
+        fprintf(stderr, "IPv4 options of the NIC packet types ignored\n");
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    const uint32_t ipv4 = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4;
+    const uint32_t ipv4_ext = RTE_PTYPE_L2_ETHER | RTE_PTYPE_L3_IPV4_EXT;
+    int ret = 0;
+
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    ret |= check("tcp", ETHER_TYPE_IPv4, 5, IPPROTO_TCP, 0,
+                 ipv4 | RTE_PTYPE_L4_TCP, IPPROTO_TCP);
+    ret |= check("udp", ETHER_TYPE_IPv4, 5, IPPROTO_UDP, 0,
+                 ipv4 | RTE_PTYPE_L4_UDP, IPPROTO_UDP);
+    ret |= check("icmp", ETHER_TYPE_IPv4, 5, IPPROTO_ICMP, 0,
+                 ipv4 | RTE_PTYPE_L4_ICMP, IPPROTO_ICMP);
+    ret |= check("gre", ETHER_TYPE_IPv4, 5, IPPROTO_GRE, 0,
+                 ipv4 | RTE_PTYPE_L4_NONFRAG, IPPROTO_GRE);
+    ret |= check("udp with options", ETHER_TYPE_IPv4, 15, IPPROTO_UDP, 0,
+                 ipv4_ext | RTE_PTYPE_L4_UDP, IPPROTO_UDP);
+    ret |= check("first fragment", ETHER_TYPE_IPv4, 5, IPPROTO_UDP,
+                 IPV4_HDR_MF_FLAG, ipv4 | RTE_PTYPE_L4_FRAG, IPPROTO_UDP);
+    ret |= check("last fragment", ETHER_TYPE_IPv4, 5, IPPROTO_UDP, 185,
+                 ipv4 | RTE_PTYPE_L4_FRAG, 0);
+    ret |= check("invalid ihl", ETHER_TYPE_IPv4, 4, IPPROTO_UDP, 0,
+                 RTE_PTYPE_L2_ETHER, 0);
+    ret |= check("arp", ETHER_TYPE_ARP, 5, IPPROTO_UDP, 0,
+                 RTE_PTYPE_L2_ETHER_ARP, 0);
+    ret |= check("ipv6", ETHER_TYPE_IPv6, 5, IPPROTO_UDP, 0,
+                 RTE_PTYPE_L2_ETHER, 0);
+    ret |= check_nic_ptypes();
+
+    if (ret) {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
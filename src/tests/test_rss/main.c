@@ -0,0 +1,115 @@
+/*
+ * Check the symmetric RSS key hashes both directions of IPv4, TCP and UDP
+ * flows to the same value, unlike the key used by default by most drivers,
+ * and still spreads flows evenly between queues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rte_eal.h>
+#include <rte_ip.h>
+
+#include "natasha.h"
+
+
+#define NB_FLOWS    (1 << 20)
+
+// Default key of the Microsoft RSS specification, used by most drivers.
+static const uint8_t default_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Number of pseudo-random flows whose reply has another hash than the flow.
+ */
+static unsigned int
+count_asymmetric(const uint8_t *key, int l4)
+{
+    unsigned int nb = 0;
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t src_port;
+    uint16_t dst_port;
+    uint32_t i;
+
+    for (i = 0; i < NB_FLOWS; ++i) {
+        src_addr = i * 2654435761u;
+        dst_addr = (i + 1) * 2246822519u;
+        src_port = i * 7919;
+        dst_port = i * 40503u >> 16;
+
+        if (rss_hash(key, src_addr, dst_addr, src_port, dst_port, l4) !=
+            rss_hash(key, dst_addr, src_addr, dst_port, src_port, l4)) {
+            nb++;
+        }
+    }
+    return nb;
+}
+
+/*
+ * Whether flows are spread between NB_QUEUES queues within 5% of the average.
+ */
+#define NB_QUEUES   8
+static int
+is_balanced(const uint8_t *key)
+{
+    uint32_t flows[NB_QUEUES] = {};
+    uint32_t hash;
+    uint32_t i;
+
+    for (i = 0; i < NB_FLOWS; ++i) {
+        hash = rss_hash(key, IPv4(10, 0, 0, 0) + (i >> 4),
+                        IPv4(51, 15, 0, 0) + i * 2654435761u % 65536,
+                        1024 + i, 443, 1);
+        flows[hash % NB_QUEUES]++;
+    }
+
+    for (i = 0; i < NB_QUEUES; ++i) {
+        printf("queue %u: %u flows\n", i, flows[i]);
+        if (flows[i] < NB_FLOWS / NB_QUEUES * 95 / 100 ||
+            flows[i] > NB_FLOWS / NB_QUEUES * 105 / 100) {
+            return 0;
+        }
+    }
+    return 1;
+}
+#undef NB_QUEUES
+
+int
+main(int argc, char **argv)
+{
+    uint8_t key[RSS_MAX_KEY_SIZE];
+    unsigned int nb;
+
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    rss_symmetric_key(key, sizeof(key));
+
+    if ((nb = count_asymmetric(key, 0)) != 0 ||
+        (nb = count_asymmetric(key, 1)) != 0) {
+        fprintf(stderr, "%u flows hashed asymmetrically\n", nb);
+        exit(EXIT_FAILURE);
+    }
+
+    // Sanity check of the test itself
+    if (count_asymmetric(default_key, 1) < NB_FLOWS / 2) {
+        fprintf(stderr, "The default key is symmetric\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!is_balanced(key)) {
+        fprintf(stderr, "Flows are not spread evenly\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%u flows hashed symmetrically\n", NB_FLOWS);
+    return 0;
+}
@@ -0,0 +1,430 @@
+/*
+ * Check the execution of the rules for a burst of packets by
+ * ipv4_handle_burst(), without flow cache: each packet must follow the path it
+ * would follow alone through the conditions, the RULES_OP_CLASSIFY
+ * instruction and the actions, and the packets stopped by a batched action
+ * (RULES_OP_ACTION_BURST) must not reach the next instructions.
+ *
+ * The rules:
+ *
+ *      if (vlan 10) { mark v; } else { mark n; }
+ *      if (ipv4.src_addr in 10.0.0.0/24) { mark a; }
+ *      if (ipv4.src_addr in 10.0.1.0/24) { mark b; }
+ *      if (ipv4.dst_addr in 192.168.0.0/16 and vlan 20) { mark c; }
+ *      if (ipv4.src_addr in 10.0.2.0/24) { mark d; drop; }
+ *      if (ipv4.src_addr in 10.0.3.0/24) { mark E; }
+ *      nat rewrite ipv4.src_addr;
+ *      mark z;
+ *      out;
+ *
+ * where "mark" appends its letter to the trace of the packet, and stops the
+ * processing of the packet if the letter is uppercase. The five "if" without
+ * else are classified.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rte_eal.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_mbuf.h>
+
+#include "actions.h"
+#include "conds.h"
+#include "natasha.h"
+#include "nat_table.h"
+#include "network_headers.h"
+
+
+#define NB_PKTS 8
+
+static uint8_t bufs[NB_PKTS][RTE_PKTMBUF_HEADROOM + 128];
+static struct rte_mbuf pkts[NB_PKTS];
+static char traces[NB_PKTS][16];
+
+static const struct {
+    uint32_t src_addr;
+    uint32_t dst_addr;
+    uint16_t vlan;
+    // Trace of the packet, and its source address once the rules executed, 0
+    // if the packet is dropped.
+    const char *trace;
+    uint32_t nat_addr;
+} burst[NB_PKTS] = {
+    { IPv4(10, 0, 0, 1), IPv4(8, 8, 8, 8), 10, "vaz", IPv4(51, 0, 0, 1) },
+    { IPv4(10, 0, 1, 1), IPv4(192, 168, 1, 1), 20, "nbcz", IPv4(51, 0, 0, 2) },
+    { IPv4(10, 0, 2, 1), IPv4(8, 8, 8, 8), 0, "nd", 0 },
+    { IPv4(10, 0, 3, 1), IPv4(8, 8, 8, 8), 10, "vE", 0 },
+    // No NAT rule
+    { IPv4(10, 0, 4, 1), IPv4(192, 168, 0, 1), 20, "nc", 0 },
+    { IPv4(10, 0, 4, 2), IPv4(8, 8, 8, 8), 0, "n", 0 },
+    { IPv4(10, 0, 0, 2), IPv4(192, 168, 0, 2), 20, "nacz", IPv4(51, 0, 0, 3) },
+    { IPv4(10, 0, 1, 2), IPv4(192, 168, 0, 3), 10, "vb", 0 },
+};
+
+/*
+ * Append the letter data to the trace of pkt. Uppercase letters free pkt and
+ * stop the processing of the rules, like action_drop().
+ */
+static int
+action_mark(struct rte_mbuf *pkt, uint8_t port, struct core *core, void *data)
+{
+    char *trace = traces[pkt - pkts];
+    char letter = *(const char *)data;
+
+    trace[strlen(trace)] = letter;
+    if (isupper(letter)) {
+        pkt_free(pkt, core);
+        return -1;
+    }
+    return 0;
+}
+
+static struct app_config_node *
+new_node(int type, struct app_config_node *left, struct app_config_node *right,
+         void *action, void *data)
+{
+    struct app_config_node *node = calloc(1, sizeof(*node));
+
+    if (node == NULL) {
+        fprintf(stderr, "Unable to allocate node\n");
+        exit(EXIT_FAILURE);
+    }
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    node->action = action;
+    node->data = data;
+    return node;
+}
+
+static struct app_config_node *
+mark(const char *letter)
+{
+    return new_node(ACTION, NULL, NULL, action_mark, (void *)letter);
+}
+
+// if (cond) { body } else { orelse }
+static struct app_config_node *
+new_if(struct app_config_node *cond, struct app_config_node *body,
+       struct app_config_node *orelse)
+{
+    return new_node(IF, new_node(COND, cond, body, NULL, NULL), orelse, NULL,
+                    NULL);
+}
+
+static struct app_config_node *
+build_rules(void)
+{
+    static struct ipv4_network net_a = { IPv4(10, 0, 0, 0), 24 };
+    static struct ipv4_network net_b = { IPv4(10, 0, 1, 0), 24 };
+    static struct ipv4_network net_c = { IPv4(192, 168, 0, 0), 16 };
+    static struct ipv4_network net_d = { IPv4(10, 0, 2, 0), 24 };
+    static struct ipv4_network net_e = { IPv4(10, 0, 3, 0), 24 };
+    static int vlan_10 = 10;
+    static int vlan_20 = 20;
+    static int rewrite_src = IPV4_SRC_ADDR;
+    static struct out_packet out = { .port = 0, .vlan = 0 };
+    struct app_config_node *stmts[] = {
+        new_if(new_node(ACTION, NULL, NULL, cond_vlan, &vlan_10),
+               mark("v"), mark("n")),
+        new_if(new_node(ACTION, NULL, NULL, cond_ipv4_src_in_network, &net_a),
+               mark("a"), NULL),
+        new_if(new_node(ACTION, NULL, NULL, cond_ipv4_src_in_network, &net_b),
+               mark("b"), NULL),
+        new_if(new_node(AND,
+                        new_node(ACTION, NULL, NULL, cond_ipv4_dst_in_network,
+                                 &net_c),
+                        new_node(ACTION, NULL, NULL, cond_vlan, &vlan_20),
+                        NULL, NULL),
+               mark("c"), NULL),
+        new_if(new_node(ACTION, NULL, NULL, cond_ipv4_src_in_network, &net_d),
+               new_node(SEQ, mark("d"),
+                        new_node(ACTION, NULL, NULL, action_drop, NULL),
+                        NULL, NULL),
+               NULL),
+        new_if(new_node(ACTION, NULL, NULL, cond_ipv4_src_in_network, &net_e),
+               mark("E"), NULL),
+        new_node(ACTION, NULL, NULL, action_nat_rewrite, &rewrite_src),
+        mark("z"),
+        new_node(ACTION, NULL, NULL, action_out, &out),
+    };
+    struct app_config_node *root = stmts[0];
+    unsigned int i;
+
+    for (i = 1; i < sizeof(stmts) / sizeof(*stmts); ++i) {
+        root = new_node(SEQ, root, stmts[i], NULL, NULL);
+    }
+    return root;
+}
+
+static int
+create_nat_tables(struct app_config *config)
+{
+    struct nat_rules rules = {};
+    int ret = 0;
+
+    nat_rules_add(&rules, IPv4(10, 0, 0, 1), IPv4(51, 0, 0, 1), SOCKET_ID_ANY);
+    nat_rules_add(&rules, IPv4(10, 0, 1, 1), IPv4(51, 0, 0, 2), SOCKET_ID_ANY);
+    nat_rules_add(&rules, IPv4(10, 0, 0, 2), IPv4(51, 0, 0, 3), SOCKET_ID_ANY);
+
+    config->nat_tables[NAT_DIR_OUT] = nat_table_create(
+        NAT_TABLE_HASH, &rules, NAT_DIR_OUT, 0, SOCKET_ID_ANY);
+    config->nat_tables[NAT_DIR_IN] = nat_table_create(
+        NAT_TABLE_HASH, &rules, NAT_DIR_IN, 0, SOCKET_ID_ANY);
+    if (config->nat_tables[NAT_DIR_OUT] == NULL ||
+        config->nat_tables[NAT_DIR_IN] == NULL) {
+        fprintf(stderr, "Unable to create NAT tables\n");
+        ret = -1;
+    }
+    nat_rules_free(&rules);
+    return ret;
+}
+
+// Build the UDP packets of burst, and reset the queues of core.
+static void
+build_burst(struct rte_mbuf **vector, struct core *core)
+{
+    const uint16_t ipv4_len = sizeof(struct ipv4_hdr) + 8;
+    struct ether_hdr *eth_hdr;
+    struct ipv4_hdr *ipv4_hdr;
+    struct rte_mbuf *pkt;
+    unsigned int i;
+
+    for (i = 0; i < NB_PKTS; ++i) {
+        pkt = &pkts[i];
+        memset(pkt, 0, sizeof(*pkt));
+        memset(bufs[i], 0, sizeof(bufs[i]));
+        memset(traces[i], 0, sizeof(traces[i]));
+        pkt->buf_addr = bufs[i];
+        pkt->data_off = RTE_PKTMBUF_HEADROOM;
+        pkt->pkt_len = sizeof(struct ether_hdr) + ipv4_len;
+        pkt->data_len = pkt->pkt_len;
+        pkt->vlan_tci = burst[i].vlan;
+
+        eth_hdr = rte_pktmbuf_mtod(pkt, struct ether_hdr *);
+        eth_hdr->ether_type = rte_cpu_to_be_16(ETHER_TYPE_IPv4);
+
+        ipv4_hdr = (struct ipv4_hdr *)(eth_hdr + 1);
+        ipv4_hdr->version_ihl = 0x45;
+        ipv4_hdr->total_length = rte_cpu_to_be_16(ipv4_len);
+        ipv4_hdr->next_proto_id = IPPROTO_UDP;
+        ipv4_hdr->src_addr = rte_cpu_to_be_32(burst[i].src_addr);
+        ipv4_hdr->dst_addr = rte_cpu_to_be_32(burst[i].dst_addr);
+
+        pkt_parse(pkt, 0);
+        vector[i] = pkt;
+    }
+
+    core->free_queue.len = 0;
+    core->tx_queues[0].len = 0;
+    memset(core->stats, 0, sizeof(*core->stats));
+}
+
+/*
+ * The program must classify the five "if" without else: the targets of the
+ * RULES_OP_CLASSIFY instruction are the first instruction after the sequence,
+ * then the body of each "if".
+ */
+static int
+check_program(const struct rules_program *program)
+{
+    static const char *const bodies = "abcdE";
+    const struct rules_insn *classify = NULL;
+    const struct rules_insn *insn;
+    uint32_t i;
+
+    for (i = 0; i < program->len; ++i) {
+        if (program->insns[i].op != RULES_OP_CLASSIFY) {
+            continue ;
+        }
+        if (classify) {
+            fprintf(stderr, "More than one classifier\n");
+            return -1;
+        }
+        classify = &program->insns[i];
+    }
+    if (classify == NULL) {
+        fprintf(stderr, "The sequence of \"if\" is not classified\n");
+        return -1;
+    }
+
+    insn = &program->insns[classify->classify.targets[0]];
+    if (insn->op != RULES_OP_ACTION_BURST ||
+        insn->burst.f != action_nat_rewrite_burst) {
+        fprintf(stderr, "Classifier target 0 is not \"nat rewrite\"\n");
+        return -1;
+    }
+    for (i = 0; i < strlen(bodies); ++i) {
+        insn = &program->insns[classify->classify.targets[i + 1]];
+        if (insn->op != RULES_OP_ACTION || insn->call.f != action_mark ||
+            *(const char *)insn->call.data != bodies[i]) {
+            fprintf(stderr, "Classifier target %u is not \"mark %c\"\n",
+                    i + 1, bodies[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Run the burst through the rules, and check the trace of each packet, the
+ * packets sent and dropped, and the rewritten addresses.
+ */
+static int
+check_burst(struct core *core)
+{
+    struct rte_mbuf *vector[NB_PKTS];
+    const struct tx_queue *tx = &core->tx_queues[0];
+    uint64_t freed = 0;
+    uint32_t src_addr;
+    unsigned int sent = 0;
+    unsigned int dropped;
+    unsigned int i;
+    int ret = 0;
+
+    build_burst(vector, core);
+    dropped = ipv4_handle_burst(vector, NB_PKTS, core);
+    if (dropped != 0) {
+        fprintf(stderr, "%u packets dropped before the rules\n", dropped);
+        ret = -1;
+    }
+
+    for (i = 0; i < core->free_queue.len; ++i) {
+        freed |= UINT64_C(1) << (core->free_queue.pkts[i] - pkts);
+    }
+
+    for (i = 0; i < NB_PKTS; ++i) {
+        if (strcmp(traces[i], burst[i].trace) != 0) {
+            fprintf(stderr, "Packet %u: trace \"%s\", expected \"%s\"\n",
+                    i, traces[i], burst[i].trace);
+            ret = -1;
+        }
+
+        if (burst[i].nat_addr == 0) {
+            if (!(freed & (UINT64_C(1) << i))) {
+                fprintf(stderr, "Packet %u not dropped\n", i);
+                ret = -1;
+            }
+            continue ;
+        }
+
+        // Sent in the order of the burst
+        if (sent >= tx->len || tx->pkts[sent] != &pkts[i]) {
+            fprintf(stderr, "Packet %u not sent\n", i);
+            ret = -1;
+            continue ;
+        }
+        sent++;
+
+        src_addr = rte_be_to_cpu_32(ipv4_header(&pkts[i])->src_addr);
+        if (src_addr != burst[i].nat_addr) {
+            fprintf(stderr, "Packet %u: source address 0x%x, expected 0x%x\n",
+                    i, src_addr, burst[i].nat_addr);
+            ret = -1;
+        }
+    }
+
+    if (sent != tx->len || (unsigned int)__builtin_popcountll(freed) !=
+                           core->free_queue.len) {
+        fprintf(stderr, "Packets sent or dropped more than once\n");
+        ret = -1;
+    }
+    if (core->stats->drop_nat_condition != 1 ||
+        core->stats->drop_no_rule != 3) {
+        fprintf(stderr, "Invalid drop statistics: %lu drop, %lu no rule\n",
+                (unsigned long)core->stats->drop_nat_condition,
+                (unsigned long)core->stats->drop_no_rule);
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Check the mask returned by the batched actions, which are only called for
+ * the packets of the mask they receive.
+ */
+static int
+check_burst_actions(struct core *core)
+{
+    struct rte_mbuf *vector[NB_PKTS];
+    int rewrite_src = IPV4_SRC_ADDR;
+    struct out_packet out = { .port = 0, .vlan = 0 };
+    uint64_t mask;
+    int ret = 0;
+
+    // Packets 0 and 1 have a NAT rule, packet 4 doesn't. Packet 6 has a NAT
+    // rule but is not in the mask.
+    build_burst(vector, core);
+    mask = action_nat_rewrite_burst(vector, 0x13, core, &rewrite_src);
+    if (mask != 0x03 || core->free_queue.len != 1 ||
+        core->free_queue.pkts[0] != &pkts[4]) {
+        fprintf(stderr, "action_nat_rewrite_burst returned 0x%lx\n",
+                (unsigned long)mask);
+        ret = -1;
+    }
+    if (ipv4_header(&pkts[6])->src_addr !=
+        rte_cpu_to_be_32(burst[6].src_addr)) {
+        fprintf(stderr, "action_nat_rewrite_burst rewrote a packet out of "
+                        "its mask\n");
+        ret = -1;
+    }
+
+    build_burst(vector, core);
+    mask = action_drop_burst(vector, 0x05, core, NULL);
+    if (mask != 0 || core->free_queue.len != 2 ||
+        core->stats->drop_nat_condition != 2) {
+        fprintf(stderr, "action_drop_burst returned 0x%lx\n",
+                (unsigned long)mask);
+        ret = -1;
+    }
+
+    build_burst(vector, core);
+    mask = action_out_burst(vector, 0x0a, core, &out);
+    if (mask != 0 || core->tx_queues[0].len != 2 ||
+        core->tx_queues[0].pkts[0] != &pkts[1] ||
+        core->tx_queues[0].pkts[1] != &pkts[3]) {
+        fprintf(stderr, "action_out_burst returned 0x%lx\n",
+                (unsigned long)mask);
+        ret = -1;
+    }
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    static struct app_config config;
+    static struct natasha_app_stats stats;
+    static struct core core;
+    int ret = 0;
+
+    if (rte_eal_init(argc, argv) < 0) {
+        fprintf(stderr, "Error with EAL initialization\n");
+        exit(1);
+    }
+
+    if (create_nat_tables(&config) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    config.program = rules_compile(build_rules(), SOCKET_ID_ANY);
+    if (config.program == NULL) {
+        fprintf(stderr, "Unable to compile rules\n");
+        exit(EXIT_FAILURE);
+    }
+
+    core.app_config = &config;
+    core.stats = &stats;
+
+    ret |= check_program(config.program);
+    ret |= check_burst(&core);
+    ret |= check_burst_actions(&core);
+
+    if (ret) {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+package.path = package.path ..";?.lua;test/?.lua;app/?.lua;"
+
+-- Same traffic as pktgen-range.lua, but destined to 52.15.0.0/16: no rule of
+-- nat.conf matches, so every packet is dropped.
+
+pktgen.range.dst_mac("0", "start", "3c:fd:fe:a5:80:98");
+pktgen.range.src_mac("0", "start", "3c:fd:fe:a5:7c:48");
+
+pktgen.range.vlan_id("0", "start", 35);
+
+pktgen.range.dst_ip("0", "start", "52.15.1.2");
+pktgen.range.dst_ip("0", "inc", "0.0.0.1");
+pktgen.range.dst_ip("0", "min", "52.15.1.2");
+pktgen.range.dst_ip("0", "max", "52.15.200.200");
+
+pktgen.range.src_ip("0", "start", "200.168.0.1");
+pktgen.range.src_ip("0", "inc", "0.0.0.1");
+pktgen.range.src_ip("0", "min", "200.168.0.1");
+pktgen.range.src_ip("0", "max", "200.168.200.200");
+
+pktgen.set_proto("0", "tcp");
+
+pktgen.range.dst_port("0", "start", 2000);
+pktgen.range.dst_port("0", "inc", 1);
+pktgen.range.dst_port("0", "min", 2000);
+pktgen.range.dst_port("0", "max", 4000);
+
+pktgen.range.src_port("0", "start", 5000);
+pktgen.range.src_port("0", "inc", 1);
+pktgen.range.src_port("0", "min", 5000);
+pktgen.range.src_port("0", "max", 7000);
+
+pktgen.range.pkt_size("0", "start", 64);
+
+pktgen.set_range("all", "on");
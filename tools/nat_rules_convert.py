@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""
+Convert the "nat rule A B;" statements of natasha configuration files to a
+binary NAT rules file, loaded with "nat rules FILE;" in the config section.
+
+Usage: nat_rules_convert.py OUTPUT INPUT [INPUT...]
+
+Other statements and comments are ignored, as well as "!include" directives:
+give the included files as inputs. "nat rule" statements which can't be
+converted, such as prefix rules "nat rule A/n B/n;", are errors: keep them in
+the configuration file. See docs/CONFIGURATION.md and the definition of
+struct nat_rules_file_header in src/nat_table.h.
+
+Rules are sorted by internal address. The order of the rules matters if an
+internal address, or an external address, is used by several rules, since
+the last one wins: such rules are rejected. The internal address of a rule
+may be the external address of another one, since each direction has its own
+table.
+"""
+
+import ipaddress
+import re
+import struct
+import sys
+
+
+MAGIC = b'NATRULES'
+VERSION = 1
+
+# Any "nat rule" statement, and those which can be converted.
+NAT_STATEMENT = re.compile(r'\bnat\s+rule\s[^;]*;?')
+NAT_RULE = re.compile(
+    r'nat\s+rule\s+(\d+\.\d+\.\d+\.\d+)\s+(\d+\.\d+\.\d+\.\d+)\s*;')
+
+
+def read_rules(path):
+    """
+    Return the rules of path, or None if a "nat rule" statement can't be
+    converted.
+    """
+    rules = []
+    ok = True
+    with open(path) as handle:
+        for lineno, line in enumerate(handle, 1):
+            line = line.split('#', 1)[0]
+            for statement in NAT_STATEMENT.findall(line):
+                match = NAT_RULE.fullmatch(statement)
+                if match is None:
+                    sys.stderr.write('%s:%d: unable to convert "%s"\n'
+                                     % (path, lineno, statement.strip()))
+                    ok = False
+                    continue
+                int_ip, ext_ip = match.groups()
+                rules.append((int(ipaddress.IPv4Address(int_ip)),
+                              int(ipaddress.IPv4Address(ext_ip))))
+    return rules if ok else None
+
+
+def check_rules(rules):
+    # One table per direction: internal addresses and external addresses are
+    # keys of different tables.
+    seen = (set(), set())
+    ok = True
+    for rule in rules:
+        for direction, addr in enumerate(rule):
+            if addr in seen[direction]:
+                sys.stderr.write('%s %s address is used by several rules\n'
+                                 % (ipaddress.IPv4Address(addr),
+                                    ('internal', 'external')[direction]))
+                ok = False
+            seen[direction].add(addr)
+    return ok
+
+
+def write_rules(path, rules):
+    rules = sorted(rules, key=lambda rule: rule[0])
+
+    with open(path, 'wb') as handle:
+        handle.write(struct.pack('<8sII', MAGIC, VERSION, len(rules)))
+        for int_ip, ext_ip in rules:
+            handle.write(struct.pack('<II', int_ip, ext_ip))
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.stderr.write(__doc__)
+        return 1
+
+    rules = []
+    ok = True
+    for path in sys.argv[2:]:
+        file_rules = read_rules(path)
+        if file_rules is None:
+            ok = False
+            continue
+        rules.extend(file_rules)
+
+    if not ok or not check_rules(rules):
+        return 1
+
+    write_rules(sys.argv[1], rules)
+    print('%d NAT rules written to %s' % (len(rules), sys.argv[1]))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())